@@ -0,0 +1,265 @@
+/*
+* Benchmarks for the hot paths of bitmap.h: generate, write, read (page cached and cold), invert and SetPixel.
+* Every case runs over a matrix of sizes and depths and reports MB/s and pixels/s.
+*
+* Usage: bitmap_bench [--min-size N] [--max-size N] [--min-time SECONDS] [--dir PATH] [--json FILE] [--filter NAME]
+*   --json FILE writes the results as JSON, "-" for stdout
+*/
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#include "bitmap.h"
+
+#ifdef _WIN32
+#include <io.h>
+#define bitmap_unlink _unlink
+#else
+#include <time.h>
+#define bitmap_unlink unlink
+#endif
+
+typedef struct {
+    const char  *name;
+    uint32_t    size;
+    uint32_t    bits_per_pixel;
+    int         cold;
+    uint64_t    iterations;
+    double      seconds;        // Mean time of one iteration
+    double      bytes;          // Bytes processed by one iteration
+    double      pixels;         // Pixels processed by one iteration
+} BENCHRESULT;
+
+typedef struct {
+    const char  *name;
+    int         cold;           // The file is dropped from the page cache before every iteration
+    void        (*setup)(void *state);
+    void        (*run)(void *state);
+    void        (*teardown)(void *state);
+} BENCHCASE;
+
+typedef struct {
+    uint32_t    size;
+    uint16_t    bits_per_pixel;
+    char        path[1024];
+    uint8_t     *pixels;        // UNPADED source pixels
+    PBITMAP     bitmap;
+    BITMAP      loaded;
+} BENCHSTATE;
+
+static double bench_now(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+#endif
+}
+
+// Drops a file from the page cache so the next read comes from the device
+static void bench_drop_cache(const char *path) {
+#ifndef _WIN32
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    fdatasync(fd);
+#ifdef POSIX_FADV_DONTNEED
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+    close(fd);
+#else
+    (void)path;
+#endif
+}
+
+static void bench_make_pixels(BENCHSTATE *state) {
+    size_t count = (size_t)state->size * state->size * (state->bits_per_pixel / 8);
+    state->pixels = (uint8_t *)malloc(count);
+    if (state->pixels == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    uint32_t seed = 0x9e3779b9u;
+    for (size_t i = 0; i < count; ++i) {
+        seed = seed * 1664525u + 1013904223u;
+        state->pixels[i] = (uint8_t)(seed >> 24);
+    }
+}
+
+static void bench_setup_pixels(void *context) {
+    bench_make_pixels((BENCHSTATE *)context);
+}
+
+static void bench_setup_bitmap(void *context) {
+    BENCHSTATE *state = (BENCHSTATE *)context;
+    bench_make_pixels(state);
+    state->bitmap = GenerateBitMapData(state->size, state->size, state->bits_per_pixel, state->pixels, BI_RGB);
+}
+
+static void bench_setup_file(void *context) {
+    BENCHSTATE *state = (BENCHSTATE *)context;
+    bench_make_pixels(state);
+    WriteBitMapFile(state->path, state->size, state->size, state->bits_per_pixel, state->pixels, BI_RGB);
+}
+
+static void bench_teardown(void *context) {
+    BENCHSTATE *state = (BENCHSTATE *)context;
+    if (state->bitmap) FreeBitMap(state->bitmap);
+    free(state->pixels);
+    bitmap_unlink(state->path);
+    state->bitmap = NULL;
+    state->pixels = NULL;
+}
+
+static void bench_generate(void *context) {
+    BENCHSTATE *state = (BENCHSTATE *)context;
+    FreeBitMap(GenerateBitMapData(state->size, state->size, state->bits_per_pixel, state->pixels, BI_RGB));
+}
+
+static void bench_write(void *context) {
+    BENCHSTATE *state = (BENCHSTATE *)context;
+    WriteBitMapFile(state->path, state->size, state->size, state->bits_per_pixel, state->pixels, BI_RGB);
+}
+
+static void bench_read(void *context) {
+    BENCHSTATE *state = (BENCHSTATE *)context;
+    BITMAP bitmap = ReadBitMapEx(state->path, NULL);
+    if (bitmap.pixels == NULL) {
+        fprintf(stderr, "failed to read %s\n", state->path);
+        exit(1);
+    }
+    ReleaseBitMap(&bitmap);
+}
+
+static void bench_invert(void *context) {
+    InvertBitMap(((BENCHSTATE *)context)->bitmap);
+}
+
+static void bench_invert_tiled(void *context) {
+    ApplyBitMapKernelTiled(((BENCHSTATE *)context)->bitmap, GetBitMapKernels()->invert, NULL, NULL);
+}
+
+static void bench_set_pixel(void *context) {
+    BENCHSTATE *state = (BENCHSTATE *)context;
+    for (uint32_t y = 0; y < state->size; ++y) {
+        for (uint32_t x = 0; x < state->size; ++x) SetPixel(x, y, (uint8_t)x, (uint8_t)y, 0x80, 0xff, state->bitmap);
+    }
+}
+
+static const BENCHCASE bench_cases[] = {
+    { "generate",     0, bench_setup_pixels, bench_generate,     bench_teardown },
+    { "write",        0, bench_setup_pixels, bench_write,        bench_teardown },
+    { "read",         0, bench_setup_file,   bench_read,         bench_teardown },
+    { "read",         1, bench_setup_file,   bench_read,         bench_teardown },
+    { "invert",       0, bench_setup_bitmap, bench_invert,       bench_teardown },
+    { "invert_tiled", 0, bench_setup_bitmap, bench_invert_tiled, bench_teardown },
+    { "set_pixel",    0, bench_setup_bitmap, bench_set_pixel,    bench_teardown },
+};
+
+// Runs a case until min_time passed, at least 3 iterations. Cold iterations drop the cache outside the timed region
+static BENCHRESULT bench_run(const BENCHCASE *bench_case, BENCHSTATE *state, double min_time) {
+    BENCHRESULT result = { bench_case->name, state->size, state->bits_per_pixel, bench_case->cold, 0, 0, 0, 0 };
+    bench_case->setup(state);
+    bench_case->run(state); // Warm up
+    double total = 0;
+    while (total < min_time || result.iterations < 3) {
+        if (bench_case->cold) bench_drop_cache(state->path);
+        double start = bench_now();
+        bench_case->run(state);
+        total += bench_now() - start;
+        ++result.iterations;
+    }
+    bench_case->teardown(state);
+    result.seconds = total / (double)result.iterations;
+    result.pixels = (double)state->size * state->size;
+    result.bytes = (double)IMAGE_SIZE(ROW_SIZE(state->bits_per_pixel, state->size), state->size);
+    return result;
+}
+
+static void bench_write_json(FILE *out, const BENCHRESULT *results, size_t count) {
+    fprintf(out, "{\n  \"benchmarks\": [\n");
+    for (size_t i = 0; i < count; ++i) {
+        const BENCHRESULT *r = &results[i];
+        fprintf(out, "    {\"name\": \"%s/%ux%u/%ubpp%s\", \"case\": \"%s\", \"width\": %u, \"height\": %u, "
+                     "\"bits_per_pixel\": %u, \"cache\": \"%s\", \"iterations\": %llu, \"seconds\": %.9g, "
+                     "\"mb_per_second\": %.6g, \"pixels_per_second\": %.6g}%s\n",
+                r->name, r->size, r->size, r->bits_per_pixel, r->cold ? "/cold" : "", r->name, r->size, r->size,
+                r->bits_per_pixel, r->cold ? "cold" : "cached", (unsigned long long)r->iterations, r->seconds,
+                r->bytes / r->seconds / 1e6, r->pixels / r->seconds, i + 1 < count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char **argv) {
+    uint32_t min_size = 64, max_size = 16384;
+    double min_time = 0.25;
+    const char *dir = ".";
+    const char *json = NULL;
+    const char *filter = NULL;
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        if (value == NULL) {
+            fprintf(stderr, "missing value for %s\n", arg);
+            return 1;
+        }
+        if (strcmp(arg, "--min-size") == 0) min_size = (uint32_t)strtoul(value, NULL, 10);
+        else if (strcmp(arg, "--max-size") == 0) max_size = (uint32_t)strtoul(value, NULL, 10);
+        else if (strcmp(arg, "--min-time") == 0) min_time = strtod(value, NULL);
+        else if (strcmp(arg, "--dir") == 0) dir = value;
+        else if (strcmp(arg, "--json") == 0) json = value;
+        else if (strcmp(arg, "--filter") == 0) filter = value;
+        else {
+            fprintf(stderr, "unknown option %s\n", arg);
+            return 1;
+        }
+        ++i;
+    }
+
+    static const uint16_t depths[] = { 24, 32 };
+    size_t capacity = 256, count = 0;
+    BENCHRESULT *results = (BENCHRESULT *)malloc(capacity * sizeof(BENCHRESULT));
+    if (results == NULL) return 1;
+    FILE *log = json && strcmp(json, "-") == 0 ? stderr : stdout;
+    fprintf(log, "%-14s %-6s %6s %12s %5s %10s %12s %14s\n", "case", "cache", "bpp", "size", "iters", "ms", "MB/s", "pixels/s");
+
+    for (uint32_t size = 64; size <= max_size; size *= 4) {
+        if (size < min_size) continue;
+        for (size_t d = 0; d < sizeof(depths) / sizeof(depths[0]); ++d) {
+            for (size_t c = 0; c < sizeof(bench_cases) / sizeof(bench_cases[0]); ++c) {
+                const BENCHCASE *bench_case = &bench_cases[c];
+                if (filter && strstr(bench_case->name, filter) == NULL) continue;
+                BENCHSTATE state;
+                memset(&state, 0, sizeof(state));
+                state.size = size;
+                state.bits_per_pixel = depths[d];
+                snprintf(state.path, sizeof(state.path), "%s/bitmap_bench_%u_%u.bmp", dir, size, (unsigned)depths[d]);
+                BENCHRESULT result = bench_run(bench_case, &state, min_time);
+                fprintf(log, "%-14s %-6s %6u %6ux%-5u %5llu %10.3f %12.1f %14.4g\n", result.name, result.cold ? "cold" : "cached",
+                        result.bits_per_pixel, size, size, (unsigned long long)result.iterations, result.seconds * 1e3,
+                        result.bytes / result.seconds / 1e6, result.pixels / result.seconds);
+                if (count == capacity) {
+                    capacity *= 2;
+                    BENCHRESULT *grown = (BENCHRESULT *)realloc(results, capacity * sizeof(BENCHRESULT));
+                    if (grown == NULL) return 1;
+                    results = grown;
+                }
+                results[count++] = result;
+            }
+        }
+    }
+
+    if (json) {
+        FILE *out = strcmp(json, "-") == 0 ? stdout : fopen(json, "w");
+        if (out == NULL) {
+            fprintf(stderr, "can't open %s\n", json);
+            return 1;
+        }
+        bench_write_json(out, results, count);
+        if (out != stdout) fclose(out);
+    }
+    free(results);
+    return 0;
+}
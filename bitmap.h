@@ -9,27 +9,406 @@ All information is taken from: https://en.m.wikipedia.org/wiki/BMP_file_format
 
 #ifndef BITMAP_H
 #define BITMAP_H
+// pread, pwrite, fileno and clock_gettime are POSIX, strict -std=c99 builds don't declare them otherwise.
+// _DEFAULT_SOURCE keeps MAP_ANONYMOUS and madvise, which glibc hides once _POSIX_C_SOURCE is set
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE) && !defined(_XOPEN_SOURCE) && !defined(_GNU_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+#ifdef __APPLE__
+#define _DARWIN_C_SOURCE
+#endif
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <assert.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <math.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#endif
+
+// Instruction sets. SSE2 and NEON are used when the compiler targets them, AVX2 and SSSE3 code
+// is always compiled on x86 and only called after a CPU check
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BITMAP_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(BITMAP_HAVE_SSE2)
+#define BITMAP_HAVE_AVX2 1
+#define BITMAP_HAVE_SSSE3 1
+#define BITMAP_TARGET_AVX2 __attribute__((target("avx2")))
+#define BITMAP_TARGET_SSSE3 __attribute__((target("ssse3")))
+#include <immintrin.h>
+#elif defined(_MSC_VER) && defined(_M_X64)
+#define BITMAP_HAVE_AVX2 1
+#define BITMAP_HAVE_SSSE3 1
+#define BITMAP_TARGET_AVX2
+#define BITMAP_TARGET_SSSE3
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define BITMAP_HAVE_NEON 1
+#include <arm_neon.h>
+#endif
+
+#ifdef BITMAP_HAVE_AVX2
+static int bitmap_cpu_has_avx2(void) {
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#else
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7) return 0;
+    __cpuid(info, 1);
+    // OSXSAVE and AVX, then check that the OS saves the YMM registers
+    if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6) return 0;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#endif
+}
+
+static int bitmap_cpu_has_ssse3(void) {
+#if defined(__GNUC__)
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+#else
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 9)) != 0;
+#endif
+}
+#endif
 
 /*
 * Calculate the row size.
 * @param bits_per_pixel usually 25. The color depth
 * @param image_width the image width
 */
-#define ROW_SIZE(bits_per_pixel, image_width) (((bits_per_pixel * image_width + 31) / 32) * 4)
+#define ROW_SIZE(bits_per_pixel, image_width) ((((bits_per_pixel) * (image_width) + 31) / 32) * 4)
 /*
 * Calculate the image size (only the pixel data)
 * @param row_size row size. Use ROW_SIZE to calculate it.
 * @param height The height of the image. You can find it in BITMAPV4HEADER.bitmap_height.
 */
-#define IMAGE_SIZE(row_size, height) (row_size * height)
+#define IMAGE_SIZE(row_size, height) ((row_size) * (height))
 #define S_RGB 0x42475273
 #define WIN 0x206E6957
+// Alignment of pixel buffers from the default allocators, wide enough for aligned AVX-512 loads
+#define BITMAP_ALIGNMENT 64
+
+/*
+* Memory hooks for pixel buffers and BITMAP structures.
+* alloc must return memory aligned to at least `alignment` bytes or NULL. free receives the size passed to alloc.
+*/
+typedef struct {
+    void    *(*alloc)(size_t size, size_t alignment, void *user);
+    void    (*free)(void *ptr, size_t size, void *user);
+    void    *user;
+} BITMAPALLOCATOR;
+
+/*
+* Instrumentation. Define BITMAP_INSTRUMENTATION before including the header to record, for every public
+* function, the number of calls, inclusive time, bytes read and written, I/O calls and allocations.
+* Without it the recording macros are empty and GetBitMapStats returns nothing.
+* Left out are the statistics and trace hook functions themselves and the getters that only return a
+* constant or a cached object (GetBitMap*Allocator, GetBitMapKernels, GetBitMapCpuCount, GetBitMapThreadPool, GetRLEBoundSize).
+*/
+#define BITMAP_STAT_FUNCTIONS(X) \
+    X(CreateBitMapPool) X(DestroyBitMapPool) X(WriteToBitMapFile) X(InitBitMapHeaders) X(GenerateBitMapDataEx) \
+    X(GenerateBitMapData) X(GenerateBitMapDataInto) X(CreateBitMap) X(RetargetBitMap) X(WriteBitMapFile) \
+    X(PrintBitMapInfo) X(DecodeRLE) X(EncodeRLE) X(WriteBitMapRLE) X(InitPaletteExpander) X(ExpandPaletteRow) \
+    X(ExpandIndexedBitMap) X(WriteBitMapIndexed) X(QuantizeBitMap) X(WriteBitMapQuantized) X(InitBitFieldsDecoder) \
+    X(DecodeBitFieldsRow) X(DecodeBitFieldsBitMap) X(SetBitMapCodec) X(GetBitMapViewPayload) X(GetBitMapPayload) \
+    X(DecodeBitMapPayload) X(WriteBitMapPayload) X(GetBitMapErrorString) X(GetBitMapBufferSize) X(ReadBitMapInto) \
+    X(ReadBitMapChecked) X(ReadBitMapEx) X(ReadBitMap) X(UnmapBitMap) X(MapBitMap) X(OpenBitMapStream) \
+    X(CreateBitMapStream) X(ReadBitMapRows) X(WriteBitMapRows) X(CloseBitMapStream) X(PremultiplyRow) \
+    X(UnpremultiplyRow) X(ConvertPixelRow) X(ConvertBitMap) X(ReadBitMapRowsAs) X(WriteBitMapRowsAs) X(ReleaseBitMap) \
+    X(cleanup) X(FreeBitMap) X(ApplyBitMapKernel) X(InvertBitMap) X(AdjustBrightnessContrast) X(GrayscaleBitMap) \
+    X(SwapRedBlue) X(CreateBitMapThreadPoolEx) X(CreateBitMapThreadPool) X(DestroyBitMapThreadPool) X(RunBitMapTasks) \
+    X(SubmitBitMapTask) X(RunBitMapTasksStatic) X(RunBitMapBands) X(ApplyBitMapKernelTiled) X(GetBitMapRow) \
+    X(InitBitMapRowTable) X(FreeBitMapRowTable) X(FlipBitMapRows) X(ReadBitMapTopDown) X(FlipBitMap) \
+    X(TransposeBitMap) X(RotateBitMap) X(ResizeBitMap) X(InitBitMapDownscaler) X(PushBitMapDownscalerRow) \
+    X(FlushBitMapDownscaler) X(FreeBitMapDownscaler) X(ReadBitMapDownscaled) X(BlitBitMap) X(ProbeBitMap) \
+    X(FreeBitMapProbeTable) X(AllocBitMapProbeTable) X(ProbeBitMaps) X(ReadBitMapRegion) X(CopyBitMapViewRegion) \
+    X(CompareBitMaps) X(CompareBitMapFiles) X(HashBitMapView) X(HashBitMap) X(HashBitMapFile) X(InitBitMapHistogram) \
+    X(AccumulateBitMapHistogram) X(FinishBitMapHistogram) X(MergeBitMapHistogram) X(InitBitMapChannelStats) \
+    X(AccumulateBitMapChannelStats) X(MergeBitMapChannelStats) X(FinishBitMapChannelStats) X(ComputeBitMapHistogram) \
+    X(ComputeBitMapChannelStats) X(ReadBitMapWithHistogram) X(ReadBitMapAsync) X(WriteBitMapAsync) X(PollBitMapFuture) \
+    X(WaitBitMapFuture) X(TakeBitMapFutureResult) X(FreeBitMapFuture) X(CreateBitMapBatchWriter) X(QueueBitMapWrite) \
+    X(FlushBitMapBatchWriter) X(DestroyBitMapBatchWriter) X(MarkBitMapDirty) X(ClearBitMapDirty) X(MapBitMapWritable) \
+    X(SyncBitMap) X(InvertPixel) X(SetPixel) X(FillRect) X(SetPixelSpan) X(SetPixels) X(SetPixels24)
+
+#define BITMAP_STAT_ENUM(name) BITMAP_STAT_##name,
+typedef enum {
+    BITMAP_STAT_FUNCTIONS(BITMAP_STAT_ENUM)
+    BITMAP_STAT_COUNT
+} BITMAPSTATID;
+#undef BITMAP_STAT_ENUM
+
+/*
+* Counters of one function. Time is inclusive, I/O and allocations are counted for the innermost
+* instrumented function on the calling thread. Every stdio, read/write or mapping call counts as one I/O call.
+*/
+typedef struct {
+    const char  *name;
+    uint64_t    calls;
+    uint64_t    total_ns;
+    uint64_t    max_ns;
+    uint64_t    bytes_read;
+    uint64_t    bytes_written;
+    uint64_t    io_calls;
+    uint64_t    allocations;
+} BITMAPSTAT;
+
+/*
+* Callbacks for tracing tools. begin and end are called around every instrumented call on the calling thread,
+* name is a string literal. Install them with SetBitMapTraceHooks before the library is used.
+*/
+typedef struct {
+    void    (*begin)(const char *name, void *user);
+    void    (*end)(const char *name, void *user);
+    void    *user;
+} BITMAPTRACEHOOKS;
+
+#define BITMAP_STAT_NAME(name) #name,
+static const char *const bitmap_stat_names[BITMAP_STAT_COUNT] = { BITMAP_STAT_FUNCTIONS(BITMAP_STAT_NAME) };
+#undef BITMAP_STAT_NAME
+
+#ifdef BITMAP_INSTRUMENTATION
+#if defined(_MSC_VER) && !defined(__clang__)
+#define BITMAP_THREAD_LOCAL __declspec(thread)
+#define bitmap_stat_add(counter, value) _InterlockedExchangeAdd64((volatile long long *)(counter), (long long)(value))
+#else
+#define BITMAP_THREAD_LOCAL __thread
+#define bitmap_stat_add(counter, value) __atomic_fetch_add((counter), (uint64_t)(value), __ATOMIC_RELAXED)
+#endif
+
+static BITMAPSTAT bitmap_stats[BITMAP_STAT_COUNT];
+static BITMAPTRACEHOOKS bitmap_trace_hooks;
+static BITMAP_THREAD_LOCAL int bitmap_stat_current = -1;
+
+typedef struct {
+    int         id;
+    int         parent;
+    uint64_t    start;
+} BITMAPSTATSCOPE;
+
+static uint64_t bitmap_stat_now(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)((double)counter.QuadPart * 1e9 / (double)frequency.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static BITMAPSTATSCOPE bitmap_stat_begin(int id) {
+    BITMAPSTATSCOPE scope = { id, bitmap_stat_current, 0 };
+    bitmap_stat_current = id;
+    bitmap_stat_add(&bitmap_stats[id].calls, 1);
+    if (bitmap_trace_hooks.begin) bitmap_trace_hooks.begin(bitmap_stat_names[id], bitmap_trace_hooks.user);
+    scope.start = bitmap_stat_now();
+    return scope;
+}
+
+static void bitmap_stat_end(BITMAPSTATSCOPE *scope) {
+    uint64_t elapsed = bitmap_stat_now() - scope->start;
+    BITMAPSTAT *stat = &bitmap_stats[scope->id];
+    bitmap_stat_add(&stat->total_ns, elapsed);
+#if defined(_MSC_VER) && !defined(__clang__)
+    uint64_t max = stat->max_ns;
+    while (elapsed > max) {
+        uint64_t seen = (uint64_t)_InterlockedCompareExchange64((volatile long long *)&stat->max_ns, (long long)elapsed, (long long)max);
+        if (seen == max) break;
+        max = seen;
+    }
+#else
+    uint64_t max = __atomic_load_n(&stat->max_ns, __ATOMIC_RELAXED);
+    while (elapsed > max && !__atomic_compare_exchange_n(&stat->max_ns, &max, elapsed, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+#endif
+    if (bitmap_trace_hooks.end) bitmap_trace_hooks.end(bitmap_stat_names[scope->id], bitmap_trace_hooks.user);
+    bitmap_stat_current = scope->parent;
+}
+
+// Adds to a counter of the innermost instrumented function on this thread
+#define bitmap_stat_count(field, value) \
+    (bitmap_stat_current >= 0 ? (void)bitmap_stat_add(&bitmap_stats[bitmap_stat_current].field, (value)) : (void)0)
+
+// Records a call to the end of the enclosing function. Without the cleanup attribute only calls and I/O are recorded
+#if defined(__GNUC__)
+#define BITMAP_SCOPE(name) \
+    BITMAPSTATSCOPE bitmap_scope __attribute__((cleanup(bitmap_stat_end), unused)) = bitmap_stat_begin(BITMAP_STAT_##name)
+#else
+#define BITMAP_SCOPE(name) \
+    int bitmap_scope = (bitmap_stat_add(&bitmap_stats[BITMAP_STAT_##name].calls, 1), 0); (void)bitmap_scope
+#endif
+#define BITMAP_STAT_ALLOC() bitmap_stat_count(allocations, 1)
+
+static size_t bitmap_stat_fread(void *ptr, size_t size, size_t n, FILE *file) {
+    size_t done = fread(ptr, size, n, file);
+    bitmap_stat_count(io_calls, 1);
+    bitmap_stat_count(bytes_read, done * size);
+    return done;
+}
+
+static size_t bitmap_stat_fwrite(const void *ptr, size_t size, size_t n, FILE *file) {
+    size_t done = fwrite(ptr, size, n, file);
+    bitmap_stat_count(io_calls, 1);
+    bitmap_stat_count(bytes_written, done * size);
+    return done;
+}
+
+static void *bitmap_stat_malloc(size_t size) {
+    bitmap_stat_count(allocations, 1);
+    return malloc(size);
+}
+
+static void *bitmap_stat_calloc(size_t n, size_t size) {
+    bitmap_stat_count(allocations, 1);
+    return calloc(n, size);
+}
+
+#define bitmap_fread bitmap_stat_fread
+#define bitmap_fwrite bitmap_stat_fwrite
+#define bitmap_fopen(name, mode) (bitmap_stat_count(io_calls, 1), fopen((name), (mode)))
+#define bitmap_fseek(file, offset, whence) (bitmap_stat_count(io_calls, 1), fseek((file), (offset), (whence)))
+#define bitmap_malloc bitmap_stat_malloc
+#define bitmap_calloc bitmap_stat_calloc
+#ifndef _WIN32
+static ssize_t bitmap_stat_pread(int fd, void *buffer, size_t size, off_t offset) {
+    ssize_t got = pread(fd, buffer, size, offset);
+    bitmap_stat_count(io_calls, 1);
+    if (got > 0) bitmap_stat_count(bytes_read, got);
+    return got;
+}
+
+static ssize_t bitmap_stat_pwrite(int fd, const void *buffer, size_t size, off_t offset) {
+    ssize_t written = pwrite(fd, buffer, size, offset);
+    bitmap_stat_count(io_calls, 1);
+    if (written > 0) bitmap_stat_count(bytes_written, written);
+    return written;
+}
+
+static ssize_t bitmap_stat_writev(int fd, const struct iovec *iov, int count) {
+    ssize_t written = writev(fd, iov, count);
+    bitmap_stat_count(io_calls, 1);
+    if (written > 0) bitmap_stat_count(bytes_written, written);
+    return written;
+}
+
+#define bitmap_pread bitmap_stat_pread
+#define bitmap_pwrite bitmap_stat_pwrite
+#define bitmap_writev bitmap_stat_writev
+#define bitmap_open(name, ...) (bitmap_stat_count(io_calls, 1), open((name), __VA_ARGS__))
+#define bitmap_mmap(addr, size, prot, flags, fd, offset) (bitmap_stat_count(io_calls, 1), mmap((addr), (size), (prot), (flags), (fd), (offset)))
+#endif
+#else
+#define BITMAP_SCOPE(name)
+#define BITMAP_STAT_ALLOC()
+#define bitmap_fread fread
+#define bitmap_fwrite fwrite
+#define bitmap_fopen fopen
+#define bitmap_fseek fseek
+#define bitmap_malloc malloc
+#define bitmap_calloc calloc
+#ifndef _WIN32
+#define bitmap_pread pread
+#define bitmap_pwrite pwrite
+#define bitmap_writev writev
+#define bitmap_open open
+#define bitmap_mmap mmap
+#endif
+#endif
+
+/*
+* Copies the counters of every instrumented function.
+* @param stats receives up to capacity entries, may be NULL to query the count
+* @param capacity number of entries in stats
+* @return number of instrumented functions, 0 when BITMAP_INSTRUMENTATION isn't defined
+*/
+uint32_t GetBitMapStats(BITMAPSTAT *stats, uint32_t capacity) {
+#ifdef BITMAP_INSTRUMENTATION
+    for (uint32_t i = 0; stats && i < capacity && i < BITMAP_STAT_COUNT; ++i) {
+        stats[i] = bitmap_stats[i];
+        stats[i].name = bitmap_stat_names[i];
+    }
+    return BITMAP_STAT_COUNT;
+#else
+    (void)stats; (void)capacity;
+    return 0;
+#endif
+}
+
+/*
+* Sets every counter back to zero. Calls that are running while the counters are reset are partly lost.
+*/
+void ResetBitMapStats(void) {
+#ifdef BITMAP_INSTRUMENTATION
+    memset(bitmap_stats, 0, sizeof(bitmap_stats));
+#endif
+}
+
+/*
+* Writes the counters of the functions that were called as JSON.
+* @param out stream opened for writing
+* @return 0 on success, -1 if writing failed
+*/
+int DumpBitMapStats(FILE *out) {
+    BITMAPSTAT stats[BITMAP_STAT_COUNT];
+    uint32_t count = GetBitMapStats(stats, BITMAP_STAT_COUNT);
+    int first = 1;
+    fprintf(out, "{\"instrumented\": %s, \"functions\": [", count ? "true" : "false");
+    for (uint32_t i = 0; i < count; ++i) {
+        if (stats[i].calls == 0) continue;
+        fprintf(out, "%s\n  {\"name\": \"%s\", \"calls\": %llu, \"total_ns\": %llu, \"max_ns\": %llu, \"bytes_read\": %llu, "
+                     "\"bytes_written\": %llu, \"io_calls\": %llu, \"allocations\": %llu}",
+                first ? "" : ",", stats[i].name, (unsigned long long)stats[i].calls, (unsigned long long)stats[i].total_ns,
+                (unsigned long long)stats[i].max_ns, (unsigned long long)stats[i].bytes_read,
+                (unsigned long long)stats[i].bytes_written, (unsigned long long)stats[i].io_calls,
+                (unsigned long long)stats[i].allocations);
+        first = 0;
+    }
+    fprintf(out, "%s]}\n", first ? "" : "\n");
+    return ferror(out) ? -1 : 0;
+}
+
+/*
+* Installs callbacks that are called around every instrumented function, for example to open Tracy or
+* Perfetto scopes. NULL removes them. Has no effect without BITMAP_INSTRUMENTATION.
+* @param hooks the callbacks, copied
+*/
+void SetBitMapTraceHooks(const BITMAPTRACEHOOKS *hooks) {
+#ifdef BITMAP_INSTRUMENTATION
+    if (hooks) bitmap_trace_hooks = *hooks;
+    else memset(&bitmap_trace_hooks, 0, sizeof(bitmap_trace_hooks));
+#else
+    (void)hooks;
+#endif
+}
+
 
 
 
@@ -67,13 +446,49 @@ typedef struct {
     uint32_t        blue_gamma;
 
 } BITMAPV4HEADER;
+#pragma pack(pop)
+
+// Rows changed since the last SyncBitMap, one bit per row in storage order
+typedef struct {
+    uint32_t    rows;       // Rows covered by words
+    uint32_t    count;      // Number of set bits
+    uint32_t    *words;     // Follows the structure in the same allocation
+} BITMAPDIRTYROWS;
+
 typedef struct  {
     FILE                *file;
     BITMAPFILEHEADER    file_header;
     BITMAPV4HEADER      info_header;
     uint8_t             *pixels;
+    BITMAPALLOCATOR     allocator;      // Allocator that owns pixels. All NULL means malloc()
+    size_t              pixels_size;    // Size of the pixels allocation
+    uint8_t             *palette;       // Color table of 8 bits per pixel and smaller images, BGRA entries
+    uint32_t            palette_colors; // Number of palette entries
+    BITMAPDIRTYROWS     *dirty;         // Rows SyncBitMap writes back, NULL until a row changes
 
 } BITMAP, *PBITMAP;
+typedef struct {
+    BITMAPFILEHEADER    file_header;
+    BITMAPV4HEADER      info_header;
+    const uint8_t       *pixels;    // First stored row, points into the mapping
+    uint32_t            stride;     // Bytes between two stored rows (ROW_SIZE)
+    const uint8_t       *data;      // Start of the mapped file
+    size_t              size;       // Size of the mapped file
+#ifdef _WIN32
+    HANDLE              mapping;
+#endif
+} BITMAPVIEW, *PBITMAPVIEW;
+typedef struct {
+    FILE                *file;
+    BITMAPFILEHEADER    file_header;
+    BITMAPV4HEADER      info_header;
+    uint32_t            row_size;       // Padded size of one row in the file
+    uint32_t            row_bytes;      // Unpadded size of one row in the caller's buffer
+    uint32_t            rows;           // Number of rows in the image
+    uint32_t            current_row;    // Rows read or written so far
+    int                 writing;
+    uint8_t             *scratch;       // One row for format conversion, allocated on first use
+} BITMAPSTREAM, *PBITMAPSTREAM;
 typedef struct {
     uint8_t red;
     uint8_t green;
@@ -85,19 +500,327 @@ typedef struct {
     uint8_t green;
     uint8_t blue;
 } COLOR24BIT;
-#pragma pack(pop)
 
 #define GetImageSize(bitmap) (bitmap.info_header.image_size)
 
+#ifdef _WIN32
+typedef CRITICAL_SECTION    BITMAP_MUTEX;
+typedef CONDITION_VARIABLE  BITMAP_COND;
+typedef HANDLE              BITMAP_THREAD;
+typedef DWORD               BITMAP_THREAD_ID;
+#define bitmap_thread_self()        GetCurrentThreadId()
+#define bitmap_thread_equal(a, b)   ((a) == (b))
+#define bitmap_mutex_init(m)        InitializeCriticalSection(m)
+#define bitmap_mutex_destroy(m)     DeleteCriticalSection(m)
+#define bitmap_mutex_lock(m)        EnterCriticalSection(m)
+#define bitmap_mutex_unlock(m)      LeaveCriticalSection(m)
+#define bitmap_cond_init(c)         InitializeConditionVariable(c)
+#define bitmap_cond_destroy(c)      ((void)0)
+#define bitmap_cond_wait(c, m)      SleepConditionVariableCS(c, m, INFINITE)
+#define bitmap_cond_signal(c)       WakeConditionVariable(c)
+#define bitmap_cond_broadcast(c)    WakeAllConditionVariable(c)
+#else
+typedef pthread_mutex_t     BITMAP_MUTEX;
+typedef pthread_cond_t      BITMAP_COND;
+typedef pthread_t           BITMAP_THREAD;
+typedef pthread_t           BITMAP_THREAD_ID;
+#define bitmap_thread_self()        pthread_self()
+#define bitmap_thread_equal(a, b)   pthread_equal(a, b)
+#define bitmap_mutex_init(m)        pthread_mutex_init(m, NULL)
+#define bitmap_mutex_destroy(m)     pthread_mutex_destroy(m)
+#define bitmap_mutex_lock(m)        pthread_mutex_lock(m)
+#define bitmap_mutex_unlock(m)      pthread_mutex_unlock(m)
+#define bitmap_cond_init(c)         pthread_cond_init(c, NULL)
+#define bitmap_cond_destroy(c)      pthread_cond_destroy(c)
+#define bitmap_cond_wait(c, m)      pthread_cond_wait(c, m)
+#define bitmap_cond_signal(c)       pthread_cond_signal(c)
+#define bitmap_cond_broadcast(c)    pthread_cond_broadcast(c)
+#endif
+
+static void *bitmap_default_alloc(size_t size, size_t alignment, void *user) {
+    (void)user;
+    if (alignment < sizeof(void *)) alignment = sizeof(void *);
+#ifdef _WIN32
+    return _aligned_malloc(size ? size : 1, alignment);
+#else
+    void *ptr = NULL;
+    return posix_memalign(&ptr, alignment, size ? size : 1) == 0 ? ptr : NULL;
+#endif
+}
+
+static void bitmap_default_free(void *ptr, size_t size, void *user) {
+    (void)size; (void)user;
+#ifdef _WIN32
+    _aligned_free(ptr);
+#else
+    free(ptr);
+#endif
+}
+
+/*
+* Returns the allocator used when NULL is passed. It returns BITMAP_ALIGNMENT aligned memory
+*/
+const BITMAPALLOCATOR *GetBitMapDefaultAllocator(void) {
+    static const BITMAPALLOCATOR allocator = { bitmap_default_alloc, bitmap_default_free, NULL };
+    return &allocator;
+}
+
+// Pixel buffers owned by the caller aren't freed by cleanup
+static void bitmap_borrowed_free(void *ptr, size_t size, void *user) {
+    (void)ptr; (void)size; (void)user;
+}
+
+// Allocates a pixel buffer for bmp and records the allocator in it
+static uint8_t *bitmap_alloc_pixels(PBITMAP bmp, size_t size, const BITMAPALLOCATOR *allocator) {
+    if (allocator == NULL) allocator = GetBitMapDefaultAllocator();
+    BITMAP_STAT_ALLOC();
+    bmp->pixels = (uint8_t *)allocator->alloc(size, BITMAP_ALIGNMENT, allocator->user);
+    bmp->allocator = *allocator;
+    bmp->pixels_size = bmp->pixels ? size : 0;
+    return bmp->pixels;
+}
+
+static void bitmap_free_pixels(PBITMAP bmp) {
+    if (bmp->allocator.free) bmp->allocator.free(bmp->pixels, bmp->pixels_size, bmp->allocator.user);
+    else free(bmp->pixels);
+    bmp->pixels = NULL;
+    bmp->pixels_size = 0;
+}
+
+static void bitmap_free_dirty(PBITMAP bmp) {
+    free(bmp->dirty);
+    bmp->dirty = NULL;
+}
+
+// Pixel buffers of MapBitMapWritable, user holds the offset of the pixels in the mapped file
+static void bitmap_mapped_free(void *ptr, size_t size, void *user) {
+    if (ptr == NULL) return;
+    uint8_t *base = (uint8_t *)ptr - (uintptr_t)user;
+#ifdef _WIN32
+    (void)size;
+    UnmapViewOfFile(base);
+#else
+    munmap(base, size + (uintptr_t)user);
+#endif
+}
+
+// Sets the bits of stored rows [first, end). The set is allocated on first use and restarts if the row count changed
+static void bitmap_add_dirty(PBITMAP bmp, uint32_t first, uint32_t end) {
+    int32_t height = bmp->info_header.bitmap_height;
+    uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    BITMAPDIRTYROWS *dirty = bmp->dirty;
+    if (dirty == NULL || dirty->rows != rows) {
+        size_t n_words = ((size_t)rows + 31) / 32;
+        bitmap_free_dirty(bmp);
+        dirty = (BITMAPDIRTYROWS *)bitmap_calloc(1, sizeof(BITMAPDIRTYROWS) + n_words * sizeof(uint32_t));
+        if (dirty == NULL) return;
+        dirty->rows = rows;
+        dirty->words = (uint32_t *)(dirty + 1);
+        bmp->dirty = dirty;
+    }
+    if (end > rows) end = rows;
+    for (uint32_t y = first; y < end; ++y) {
+        uint32_t bit = 1u << (y & 31);
+        if (dirty->words[y >> 5] & bit) continue;
+        dirty->words[y >> 5] |= bit;
+        ++dirty->count;
+    }
+}
+
+// Bitmaps with an open file or a writable mapping, SyncBitMap writes their changes back
+static inline int bitmap_has_backing(const BITMAP *bmp) {
+    return bmp->file != NULL || bmp->allocator.free == bitmap_mapped_free;
+}
+
+// Marks count rows starting at row y counted from the top. In-memory bitmaps have nothing to sync and skip it
+static inline void bitmap_mark_dirty(PBITMAP bmp, uint32_t y, uint32_t count) {
+    if (!bitmap_has_backing(bmp)) return;
+    int32_t height = bmp->info_header.bitmap_height;
+    uint32_t first = height < 0 ? y : (uint32_t)height - y - count;
+    if (count == 1 && bmp->dirty && first < bmp->dirty->rows && (bmp->dirty->words[first >> 5] >> (first & 31) & 1)) return;
+    bitmap_add_dirty(bmp, first, first + count);
+}
+
+static void bitmap_free_palette(PBITMAP bmp) {
+    if (bmp->palette == NULL) return;
+    if (bmp->allocator.free) bmp->allocator.free(bmp->palette, (size_t)bmp->palette_colors * 4, bmp->allocator.user);
+    else free(bmp->palette);
+    bmp->palette = NULL;
+    bmp->palette_colors = 0;
+}
+
+// Top row and downward stride of uncompressed pixel rows in storage order
+static const uint8_t *bitmap_top_row(const uint8_t *pixels, int32_t height, uint32_t row_size, ptrdiff_t *stride) {
+    uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    *stride = height < 0 ? (ptrdiff_t)row_size : -(ptrdiff_t)row_size;
+    return height < 0 || rows == 0 ? pixels : pixels + (size_t)(rows - 1) * row_size;
+}
+
+#define BITMAP_POOL_CLASSES 160
+
+/*
+* Pool of pixel buffers. Freed buffers are kept on a free list per size class and handed out
+* again to allocations of the same class. Classes are powers of two split into 4 steps, so
+* an allocation wastes at most a quarter of its size.
+*/
+typedef struct {
+    BITMAP_MUTEX    mutex;
+    void            *free_lists[BITMAP_POOL_CLASSES];
+    size_t          cached_bytes;
+    size_t          max_cached_bytes;
+} BITMAPPOOL;
+
+// Maps a size to its class index and the size that is really allocated
+static uint32_t bitmap_pool_class(size_t size, size_t *class_size) {
+    if (size <= 4096) {
+        *class_size = 4096;
+        return 0;
+    }
+    uint32_t e = 12;
+    while (e < 63 && ((size_t)1 << (e + 1)) < size) ++e; // 2^e < size <= 2^(e + 1)
+    size_t step = (size_t)1 << (e - 2);
+    size_t steps = (size + step - 1) / step; // 5 to 8
+    *class_size = steps * step;
+    return 1 + (e - 12) * 4 + (uint32_t)(steps - 5);
+}
+
+static void *bitmap_pool_alloc(size_t size, size_t alignment, void *user) {
+    BITMAPPOOL *pool = (BITMAPPOOL *)user;
+    size_t class_size;
+    uint32_t index = bitmap_pool_class(size, &class_size);
+    if (index >= BITMAP_POOL_CLASSES || alignment > BITMAP_ALIGNMENT) return bitmap_default_alloc(size, alignment, NULL);
+    bitmap_mutex_lock(&pool->mutex);
+    void *block = pool->free_lists[index];
+    if (block) {
+        memcpy(&pool->free_lists[index], block, sizeof(void *));
+        pool->cached_bytes -= class_size;
+    }
+    bitmap_mutex_unlock(&pool->mutex);
+    return block ? block : bitmap_default_alloc(class_size, BITMAP_ALIGNMENT, NULL);
+}
+
+static void bitmap_pool_free(void *ptr, size_t size, void *user) {
+    if (ptr == NULL) return;
+    BITMAPPOOL *pool = (BITMAPPOOL *)user;
+    size_t class_size;
+    uint32_t index = bitmap_pool_class(size, &class_size);
+    if (index < BITMAP_POOL_CLASSES) {
+        bitmap_mutex_lock(&pool->mutex);
+        if (pool->cached_bytes + class_size <= pool->max_cached_bytes) {
+            memcpy(ptr, &pool->free_lists[index], sizeof(void *));
+            pool->free_lists[index] = ptr;
+            pool->cached_bytes += class_size;
+            ptr = NULL;
+        }
+        bitmap_mutex_unlock(&pool->mutex);
+    }
+    if (ptr) bitmap_default_free(ptr, size, NULL);
+}
+
+/*
+* Creates a pool of reusable pixel buffers.
+* @param max_cached_bytes upper limit for the memory kept on the free lists
+* @return the pool or NULL. Release it with DestroyBitMapPool after every buffer from it was freed
+*/
+BITMAPPOOL *CreateBitMapPool(size_t max_cached_bytes) {
+    BITMAP_SCOPE(CreateBitMapPool);
+    BITMAPPOOL *pool = (BITMAPPOOL *)bitmap_calloc(1, sizeof(BITMAPPOOL));
+    if (pool == NULL) return NULL;
+    bitmap_mutex_init(&pool->mutex);
+    pool->max_cached_bytes = max_cached_bytes;
+    return pool;
+}
+
+/*
+* Returns an allocator that takes its buffers from pool. Pass it to GenerateBitMapDataEx or ReadBitMapEx.
+* @param pool the pool
+*/
+BITMAPALLOCATOR GetBitMapPoolAllocator(BITMAPPOOL *pool) {
+    BITMAPALLOCATOR allocator = { bitmap_pool_alloc, bitmap_pool_free, pool };
+    return allocator;
+}
+
+/*
+* Frees the cached buffers and the pool.
+* @param pool the pool to destroy
+*/
+void DestroyBitMapPool(BITMAPPOOL *pool) {
+    BITMAP_SCOPE(DestroyBitMapPool);
+    if (pool == NULL) return;
+    for (uint32_t i = 0; i < BITMAP_POOL_CLASSES; ++i) {
+        void *block = pool->free_lists[i];
+        while (block) {
+            void *next;
+            memcpy(&next, block, sizeof(void *));
+            bitmap_default_free(block, 0, NULL);
+            block = next;
+        }
+    }
+    bitmap_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
 /*
 * Write to bitmap_file the struct data bitmap_data
 * @param bitmap_file Valid file stream to a file which is opened in write binary mode
-* @param bitmap_data PBITMAP structure with valid BITMAPFILEHEADER, BITMAPV4HEADER and pixel data
+* @param bitmap_data PBITMAP structure with valid BITMAPFILEHEADER, BITMAPV4HEADER and ROW_SIZE padded pixel data,
+* like ReadBitMapEx returns. The palette of 8 bit and smaller images is written between the headers and the pixels,
+* file_header.offset has to count it
 */
 void WriteToBitMapFile(FILE* bitmap_file, PBITMAP bitmap_data) {
-    fwrite(&bitmap_data->file_header, sizeof(bitmap_data->file_header), 1, bitmap_file);
-    fwrite(&bitmap_data->info_header, sizeof(bitmap_data->info_header), 1, bitmap_file);
-    fwrite(bitmap_data->pixels, bitmap_data->info_header.image_size, 1, bitmap_file);
+    BITMAP_SCOPE(WriteToBitMapFile);
+    bitmap_fwrite(&bitmap_data->file_header, sizeof(bitmap_data->file_header), 1, bitmap_file);
+    bitmap_fwrite(&bitmap_data->info_header, sizeof(bitmap_data->info_header), 1, bitmap_file);
+    if (bitmap_data->palette && bitmap_data->palette_colors && bitmap_data->info_header.bits_per_pixel <= 8) {
+        bitmap_fwrite(bitmap_data->palette, 4, bitmap_data->palette_colors, bitmap_file);
+    }
+    bitmap_fwrite(bitmap_data->pixels, bitmap_data->info_header.image_size, 1, bitmap_file);
+}
+/*
+* Fills BITMAPFILEHEADER and BITMAPV4HEADER for an uncompressed image
+* @param width the width of the bitmap file
+* @param height the height of the bitmap file. Negative values describe a top-down image
+* @param bits_per_pixel color depth of the bitmap file
+* @param compression compression method stored in the header
+* @param file_header receives the file header
+* @param info_header receives the info header
+*/
+void InitBitMapHeaders(int32_t width, int32_t height, uint16_t bits_per_pixel, uint32_t compression,
+                       BITMAPFILEHEADER *file_header, BITMAPV4HEADER *info_header) {
+    BITMAP_SCOPE(InitBitMapHeaders);
+    uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    uint32_t row_size = ROW_SIZE(bits_per_pixel, width);
+    uint32_t image_size = IMAGE_SIZE(row_size, rows);
+    uint32_t size = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPV4HEADER) + image_size;
+
+    // No designated initializers here: they are C++20-only and this header is also included from bitmap.hpp
+    BITMAPFILEHEADER fh;
+    memset(&fh, 0, sizeof(fh));
+    fh.header_field[0] = 'B';
+    fh.header_field[1] = 'M';
+    fh.size = size;
+    fh.offset = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPV4HEADER);
+
+    BITMAPV4HEADER ih;
+    memset(&ih, 0, sizeof(ih));
+    ih.header_size = sizeof(BITMAPV4HEADER);
+    ih.bitmap_width = width;
+    ih.bitmap_height = height;
+    ih.n_color_planes = 1;
+    ih.bits_per_pixel = bits_per_pixel;
+    ih.compression_method = compression;
+    ih.image_size = image_size;
+    ih.horizontal_resolution = 2835;
+    ih.vertical_resolution = 2835;
+    if (bits_per_pixel == 32) {
+        ih.red_mask = 0x00ff0000;
+        ih.green_mask = 0x0000ff00;
+        ih.blue_mask = 0x000000ff;
+        ih.alpha_mask = 0xff000000;
+    }
+    ih.color_space = S_RGB;
+    *file_header = fh;
+    *info_header = ih;
 }
 /*
 * Generates PBITMAP structure with valid data
@@ -105,54 +828,39 @@ void WriteToBitMapFile(FILE* bitmap_file, PBITMAP bitmap_data) {
 * @param height the height of the bitmap file
 * @param bits_per_pixel color depth of the bitmap file
 * @param pixels UNPADED pixel data
-* @return PBITMAP structure allocated by malloc() that contains valid BITMAPFILEHEADER, BITMAPV4HEADER and padded pixel data
+* @param compression compression method stored in the header
+* @param allocator allocator for the structure and the pixels, NULL for the default allocator
+* @return PBITMAP structure that contains valid BITMAPFILEHEADER, BITMAPV4HEADER and padded pixel data, NULL on failure.
+* Release it with FreeBitMap
 */
-PBITMAP GenerateBitMapData(int32_t width, int32_t height, uint16_t bits_per_pixel, uint8_t *pixels, uint32_t compression) {
+PBITMAP GenerateBitMapDataEx(int32_t width, int32_t height, uint16_t bits_per_pixel, const uint8_t *pixels, uint32_t compression,
+                             const BITMAPALLOCATOR *allocator) {
+    BITMAP_SCOPE(GenerateBitMapDataEx);
+    if (allocator == NULL) allocator = GetBitMapDefaultAllocator();
+    BITMAPFILEHEADER file_header;
+    BITMAPV4HEADER info_header;
+    InitBitMapHeaders(width, height, bits_per_pixel, compression, &file_header, &info_header);
     uint32_t row_size = ROW_SIZE(bits_per_pixel, width);
-    uint32_t image_size = IMAGE_SIZE(row_size, height);
-    uint32_t size = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPV4HEADER) + image_size;
-    
-    BITMAPFILEHEADER file_header = {
-        .header_field = {'B', 'M'},
-        .size = size,
-        .reserved1 = 0,
-        .reserved2 = 0,
-        .offset = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPV4HEADER)
-    };
-    
-    BITMAPV4HEADER info_header = {
-        .header_size = sizeof(BITMAPV4HEADER),
-        .bitmap_width = width,
-        .bitmap_height = height,
-        .n_color_planes = 1,
-        .bits_per_pixel = bits_per_pixel,
-        .compression_method = compression,
-        .image_size = image_size,
-        .horizontal_resolution = 2835,
-        .vertical_resolution = 2835,
-        .n_colors_in_palette = 0,
-        .important_colors = 0,
-        .red_mask = (bits_per_pixel == 32) ? 0x00ff0000 : 0,
-        .green_mask = (bits_per_pixel == 32) ? 0x0000ff00 : 0,
-        .blue_mask = (bits_per_pixel == 32) ? 0x000000ff : 0,
-        .alpha_mask = (bits_per_pixel == 32) ? 0xff000000 : 0,
-        .color_space = S_RGB,
-        .color_end_points = {0},
-        .red_gamma = 0,
-        .green_gamma = 0,
-        .blue_gamma = 0
-    };
+    uint32_t image_size = info_header.image_size;
 
-    PBITMAP bitmap = malloc(sizeof(BITMAP));
+
+    BITMAP_STAT_ALLOC();
+    PBITMAP bitmap = (PBITMAP)allocator->alloc(sizeof(BITMAP), sizeof(void *), allocator->user);
+    if (bitmap == NULL) return NULL;
+    memset(bitmap, 0, sizeof(BITMAP));
     bitmap->file_header = file_header;
     bitmap->info_header = info_header;
 
-    bitmap->pixels = malloc(image_size);
+    if (bitmap_alloc_pixels(bitmap, image_size, allocator) == NULL) {
+        allocator->free(bitmap, sizeof(BITMAP), allocator->user);
+        return NULL;
+    }
     uint8_t *pixel_ptr = bitmap->pixels;
     uint32_t pixel_idx = 0;
     uint32_t pixel_size = bits_per_pixel / 8;
+    uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
 
-    for (int y = 0; y < height; ++y) {
+    for (uint32_t y = 0; y < rows; ++y) {
         memcpy(pixel_ptr, &pixels[pixel_idx], width * pixel_size);
         pixel_ptr += width * pixel_size;
         pixel_idx += width * pixel_size;
@@ -163,6 +871,70 @@ PBITMAP GenerateBitMapData(int32_t width, int32_t height, uint16_t bits_per_pixe
 
     return bitmap;
 }
+/*
+* Generates PBITMAP structure with valid data
+* @param width the width of the bitmap file
+* @param height the height of the bitmap file
+* @param bits_per_pixel color depth of the bitmap file
+* @param pixels UNPADED pixel data
+* @return PBITMAP structure from the default allocator that contains valid BITMAPFILEHEADER, BITMAPV4HEADER and padded pixel data.
+* Release it with FreeBitMap
+*/
+PBITMAP GenerateBitMapData(int32_t width, int32_t height, uint16_t bits_per_pixel, uint8_t *pixels, uint32_t compression) {
+    BITMAP_SCOPE(GenerateBitMapData);
+    return GenerateBitMapDataEx(width, height, bits_per_pixel, pixels, compression, NULL);
+}
+
+// Copies UNPADED rows into padded rows. src may be dst itself, then the rows are padded in place
+static void bitmap_pad_rows(uint8_t *dst, const uint8_t *src, uint32_t row_size, uint32_t row_bytes, uint32_t rows) {
+    uint32_t padding_size = row_size - row_bytes;
+    if (src == dst) {
+        // Padded rows are never before their unpadded position, so walk from the last row
+        uint8_t *to = dst + (size_t)rows * row_size;
+        const uint8_t *from = dst + (size_t)rows * row_bytes;
+        for (uint32_t y = 0; y < rows; ++y) {
+            to -= row_size;
+            from -= row_bytes;
+            memmove(to, from, row_bytes);
+            memset(to + row_bytes, 0, padding_size);
+        }
+    } else if (padding_size == 0) {
+        memcpy(dst, src, (size_t)row_size * rows);
+    } else {
+        for (uint32_t y = 0; y < rows; ++y, dst += row_size, src += row_bytes) {
+            memcpy(dst, src, row_bytes);
+            memset(dst + row_bytes, 0, padding_size);
+        }
+    }
+}
+
+/*
+* Fills a caller owned BITMAP and pixel buffer. Nothing is allocated.
+* @param width the width of the bitmap file
+* @param height the height of the bitmap file
+* @param bits_per_pixel color depth of the bitmap file
+* @param pixels UNPADED pixel data. May be buffer itself, then the rows are padded in place. NULL leaves the buffer as it is
+* @param compression compression method stored in the header
+* @param buffer receives the padded pixel data, at least IMAGE_SIZE(ROW_SIZE(bits_per_pixel, width), height) bytes
+* @param buffer_size size of buffer
+* @param bitmap receives the headers, bitmap->pixels points to buffer. cleanup won't free buffer
+* @return 0 on success, -1 if buffer is too small
+*/
+int GenerateBitMapDataInto(int32_t width, int32_t height, uint16_t bits_per_pixel, const uint8_t *pixels, uint32_t compression,
+                           uint8_t *buffer, size_t buffer_size, PBITMAP bitmap) {
+    BITMAP_SCOPE(GenerateBitMapDataInto);
+    memset(bitmap, 0, sizeof(*bitmap));
+    InitBitMapHeaders(width, height, bits_per_pixel, compression, &bitmap->file_header, &bitmap->info_header);
+    if (buffer_size < bitmap->info_header.image_size) return -1;
+    bitmap->pixels = buffer;
+    bitmap->pixels_size = buffer_size;
+    bitmap->allocator.free = bitmap_borrowed_free;
+    if (pixels == NULL) return 0;
+
+    uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    bitmap_pad_rows(buffer, pixels, ROW_SIZE(bits_per_pixel, width), (bits_per_pixel * width + 7) / 8, rows);
+    return 0;
+}
 
 // compression enum
 
@@ -179,6 +951,11 @@ typedef enum  {
     BI_CMYKRLE4 = 13
 } COMPRESSION;
 
+static int bitmap_is_uncompressed(const BITMAPV4HEADER *info_header) {
+    return info_header->compression_method == BI_RGB || info_header->compression_method == BI_BITFIELDS ||
+           info_header->compression_method == BI_ALPHABITFIELDS;
+}
+
 /*
 * Creates a bitmap image file.
 * @param file_name the path to the output file
@@ -186,14 +963,154 @@ typedef enum  {
 * @param height the height of the bitmap file
 * @param pixels UNPADED pixel data
 * @return A BITMAP struct that contains the headers, pixel data and a file stream
+* If only the file on disk is needed use WriteBitMapFile, it doesn't copy the pixels or keep the file open.
 */
 BITMAP CreateBitMap(const char* file_name, int32_t width, int32_t height, uint8_t *pixels, uint32_t color_depth, COMPRESSION compression) {
+    BITMAP_SCOPE(CreateBitMap);
+    BITMAP bitmap;
+    memset(&bitmap, 0, sizeof(bitmap));
     PBITMAP bitmap_data = GenerateBitMapData(width, height, color_depth, pixels, compression);
-    FILE *bitmap_file = fopen(file_name, "wb+");
-    WriteToBitMapFile(bitmap_file, bitmap_data);
-    fseek(bitmap_file, 0, SEEK_SET);
-    bitmap_data->file = bitmap_file;
-    return *bitmap_data;
+    if (bitmap_data == NULL) return bitmap;
+    bitmap = *bitmap_data;
+    // Only the pixels move into the returned copy, the heap structure itself is released
+    bitmap.allocator.free(bitmap_data, sizeof(BITMAP), bitmap.allocator.user);
+    FILE *bitmap_file = bitmap_fopen(file_name, "wb+");
+    if (bitmap_file == NULL) return bitmap;
+    WriteToBitMapFile(bitmap_file, &bitmap);
+    bitmap_fseek(bitmap_file, 0, SEEK_SET);
+    bitmap.file = bitmap_file;
+    return bitmap;
+}
+
+/*
+* Points an existing bitmap at a new file and new pixel content and writes it. The headers and
+* the padded pixel buffer are reused, so a sequence of same sized frames needs no allocation.
+* The previous file of the bitmap is closed.
+* @param bitmap a bitmap from CreateBitMap, GenerateBitMapData or GenerateBitMapDataInto with uncompressed pixels
+* @param file_name the path to the output file. NULL only replaces the pixels
+* @param pixels UNPADED pixel data with the dimensions of the bitmap. NULL writes the current pixels
+* @return 0 on success, -1 on failure
+*/
+int RetargetBitMap(PBITMAP bitmap, const char *file_name, const uint8_t *pixels) {
+    BITMAP_SCOPE(RetargetBitMap);
+    if (bitmap == NULL || bitmap->pixels == NULL || !bitmap_is_uncompressed(&bitmap->info_header)) return -1;
+    if (pixels) {
+        int32_t height = bitmap->info_header.bitmap_height;
+        uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+        uint16_t bpp = bitmap->info_header.bits_per_pixel;
+        uint32_t width = (uint32_t)bitmap->info_header.bitmap_width;
+        bitmap_pad_rows(bitmap->pixels, pixels, ROW_SIZE(bpp, width), (bpp * width + 7) / 8, rows);
+    }
+    if (file_name == NULL) return 0;
+    if (bitmap->file) {
+        fclose(bitmap->file);
+        bitmap->file = NULL;
+    }
+    FILE *bitmap_file = bitmap_fopen(file_name, "wb+");
+    if (bitmap_file == NULL) return -1;
+    WriteToBitMapFile(bitmap_file, bitmap);
+    if (fflush(bitmap_file) != 0 || ferror(bitmap_file)) {
+        fclose(bitmap_file);
+        return -1;
+    }
+    bitmap_fseek(bitmap_file, 0, SEEK_SET);
+    bitmap->file = bitmap_file;
+    return 0;
+}
+#ifndef _WIN32
+// Keeps calling writev until every iovec is written, adjusting the array on short writes
+static int bitmap_writev_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t written = bitmap_writev(fd, iov, count);
+        if (written < 0) return -1;
+        while (count > 0 && (size_t)written >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = (uint8_t *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+#endif
+
+/*
+* Writes a bitmap file straight from UNPADED pixel data. Unlike CreateBitMap no padded copy
+* of the pixels is made and the file is closed when the function returns.
+* On POSIX systems the headers, rows and padding are written with vectored writes.
+* @param file_name the path to the output file
+* @param width the width of the bitmap file
+* @param height the height of the bitmap file
+* @param bits_per_pixel color depth of the bitmap file
+* @param pixels UNPADED pixel data
+* @param compression compression method stored in the header
+* @return 0 on success, -1 on failure
+*/
+int WriteBitMapFile(const char *file_name, int32_t width, int32_t height, uint16_t bits_per_pixel, const uint8_t *pixels, uint32_t compression) {
+    BITMAP_SCOPE(WriteBitMapFile);
+    BITMAPFILEHEADER file_header;
+    BITMAPV4HEADER info_header;
+    InitBitMapHeaders(width, height, bits_per_pixel, compression, &file_header, &info_header);
+    uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    uint32_t row_size = ROW_SIZE(bits_per_pixel, width);
+    uint32_t row_bytes = (bits_per_pixel * width + 7) / 8;
+    uint32_t padding_size = row_size - row_bytes;
+    static const uint8_t padding[4] = {0};
+#ifdef _WIN32
+    FILE *bitmap_file = bitmap_fopen(file_name, "wb");
+    if (bitmap_file == NULL) return -1;
+    int result = 0;
+    if (bitmap_fwrite(&file_header, sizeof(file_header), 1, bitmap_file) != 1 ||
+        bitmap_fwrite(&info_header, sizeof(info_header), 1, bitmap_file) != 1) result = -1;
+    if (result == 0 && padding_size == 0) {
+        if (rows && bitmap_fwrite(pixels, row_bytes, rows, bitmap_file) != rows) result = -1;
+    } else {
+        const uint8_t *row = pixels;
+        for (uint32_t y = 0; result == 0 && y < rows; ++y, row += row_bytes) {
+            if (bitmap_fwrite(row, 1, row_bytes, bitmap_file) != row_bytes ||
+                bitmap_fwrite(padding, 1, padding_size, bitmap_file) != padding_size) result = -1;
+        }
+    }
+    if (fclose(bitmap_file) != 0) result = -1;
+    return result;
+#else
+#ifdef IOV_MAX
+    enum { BITMAP_IOV_COUNT = IOV_MAX < 1024 ? IOV_MAX : 1024 };
+#else
+    enum { BITMAP_IOV_COUNT = 16 };
+#endif
+    struct iovec iov[BITMAP_IOV_COUNT];
+    int fd = bitmap_open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return -1;
+    int count = 0;
+    iov[count].iov_base = &file_header;
+    iov[count++].iov_len = sizeof(file_header);
+    iov[count].iov_base = &info_header;
+    iov[count++].iov_len = sizeof(info_header);
+    int result = 0;
+    if (padding_size == 0) {
+        iov[count].iov_base = (void *)pixels;
+        iov[count++].iov_len = (size_t)row_bytes * rows;
+    } else {
+        const uint8_t *row = pixels;
+        for (uint32_t y = 0; result == 0 && y < rows; ++y, row += row_bytes) {
+            if (count + 2 > BITMAP_IOV_COUNT) {
+                result = bitmap_writev_all(fd, iov, count);
+                count = 0;
+            }
+            iov[count].iov_base = (void *)row;
+            iov[count++].iov_len = row_bytes;
+            iov[count].iov_base = (void *)padding;
+            iov[count++].iov_len = padding_size;
+        }
+    }
+    if (result == 0) result = bitmap_writev_all(fd, iov, count);
+    if (close(fd) != 0) result = -1;
+    return result;
+#endif
 }
 /*
 * Prints bitmap header values
@@ -201,10 +1118,11 @@ BITMAP CreateBitMap(const char* file_name, int32_t width, int32_t height, uint8_
 */
 void PrintBitMapInfo(FILE *f)
 {
+    BITMAP_SCOPE(PrintBitMapInfo);
     BITMAPFILEHEADER file_header;
     BITMAPV4HEADER info_header;
-    fread(&file_header, sizeof(file_header), 1, f);
-    fread(&info_header, sizeof(info_header), 1, f);
+    bitmap_fread(&file_header, sizeof(file_header), 1, f);
+    bitmap_fread(&info_header, sizeof(info_header), 1, f);
     printf("----BEGIN FILE HEADER---");
     printf("Size: %d\n", file_header.size);
     printf("Reserved 1: %d\n", file_header.reserved1);
@@ -233,54 +1151,5595 @@ void PrintBitMapInfo(FILE *f)
     printf("----END BITMAPV4HEADER HEADER---\n");
 }
 /*
-* Reads a bitmap file.
-* @param file_name the path to a bitmap file
-* @return BITMAP structure which contains the header and pixel data of the bitmap file.
+* RLE8 / RLE4
+* Decoded images use one palette index per byte (8 bits per pixel), rows in file order.
 */
-BITMAP ReadBitMap(const char *file_name)
-{
-    BITMAP bitmap;
-    FILE *bitmap_file = fopen(file_name, "rb");
-    fread(&bitmap.file_header, sizeof(bitmap.file_header), 1, bitmap_file);
-    fread(&bitmap.info_header, sizeof(bitmap.info_header), 1, bitmap_file);
-    uint32_t row_size = ROW_SIZE(bitmap.info_header.bits_per_pixel, bitmap.info_header.bitmap_width);
-    uint32_t pixel_size = bitmap.info_header.bits_per_pixel / 8;
-    uint32_t padded_row_size = (bitmap.info_header.bitmap_width * pixel_size + 3) & ~3; // Adjusted for padding
-    fseek(bitmap_file, bitmap.file_header.offset, SEEK_SET);
-    bitmap.pixels = malloc(bitmap.info_header.image_size);
-    uint8_t *ptr = bitmap.pixels;
-    for (int y = 0; y < bitmap.info_header.bitmap_height; y++)
-    {
-        fread(ptr, 1, padded_row_size, bitmap_file); // Read the whole row including padding
-        fseek(bitmap_file, row_size - padded_row_size, SEEK_CUR); // Move past the padding
-        ptr += bitmap.info_header.bitmap_width * pixel_size;
+
+/*
+* Decodes an RLE8 or RLE4 pixel array into palette indices, one byte per pixel.
+* Pixels skipped by delta escapes or missing at the end of the data are set to 0.
+* @param src compressed pixel array
+* @param src_size size of src
+* @param compression BI_RLE8 or BI_RLE4
+* @param width image width
+* @param rows image height, RLE images are always bottom-up
+* @param dst receives rows * dst_stride bytes
+* @param dst_stride bytes per row in dst, at least width
+* @return 0 on success, -1 on malformed data or unsupported compression
+*/
+int DecodeRLE(const uint8_t *src, size_t src_size, uint32_t compression, uint32_t width, uint32_t rows,
+              uint8_t *dst, size_t dst_stride) {
+    BITMAP_SCOPE(DecodeRLE);
+    if ((compression != BI_RLE8 && compression != BI_RLE4) || dst_stride < width) return -1;
+    int rle4 = compression == BI_RLE4;
+    memset(dst, 0, dst_stride * rows);
+    uint32_t x = 0, y = 0;
+    size_t i = 0;
+    while (y < rows && i + 1 < src_size) {
+        uint8_t count = src[i], value = src[i + 1];
+        i += 2;
+        uint8_t *row = dst + (size_t)y * dst_stride;
+        if (count > 0) {
+            // Encoded run, RLE4 alternates between the high and the low nibble
+            uint32_t room = x < width ? width - x : 0; // x may be past the row after a run or a delta
+            uint32_t n = count < room ? count : room;
+            if (rle4) {
+                for (uint32_t k = 0; k < n; ++k) row[x + k] = (k & 1) ? (value & 0x0F) : (value >> 4);
+            } else {
+                memset(row + x, value, n);
+            }
+            x += count;
+        } else if (value == 0) {            // End of line
+            x = 0;
+            ++y;
+        } else if (value == 1) {            // End of bitmap
+            return 0;
+        } else if (value == 2) {            // Delta
+            if (i + 1 >= src_size) return -1;
+            x += src[i];
+            y += src[i + 1];
+            i += 2;
+        } else {                            // Absolute run of `value` pixels, padded to 16 bits
+            size_t n_bytes = rle4 ? ((size_t)value + 1) / 2 : value;
+            if (i + n_bytes > src_size) return -1;
+            for (uint32_t k = 0; k < value; ++k, ++x) {
+                if (x >= width) continue;
+                row[x] = rle4 ? ((k & 1) ? (src[i + k / 2] & 0x0F) : (src[i + k / 2] >> 4)) : src[i + k];
+            }
+            i += (n_bytes + 1) & ~(size_t)1;
+        }
     }
-    fclose(bitmap_file);
-    return bitmap;
+    return 0;
 }
 
-void cleanup(PBITMAP bmp) {
-    if (bmp == NULL) {
-        fprintf(stderr, "bmp is NULL. Not freeing!\n");
-        return;
-    }
+/*
+* Upper bound of the size EncodeRLE produces.
+* @param width image width
+* @param rows image height
+*/
+size_t GetRLEBoundSize(uint32_t width, uint32_t rows) {
+    // Worst case is absolute runs of 255 pixels: 2 escape bytes and 1 padding byte per run, plus the end of line
+    return (size_t)rows * ((size_t)width + ((size_t)width / 255 + 1) * 3 + 2) + 2;
+}
 
-    if (bmp->pixels) {
-        free(bmp->pixels);
-        bmp->pixels = NULL;
+// Length of the run of equal values starting at x, at most 255
+static uint32_t bitmap_rle_run(const uint8_t *row, uint32_t x, uint32_t width) {
+    uint32_t n = 1;
+    while (x + n < width && n < 255 && row[x + n] == row[x]) ++n;
+    return n;
+}
+
+/*
+* Encodes palette indices (one byte per pixel) as RLE8 or RLE4.
+* Runs of 3 or more equal pixels become encoded runs, everything else absolute runs.
+* @param indices palette indices, RLE4 only uses the low nibble
+* @param width image width
+* @param rows image height
+* @param stride bytes per row in indices
+* @param compression BI_RLE8 or BI_RLE4
+* @param dst output buffer, GetRLEBoundSize(width, rows) bytes are always enough
+* @param dst_capacity size of dst
+* @return the encoded size, 0 if dst is too small or compression isn't supported
+*/
+size_t EncodeRLE(const uint8_t *indices, uint32_t width, uint32_t rows, size_t stride, uint32_t compression,
+                 uint8_t *dst, size_t dst_capacity) {
+    BITMAP_SCOPE(EncodeRLE);
+    if (compression != BI_RLE8 && compression != BI_RLE4) return 0;
+    int rle4 = compression == BI_RLE4;
+    uint8_t mask = rle4 ? 0x0F : 0xFF;
+    size_t n = 0;
+#define BITMAP_RLE_PUT(byte) do { if (n >= dst_capacity) return 0; dst[n++] = (uint8_t)(byte); } while (0)
+    const uint8_t *row = indices;
+    for (uint32_t y = 0; y < rows; ++y, row += stride) {
+        uint32_t x = 0;
+        while (x < width) {
+            uint32_t run = bitmap_rle_run(row, x, width);
+            if (run >= 3 || width - x < 3) {
+                // Short tails can't use absolute mode, which needs at least 3 pixels
+                if (run > width - x) run = width - x;
+                BITMAP_RLE_PUT(run);
+                BITMAP_RLE_PUT(rle4 ? ((row[x] & mask) << 4) | (row[x] & mask) : row[x]);
+                x += run;
+                continue;
+            }
+            uint32_t end = x;
+            while (end < width && end - x < 255 && (bitmap_rle_run(row, end, width) < 3 || end - x < 3)) ++end;
+            uint32_t count = end - x;
+            BITMAP_RLE_PUT(0);
+            BITMAP_RLE_PUT(count);
+            size_t n_bytes = rle4 ? (count + 1) / 2 : count;
+            for (uint32_t k = 0; k < n_bytes; ++k) {
+                if (rle4) {
+                    uint8_t high = row[x + 2 * k] & mask;
+                    uint8_t low = 2 * k + 1 < count ? (row[x + 2 * k + 1] & mask) : 0;
+                    BITMAP_RLE_PUT((high << 4) | low);
+                } else {
+                    BITMAP_RLE_PUT(row[x + k]);
+                }
+            }
+            if (n_bytes & 1) BITMAP_RLE_PUT(0);
+            x = end;
+        }
+        BITMAP_RLE_PUT(0);
+        BITMAP_RLE_PUT(y + 1 < rows ? 0 : 1); // End of line, end of bitmap after the last row
+    }
+    if (rows == 0) {
+        BITMAP_RLE_PUT(0);
+        BITMAP_RLE_PUT(1);
+    }
+#undef BITMAP_RLE_PUT
+    return n;
+}
+
+/*
+* Writes palette indices as an RLE8 or RLE4 compressed bitmap file.
+* @param file_name the path to the output file
+* @param width the width of the bitmap file
+* @param height the height of the bitmap file, RLE images are always bottom-up
+* @param indices UNPADED palette indices, one byte per pixel
+* @param palette n_colors BGRA entries
+* @param n_colors palette size, at most 256 for RLE8 and 16 for RLE4
+* @param compression BI_RLE8 or BI_RLE4
+* @return 0 on success, -1 on failure
+*/
+int WriteBitMapRLE(const char *file_name, int32_t width, int32_t height, const uint8_t *indices, const uint8_t *palette,
+                   uint32_t n_colors, uint32_t compression) {
+    BITMAP_SCOPE(WriteBitMapRLE);
+    if ((compression != BI_RLE8 && compression != BI_RLE4) || width < 0 || height < 0 ||
+        n_colors > (compression == BI_RLE8 ? 256u : 16u)) return -1;
+    size_t capacity = GetRLEBoundSize((uint32_t)width, (uint32_t)height);
+    uint8_t *encoded = (uint8_t *)bitmap_malloc(capacity);
+    if (encoded == NULL) return -1;
+    size_t encoded_size = EncodeRLE(indices, (uint32_t)width, (uint32_t)height, (size_t)width, compression, encoded, capacity);
+
+    BITMAPFILEHEADER file_header;
+    BITMAPV4HEADER info_header;
+    InitBitMapHeaders(width, height, compression == BI_RLE8 ? 8 : 4, compression, &file_header, &info_header);
+    info_header.image_size = (uint32_t)encoded_size;
+    info_header.n_colors_in_palette = n_colors;
+    file_header.offset = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPV4HEADER) + n_colors * 4;
+    file_header.size = file_header.offset + (uint32_t)encoded_size;
+
+    FILE *bitmap_file = bitmap_fopen(file_name, "wb");
+    int result = -1;
+    if (bitmap_file) {
+        if (bitmap_fwrite(&file_header, sizeof(file_header), 1, bitmap_file) == 1 &&
+            bitmap_fwrite(&info_header, sizeof(info_header), 1, bitmap_file) == 1 &&
+            (n_colors == 0 || bitmap_fwrite(palette, 4, n_colors, bitmap_file) == n_colors) &&
+            bitmap_fwrite(encoded, 1, encoded_size, bitmap_file) == encoded_size) result = 0;
+        if (fclose(bitmap_file) != 0) result = -1;
+    }
+    free(encoded);
+    return result;
+}
+
+/*
+* Expansion of 1, 2, 4 and 8 bit palette indices to 32 bit BGRA.
+* 8 bit indices are looked up per pixel (with AVX2 gathers where available), smaller indices per byte in a
+* table holding the pixels of all 256 byte values, so a byte of 1 bit indices becomes 8 pixels in one copy.
+*/
+typedef struct {
+    uint32_t    bits_per_pixel;
+    uint32_t    colors[256];        // BGRA, alpha set to 255
+    uint32_t    bytes[256 * 8];     // 1, 2 and 4 bit: the 8 / bits_per_pixel pixels of every index byte
+    int         use_avx2;
+} PALETTEEXPANDER;
+
+/*
+* Prepares the lookup tables for a palette.
+* @param expander receives the tables
+* @param palette n_colors BGRA entries as stored in the file, the fourth byte is ignored
+* @param n_colors palette size. Indices past it expand to black
+* @param bits_per_pixel 1, 2, 4 or 8
+* @return 0 on success, -1 if bits_per_pixel isn't supported
+*/
+int InitPaletteExpander(PALETTEEXPANDER *expander, const uint8_t *palette, uint32_t n_colors, uint32_t bits_per_pixel) {
+    BITMAP_SCOPE(InitPaletteExpander);
+    if (bits_per_pixel != 1 && bits_per_pixel != 2 && bits_per_pixel != 4 && bits_per_pixel != 8) return -1;
+    memset(expander, 0, sizeof(*expander));
+    expander->bits_per_pixel = bits_per_pixel;
+    if (n_colors > 256) n_colors = 256;
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t color = 0;
+        if (i < n_colors) memcpy(&color, palette + i * 4, 4);
+        expander->colors[i] = (color & 0x00ffffff) | 0xff000000;
+    }
+    if (bits_per_pixel < 8) {
+        uint32_t per_byte = 8 / bits_per_pixel, mask = (1u << bits_per_pixel) - 1;
+        for (uint32_t b = 0; b < 256; ++b) {
+            // The leftmost pixel is in the high bits
+            for (uint32_t k = 0; k < per_byte; ++k) {
+                expander->bytes[b * per_byte + k] = expander->colors[(b >> (8 - bits_per_pixel * (k + 1))) & mask];
+            }
+        }
+    }
+#ifdef BITMAP_HAVE_AVX2
+    expander->use_avx2 = bitmap_cpu_has_avx2();
+#endif
+    return 0;
+}
+
+#ifdef BITMAP_HAVE_AVX2
+BITMAP_TARGET_AVX2 static uint32_t bitmap_expand8_avx2(const uint32_t *colors, const uint8_t *src, uint8_t *dst, uint32_t width) {
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m256i index = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + x)));
+        __m256i pixels = _mm256_i32gather_epi32((const int *)colors, index, 4);
+        _mm256_storeu_si256((__m256i *)(dst + x * 4), pixels);
+    }
+    return x;
+}
+#endif
+
+/*
+* Expands one row of indices.
+* @param expander tables from InitPaletteExpander
+* @param src packed indices, leftmost pixel in the high bits of a byte
+* @param dst receives width * 4 bytes of BGRA. Must not overlap src
+* @param width number of pixels
+*/
+void ExpandPaletteRow(const PALETTEEXPANDER *expander, const uint8_t *src, uint8_t *dst, uint32_t width) {
+    BITMAP_SCOPE(ExpandPaletteRow);
+    uint32_t x = 0;
+    switch (expander->bits_per_pixel) {
+    case 8:
+#ifdef BITMAP_HAVE_AVX2
+        if (expander->use_avx2) x = bitmap_expand8_avx2(expander->colors, src, dst, width);
+#endif
+        for (; x < width; ++x) memcpy(dst + x * 4, &expander->colors[src[x]], 4);
+        return;
+    case 4:
+        for (; x + 2 <= width; x += 2) memcpy(dst + x * 4, &expander->bytes[src[x / 2] * 2], 8);
+        break;
+    case 2:
+        for (; x + 4 <= width; x += 4) memcpy(dst + x * 4, &expander->bytes[src[x / 4] * 4], 16);
+        break;
+    case 1:
+        for (; x + 8 <= width; x += 8) memcpy(dst + x * 4, &expander->bytes[src[x / 8] * 8], 32);
+        break;
+    default:
+        return;
+    }
+    // The pixels of the last partial byte
+    if (x < width) {
+        uint32_t per_byte = 8 / expander->bits_per_pixel;
+        memcpy(dst + x * 4, &expander->bytes[src[x / per_byte] * per_byte], (size_t)(width - x) * 4);
+    }
+}
+
+/*
+* Expands a palettized bitmap (1, 2, 4 or 8 bit, like the result of reading an RLE file) to 32 bit BGRA.
+* The pixel buffer is replaced through the bitmap's allocator. The palette is freed, 32 bit images have none,
+* and the headers are rebuilt for a 32 bit file without a color table.
+* @param bmp 1, 2, 4 or 8 bit bitmap with a palette
+* @return 0 on success, -1 if bmp isn't palettized, has no palette or memory is exhausted
+*/
+int ExpandIndexedBitMap(PBITMAP bmp) {
+    BITMAP_SCOPE(ExpandIndexedBitMap);
+    uint32_t bits_per_pixel = bmp->info_header.bits_per_pixel;
+    if (bmp->palette == NULL || bmp->info_header.bitmap_width < 0 || bmp->info_header.compression_method != BI_RGB) return -1;
+    PALETTEEXPANDER *expander = (PALETTEEXPANDER *)bitmap_malloc(sizeof(PALETTEEXPANDER));
+    if (expander == NULL) return -1;
+    if (InitPaletteExpander(expander, bmp->palette, bmp->palette_colors, bits_per_pixel) != 0) {
+        free(expander);
+        return -1;
+    }
+    uint32_t width = (uint32_t)bmp->info_header.bitmap_width;
+    int32_t height = bmp->info_header.bitmap_height;
+    uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    uint32_t src_stride = ROW_SIZE(bits_per_pixel, width), dst_stride = width * 4;
+
+    BITMAP expanded = *bmp;
+    if (bitmap_alloc_pixels(&expanded, (size_t)dst_stride * rows, bmp->allocator.alloc ? &bmp->allocator : NULL) == NULL) {
+        free(expander);
+        return -1;
+    }
+    const uint8_t *src = bmp->pixels;
+    uint8_t *dst = expanded.pixels;
+    for (uint32_t y = 0; y < rows; ++y, src += src_stride, dst += dst_stride) ExpandPaletteRow(expander, src, dst, width);
+    free(expander);
+    bitmap_free_pixels(bmp);
+    bmp->pixels = expanded.pixels;
+    bmp->pixels_size = expanded.pixels_size;
+    bmp->allocator = expanded.allocator;
+    bmp->info_header.bits_per_pixel = 32;
+    bmp->info_header.image_size = dst_stride * rows;
+    bmp->info_header.red_mask = 0x00ff0000;
+    bmp->info_header.green_mask = 0x0000ff00;
+    bmp->info_header.blue_mask = 0x000000ff;
+    bmp->info_header.alpha_mask = 0xff000000;
+    bmp->info_header.header_size = sizeof(BITMAPV4HEADER);
+    bmp->info_header.n_colors_in_palette = 0;
+    bmp->file_header.offset = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPV4HEADER);
+    bmp->file_header.size = bmp->file_header.offset + bmp->info_header.image_size;
+    bitmap_free_palette(bmp);
+    return 0;
+}
+
+/*
+* Writes palette indices as an uncompressed 1, 2, 4 or 8 bit bitmap file.
+* @param file_name the path to the output file
+* @param width the width of the bitmap file
+* @param height the height of the bitmap file. Negative values describe a top-down image
+* @param bits_per_pixel 1, 2, 4 or 8
+* @param indices UNPADED palette indices, one byte per pixel. They are packed to bits_per_pixel while writing
+* @param palette n_colors BGRA entries
+* @param n_colors palette size, at most 2^bits_per_pixel
+* @return 0 on success, -1 on failure
+*/
+int WriteBitMapIndexed(const char *file_name, int32_t width, int32_t height, uint16_t bits_per_pixel, const uint8_t *indices,
+                       const uint8_t *palette, uint32_t n_colors) {
+    BITMAP_SCOPE(WriteBitMapIndexed);
+    if ((bits_per_pixel != 1 && bits_per_pixel != 2 && bits_per_pixel != 4 && bits_per_pixel != 8) || width < 0 ||
+        n_colors > (1u << bits_per_pixel)) return -1;
+    BITMAPFILEHEADER file_header;
+    BITMAPV4HEADER info_header;
+    InitBitMapHeaders(width, height, bits_per_pixel, BI_RGB, &file_header, &info_header);
+    info_header.n_colors_in_palette = n_colors;
+    file_header.offset += n_colors * 4;
+    file_header.size += n_colors * 4;
+    uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    uint32_t row_size = ROW_SIZE(bits_per_pixel, (uint32_t)width);
+    uint8_t *packed = (uint8_t *)bitmap_malloc(row_size ? row_size : 1);
+    if (packed == NULL) return -1;
+
+    FILE *bitmap_file = bitmap_fopen(file_name, "wb");
+    int result = -1;
+    if (bitmap_file) {
+        result = bitmap_fwrite(&file_header, sizeof(file_header), 1, bitmap_file) == 1 &&
+                 bitmap_fwrite(&info_header, sizeof(info_header), 1, bitmap_file) == 1 &&
+                 (n_colors == 0 || bitmap_fwrite(palette, 4, n_colors, bitmap_file) == n_colors) ? 0 : -1;
+        uint32_t mask = (1u << bits_per_pixel) - 1;
+        const uint8_t *row = indices;
+        for (uint32_t y = 0; result == 0 && y < rows; ++y, row += width) {
+            if (bits_per_pixel == 8) {
+                memcpy(packed, row, (size_t)width);
+                memset(packed + width, 0, row_size - (uint32_t)width);
+            } else {
+                memset(packed, 0, row_size);
+                for (uint32_t x = 0; x < (uint32_t)width; ++x) {
+                    uint32_t bit = x * bits_per_pixel;
+                    packed[bit / 8] |= (uint8_t)((row[x] & mask) << (8 - bits_per_pixel - bit % 8));
+                }
+            }
+            if (bitmap_fwrite(packed, 1, row_size, bitmap_file) != row_size) result = -1;
+        }
+        if (fclose(bitmap_file) != 0) result = -1;
+    }
+    free(packed);
+    return result;
+}
+
+// Median cut works on a histogram of 5 bits per channel
+#define BITMAP_QUANT_BINS (32 * 32 * 32)
+#define BITMAP_QUANT_BIN(r, g, b) (((uint32_t)(r) >> 3) << 10 | ((uint32_t)(g) >> 3) << 5 | ((uint32_t)(b) >> 3))
+
+typedef struct {
+    uint8_t     lo[3];      // Inclusive bounds in bins, red, green, blue
+    uint8_t     hi[3];
+    uint64_t    count;
+} BITMAPQUANTBOX;
+
+// Shrinks a box to the populated bins inside it and counts its pixels
+static void bitmap_quant_shrink(BITMAPQUANTBOX *box, const uint32_t *counts) {
+    uint8_t lo[3] = { 31, 31, 31 }, hi[3] = { 0, 0, 0 };
+    uint64_t total = 0;
+    for (uint32_t r = box->lo[0]; r <= box->hi[0]; ++r) {
+        for (uint32_t g = box->lo[1]; g <= box->hi[1]; ++g) {
+            for (uint32_t b = box->lo[2]; b <= box->hi[2]; ++b) {
+                uint32_t n = counts[r << 10 | g << 5 | b];
+                if (n == 0) continue;
+                total += n;
+                uint8_t c[3] = { (uint8_t)r, (uint8_t)g, (uint8_t)b };
+                for (int i = 0; i < 3; ++i) {
+                    if (c[i] < lo[i]) lo[i] = c[i];
+                    if (c[i] > hi[i]) hi[i] = c[i];
+                }
+            }
+        }
+    }
+    box->count = total;
+    if (total) {
+        memcpy(box->lo, lo, 3);
+        memcpy(box->hi, hi, 3);
+    }
+}
+
+/*
+* Builds a palette with median cut and maps every pixel to its nearest palette color.
+* @param bmp 24 or 32 bit BGR(A) bitmap with padded pixel data. Alpha is ignored
+* @param max_colors largest palette to build, 1 to 256
+* @param palette receives up to max_colors BGRA entries
+* @param indices receives one index per pixel, width bytes per row in the row order of bmp
+* @param n_colors receives the size of the palette
+* @return 0 on success, -1 if the bitmap isn't supported or memory is exhausted
+*/
+int QuantizeBitMap(PBITMAP bmp, uint32_t max_colors, uint8_t *palette, uint8_t *indices, uint32_t *n_colors) {
+    BITMAP_SCOPE(QuantizeBitMap);
+    uint32_t pixel_size = bmp->info_header.bits_per_pixel / 8;
+    if ((pixel_size != 3 && pixel_size != 4) || bmp->pixels == NULL || bmp->info_header.bitmap_width < 0 ||
+        max_colors == 0 || max_colors > 256) return -1;
+    uint32_t width = (uint32_t)bmp->info_header.bitmap_width;
+    int32_t height = bmp->info_header.bitmap_height;
+    uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    size_t row_size = ROW_SIZE(bmp->info_header.bits_per_pixel, width);
+
+    uint32_t *counts = (uint32_t *)bitmap_calloc(BITMAP_QUANT_BINS, sizeof(uint32_t));
+    uint64_t *sums = (uint64_t *)bitmap_calloc((size_t)BITMAP_QUANT_BINS * 3, sizeof(uint64_t));
+    uint8_t *map = (uint8_t *)bitmap_malloc(BITMAP_QUANT_BINS);
+    if (counts == NULL || sums == NULL || map == NULL) {
+        free(counts);
+        free(sums);
+        free(map);
+        return -1;
+    }
+    const uint8_t *row = bmp->pixels;
+    for (uint32_t y = 0; y < rows; ++y, row += row_size) {
+        const uint8_t *pixel = row;
+        for (uint32_t x = 0; x < width; ++x, pixel += pixel_size) {
+            uint32_t bin = BITMAP_QUANT_BIN(pixel[2], pixel[1], pixel[0]);
+            ++counts[bin];
+            sums[bin * 3 + 0] += pixel[2];
+            sums[bin * 3 + 1] += pixel[1];
+            sums[bin * 3 + 2] += pixel[0];
+        }
+    }
+
+    BITMAPQUANTBOX boxes[256];
+    uint32_t n_boxes = 1;
+    BITMAPQUANTBOX all = { { 0, 0, 0 }, { 31, 31, 31 }, 0 };
+    boxes[0] = all;
+    bitmap_quant_shrink(&boxes[0], counts);
+    while (n_boxes < max_colors) {
+        // Split the most populated box that spans more than one bin along its longest side
+        int best = -1;
+        for (uint32_t i = 0; i < n_boxes; ++i) {
+            const BITMAPQUANTBOX *box = &boxes[i];
+            int splittable = box->hi[0] > box->lo[0] || box->hi[1] > box->lo[1] || box->hi[2] > box->lo[2];
+            if (splittable && (best < 0 || box->count > boxes[best].count)) best = (int)i;
+        }
+        if (best < 0) break;
+        BITMAPQUANTBOX *box = &boxes[best];
+        int axis = 0;
+        for (int i = 1; i < 3; ++i) {
+            if (box->hi[i] - box->lo[i] > box->hi[axis] - box->lo[axis]) axis = i;
+        }
+        uint64_t slices[32] = {0};
+        for (uint32_t r = box->lo[0]; r <= box->hi[0]; ++r) {
+            for (uint32_t g = box->lo[1]; g <= box->hi[1]; ++g) {
+                for (uint32_t b = box->lo[2]; b <= box->hi[2]; ++b) {
+                    uint32_t c[3] = { r, g, b };
+                    slices[c[axis]] += counts[r << 10 | g << 5 | b];
+                }
+            }
+        }
+        // Cut after the slice where half of the pixels are reached, keeping both halves non-empty
+        uint64_t seen = 0;
+        uint32_t cut = box->lo[axis];
+        for (; cut < box->hi[axis]; ++cut) {
+            seen += slices[cut];
+            if (seen * 2 >= box->count) break;
+        }
+        if (cut >= box->hi[axis]) cut = box->hi[axis] - 1;
+        BITMAPQUANTBOX upper = *box;
+        box->hi[axis] = (uint8_t)cut;
+        upper.lo[axis] = (uint8_t)(cut + 1);
+        bitmap_quant_shrink(box, counts);
+        bitmap_quant_shrink(&upper, counts);
+        boxes[n_boxes++] = upper;
+    }
+
+    // Palette entries are the pixel means of the boxes
+    for (uint32_t i = 0; i < n_boxes; ++i) {
+        uint64_t total = 0, sum[3] = { 0, 0, 0 };
+        const BITMAPQUANTBOX *box = &boxes[i];
+        for (uint32_t r = box->lo[0]; r <= box->hi[0]; ++r) {
+            for (uint32_t g = box->lo[1]; g <= box->hi[1]; ++g) {
+                for (uint32_t b = box->lo[2]; b <= box->hi[2]; ++b) {
+                    uint32_t bin = r << 10 | g << 5 | b;
+                    total += counts[bin];
+                    for (int c = 0; c < 3; ++c) sum[c] += sums[bin * 3 + c];
+                }
+            }
+        }
+        uint8_t *entry = palette + i * 4;
+        for (int c = 0; c < 3; ++c) entry[2 - c] = total ? (uint8_t)((sum[c] + total / 2) / total) : 0;
+        entry[3] = 0;
+    }
+
+    // Every populated bin maps to the palette entry nearest to the mean color of the bin
+    for (uint32_t bin = 0; bin < BITMAP_QUANT_BINS; ++bin) {
+        if (counts[bin] == 0) continue;
+        int32_t mean[3];
+        for (int c = 0; c < 3; ++c) mean[c] = (int32_t)((sums[bin * 3 + c] + counts[bin] / 2) / counts[bin]);
+        uint32_t nearest = 0, nearest_distance = UINT32_MAX;
+        for (uint32_t i = 0; i < n_boxes; ++i) {
+            const uint8_t *entry = palette + i * 4;
+            int32_t dr = mean[0] - entry[2], dg = mean[1] - entry[1], db = mean[2] - entry[0];
+            uint32_t distance = (uint32_t)(dr * dr + dg * dg + db * db);
+            if (distance < nearest_distance) {
+                nearest_distance = distance;
+                nearest = i;
+            }
+        }
+        map[bin] = (uint8_t)nearest;
+    }
+    row = bmp->pixels;
+    uint8_t *out = indices;
+    for (uint32_t y = 0; y < rows; ++y, row += row_size, out += width) {
+        const uint8_t *pixel = row;
+        for (uint32_t x = 0; x < width; ++x, pixel += pixel_size) out[x] = map[BITMAP_QUANT_BIN(pixel[2], pixel[1], pixel[0])];
+    }
+    *n_colors = n_boxes;
+    free(counts);
+    free(sums);
+    free(map);
+    return 0;
+}
+
+/*
+* Quantizes a 24 or 32 bit bitmap to a palette and writes it with the smallest fitting depth:
+* 1 bit for 2 colors, 4 bits for 16 and 8 bits for 256.
+* @param file_name the path to the output file
+* @param bmp 24 or 32 bit BGR(A) bitmap with padded pixel data
+* @param max_colors largest palette to build, 1 to 256
+* @return 0 on success, -1 on failure
+*/
+int WriteBitMapQuantized(const char *file_name, PBITMAP bmp, uint32_t max_colors) {
+    BITMAP_SCOPE(WriteBitMapQuantized);
+    if (bmp->info_header.bitmap_width < 0) return -1;
+    int32_t height = bmp->info_header.bitmap_height;
+    uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    uint8_t palette[256 * 4];
+    uint8_t *indices = (uint8_t *)bitmap_malloc((size_t)bmp->info_header.bitmap_width * rows + 1);
+    if (indices == NULL) return -1;
+    uint32_t n_colors = 0;
+    int result = QuantizeBitMap(bmp, max_colors, palette, indices, &n_colors);
+    if (result == 0) {
+        uint16_t bits_per_pixel = n_colors <= 2 ? 1 : n_colors <= 16 ? 4 : 8;
+        result = WriteBitMapIndexed(file_name, bmp->info_header.bitmap_width, height, bits_per_pixel, indices, palette, n_colors);
+    }
+    free(indices);
+    return result;
+}
+
+/*
+* BI_BITFIELDS / BI_ALPHABITFIELDS
+* Pixels described by channel masks are unpacked to the canonical 32 bit BGRA layout. 565, 555/1555 and
+* byte aligned 32 bit layouts (BGRA, RGBA, ARGB, ...) use specialized routines, other masks a generic loop.
+*/
+typedef enum {
+    BITFIELDS_GENERIC,
+    BITFIELDS_RGB565,
+    BITFIELDS_RGB555,   // Also 1555 with the top bit as alpha
+    BITFIELDS_BYTES     // 32 bit, every mask is one whole byte or empty
+} BITFIELDSKIND;
+
+typedef struct {
+    uint32_t        bits_per_pixel;
+    uint32_t        mask[4];        // Blue, green, red, alpha
+    uint32_t        shift[4];
+    uint32_t        bits[4];
+    BITFIELDSKIND   kind;
+    uint8_t         shuffle[16];    // BITFIELDS_BYTES: source byte of every output byte of 4 pixels, 0x80 = 255 alpha
+} BITFIELDSDECODER;
+
+/*
+* Prepares the decoding of one mask combination.
+* @param decoder receives the decoding plan
+* @param bits_per_pixel 16 or 32
+* @param red_mask, green_mask, blue_mask, alpha_mask channel masks, alpha_mask may be 0
+* @return 0 on success, -1 if the depth isn't supported or a mask isn't a contiguous run of bits
+*/
+int InitBitFieldsDecoder(BITFIELDSDECODER *decoder, uint32_t bits_per_pixel, uint32_t red_mask, uint32_t green_mask,
+                         uint32_t blue_mask, uint32_t alpha_mask) {
+    BITMAP_SCOPE(InitBitFieldsDecoder);
+    memset(decoder, 0, sizeof(*decoder));
+    if (bits_per_pixel != 16 && bits_per_pixel != 32) return -1;
+    if (bits_per_pixel == 16 && ((red_mask | green_mask | blue_mask | alpha_mask) >> 16)) return -1;
+    uint32_t masks[4] = { blue_mask, green_mask, red_mask, alpha_mask };
+    decoder->bits_per_pixel = bits_per_pixel;
+    int bytes = bits_per_pixel == 32;
+    for (int c = 0; c < 4; ++c) {
+        uint32_t m = masks[c], shift = 0, bits = 0;
+        if (m) {
+            while (((m >> shift) & 1) == 0) ++shift;
+            while (shift + bits < 32 && ((m >> (shift + bits)) & 1)) ++bits;
+            if ((m >> shift) != (bits == 32 ? 0xFFFFFFFFu : (1u << bits) - 1)) return -1; // Holes in the mask
+        }
+        decoder->mask[c] = m;
+        decoder->shift[c] = shift;
+        decoder->bits[c] = bits;
+        if (m && (bits != 8 || (shift & 7))) bytes = 0;
+    }
+    if (bits_per_pixel == 16 && red_mask == 0xF800 && green_mask == 0x07E0 && blue_mask == 0x001F && alpha_mask == 0) {
+        decoder->kind = BITFIELDS_RGB565;
+    } else if (bits_per_pixel == 16 && red_mask == 0x7C00 && green_mask == 0x03E0 && blue_mask == 0x001F &&
+               (alpha_mask == 0 || alpha_mask == 0x8000)) {
+        decoder->kind = BITFIELDS_RGB555;
+    } else if (bytes) {
+        decoder->kind = BITFIELDS_BYTES;
+        for (int p = 0; p < 4; ++p) {
+            for (int c = 0; c < 4; ++c) {
+                decoder->shuffle[p * 4 + c] = masks[c] ? (uint8_t)(p * 4 + decoder->shift[c] / 8) : 0x80;
+            }
+        }
+    } else {
+        decoder->kind = BITFIELDS_GENERIC;
+    }
+    return 0;
+}
+
+// Scales an n bit channel value to 8 bits by repeating its bits
+static inline uint8_t bitmap_expand_channel(uint32_t value, uint32_t bits) {
+    if (bits >= 8) return (uint8_t)(value >> (bits - 8));
+    uint32_t r = value << (8 - bits);
+    for (uint32_t s = bits; s < 8; s *= 2) r |= r >> s;
+    return (uint8_t)r;
+}
+
+static void bitmap_bitfields_scalar(const BITFIELDSDECODER *d, const uint8_t *src, uint8_t *dst, uint32_t x, uint32_t width) {
+    uint32_t pixel_size = d->bits_per_pixel / 8;
+    for (; x < width; ++x) {
+        uint32_t value = 0;
+        memcpy(&value, src + x * pixel_size, pixel_size);
+        uint8_t out[4];
+        for (int c = 0; c < 4; ++c) {
+            out[c] = d->mask[c] ? bitmap_expand_channel((value & d->mask[c]) >> d->shift[c], d->bits[c]) : (c == 3 ? 255 : 0);
+        }
+        memcpy(dst + x * 4, out, 4);
+    }
+}
+
+#ifdef BITMAP_HAVE_SSE2
+// 8 pixels of 565 or 555/1555 to BGRA
+static uint32_t bitmap_bitfields16_sse2(const BITFIELDSDECODER *d, const uint8_t *src, uint8_t *dst, uint32_t width) {
+    const __m128i m5 = _mm_set1_epi16(0x1F), m6 = _mm_set1_epi16(0x3F), opaque = _mm_set1_epi16((int16_t)0xFF00);
+    int rgb565 = d->kind == BITFIELDS_RGB565, has_alpha = d->mask[3] != 0;
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + x * 2));
+        __m128i r, g, b = _mm_and_si128(v, m5), a = opaque;
+        if (rgb565) {
+            r = _mm_srli_epi16(v, 11);
+            g = _mm_and_si128(_mm_srli_epi16(v, 5), m6);
+            g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+        } else {
+            r = _mm_and_si128(_mm_srli_epi16(v, 10), m5);
+            g = _mm_and_si128(_mm_srli_epi16(v, 5), m5);
+            g = _mm_or_si128(_mm_slli_epi16(g, 3), _mm_srli_epi16(g, 2));
+            if (has_alpha) a = _mm_and_si128(_mm_srai_epi16(v, 15), opaque);
+        }
+        r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+        b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+        __m128i bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+        __m128i ra = _mm_or_si128(r, a);
+        _mm_storeu_si128((__m128i *)(dst + x * 4), _mm_unpacklo_epi16(bg, ra));
+        _mm_storeu_si128((__m128i *)(dst + x * 4 + 16), _mm_unpackhi_epi16(bg, ra));
+    }
+    return x;
+}
+#endif
+
+#ifdef BITMAP_HAVE_SSSE3
+BITMAP_TARGET_SSSE3 static uint32_t bitmap_bitfields_bytes_ssse3(const BITFIELDSDECODER *d, const uint8_t *src, uint8_t *dst, uint32_t width) {
+    const __m128i shuffle = _mm_loadu_si128((const __m128i *)d->shuffle);
+    __m128i alpha = _mm_setzero_si128();
+    if (d->mask[3] == 0) alpha = _mm_set1_epi32((int)0xFF000000u);
+    uint32_t x = 0;
+    for (; x + 4 <= width; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + x * 4));
+        _mm_storeu_si128((__m128i *)(dst + x * 4), _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha));
+    }
+    return x;
+}
+#endif
+
+#if defined(BITMAP_HAVE_NEON) && defined(__aarch64__)
+static uint32_t bitmap_bitfields_bytes_neon(const BITFIELDSDECODER *d, const uint8_t *src, uint8_t *dst, uint32_t width) {
+    // Out of range indices (0x80) give 0 in vqtbl1q_u8
+    const uint8x16_t shuffle = vld1q_u8(d->shuffle);
+    const uint8x16_t alpha = vreinterpretq_u8_u32(vdupq_n_u32(d->mask[3] == 0 ? 0xFF000000u : 0));
+    uint32_t x = 0;
+    for (; x + 4 <= width; x += 4) vst1q_u8(dst + x * 4, vorrq_u8(vqtbl1q_u8(vld1q_u8(src + x * 4), shuffle), alpha));
+    return x;
+}
+#endif
+
+/*
+* Unpacks one row to 32 bit BGRA. src and dst may be the same buffer for 32 bit input.
+* @param decoder plan from InitBitFieldsDecoder
+* @param src packed pixels
+* @param dst receives width * 4 bytes
+* @param width number of pixels
+*/
+void DecodeBitFieldsRow(const BITFIELDSDECODER *decoder, const uint8_t *src, uint8_t *dst, uint32_t width) {
+    BITMAP_SCOPE(DecodeBitFieldsRow);
+    uint32_t x = 0;
+    switch (decoder->kind) {
+    case BITFIELDS_RGB565:
+    case BITFIELDS_RGB555:
+#ifdef BITMAP_HAVE_SSE2
+        // In place decoding would overwrite input not read yet, keep that to the scalar loop
+        if (src != dst) x = bitmap_bitfields16_sse2(decoder, src, dst, width);
+#endif
+        break;
+    case BITFIELDS_BYTES:
+#ifdef BITMAP_HAVE_SSSE3
+        {
+            static int has_ssse3 = -1;
+            if (has_ssse3 < 0) has_ssse3 = bitmap_cpu_has_ssse3();
+            if (has_ssse3) x = bitmap_bitfields_bytes_ssse3(decoder, src, dst, width);
+        }
+#elif defined(BITMAP_HAVE_NEON) && defined(__aarch64__)
+        x = bitmap_bitfields_bytes_neon(decoder, src, dst, width);
+#endif
+        break;
+    default:
+        break;
+    }
+    bitmap_bitfields_scalar(decoder, src, dst, x, width);
+}
+
+/*
+* Converts a bitmap with BI_BITFIELDS or BI_ALPHABITFIELDS pixels to canonical 32 bit BGRA (BI_RGB with the standard masks).
+* 32 bit pixels are converted in place, 16 bit pixels get a new buffer from the bitmap's allocator.
+* @param bmp bitmap with padded pixel data, 16 or 32 bits per pixel
+* @return 0 on success, -1 on unsupported masks or exhausted memory
+*/
+int DecodeBitFieldsBitMap(PBITMAP bmp) {
+    BITMAP_SCOPE(DecodeBitFieldsBitMap);
+    BITMAPV4HEADER *ih = &bmp->info_header;
+    BITFIELDSDECODER decoder;
+    uint32_t alpha_mask = ih->compression_method == BI_ALPHABITFIELDS || ih->header_size >= 56 ? ih->alpha_mask : 0;
+    if (ih->bitmap_width < 0 ||
+        InitBitFieldsDecoder(&decoder, ih->bits_per_pixel, ih->red_mask, ih->green_mask, ih->blue_mask, alpha_mask) != 0) return -1;
+    uint32_t width = (uint32_t)ih->bitmap_width;
+    uint32_t rows = ih->bitmap_height < 0 ? (uint32_t)-(int64_t)ih->bitmap_height : (uint32_t)ih->bitmap_height;
+    uint32_t src_stride = ROW_SIZE(ih->bits_per_pixel, width), dst_stride = width * 4;
+    int identity = decoder.kind == BITFIELDS_BYTES && memcmp(decoder.shuffle, "\0\1\2\3\4\5\6\7\10\11\12\13\14\15\16\17", 16) == 0;
+
+    if (!identity) {
+        if (ih->bits_per_pixel == 32) {
+            uint8_t *row = bmp->pixels;
+            for (uint32_t y = 0; y < rows; ++y, row += src_stride) DecodeBitFieldsRow(&decoder, row, row, width);
+        } else {
+            BITMAP decoded = *bmp;
+            if (bitmap_alloc_pixels(&decoded, (size_t)dst_stride * rows, bmp->allocator.alloc ? &bmp->allocator : NULL) == NULL) return -1;
+            const uint8_t *src = bmp->pixels;
+            uint8_t *dst = decoded.pixels;
+            for (uint32_t y = 0; y < rows; ++y, src += src_stride, dst += dst_stride) DecodeBitFieldsRow(&decoder, src, dst, width);
+            bitmap_free_pixels(bmp);
+            bmp->pixels = decoded.pixels;
+            bmp->pixels_size = decoded.pixels_size;
+            bmp->allocator = decoded.allocator;
+        }
+    }
+    ih->bits_per_pixel = 32;
+    ih->compression_method = BI_RGB;
+    ih->image_size = dst_stride * rows;
+    ih->red_mask = 0x00ff0000;
+    ih->green_mask = 0x0000ff00;
+    ih->blue_mask = 0x000000ff;
+    ih->alpha_mask = 0xff000000;
+    return 0;
+}
+
+/*
+* Embedded PNG and JPEG payloads
+* BI_PNG and BI_JPEG files carry a complete PNG or JPEG stream instead of pixel rows. The stream is exposed
+* as it is stored and is only turned into pixels by a codec the application provides.
+*/
+typedef struct {
+    const uint8_t   *data;          // First byte of the PNG or JPEG stream
+    size_t          size;
+    uint32_t        compression;    // BI_PNG or BI_JPEG
+} BITMAPPAYLOAD;
+
+typedef struct {
+    /*
+    * Decodes payload into width x height pixels of bits_per_pixel, B, G, R (and A) byte order.
+    * top is the top row, stride the bytes from one row to the one below it (negative for bottom-up images).
+    * Returns 0 on success, -1 on failure
+    */
+    int         (*decode)(void *user, const BITMAPPAYLOAD *payload, uint8_t *top, ptrdiff_t stride, uint32_t width, uint32_t height);
+    uint16_t    bits_per_pixel;     // 24 or 32
+    void        *user;
+} BITMAPCODEC;
+
+static BITMAPCODEC bitmap_codec;
+
+static int bitmap_is_payload(const BITMAPV4HEADER *info_header) {
+    return info_header->compression_method == BI_PNG || info_header->compression_method == BI_JPEG;
+}
+
+/*
+* Installs the codec ReadBitMap uses to decode BI_PNG and BI_JPEG files. Without one their payload is returned
+* as it is stored. Not thread safe, install it before reading images.
+* @param codec the codec, copied. NULL removes it
+*/
+void SetBitMapCodec(const BITMAPCODEC *codec) {
+    BITMAP_SCOPE(SetBitMapCodec);
+    if (codec) bitmap_codec = *codec;
+    else memset(&bitmap_codec, 0, sizeof(bitmap_codec));
+}
+
+// Payload of a BI_PNG or BI_JPEG file of `size` bytes. image_size may be 0, the payload then runs to the end of the file
+static int bitmap_payload_span(const BITMAPFILEHEADER *file_header, const BITMAPV4HEADER *info_header, uint64_t size,
+                               uint64_t *offset, uint64_t *length) {
+    if (!bitmap_is_payload(info_header) || file_header->offset > size) return -1;
+    *offset = file_header->offset;
+    *length = size - file_header->offset;
+    if (info_header->image_size != 0 && info_header->image_size < *length) *length = info_header->image_size;
+    return *length ? 0 : -1;
+}
+
+/*
+* Returns the PNG or JPEG stream of a mapped BI_PNG or BI_JPEG file without copying it
+* @param view view from MapBitMap
+* @param payload receives the stream, it points into the mapping
+* @return 0 on success, -1 if the file has no payload
+*/
+int GetBitMapViewPayload(const BITMAPVIEW *view, BITMAPPAYLOAD *payload) {
+    BITMAP_SCOPE(GetBitMapViewPayload);
+    uint64_t offset, length;
+    memset(payload, 0, sizeof(*payload));
+    if (bitmap_payload_span(&view->file_header, &view->info_header, view->size, &offset, &length) != 0) return -1;
+    payload->data = view->data + offset;
+    payload->size = (size_t)length;
+    payload->compression = view->info_header.compression_method;
+    return 0;
+}
+
+/*
+* Returns the PNG or JPEG stream of a BI_PNG or BI_JPEG bitmap that was read without a codec
+* @param bmp bitmap from ReadBitMap
+* @param payload receives the stream, it points into bmp->pixels
+* @return 0 on success, -1 if the bitmap has no payload
+*/
+int GetBitMapPayload(const BITMAP *bmp, BITMAPPAYLOAD *payload) {
+    BITMAP_SCOPE(GetBitMapPayload);
+    memset(payload, 0, sizeof(*payload));
+    if (!bitmap_is_payload(&bmp->info_header) || bmp->pixels == NULL || bmp->info_header.image_size == 0) return -1;
+    payload->data = bmp->pixels;
+    payload->size = bmp->info_header.image_size;
+    payload->compression = bmp->info_header.compression_method;
+    return 0;
+}
+
+/*
+* Decodes the PNG or JPEG stream of a bitmap into padded BI_RGB pixels of codec->bits_per_pixel.
+* The row order of the file is kept.
+* @param bmp bitmap from ReadBitMap that holds a payload
+* @param codec codec to decode with, NULL for the one installed with SetBitMapCodec
+* @return 0 on success, -1 if there is no payload or codec or decoding failed. bmp is unchanged on failure
+*/
+int DecodeBitMapPayload(PBITMAP bmp, const BITMAPCODEC *codec) {
+    BITMAP_SCOPE(DecodeBitMapPayload);
+    if (codec == NULL) codec = &bitmap_codec;
+    BITMAPV4HEADER *ih = &bmp->info_header;
+    BITMAPPAYLOAD payload;
+    if (codec->decode == NULL || (codec->bits_per_pixel != 24 && codec->bits_per_pixel != 32) || ih->bitmap_width <= 0 ||
+        GetBitMapPayload(bmp, &payload) != 0) return -1;
+    uint32_t width = (uint32_t)ih->bitmap_width;
+    uint32_t rows = ih->bitmap_height < 0 ? (uint32_t)-(int64_t)ih->bitmap_height : (uint32_t)ih->bitmap_height;
+    uint64_t row_size = ROW_SIZE((uint64_t)codec->bits_per_pixel, width);
+    if (rows == 0 || row_size * rows > UINT32_MAX) return -1;
+    BITMAP decoded = *bmp;
+    if (bitmap_alloc_pixels(&decoded, (size_t)(row_size * rows), bmp->allocator.alloc ? &bmp->allocator : NULL) == NULL) return -1;
+    ptrdiff_t stride;
+    uint8_t *top = (uint8_t *)bitmap_top_row(decoded.pixels, ih->bitmap_height, (uint32_t)row_size, &stride);
+    if (codec->decode(codec->user, &payload, top, stride, width, rows) != 0) {
+        bitmap_free_pixels(&decoded);
+        return -1;
+    }
+    uint32_t row_bytes = width * (codec->bits_per_pixel / 8);
+    if (row_bytes != row_size) {
+        uint8_t *row = decoded.pixels;
+        for (uint32_t y = 0; y < rows; ++y, row += row_size) memset(row + row_bytes, 0, (size_t)row_size - row_bytes);
+    }
+    bitmap_free_pixels(bmp);
+    bmp->pixels = decoded.pixels;
+    bmp->pixels_size = decoded.pixels_size;
+    bmp->allocator = decoded.allocator;
+    ih->bits_per_pixel = codec->bits_per_pixel;
+    ih->compression_method = BI_RGB;
+    ih->image_size = (uint32_t)(row_size * rows);
+    if (codec->bits_per_pixel == 32) {
+        ih->red_mask = 0x00ff0000;
+        ih->green_mask = 0x0000ff00;
+        ih->blue_mask = 0x000000ff;
+        ih->alpha_mask = 0xff000000;
+    }
+    return 0;
+}
+
+/*
+* Writes a BI_PNG or BI_JPEG bitmap file around an already compressed stream, nothing is decoded or re-encoded.
+* @param file_name the path to the output file
+* @param width the width of the image in the stream
+* @param height the height of the image in the stream. Negative values describe a top-down image
+* @param compression BI_PNG or BI_JPEG
+* @param data the PNG or JPEG stream
+* @param size size of data
+* @return 0 on success, -1 on failure
+*/
+int WriteBitMapPayload(const char *file_name, int32_t width, int32_t height, uint32_t compression, const uint8_t *data, size_t size) {
+    BITMAP_SCOPE(WriteBitMapPayload);
+    uint64_t total = (uint64_t)sizeof(BITMAPFILEHEADER) + sizeof(BITMAPV4HEADER) + size;
+    if ((compression != BI_PNG && compression != BI_JPEG) || size == 0 || total > UINT32_MAX) return -1;
+    BITMAPFILEHEADER file_header;
+    BITMAPV4HEADER info_header;
+    InitBitMapHeaders(width, height, 0, compression, &file_header, &info_header);
+    file_header.size = (uint32_t)total;
+    info_header.image_size = (uint32_t)size;
+    FILE *bitmap_file = bitmap_fopen(file_name, "wb");
+    if (bitmap_file == NULL) return -1;
+    int result = bitmap_fwrite(&file_header, sizeof(file_header), 1, bitmap_file) == 1 &&
+                 bitmap_fwrite(&info_header, sizeof(info_header), 1, bitmap_file) == 1 &&
+                 bitmap_fwrite(data, 1, size, bitmap_file) == size ? 0 : -1;
+    if (fclose(bitmap_file) != 0) result = -1;
+    return result;
+}
+
+/*
+* Validating parser
+* Every header of an untrusted file is checked once, before anything is allocated: the signature, the header size
+* (BITMAPCOREHEADER, BITMAPINFOHEADER and its V2 to V5 extensions), the pixel format and the size of the pixel
+* array in 64 bit arithmetic against ROW_SIZE and the size of the file. Failing functions return a BITMAPERROR.
+* All codes are negative and BITMAP_ERROR is -1, so callers that only compare with 0 or -1 keep working.
+*/
+typedef enum {
+    BITMAP_OK = 0,
+    BITMAP_ERROR = -1,              // Failure without a more specific code
+    BITMAP_ERROR_IO = -2,           // The file can't be opened, read or written
+    BITMAP_ERROR_SIGNATURE = -3,    // The file doesn't start with "BM"
+    BITMAP_ERROR_HEADER = -4,       // Unknown header size or a header field out of range
+    BITMAP_ERROR_FORMAT = -5,       // Bits per pixel and compression that aren't supported together
+    BITMAP_ERROR_SIZE = -6,         // The dimensions overflow the size arithmetic
+    BITMAP_ERROR_TRUNCATED = -7,    // The file ends before its headers or pixel array do
+    BITMAP_ERROR_MEMORY = -8        // An allocation failed
+} BITMAPERROR;
+
+/*
+* Returns a short description of an error code.
+* @param error a BITMAPERROR, 0 or -1
+*/
+const char *GetBitMapErrorString(int error) {
+    BITMAP_SCOPE(GetBitMapErrorString);
+    switch (error) {
+    case BITMAP_OK: return "success";
+    case BITMAP_ERROR_IO: return "i/o error";
+    case BITMAP_ERROR_SIGNATURE: return "not a bitmap file";
+    case BITMAP_ERROR_HEADER: return "invalid header";
+    case BITMAP_ERROR_FORMAT: return "unsupported pixel format";
+    case BITMAP_ERROR_SIZE: return "image too large";
+    case BITMAP_ERROR_TRUNCATED: return "truncated file";
+    case BITMAP_ERROR_MEMORY: return "out of memory";
+    default: return "error";
+    }
+}
+
+// Largest header combination: BITMAPFILEHEADER, BITMAPV5HEADER. Also covers BITMAPINFOHEADER with 4 masks
+#define BITMAP_HEADERS_SIZE (14 + 124)
+
+/*
+* Parses the headers at the start of a file into a BITMAPFILEHEADER and a BITMAPV4HEADER. Fields a shorter header
+* lacks are 0, header_size keeps the stored size. BITMAPCOREHEADER fields are widened, the masks that follow a
+* BITMAPINFOHEADER are moved into the mask fields.
+*/
+static int bitmap_parse_headers(const uint8_t *data, size_t size, BITMAPFILEHEADER *file_header, BITMAPV4HEADER *info_header) {
+    memset(info_header, 0, sizeof(*info_header));
+    if (size < 2) return BITMAP_ERROR_TRUNCATED;
+    if (data[0] != 'B' || data[1] != 'M') return BITMAP_ERROR_SIGNATURE;
+    if (size < 14 + 4) return BITMAP_ERROR_TRUNCATED;
+    memcpy(file_header, data, sizeof(*file_header));
+    uint32_t header_size;
+    memcpy(&header_size, data + 14, 4);
+    if (header_size != 12 && header_size != 40 && header_size != 52 && header_size != 56 &&
+        header_size != 64 && header_size != 108 && header_size != 124) return BITMAP_ERROR_HEADER;
+    uint32_t masks_size = 0;
+    if (header_size == 12) {
+        if (size < 14 + 12) return BITMAP_ERROR_TRUNCATED;
+        // BITMAPCOREHEADER: 16 bit width and height, always bottom-up and uncompressed
+        uint16_t core[4];
+        memcpy(core, data + 18, sizeof(core));
+        info_header->header_size = 12;
+        info_header->bitmap_width = core[0];
+        info_header->bitmap_height = core[1];
+        info_header->n_color_planes = core[2];
+        info_header->bits_per_pixel = core[3];
+        if (core[3] != 1 && core[3] != 4 && core[3] != 8 && core[3] != 24) return BITMAP_ERROR_FORMAT;
+    } else {
+        if (size < 14 + (size_t)header_size) return BITMAP_ERROR_TRUNCATED;
+        memcpy(info_header, data + 14, header_size < sizeof(*info_header) ? header_size : sizeof(*info_header));
+        if (header_size == 40 && (info_header->compression_method == BI_BITFIELDS || info_header->compression_method == BI_ALPHABITFIELDS)) {
+            // The masks follow the header, the alpha mask only for BI_ALPHABITFIELDS
+            masks_size = info_header->compression_method == BI_BITFIELDS ? 12 : 16;
+            if (size < 14 + 40 + (size_t)masks_size) return BITMAP_ERROR_TRUNCATED;
+            memcpy(&info_header->red_mask, data + 14 + 40, masks_size);
+        }
+    }
+    int32_t height = info_header->bitmap_height;
+    uint32_t bits_per_pixel = info_header->bits_per_pixel, compression = info_header->compression_method;
+    if (info_header->bitmap_width < 0 || height == INT32_MIN || file_header->offset < 14 + header_size + masks_size) return BITMAP_ERROR_HEADER;
+    switch (compression) {
+    case BI_RGB:
+        if (bits_per_pixel != 1 && bits_per_pixel != 2 && bits_per_pixel != 4 && bits_per_pixel != 8 &&
+            bits_per_pixel != 16 && bits_per_pixel != 24 && bits_per_pixel != 32) return BITMAP_ERROR_FORMAT;
+        break;
+    case BI_BITFIELDS:
+    case BI_ALPHABITFIELDS:
+        if (bits_per_pixel != 16 && bits_per_pixel != 32) return BITMAP_ERROR_FORMAT;
+        break;
+    case BI_RLE8:
+    case BI_RLE4:
+        // RLE images are bottom-up only
+        if (bits_per_pixel != (compression == BI_RLE8 ? 8u : 4u) || height < 0) return BITMAP_ERROR_FORMAT;
+        break;
+    case BI_JPEG:
+    case BI_PNG:
+        break;
+    default:
+        return BITMAP_ERROR_FORMAT;
+    }
+    return BITMAP_OK;
+}
+
+/*
+* Checks that the pixel array of parsed headers fits in a file of file_size bytes, and that every buffer size derived
+* from the headers fits in 32 bits. Only the padding of the last row may be missing, like bitmap_read_pixels allows.
+*/
+static int bitmap_check_pixel_array(const BITMAPFILEHEADER *file_header, const BITMAPV4HEADER *info_header, uint64_t file_size) {
+    int32_t height = info_header->bitmap_height;
+    uint64_t rows = height < 0 ? (uint64_t)-(int64_t)height : (uint64_t)height;
+    uint64_t width = (uint32_t)info_header->bitmap_width;
+    uint32_t compression = info_header->compression_method;
+    if (compression == BI_JPEG || compression == BI_PNG) return file_header->offset > file_size ? BITMAP_ERROR_TRUNCATED : BITMAP_OK;
+    // Width and rows are below 2^31 and the row size below 2^34, the product can't overflow 64 bits
+    uint64_t row_size = ROW_SIZE((uint64_t)info_header->bits_per_pixel, width);
+    if (compression == BI_RLE8 || compression == BI_RLE4) {
+        // Runs and deltas expand without bound, only the decoded 8 bit image has to stay in range
+        if (ROW_SIZE((uint64_t)8, width) * rows > UINT32_MAX) return BITMAP_ERROR_SIZE;
+        return file_header->offset > file_size ? BITMAP_ERROR_TRUNCATED : BITMAP_OK;
+    }
+    // Decoded bit fields images are 32 bit
+    uint64_t decoded_size = ROW_SIZE((uint64_t)32, width) * rows;
+    if (row_size * rows > UINT32_MAX || (compression != BI_RGB && decoded_size > UINT32_MAX)) return BITMAP_ERROR_SIZE;
+    uint64_t row_bytes = (info_header->bits_per_pixel * width + 7) / 8;
+    uint64_t required = rows ? row_size * rows - (row_size - row_bytes) : 0;
+    if (file_header->offset > file_size || required > file_size - file_header->offset) return BITMAP_ERROR_TRUNCATED;
+    return BITMAP_OK;
+}
+
+// Size of an open file. The position is left at the end
+static int bitmap_file_size(FILE *bitmap_file, uint64_t *size) {
+    long end;
+    if (bitmap_fseek(bitmap_file, 0, SEEK_END) != 0 || (end = ftell(bitmap_file)) < 0) return BITMAP_ERROR_IO;
+    *size = (uint64_t)end;
+    return BITMAP_OK;
+}
+
+// Reads and validates the headers with a single read. The position of the file is unspecified afterwards
+static int bitmap_read_headers(FILE *bitmap_file, BITMAPFILEHEADER *file_header, BITMAPV4HEADER *info_header) {
+    uint8_t data[BITMAP_HEADERS_SIZE];
+    size_t size = bitmap_fread(data, 1, sizeof(data), bitmap_file);
+    if (size < sizeof(data) && ferror(bitmap_file)) return BITMAP_ERROR_IO;
+    int result = bitmap_parse_headers(data, size, file_header, info_header);
+    uint64_t file_size;
+    if (result == BITMAP_OK) result = bitmap_file_size(bitmap_file, &file_size);
+    if (result == BITMAP_OK) result = bitmap_check_pixel_array(file_header, info_header, file_size);
+    return result;
+}
+
+// Reads the uncompressed pixel array into dst with dst_stride bytes per row
+static int bitmap_read_pixels(FILE *bitmap_file, const BITMAPFILEHEADER *file_header, const BITMAPV4HEADER *info_header,
+                              uint8_t *dst, size_t dst_stride) {
+    uint32_t width = (uint32_t)info_header->bitmap_width;
+    uint32_t rows = info_header->bitmap_height < 0 ? (uint32_t)-(int64_t)info_header->bitmap_height : (uint32_t)info_header->bitmap_height;
+    uint32_t row_size = ROW_SIZE(info_header->bits_per_pixel, width);
+    uint32_t row_bytes = (info_header->bits_per_pixel * width + 7) / 8;
+    if (rows == 0) return 0;
+    if (bitmap_fseek(bitmap_file, file_header->offset, SEEK_SET) != 0) return -1;
+    if (dst_stride == row_size) {
+        // Same layout as the file: one read, the padding of the last row may be missing
+        size_t size = (size_t)row_size * rows;
+        size_t got = bitmap_fread(dst, 1, size, bitmap_file);
+        if (got < size - (row_size - row_bytes)) return -1;
+        memset(dst + got, 0, size - got);
+        return 0;
+    }
+    uint8_t padding[4];
+    uint32_t padding_size = row_size - row_bytes;
+    for (uint32_t y = 0; y < rows; ++y, dst += dst_stride) {
+        if (bitmap_fread(dst, 1, row_bytes, bitmap_file) != row_bytes) return -1;
+        if (y + 1 < rows && bitmap_fread(padding, 1, padding_size, bitmap_file) != padding_size) return -1;
+    }
+    return 0;
+}
+
+/*
+* Returns the buffer size ReadBitMapInto needs for a file. Only the headers are read.
+* @param file_name the path to a bitmap file
+* @param dst_stride bytes per row in the destination buffer, 0 for ROW_SIZE
+* @return the size in bytes, 0 if the file can't be read or isn't an uncompressed BI_RGB bitmap
+*/
+size_t GetBitMapBufferSize(const char *file_name, uint32_t dst_stride) {
+    BITMAP_SCOPE(GetBitMapBufferSize);
+    BITMAPFILEHEADER file_header;
+    BITMAPV4HEADER info_header;
+    FILE *bitmap_file = bitmap_fopen(file_name, "rb");
+    if (bitmap_file == NULL) return 0;
+    int result = bitmap_read_headers(bitmap_file, &file_header, &info_header);
+    fclose(bitmap_file);
+    if (result != 0 || info_header.compression_method != BI_RGB) return 0;
+    int32_t height = info_header.bitmap_height;
+    uint64_t rows = height < 0 ? (uint64_t)-(int64_t)height : (uint64_t)height;
+    uint64_t stride = dst_stride ? dst_stride : ROW_SIZE((uint64_t)info_header.bits_per_pixel, (uint32_t)info_header.bitmap_width);
+    return (size_t)(stride * rows);
+}
+
+/*
+* Rewrites the headers of a bitmap read from a file to describe the file WriteToBitMapFile writes from it:
+* a BITMAPV4HEADER, the color table of 8 bit and smaller images and the ROW_SIZE padded pixels. The stored
+* header size, offset and image_size (which may be 0 for BI_RGB) only describe the source file.
+*/
+static void bitmap_normalize_headers(PBITMAP bitmap) {
+    uint32_t palette_colors = bitmap->palette && bitmap->info_header.bits_per_pixel <= 8 ? bitmap->palette_colors : 0;
+    if (!bitmap_is_payload(&bitmap->info_header)) {
+        int32_t height = bitmap->info_header.bitmap_height;
+        uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+        bitmap->info_header.image_size = IMAGE_SIZE(ROW_SIZE(bitmap->info_header.bits_per_pixel, (uint32_t)bitmap->info_header.bitmap_width), rows);
+    }
+    bitmap->info_header.header_size = sizeof(BITMAPV4HEADER);
+    bitmap->info_header.n_colors_in_palette = palette_colors;
+    bitmap->file_header.offset = sizeof(BITMAPFILEHEADER) + sizeof(BITMAPV4HEADER) + palette_colors * 4;
+    bitmap->file_header.size = bitmap->file_header.offset + bitmap->info_header.image_size;
+}
+
+/*
+* Reads an uncompressed bitmap file into a buffer owned by the caller. Nothing is allocated, so BI_BITFIELDS and
+* BI_ALPHABITFIELDS files, which ReadBitMapEx converts to 32 bit BGRA, are rejected.
+* @param file_name the path to a bitmap file
+* @param dst destination buffer, at least GetBitMapBufferSize(file_name, dst_stride) bytes
+* @param dst_stride bytes per row in dst, 0 for ROW_SIZE. Must fit an unpadded row. The BITMAP doesn't record the
+* stride: with any other stride than ROW_SIZE, don't pass it to the functions that take a PBITMAP
+* @param bitmap receives the headers, bitmap->pixels points to dst. cleanup won't free dst
+* @return 0 on success, -1 on failure
+*/
+int ReadBitMapInto(const char *file_name, uint8_t *dst, uint32_t dst_stride, PBITMAP bitmap) {
+    BITMAP_SCOPE(ReadBitMapInto);
+    memset(bitmap, 0, sizeof(*bitmap));
+    FILE *bitmap_file = bitmap_fopen(file_name, "rb");
+    if (bitmap_file == NULL) return -1;
+    int result = bitmap_read_headers(bitmap_file, &bitmap->file_header, &bitmap->info_header);
+    if (result == 0 && bitmap->info_header.compression_method != BI_RGB) result = -1;
+    size_t stride = 0;
+    if (result == 0) {
+        uint32_t width = (uint32_t)bitmap->info_header.bitmap_width;
+        uint32_t row_bytes = (bitmap->info_header.bits_per_pixel * width + 7) / 8;
+        stride = dst_stride ? dst_stride : ROW_SIZE(bitmap->info_header.bits_per_pixel, width);
+        result = stride < row_bytes ? -1 : bitmap_read_pixels(bitmap_file, &bitmap->file_header, &bitmap->info_header, dst, stride);
+    }
+    fclose(bitmap_file);
+    if (result == 0) {
+        int32_t height = bitmap->info_header.bitmap_height;
+        bitmap->pixels_size = stride * (height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height);
+        bitmap_normalize_headers(bitmap);
+    }
+    bitmap->pixels = dst;
+    bitmap->allocator.free = bitmap_borrowed_free;
+    return result;
+}
+
+// Number of color table entries stored between the info header and the pixels, entry_size receives their size
+static uint32_t bitmap_palette_colors(const BITMAPFILEHEADER *file_header, const BITMAPV4HEADER *info_header, uint32_t *entry_size) {
+    uint32_t bits_per_pixel = info_header->bits_per_pixel;
+    uint32_t n_colors = info_header->n_colors_in_palette;
+    if (bits_per_pixel > 8) return 0;
+    if (n_colors == 0 || n_colors > (1u << bits_per_pixel)) n_colors = 1u << bits_per_pixel;
+    uint64_t start = (uint64_t)sizeof(BITMAPFILEHEADER) + info_header->header_size;
+    // BITMAPCOREHEADER files store 3 byte BGR entries
+    *entry_size = info_header->header_size == 12 ? 3 : 4;
+    if (start >= file_header->offset) return 0;
+    if ((file_header->offset - start) / *entry_size < n_colors) n_colors = (uint32_t)((file_header->offset - start) / *entry_size);
+    return n_colors;
+}
+
+// Widens 3 byte entries from the back, in place
+static void bitmap_widen_palette(uint8_t *palette, uint32_t n_colors, uint32_t entry_size) {
+    for (uint32_t i = n_colors; entry_size == 3 && i-- > 0;) {
+        uint8_t *entry = palette + (size_t)i * 4;
+        const uint8_t *packed = palette + (size_t)i * 3;
+        uint8_t blue = packed[0], green = packed[1], red = packed[2];
+        entry[0] = blue;
+        entry[1] = green;
+        entry[2] = red;
+        entry[3] = 0;
+    }
+}
+
+// Loads the color table that follows the info header. A missing table is not an error
+static void bitmap_read_palette(FILE *bitmap_file, PBITMAP bitmap, const BITMAPALLOCATOR *allocator) {
+    if (allocator == NULL) allocator = GetBitMapDefaultAllocator();
+    uint32_t entry_size;
+    uint32_t n_colors = bitmap_palette_colors(&bitmap->file_header, &bitmap->info_header, &entry_size);
+    long start = (long)(sizeof(BITMAPFILEHEADER) + bitmap->info_header.header_size);
+    if (n_colors == 0 || bitmap_fseek(bitmap_file, start, SEEK_SET) != 0) return;
+    BITMAP_STAT_ALLOC();
+    bitmap->palette = (uint8_t *)allocator->alloc((size_t)n_colors * 4, sizeof(uint32_t), allocator->user);
+    if (bitmap->palette == NULL) return;
+    bitmap->palette_colors = n_colors;
+    if (bitmap_fread(bitmap->palette, entry_size, n_colors, bitmap_file) != n_colors) {
+        bitmap_free_palette(bitmap);
+        return;
+    }
+    bitmap_widen_palette(bitmap->palette, n_colors, entry_size);
+}
+
+// Decodes an RLE pixel array into 8 bit palette indices and rewrites the headers to match
+static int bitmap_read_rle(FILE *bitmap_file, PBITMAP bitmap, const BITMAPALLOCATOR *allocator) {
+    int32_t height = bitmap->info_header.bitmap_height;
+    uint32_t width = (uint32_t)bitmap->info_header.bitmap_width;
+    uint64_t file_size;
+    if (bitmap_file_size(bitmap_file, &file_size) != 0) return BITMAP_ERROR_IO;
+    // image_size may be 0, the data then runs to the end of the file
+    uint64_t src_size = bitmap->info_header.image_size;
+    if (src_size == 0 || src_size > file_size - bitmap->file_header.offset) src_size = file_size - bitmap->file_header.offset;
+    if (src_size > SIZE_MAX) return BITMAP_ERROR_SIZE;
+    uint8_t *src = (uint8_t *)bitmap_malloc(src_size ? (size_t)src_size : 1);
+    if (src == NULL) return BITMAP_ERROR_MEMORY;
+    uint32_t row_size = ROW_SIZE(8, width);
+    int result = BITMAP_OK;
+    if (bitmap_fseek(bitmap_file, bitmap->file_header.offset, SEEK_SET) != 0 || bitmap_fread(src, 1, (size_t)src_size, bitmap_file) != src_size) {
+        result = BITMAP_ERROR_IO;
+    } else if (bitmap_alloc_pixels(bitmap, (size_t)row_size * (uint32_t)height, allocator) == NULL) {
+        result = BITMAP_ERROR_MEMORY;
+    } else if (DecodeRLE(src, (size_t)src_size, bitmap->info_header.compression_method, width, (uint32_t)height, bitmap->pixels, row_size) == 0) {
+        bitmap->info_header.bits_per_pixel = 8;
+        bitmap->info_header.compression_method = BI_RGB;
+        bitmap->info_header.image_size = row_size * (uint32_t)height;
+    } else {
+        bitmap_free_pixels(bitmap);
+        result = BITMAP_ERROR_FORMAT;
+    }
+    free(src);
+    return result;
+}
+
+/*
+* Reads a bitmap file and reports why it can't be read. Every header field is validated before anything is
+* allocated, so malformed or hostile files fail with an error code instead of overrunning a buffer.
+* @param file_name the path to a bitmap file
+* @param allocator allocator for the pixels, NULL for the default allocator
+* @param bitmap receives the headers and pixel data like ReadBitMapEx returns them. pixels is NULL on failure
+* @return BITMAP_OK, or a negative BITMAPERROR
+*/
+int ReadBitMapChecked(const char *file_name, const BITMAPALLOCATOR *allocator, PBITMAP bitmap)
+{
+    BITMAP_SCOPE(ReadBitMapChecked);
+    memset(bitmap, 0, sizeof(*bitmap));
+    FILE *bitmap_file = bitmap_fopen(file_name, "rb");
+    if (bitmap_file == NULL) return BITMAP_ERROR_IO;
+    int result = bitmap_read_headers(bitmap_file, &bitmap->file_header, &bitmap->info_header);
+    if (result != BITMAP_OK) {
+        fclose(bitmap_file);
+        return result;
+    }
+    if (bitmap_is_uncompressed(&bitmap->info_header)) {
+        // The sizes were checked against the file, they fit in 32 bits
+        uint32_t width = (uint32_t)bitmap->info_header.bitmap_width;
+        int32_t height = bitmap->info_header.bitmap_height;
+        uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+        uint32_t row_size = ROW_SIZE(bitmap->info_header.bits_per_pixel, width);
+        if (bitmap_alloc_pixels(bitmap, (size_t)row_size * rows, allocator) == NULL) {
+            result = BITMAP_ERROR_MEMORY;
+        } else if (bitmap_read_pixels(bitmap_file, &bitmap->file_header, &bitmap->info_header, bitmap->pixels, row_size) != 0) {
+            result = BITMAP_ERROR_IO;
+        } else if (bitmap->info_header.compression_method != BI_RGB && DecodeBitFieldsBitMap(bitmap) != 0) {
+            result = BITMAP_ERROR_FORMAT;
+        }
+    } else if (bitmap->info_header.compression_method == BI_RLE8 || bitmap->info_header.compression_method == BI_RLE4) {
+        result = bitmap_read_rle(bitmap_file, bitmap, allocator);
+    } else {
+        // PNG and JPEG payloads are returned as they are stored
+        uint64_t offset, length, file_size;
+        result = bitmap_file_size(bitmap_file, &file_size);
+        if (result == BITMAP_OK && (bitmap_payload_span(&bitmap->file_header, &bitmap->info_header, file_size, &offset, &length) != 0 ||
+                                    length > UINT32_MAX)) result = BITMAP_ERROR_TRUNCATED;
+        if (result == BITMAP_OK) {
+            bitmap->info_header.image_size = (uint32_t)length;
+            if (bitmap_alloc_pixels(bitmap, bitmap->info_header.image_size, allocator) == NULL) {
+                result = BITMAP_ERROR_MEMORY;
+            } else if (bitmap_fseek(bitmap_file, bitmap->file_header.offset, SEEK_SET) != 0 ||
+                       bitmap_fread(bitmap->pixels, 1, bitmap->info_header.image_size, bitmap_file) != bitmap->info_header.image_size) {
+                result = BITMAP_ERROR_IO;
+            } else if (bitmap_codec.decode) {
+                // Without a codec, or if it fails, the payload stays as it is
+                DecodeBitMapPayload(bitmap, NULL);
+            }
+        }
+    }
+    if (result != BITMAP_OK && bitmap->pixels) bitmap_free_pixels(bitmap);
+    if (bitmap->pixels && bitmap->info_header.bits_per_pixel <= 8 && !bitmap_is_payload(&bitmap->info_header)) {
+        bitmap_read_palette(bitmap_file, bitmap, allocator);
+    }
+    if (result == BITMAP_OK) bitmap_normalize_headers(bitmap);
+    fclose(bitmap_file);
+    return result;
+}
+
+/*
+* Reads a bitmap file.
+* @param file_name the path to a bitmap file
+* @param allocator allocator for the pixels, NULL for the default allocator
+* @return BITMAP structure which contains the header and pixel data of the bitmap file.
+* Rows are padded to ROW_SIZE like the pixels of GenerateBitMapData. pixels is NULL if the file can't be read,
+* ReadBitMapChecked tells why.
+* RLE8 and RLE4 files are decoded to 8 bit palette indices (bits_per_pixel 8, BI_RGB), see ExpandIndexedBitMap.
+* The color table of 8 bit and smaller images is loaded into palette.
+* BI_BITFIELDS and BI_ALPHABITFIELDS pixels are converted to 32 bit BGRA, see DecodeBitFieldsBitMap
+*/
+BITMAP ReadBitMapEx(const char *file_name, const BITMAPALLOCATOR *allocator)
+{
+    BITMAP_SCOPE(ReadBitMapEx);
+    BITMAP bitmap;
+    ReadBitMapChecked(file_name, allocator, &bitmap);
+    return bitmap;
+}
+/*
+* Reads a bitmap file.
+* @param file_name the path to a bitmap file
+* @return BITMAP structure which contains the header and pixel data of the bitmap file.
+* Rows are UNPADED, (bits_per_pixel * width + 7) / 8 bytes each, in file order. Decoding works like ReadBitMapEx,
+* use ReadBitMapEx for padded rows, which the drawing and processing functions expect.
+*/
+BITMAP ReadBitMap(const char *file_name)
+{
+    BITMAP_SCOPE(ReadBitMap);
+    BITMAP bitmap = ReadBitMapEx(file_name, NULL);
+    if (bitmap.pixels == NULL || bitmap_is_payload(&bitmap.info_header)) return bitmap;
+    uint32_t width = (uint32_t)bitmap.info_header.bitmap_width;
+    int32_t height = bitmap.info_header.bitmap_height;
+    uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    uint32_t row_size = ROW_SIZE(bitmap.info_header.bits_per_pixel, width);
+    uint32_t row_bytes = (bitmap.info_header.bits_per_pixel * width + 7) / 8;
+    // Unpadded rows are never after their padded position, so walk from the first row
+    for (uint32_t y = 1; row_bytes < row_size && y < rows; ++y) {
+        memmove(bitmap.pixels + (size_t)y * row_bytes, bitmap.pixels + (size_t)y * row_size, row_bytes);
+    }
+    return bitmap;
+}
+
+/*
+* Releases a view created by MapBitMap. The pixel pointer of the view is invalid afterwards.
+* @param view the view to release
+*/
+void UnmapBitMap(PBITMAPVIEW view) {
+    BITMAP_SCOPE(UnmapBitMap);
+    if (view == NULL || view->data == NULL) return;
+#ifdef _WIN32
+    UnmapViewOfFile(view->data);
+    CloseHandle(view->mapping);
+#else
+    munmap((void *)view->data, view->size);
+#endif
+    memset(view, 0, sizeof(*view));
+}
+
+/*
+* Maps a bitmap file into memory and returns a read-only view of it. Nothing is copied:
+* view->pixels points straight at the pixel array at file_header.offset.
+* Rows are stored in file order (bottom-up unless bitmap_height is negative) and are view->stride bytes apart.
+* @param file_name the path to a bitmap file
+* @param view BITMAPVIEW structure that receives the headers and the mapping
+* @return 0 on success, -1 if the file can't be mapped or isn't a valid bitmap. Release the view with UnmapBitMap
+*/
+int MapBitMap(const char *file_name, PBITMAPVIEW view) {
+    BITMAP_SCOPE(MapBitMap);
+    memset(view, 0, sizeof(*view));
+#ifdef _WIN32
+    HANDLE file = CreateFileA(file_name, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return -1;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        return -1;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(file); // The mapping keeps its own reference to the file
+    if (mapping == NULL) return -1;
+    const uint8_t *data = (const uint8_t *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (data == NULL) {
+        CloseHandle(mapping);
+        return -1;
+    }
+    view->mapping = mapping;
+    view->size = (size_t)file_size.QuadPart;
+#else
+    int fd = bitmap_open(file_name, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    void *data = bitmap_mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // The mapping stays valid after the descriptor is closed
+    if (data == MAP_FAILED) return -1;
+    view->size = (size_t)st.st_size;
+#endif
+    view->data = (const uint8_t *)data;
+
+    if (bitmap_parse_headers(view->data, view->size, &view->file_header, &view->info_header) != BITMAP_OK ||
+        bitmap_check_pixel_array(&view->file_header, &view->info_header, view->size) != BITMAP_OK) {
+        UnmapBitMap(view);
+        return -1;
+    }
+    int32_t height = view->info_header.bitmap_height;
+    uint64_t rows = height < 0 ? (uint64_t)-(int64_t)height : (uint64_t)height;
+    uint32_t stride = ROW_SIZE(view->info_header.bits_per_pixel, (uint32_t)view->info_header.bitmap_width);
+    // Rows of a view are read with their padding, the last one included
+    if (bitmap_is_uncompressed(&view->info_header) && stride * rows > view->size - view->file_header.offset) {
+        UnmapBitMap(view);
+        return -1;
+    }
+    view->stride = (uint32_t)stride;
+    view->pixels = view->data + view->file_header.offset;
+    return 0;
+}
+
+/*
+* Opens a bitmap file for reading it row by row. Only the headers are read.
+* @param file_name the path to a bitmap file
+* @param stream BITMAPSTREAM structure that receives the headers and the file stream
+* @return 0 on success, -1 if the file can't be opened or isn't an uncompressed bitmap
+*/
+int OpenBitMapStream(const char *file_name, PBITMAPSTREAM stream) {
+    BITMAP_SCOPE(OpenBitMapStream);
+    memset(stream, 0, sizeof(*stream));
+    FILE *bitmap_file = bitmap_fopen(file_name, "rb");
+    if (bitmap_file == NULL) return -1;
+    if (bitmap_read_headers(bitmap_file, &stream->file_header, &stream->info_header) != BITMAP_OK ||
+        !bitmap_is_uncompressed(&stream->info_header) ||
+        bitmap_fseek(bitmap_file, stream->file_header.offset, SEEK_SET) != 0) {
+        fclose(bitmap_file);
+        return -1;
+    }
+    uint32_t width = stream->info_header.bitmap_width;
+    int32_t height = stream->info_header.bitmap_height;
+    stream->file = bitmap_file;
+    stream->row_size = ROW_SIZE(stream->info_header.bits_per_pixel, width);
+    stream->row_bytes = (stream->info_header.bits_per_pixel * width + 7) / 8;
+    stream->rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    return 0;
+}
+
+/*
+* Creates a bitmap file that is filled row by row. The headers are written right away.
+* @param file_name the path to the output file
+* @param width the width of the bitmap file
+* @param height the height of the bitmap file
+* @param bits_per_pixel color depth of the bitmap file
+* @param compression compression method stored in the header
+* @param stream BITMAPSTREAM structure that receives the headers and the file stream
+* @return 0 on success, -1 if the file can't be created
+*/
+int CreateBitMapStream(const char *file_name, int32_t width, int32_t height, uint16_t bits_per_pixel, uint32_t compression, PBITMAPSTREAM stream) {
+    BITMAP_SCOPE(CreateBitMapStream);
+    memset(stream, 0, sizeof(*stream));
+    InitBitMapHeaders(width, height, bits_per_pixel, compression, &stream->file_header, &stream->info_header);
+    FILE *bitmap_file = bitmap_fopen(file_name, "wb");
+    if (bitmap_file == NULL) return -1;
+    if (bitmap_fwrite(&stream->file_header, sizeof(stream->file_header), 1, bitmap_file) != 1 ||
+        bitmap_fwrite(&stream->info_header, sizeof(stream->info_header), 1, bitmap_file) != 1) {
+        fclose(bitmap_file);
+        return -1;
+    }
+    stream->file = bitmap_file;
+    stream->row_size = ROW_SIZE(bits_per_pixel, width);
+    stream->row_bytes = (bits_per_pixel * width + 7) / 8;
+    stream->rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    stream->writing = 1;
+    return 0;
+}
+
+/*
+* Reads the next rows of a stream opened with OpenBitMapStream.
+* @param stream the stream to read from
+* @param buffer receives n_rows UNPADED rows, stream->row_bytes bytes each
+* @param n_rows the number of rows to read
+* @return the number of rows read. Less than n_rows at the end of the image or on a read error
+*/
+uint32_t ReadBitMapRows(PBITMAPSTREAM stream, uint8_t *buffer, uint32_t n_rows) {
+    BITMAP_SCOPE(ReadBitMapRows);
+    if (stream->file == NULL || stream->writing) return 0;
+    if (n_rows > stream->rows - stream->current_row) n_rows = stream->rows - stream->current_row;
+    uint32_t padding_size = stream->row_size - stream->row_bytes;
+    uint32_t done = 0;
+    if (padding_size == 0) {
+        done = (uint32_t)bitmap_fread(buffer, stream->row_bytes, n_rows, stream->file);
+    } else {
+        uint8_t padding[4];
+        for (; done < n_rows; ++done) {
+            // Reading the padding keeps stdio's buffer, an fseek would drop it on every row.
+            // The padding of the last row may be missing, like bitmap_read_pixels allows
+            if (bitmap_fread(buffer, 1, stream->row_bytes, stream->file) != stream->row_bytes ||
+                (stream->current_row + done + 1 < stream->rows &&
+                 bitmap_fread(padding, 1, padding_size, stream->file) != padding_size)) break;
+            buffer += stream->row_bytes;
+        }
+    }
+    stream->current_row += done;
+    return done;
+}
+
+/*
+* Writes the next rows of a stream created with CreateBitMapStream. Padding is added to every row.
+* @param stream the stream to write to
+* @param buffer n_rows UNPADED rows, stream->row_bytes bytes each
+* @param n_rows the number of rows to write
+* @return the number of rows written. Less than n_rows once the image is complete or on a write error
+*/
+uint32_t WriteBitMapRows(PBITMAPSTREAM stream, const uint8_t *buffer, uint32_t n_rows) {
+    BITMAP_SCOPE(WriteBitMapRows);
+    if (stream->file == NULL || !stream->writing) return 0;
+    if (n_rows > stream->rows - stream->current_row) n_rows = stream->rows - stream->current_row;
+    uint32_t padding_size = stream->row_size - stream->row_bytes;
+    uint32_t done = 0;
+    if (padding_size == 0) {
+        done = (uint32_t)bitmap_fwrite(buffer, stream->row_bytes, n_rows, stream->file);
+    } else {
+        static const uint8_t padding[4] = {0};
+        for (; done < n_rows; ++done) {
+            if (bitmap_fwrite(buffer, 1, stream->row_bytes, stream->file) != stream->row_bytes ||
+                bitmap_fwrite(padding, 1, padding_size, stream->file) != padding_size) break;
+            buffer += stream->row_bytes;
+        }
+    }
+    stream->current_row += done;
+    return done;
+}
+
+/*
+* Closes a stream. A write stream that is closed before all rows were written leaves an incomplete file.
+* @param stream the stream to close
+* @return 0 on success, -1 if the image is incomplete or the file couldn't be flushed
+*/
+int CloseBitMapStream(PBITMAPSTREAM stream) {
+    BITMAP_SCOPE(CloseBitMapStream);
+    if (stream->file == NULL) return -1;
+    int result = (stream->writing && stream->current_row != stream->rows) ? -1 : 0;
+    if (fclose(stream->file) != 0) result = -1;
+    stream->file = NULL;
+    free(stream->scratch);
+    stream->scratch = NULL;
+    return result;
+}
+
+/*
+* Pixel format conversion
+* Channel order and size changes are one byte shuffle per 4 pixels (pshufb on SSSE3, vqtbl1q on AArch64),
+* premultiplication runs as a second pass over the converted row.
+*/
+typedef enum {
+    PIXELFORMAT_BGR24,                  // Layout of 24 bit bitmap files
+    PIXELFORMAT_RGB24,
+    PIXELFORMAT_BGRA32,                 // Layout of 32 bit bitmap files
+    PIXELFORMAT_RGBA32,
+    PIXELFORMAT_BGRA32_PREMULTIPLIED,
+    PIXELFORMAT_RGBA32_PREMULTIPLIED
+} PIXELFORMAT;
+
+#define PIXELFORMAT_SIZE(format) ((format) <= PIXELFORMAT_RGB24 ? 3u : 4u)
+#define PIXELFORMAT_IS_RGB(format) ((format) == PIXELFORMAT_RGB24 || (format) == PIXELFORMAT_RGBA32 || (format) == PIXELFORMAT_RGBA32_PREMULTIPLIED)
+#define PIXELFORMAT_IS_PREMULTIPLIED(format) ((format) >= PIXELFORMAT_BGRA32_PREMULTIPLIED)
+
+// Shuffle of 4 pixels from src to dst format, 0x80 marks bytes that come out as 0 (alpha is ORed in afterwards)
+static void bitmap_format_shuffle(PIXELFORMAT src_format, PIXELFORMAT dst_format, uint8_t shuffle[16]) {
+    uint32_t src_size = PIXELFORMAT_SIZE(src_format), dst_size = PIXELFORMAT_SIZE(dst_format);
+    memset(shuffle, 0x80, 16);
+    for (uint32_t p = 0; p < 4; ++p) {
+        for (uint32_t c = 0; c < dst_size; ++c) {
+            uint32_t src_c = c;
+            if (c < 3 && PIXELFORMAT_IS_RGB(src_format) != PIXELFORMAT_IS_RGB(dst_format)) src_c = 2 - c;
+            if (src_c < src_size) shuffle[p * dst_size + c] = (uint8_t)(p * src_size + src_c);
+        }
+    }
+}
+
+static void bitmap_shuffle_scalar(const uint8_t *src, uint32_t src_size, uint8_t *dst, uint32_t dst_size,
+                                  const uint8_t shuffle[16], uint32_t x, uint32_t width) {
+    for (; x < width; ++x) {
+        const uint8_t *s = src + x * src_size;
+        uint8_t pixel[4];
+        for (uint32_t c = 0; c < dst_size; ++c) pixel[c] = shuffle[c] == 0x80 ? 255 : s[shuffle[c]];
+        memcpy(dst + x * dst_size, pixel, dst_size);
+    }
+}
+
+#ifdef BITMAP_HAVE_SSSE3
+BITMAP_TARGET_SSSE3 static uint32_t bitmap_shuffle_ssse3(const uint8_t *src, uint32_t src_size, uint8_t *dst, uint32_t dst_size,
+                                                        const uint8_t shuffle[16], uint32_t width) {
+    const __m128i mask = _mm_loadu_si128((const __m128i *)shuffle);
+    const __m128i alpha = (dst_size == 4 && src_size == 3) ? _mm_set1_epi32((int)0xFF000000u) : _mm_setzero_si128();
+    uint32_t x = 0;
+    // 4 pixels per step, 16 bytes are loaded so 24 bit input needs one pixel and a bit more behind them
+    for (; (x + 4) * src_size + (16 - 4 * src_size) <= width * src_size; x += 4) {
+        __m128i v = _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(src + x * src_size)), mask), alpha);
+        if (dst_size == 4) {
+            _mm_storeu_si128((__m128i *)(dst + x * 4), v);
+        } else {
+            // Exactly 12 bytes, the next 4 may still be unread input when converting in place
+            int32_t last = _mm_cvtsi128_si32(_mm_srli_si128(v, 8));
+            _mm_storel_epi64((__m128i *)(dst + x * 3), v);
+            memcpy(dst + x * 3 + 8, &last, 4);
+        }
+    }
+    return x;
+}
+#endif
+
+#if defined(BITMAP_HAVE_NEON) && defined(__aarch64__)
+static uint32_t bitmap_shuffle_neon(const uint8_t *src, uint32_t src_size, uint8_t *dst, uint32_t dst_size,
+                                    const uint8_t shuffle[16], uint32_t width) {
+    const uint8x16_t mask = vld1q_u8(shuffle);
+    const uint8x16_t alpha = vreinterpretq_u8_u32(vdupq_n_u32((dst_size == 4 && src_size == 3) ? 0xFF000000u : 0));
+    uint32_t x = 0;
+    for (; (x + 4) * src_size + (16 - 4 * src_size) <= width * src_size; x += 4) {
+        uint8x16_t v = vorrq_u8(vqtbl1q_u8(vld1q_u8(src + x * src_size), mask), alpha);
+        if (dst_size == 4) {
+            vst1q_u8(dst + x * 4, v);
+        } else {
+            vst1_u8(dst + x * 3, vget_low_u8(v));
+            vst1q_lane_u32((uint32_t *)(void *)(dst + x * 3 + 8), vreinterpretq_u32_u8(v), 2);
+        }
+    }
+    return x;
+}
+#endif
+
+static void bitmap_premultiply_scalar(uint8_t *row, uint32_t x, uint32_t width) {
+    for (uint8_t *p = row + x * 4; x < width; ++x, p += 4) {
+        for (int c = 0; c < 3; ++c) {
+            uint32_t t = p[c] * p[3] + 128;
+            p[c] = (uint8_t)((t + (t >> 8)) >> 8);
+        }
+    }
+}
+
+/*
+* Multiplies the color channels of 32 bit pixels with their alpha, c = c * a / 255 rounded.
+* @param row pixels, 4 bytes each with alpha in the last byte
+* @param width number of pixels
+*/
+void PremultiplyRow(uint8_t *row, uint32_t width) {
+    BITMAP_SCOPE(PremultiplyRow);
+    uint32_t x = 0;
+#ifdef BITMAP_HAVE_SSE2
+    const __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi16(128), alpha = _mm_set1_epi32((int)0xFF000000u);
+    for (; x + 4 <= width; x += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(row + x * 4));
+        __m128i lo = _mm_unpacklo_epi8(v, zero), hi = _mm_unpackhi_epi8(v, zero);
+        __m128i alo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+        __m128i ahi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+        lo = _mm_add_epi16(_mm_mullo_epi16(lo, alo), round);
+        hi = _mm_add_epi16(_mm_mullo_epi16(hi, ahi), round);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+        __m128i r = _mm_packus_epi16(lo, hi);
+        _mm_storeu_si128((__m128i *)(row + x * 4), _mm_or_si128(_mm_andnot_si128(alpha, r), _mm_and_si128(v, alpha)));
+    }
+#endif
+    bitmap_premultiply_scalar(row, x, width);
+}
+
+/*
+* Divides the color channels of premultiplied 32 bit pixels by their alpha. Pixels with alpha 0 become black.
+* @param row pixels, 4 bytes each with alpha in the last byte
+* @param width number of pixels
+*/
+void UnpremultiplyRow(uint8_t *row, uint32_t width) {
+    BITMAP_SCOPE(UnpremultiplyRow);
+    // 255 / a in 16.16 fixed point, computed once
+    static uint32_t reciprocal[256];
+    static volatile int initialized = 0;
+    if (!initialized) {
+        reciprocal[0] = 0;
+        for (uint32_t a = 1; a < 256; ++a) reciprocal[a] = ((255u << 16) + a / 2) / a;
+        initialized = 1;
+    }
+    for (uint8_t *p = row; width > 0; --width, p += 4) {
+        uint32_t r = reciprocal[p[3]];
+        for (int c = 0; c < 3; ++c) {
+            uint32_t v = (p[c] * r + 0x8000) >> 16;
+            p[c] = (uint8_t)(v > 255 ? 255 : v);
+        }
+    }
+}
+
+/*
+* Converts one row between pixel formats. src and dst may be the same buffer unless dst pixels are larger.
+* @param src source pixels
+* @param src_format format of src
+* @param dst receives width converted pixels
+* @param dst_format format of dst
+* @param width number of pixels
+*/
+void ConvertPixelRow(const uint8_t *src, PIXELFORMAT src_format, uint8_t *dst, PIXELFORMAT dst_format, uint32_t width) {
+    BITMAP_SCOPE(ConvertPixelRow);
+    uint32_t src_size = PIXELFORMAT_SIZE(src_format), dst_size = PIXELFORMAT_SIZE(dst_format);
+    int src_premultiplied = PIXELFORMAT_IS_PREMULTIPLIED(src_format), dst_premultiplied = PIXELFORMAT_IS_PREMULTIPLIED(dst_format);
+    if (src_premultiplied && dst_size == 3) {
+        // The alpha is gone after the shuffle, undo the premultiplication per pixel
+        for (uint32_t x = 0; x < width; ++x) {
+            uint8_t pixel[4];
+            memcpy(pixel, src + x * 4, 4);
+            UnpremultiplyRow(pixel, 1);
+            ConvertPixelRow(pixel, src_format == PIXELFORMAT_BGRA32_PREMULTIPLIED ? PIXELFORMAT_BGRA32 : PIXELFORMAT_RGBA32,
+                            dst + x * 3, dst_format, 1);
+        }
+        return;
+    }
+    uint8_t shuffle[16];
+    bitmap_format_shuffle(src_format, dst_format, shuffle);
+    uint32_t x = 0;
+    if (src_size != dst_size || memcmp(shuffle, "\0\1\2\3\4\5\6\7\10\11\12\13\14\15\16\17", 4 * dst_size) != 0) {
+#ifdef BITMAP_HAVE_SSSE3
+        static int has_ssse3 = -1;
+        if (has_ssse3 < 0) has_ssse3 = bitmap_cpu_has_ssse3();
+        if (has_ssse3) x = bitmap_shuffle_ssse3(src, src_size, dst, dst_size, shuffle, width);
+#elif defined(BITMAP_HAVE_NEON) && defined(__aarch64__)
+        x = bitmap_shuffle_neon(src, src_size, dst, dst_size, shuffle, width);
+#endif
+        bitmap_shuffle_scalar(src, src_size, dst, dst_size, shuffle, x, width);
+    } else if (src != dst) {
+        memcpy(dst, src, (size_t)width * dst_size);
+    }
+    if (dst_premultiplied && !src_premultiplied && src_size == 4) PremultiplyRow(dst, width);
+    else if (src_premultiplied && !dst_premultiplied) UnpremultiplyRow(dst, width);
+}
+
+/*
+* Converts the pixels of a bitmap to another format. Converts in place when the pixels don't get larger,
+* otherwise the buffer is replaced through the bitmap's allocator. bits_per_pixel is updated, rows stay ROW_SIZE padded.
+* Only BGR24 and BGRA32 match the bitmap file layout.
+* @param bmp bitmap with padded pixel data
+* @param src_format current format of the pixels, must match bits_per_pixel
+* @param dst_format the new format
+* @return 0 on success, -1 on a format mismatch or exhausted memory
+*/
+int ConvertBitMap(PBITMAP bmp, PIXELFORMAT src_format, PIXELFORMAT dst_format) {
+    BITMAP_SCOPE(ConvertBitMap);
+    uint32_t src_size = PIXELFORMAT_SIZE(src_format), dst_size = PIXELFORMAT_SIZE(dst_format);
+    if (bmp->info_header.bits_per_pixel != src_size * 8 || bmp->info_header.bitmap_width < 0) return -1;
+    uint32_t width = (uint32_t)bmp->info_header.bitmap_width;
+    uint32_t rows = bmp->info_header.bitmap_height < 0 ? (uint32_t)-(int64_t)bmp->info_header.bitmap_height : (uint32_t)bmp->info_header.bitmap_height;
+    uint32_t src_stride = ROW_SIZE(src_size * 8, width), dst_stride = ROW_SIZE(dst_size * 8, width);
+    uint32_t padding_size = dst_stride - width * dst_size;
+
+    BITMAP converted = *bmp;
+    if (dst_size > src_size &&
+        bitmap_alloc_pixels(&converted, (size_t)dst_stride * rows, bmp->allocator.alloc ? &bmp->allocator : NULL) == NULL) return -1;
+    // Rows are processed in order, in place a converted row never reaches the next source row
+    const uint8_t *src = bmp->pixels;
+    uint8_t *dst = converted.pixels;
+    for (uint32_t y = 0; y < rows; ++y, src += src_stride, dst += dst_stride) {
+        ConvertPixelRow(src, src_format, dst, dst_format, width);
+        memset(dst + width * dst_size, 0, padding_size);
+    }
+    if (converted.pixels != bmp->pixels) {
+        bitmap_free_pixels(bmp);
+        bmp->pixels = converted.pixels;
+        bmp->pixels_size = converted.pixels_size;
+        bmp->allocator = converted.allocator;
+    }
+    bmp->info_header.bits_per_pixel = (uint16_t)(dst_size * 8);
+    bmp->info_header.image_size = dst_stride * rows;
+    uint32_t m = dst_size == 4 ? 0xFF : 0;
+    bmp->info_header.red_mask = m << 16;
+    bmp->info_header.green_mask = m << 8;
+    bmp->info_header.blue_mask = m;
+    bmp->info_header.alpha_mask = m << 24;
+    return 0;
+}
+
+// File layout of a stream's pixels, -1 if it has none of the convertible layouts
+static int bitmap_stream_format(PBITMAPSTREAM stream) {
+    if (stream->info_header.bits_per_pixel == 24) return PIXELFORMAT_BGR24;
+    if (stream->info_header.bits_per_pixel == 32) return PIXELFORMAT_BGRA32;
+    return -1;
+}
+
+/*
+* ReadBitMapRows that converts every row to `format` while it's read.
+* @param stream 24 or 32 bit stream opened with OpenBitMapStream
+* @param buffer receives n_rows UNPADED rows of width * PIXELFORMAT_SIZE(format) bytes
+* @param n_rows the number of rows to read
+* @param format format of the rows in buffer
+* @return the number of rows read
+*/
+uint32_t ReadBitMapRowsAs(PBITMAPSTREAM stream, uint8_t *buffer, uint32_t n_rows, PIXELFORMAT format) {
+    BITMAP_SCOPE(ReadBitMapRowsAs);
+    int file_format = bitmap_stream_format(stream);
+    if (file_format < 0) return 0;
+    uint32_t width = (uint32_t)stream->info_header.bitmap_width;
+    size_t row_bytes = (size_t)width * PIXELFORMAT_SIZE(format);
+    int in_place = PIXELFORMAT_SIZE(format) == PIXELFORMAT_SIZE(file_format);
+    if (!in_place && stream->scratch == NULL && (stream->scratch = (uint8_t *)bitmap_malloc(stream->row_bytes)) == NULL) return 0;
+    uint32_t done = 0;
+    for (; done < n_rows; ++done, buffer += row_bytes) {
+        // Pixels of the same size are converted in the caller's row, the file row of other sizes doesn't fit it
+        uint8_t *row = in_place ? buffer : stream->scratch;
+        if (ReadBitMapRows(stream, row, 1) != 1) break;
+        ConvertPixelRow(row, (PIXELFORMAT)file_format, buffer, format, width);
+    }
+    return done;
+}
+
+/*
+* WriteBitMapRows that converts every row from `format` to the file layout while it's written.
+* @param stream 24 or 32 bit stream created with CreateBitMapStream
+* @param buffer n_rows UNPADED rows of width * PIXELFORMAT_SIZE(format) bytes
+* @param n_rows the number of rows to write
+* @param format format of the rows in buffer
+* @return the number of rows written
+*/
+uint32_t WriteBitMapRowsAs(PBITMAPSTREAM stream, const uint8_t *buffer, uint32_t n_rows, PIXELFORMAT format) {
+    BITMAP_SCOPE(WriteBitMapRowsAs);
+    int file_format = bitmap_stream_format(stream);
+    if (file_format < 0) return 0;
+    uint32_t width = (uint32_t)stream->info_header.bitmap_width;
+    size_t row_bytes = (size_t)width * PIXELFORMAT_SIZE(format);
+    if (stream->scratch == NULL && (stream->scratch = (uint8_t *)bitmap_malloc(stream->row_bytes)) == NULL) return 0;
+    uint32_t done = 0;
+    for (; done < n_rows; ++done, buffer += row_bytes) {
+        ConvertPixelRow(buffer, format, stream->scratch, (PIXELFORMAT)file_format, width);
+        if (WriteBitMapRows(stream, stream->scratch, 1) != 1) break;
+    }
+    return done;
+}
+
+
+/*
+* Releases everything a BITMAP owns: the pixels, the palette, the dirty row table and the file. The structure
+* itself is left zeroed and can be reused. Does nothing for a zeroed BITMAP.
+* @param bmp the bitmap to release, may be NULL
+*/
+void ReleaseBitMap(PBITMAP bmp) {
+    BITMAP_SCOPE(ReleaseBitMap);
+    if (bmp == NULL) return;
+    bitmap_free_palette(bmp);
+    bitmap_free_dirty(bmp);
+    if (bmp->pixels) bitmap_free_pixels(bmp);
+    if (bmp->file) fclose(bmp->file);
+    memset(bmp, 0, sizeof(*bmp));
+}
+
+/*
+* Releases a BITMAP like ReleaseBitMap and reports missing pixels or a missing file on stderr.
+* @param bmp the bitmap to release
+*/
+void cleanup(PBITMAP bmp) {
+    BITMAP_SCOPE(cleanup);
+    if (bmp == NULL) {
+        fprintf(stderr, "bmp is NULL. Not freeing!\n");
+        return;
+    }
+    if (bmp->pixels == NULL) fprintf(stderr, "bmp->pixels is NULL. Not freeing!\n");
+    if (bmp->file == NULL) fprintf(stderr, "bmp->file is NULL. Not closing!\n");
+    ReleaseBitMap(bmp);
+}
+
+/*
+* Releases a PBITMAP returned by GenerateBitMapData or GenerateBitMapDataEx: the pixels, the file and the structure itself.
+* @param bmp the bitmap to free
+*/
+void FreeBitMap(PBITMAP bmp) {
+    BITMAP_SCOPE(FreeBitMap);
+    if (bmp == NULL) return;
+    BITMAPALLOCATOR allocator = bmp->allocator;
+    ReleaseBitMap(bmp);
+    if (allocator.free) allocator.free(bmp, sizeof(BITMAP), allocator.user);
+    else free(bmp);
+}
+
+
+/*
+* Pixel kernels
+* A row kernel processes `width` pixels of one row in place. pixel_size is 3 or 4 bytes, 32bpp rows
+* keep their alpha channel. GetBitMapKernels picks the SSE2, AVX2 or NEON versions at runtime.
+*/
+typedef void (*BITMAPROWKERNEL)(uint8_t *row, uint32_t width, uint32_t pixel_size, const void *params);
+
+typedef struct {
+    BITMAPROWKERNEL invert;                 // params: unused
+    BITMAPROWKERNEL brightness_contrast;    // params: const BRIGHTNESSCONTRAST *
+    BITMAPROWKERNEL grayscale;              // params: unused
+    BITMAPROWKERNEL swap_red_blue;          // params: unused
+} BITMAPKERNELS;
+
+typedef struct {
+    int32_t brightness; // Added to every channel, -255 to 255
+    int32_t contrast;   // Fixed point scale around 128, 512 = 1.0
+} BRIGHTNESSCONTRAST;
+
+// Byte mask of the color channels, repeated every 4 bytes. 24bpp rows have no alpha to keep
+#define BITMAP_COLOR_MASK(pixel_size) ((pixel_size) == 4 ? 0x00FFFFFFu : 0xFFFFFFFFu)
+
+static inline uint8_t bitmap_adjust_channel(uint8_t value, const BRIGHTNESSCONTRAST *bc) {
+    int32_t v = ((((int32_t)value - 128) * 128 * bc->contrast) >> 16) + 128 + bc->brightness;
+    return (uint8_t)(v < 0 ? 0 : v > 255 ? 255 : v);
+}
+
+static void bitmap_invert_scalar(uint8_t *row, uint32_t offset, uint32_t n_bytes, uint32_t pixel_size) {
+    uint32_t mask = BITMAP_COLOR_MASK(pixel_size);
+    for (uint32_t i = offset; i < n_bytes; ++i) row[i] ^= (uint8_t)(mask >> ((i & 3) * 8));
+}
+
+static void bitmap_adjust_scalar(uint8_t *row, uint32_t offset, uint32_t n_bytes, uint32_t pixel_size, const BRIGHTNESSCONTRAST *bc) {
+    for (uint32_t i = offset; i < n_bytes; ++i) {
+        if (pixel_size == 4 && (i & 3) == 3) continue; // Alpha
+        row[i] = bitmap_adjust_channel(row[i], bc);
+    }
+}
+
+static void bitmap_grayscale_scalar(uint8_t *row, uint32_t x, uint32_t width, uint32_t pixel_size) {
+    for (uint8_t *p = row + x * pixel_size; x < width; ++x, p += pixel_size) {
+        uint8_t y = (uint8_t)((29 * p[0] + 150 * p[1] + 77 * p[2] + 128) >> 8);
+        p[0] = p[1] = p[2] = y;
+    }
+}
+
+static void bitmap_swap_scalar(uint8_t *row, uint32_t x, uint32_t width, uint32_t pixel_size) {
+    for (uint8_t *p = row + x * pixel_size; x < width; ++x, p += pixel_size) {
+        uint8_t blue = p[0];
+        p[0] = p[2];
+        p[2] = blue;
+    }
+}
+
+static void bitmap_invert_row_scalar(uint8_t *row, uint32_t width, uint32_t pixel_size, const void *params) {
+    (void)params;
+    bitmap_invert_scalar(row, 0, width * pixel_size, pixel_size);
+}
+static void bitmap_adjust_row_scalar(uint8_t *row, uint32_t width, uint32_t pixel_size, const void *params) {
+    bitmap_adjust_scalar(row, 0, width * pixel_size, pixel_size, (const BRIGHTNESSCONTRAST *)params);
+}
+static void bitmap_grayscale_row_scalar(uint8_t *row, uint32_t width, uint32_t pixel_size, const void *params) {
+    (void)params;
+    bitmap_grayscale_scalar(row, 0, width, pixel_size);
+}
+static void bitmap_swap_row_scalar(uint8_t *row, uint32_t width, uint32_t pixel_size, const void *params) {
+    (void)params;
+    bitmap_swap_scalar(row, 0, width, pixel_size);
+}
+
+#ifdef BITMAP_HAVE_SSE2
+static void bitmap_invert_row_sse2(uint8_t *row, uint32_t width, uint32_t pixel_size, const void *params) {
+    (void)params;
+    uint32_t n_bytes = width * pixel_size, i = 0;
+    const __m128i mask = _mm_set1_epi32((int)BITMAP_COLOR_MASK(pixel_size));
+    for (; i + 16 <= n_bytes; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(row + i));
+        _mm_storeu_si128((__m128i *)(row + i), _mm_xor_si128(v, mask));
+    }
+    bitmap_invert_scalar(row, i, n_bytes, pixel_size);
+}
+
+static inline __m128i bitmap_adjust_sse2(__m128i v, __m128i contrast, __m128i offset) {
+    const __m128i zero = _mm_setzero_si128(), bias = _mm_set1_epi16(128);
+    __m128i lo = _mm_slli_epi16(_mm_sub_epi16(_mm_unpacklo_epi8(v, zero), bias), 7);
+    __m128i hi = _mm_slli_epi16(_mm_sub_epi16(_mm_unpackhi_epi8(v, zero), bias), 7);
+    lo = _mm_add_epi16(_mm_mulhi_epi16(lo, contrast), offset);
+    hi = _mm_add_epi16(_mm_mulhi_epi16(hi, contrast), offset);
+    return _mm_packus_epi16(lo, hi);
+}
+
+static void bitmap_adjust_row_sse2(uint8_t *row, uint32_t width, uint32_t pixel_size, const void *params) {
+    const BRIGHTNESSCONTRAST *bc = (const BRIGHTNESSCONTRAST *)params;
+    uint32_t n_bytes = width * pixel_size, i = 0;
+    const __m128i mask = _mm_set1_epi32((int)BITMAP_COLOR_MASK(pixel_size));
+    const __m128i contrast = _mm_set1_epi16((int16_t)bc->contrast);
+    const __m128i offset = _mm_set1_epi16((int16_t)(128 + bc->brightness));
+    for (; i + 16 <= n_bytes; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(row + i));
+        __m128i r = bitmap_adjust_sse2(v, contrast, offset);
+        _mm_storeu_si128((__m128i *)(row + i), _mm_or_si128(_mm_and_si128(r, mask), _mm_andnot_si128(mask, v)));
+    }
+    bitmap_adjust_scalar(row, i, n_bytes, pixel_size, bc);
+}
+
+// 4 BGRA pixels to 4 luma values, one per 32 bit lane
+static inline __m128i bitmap_luma_sse2(__m128i v) {
+    const __m128i zero = _mm_setzero_si128(), weights = _mm_setr_epi16(29, 150, 77, 0, 29, 150, 77, 0);
+    __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(v, zero), weights);
+    __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(v, zero), weights);
+    lo = _mm_shuffle_epi32(_mm_add_epi32(lo, _mm_srli_epi64(lo, 32)), _MM_SHUFFLE(3, 1, 2, 0));
+    hi = _mm_shuffle_epi32(_mm_add_epi32(hi, _mm_srli_epi64(hi, 32)), _MM_SHUFFLE(3, 1, 2, 0));
+    return _mm_srli_epi32(_mm_add_epi32(_mm_unpacklo_epi64(lo, hi), _mm_set1_epi32(128)), 8);
+}
+
+static void bitmap_grayscale_row_sse2(uint8_t *row, uint32_t width, uint32_t pixel_size, const void *params) {
+    (void)params;
+    uint32_t x = 0;
+    if (pixel_size == 4) {
+        const __m128i alpha = _mm_set1_epi32((int)0xFF000000u);
+        for (; x + 4 <= width; x += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(row + x * 4));
+            __m128i y = bitmap_luma_sse2(v);
+            y = _mm_or_si128(_mm_or_si128(y, _mm_slli_epi32(y, 8)), _mm_slli_epi32(y, 16));
+            _mm_storeu_si128((__m128i *)(row + x * 4), _mm_or_si128(y, _mm_and_si128(v, alpha)));
+        }
+    }
+    bitmap_grayscale_scalar(row, x, width, pixel_size);
+}
+
+static void bitmap_swap_row_sse2(uint8_t *row, uint32_t width, uint32_t pixel_size, const void *params) {
+    (void)params;
+    uint32_t x = 0;
+    if (pixel_size == 4) {
+        const __m128i ga = _mm_set1_epi32((int)0xFF00FF00u), low = _mm_set1_epi32(0xFF), red = _mm_set1_epi32(0x00FF0000);
+        for (; x + 4 <= width; x += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(row + x * 4));
+            __m128i r = _mm_or_si128(_mm_and_si128(v, ga), _mm_and_si128(_mm_srli_epi32(v, 16), low));
+            _mm_storeu_si128((__m128i *)(row + x * 4), _mm_or_si128(r, _mm_and_si128(_mm_slli_epi32(v, 16), red)));
+        }
+    }
+    bitmap_swap_scalar(row, x, width, pixel_size);
+}
+#endif
+
+#ifdef BITMAP_HAVE_AVX2
+BITMAP_TARGET_AVX2 static void bitmap_invert_row_avx2(uint8_t *row, uint32_t width, uint32_t pixel_size, const void *params) {
+    (void)params;
+    uint32_t n_bytes = width * pixel_size, i = 0;
+    const __m256i mask = _mm256_set1_epi32((int)BITMAP_COLOR_MASK(pixel_size));
+    for (; i + 32 <= n_bytes; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(row + i));
+        _mm256_storeu_si256((__m256i *)(row + i), _mm256_xor_si256(v, mask));
+    }
+    bitmap_invert_scalar(row, i, n_bytes, pixel_size);
+}
+
+BITMAP_TARGET_AVX2 static void bitmap_adjust_row_avx2(uint8_t *row, uint32_t width, uint32_t pixel_size, const void *params) {
+    const BRIGHTNESSCONTRAST *bc = (const BRIGHTNESSCONTRAST *)params;
+    uint32_t n_bytes = width * pixel_size, i = 0;
+    const __m256i zero = _mm256_setzero_si256(), bias = _mm256_set1_epi16(128);
+    const __m256i mask = _mm256_set1_epi32((int)BITMAP_COLOR_MASK(pixel_size));
+    const __m256i contrast = _mm256_set1_epi16((int16_t)bc->contrast);
+    const __m256i offset = _mm256_set1_epi16((int16_t)(128 + bc->brightness));
+    for (; i + 32 <= n_bytes; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(row + i));
+        __m256i lo = _mm256_slli_epi16(_mm256_sub_epi16(_mm256_unpacklo_epi8(v, zero), bias), 7);
+        __m256i hi = _mm256_slli_epi16(_mm256_sub_epi16(_mm256_unpackhi_epi8(v, zero), bias), 7);
+        lo = _mm256_add_epi16(_mm256_mulhi_epi16(lo, contrast), offset);
+        hi = _mm256_add_epi16(_mm256_mulhi_epi16(hi, contrast), offset);
+        __m256i r = _mm256_packus_epi16(lo, hi);
+        _mm256_storeu_si256((__m256i *)(row + i), _mm256_or_si256(_mm256_and_si256(r, mask), _mm256_andnot_si256(mask, v)));
+    }
+    bitmap_adjust_scalar(row, i, n_bytes, pixel_size, bc);
+}
+
+BITMAP_TARGET_AVX2 static void bitmap_grayscale_row_avx2(uint8_t *row, uint32_t width, uint32_t pixel_size, const void *params) {
+    (void)params;
+    uint32_t x = 0;
+    if (pixel_size == 4) {
+        const __m256i zero = _mm256_setzero_si256(), alpha = _mm256_set1_epi32((int)0xFF000000u), round = _mm256_set1_epi32(128);
+        const __m256i weights = _mm256_setr_epi16(29, 150, 77, 0, 29, 150, 77, 0, 29, 150, 77, 0, 29, 150, 77, 0);
+        for (; x + 8 <= width; x += 8) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(row + x * 4));
+            __m256i lo = _mm256_madd_epi16(_mm256_unpacklo_epi8(v, zero), weights);
+            __m256i hi = _mm256_madd_epi16(_mm256_unpackhi_epi8(v, zero), weights);
+            lo = _mm256_shuffle_epi32(_mm256_add_epi32(lo, _mm256_srli_epi64(lo, 32)), _MM_SHUFFLE(3, 1, 2, 0));
+            hi = _mm256_shuffle_epi32(_mm256_add_epi32(hi, _mm256_srli_epi64(hi, 32)), _MM_SHUFFLE(3, 1, 2, 0));
+            __m256i y = _mm256_srli_epi32(_mm256_add_epi32(_mm256_unpacklo_epi64(lo, hi), round), 8);
+            y = _mm256_or_si256(_mm256_or_si256(y, _mm256_slli_epi32(y, 8)), _mm256_slli_epi32(y, 16));
+            _mm256_storeu_si256((__m256i *)(row + x * 4), _mm256_or_si256(y, _mm256_and_si256(v, alpha)));
+        }
+    }
+    bitmap_grayscale_scalar(row, x, width, pixel_size);
+}
+
+BITMAP_TARGET_AVX2 static void bitmap_swap_row_avx2(uint8_t *row, uint32_t width, uint32_t pixel_size, const void *params) {
+    (void)params;
+    uint32_t x = 0;
+    if (pixel_size == 4) {
+        const __m256i ga = _mm256_set1_epi32((int)0xFF00FF00u), low = _mm256_set1_epi32(0xFF), red = _mm256_set1_epi32(0x00FF0000);
+        for (; x + 8 <= width; x += 8) {
+            __m256i v = _mm256_loadu_si256((const __m256i *)(row + x * 4));
+            __m256i r = _mm256_or_si256(_mm256_and_si256(v, ga), _mm256_and_si256(_mm256_srli_epi32(v, 16), low));
+            _mm256_storeu_si256((__m256i *)(row + x * 4), _mm256_or_si256(r, _mm256_and_si256(_mm256_slli_epi32(v, 16), red)));
+        }
+    }
+    bitmap_swap_scalar(row, x, width, pixel_size);
+}
+
+#endif
+
+#ifdef BITMAP_HAVE_NEON
+static void bitmap_invert_row_neon(uint8_t *row, uint32_t width, uint32_t pixel_size, const void *params) {
+    (void)params;
+    uint32_t n_bytes = width * pixel_size, i = 0;
+    const uint8x16_t mask = vreinterpretq_u8_u32(vdupq_n_u32(BITMAP_COLOR_MASK(pixel_size)));
+    for (; i + 16 <= n_bytes; i += 16) vst1q_u8(row + i, veorq_u8(vld1q_u8(row + i), mask));
+    bitmap_invert_scalar(row, i, n_bytes, pixel_size);
+}
+
+static inline int16x8_t bitmap_adjust_neon(int16x8_t v, int16x4_t contrast, int16x8_t offset) {
+    v = vshlq_n_s16(vsubq_s16(v, vdupq_n_s16(128)), 7);
+    int32x4_t lo = vshrq_n_s32(vmull_s16(vget_low_s16(v), contrast), 16);
+    int32x4_t hi = vshrq_n_s32(vmull_s16(vget_high_s16(v), contrast), 16);
+    return vaddq_s16(vcombine_s16(vmovn_s32(lo), vmovn_s32(hi)), offset);
+}
+
+static void bitmap_adjust_row_neon(uint8_t *row, uint32_t width, uint32_t pixel_size, const void *params) {
+    const BRIGHTNESSCONTRAST *bc = (const BRIGHTNESSCONTRAST *)params;
+    uint32_t n_bytes = width * pixel_size, i = 0;
+    const uint8x16_t mask = vreinterpretq_u8_u32(vdupq_n_u32(BITMAP_COLOR_MASK(pixel_size)));
+    const int16x4_t contrast = vdup_n_s16((int16_t)bc->contrast);
+    const int16x8_t offset = vdupq_n_s16((int16_t)(128 + bc->brightness));
+    for (; i + 16 <= n_bytes; i += 16) {
+        uint8x16_t v = vld1q_u8(row + i);
+        int16x8_t lo = bitmap_adjust_neon(vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(v))), contrast, offset);
+        int16x8_t hi = bitmap_adjust_neon(vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(v))), contrast, offset);
+        uint8x16_t r = vcombine_u8(vqmovun_s16(lo), vqmovun_s16(hi));
+        vst1q_u8(row + i, vbslq_u8(mask, r, v));
+    }
+    bitmap_adjust_scalar(row, i, n_bytes, pixel_size, bc);
+}
+
+static inline uint8x16_t bitmap_luma_neon(uint8x16_t b, uint8x16_t g, uint8x16_t r) {
+    const uint8x8_t wb = vdup_n_u8(29), wg = vdup_n_u8(150), wr = vdup_n_u8(77);
+    uint16x8_t lo = vmlal_u8(vmlal_u8(vmull_u8(vget_low_u8(b), wb), vget_low_u8(g), wg), vget_low_u8(r), wr);
+    uint16x8_t hi = vmlal_u8(vmlal_u8(vmull_u8(vget_high_u8(b), wb), vget_high_u8(g), wg), vget_high_u8(r), wr);
+    return vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8));
+}
+
+static void bitmap_grayscale_row_neon(uint8_t *row, uint32_t width, uint32_t pixel_size, const void *params) {
+    (void)params;
+    uint32_t x = 0;
+    if (pixel_size == 4) {
+        for (; x + 16 <= width; x += 16) {
+            uint8x16x4_t p = vld4q_u8(row + x * 4);
+            p.val[0] = p.val[1] = p.val[2] = bitmap_luma_neon(p.val[0], p.val[1], p.val[2]);
+            vst4q_u8(row + x * 4, p);
+        }
+    } else {
+        for (; x + 16 <= width; x += 16) {
+            uint8x16x3_t p = vld3q_u8(row + x * 3);
+            p.val[0] = p.val[1] = p.val[2] = bitmap_luma_neon(p.val[0], p.val[1], p.val[2]);
+            vst3q_u8(row + x * 3, p);
+        }
+    }
+    bitmap_grayscale_scalar(row, x, width, pixel_size);
+}
+
+static void bitmap_swap_row_neon(uint8_t *row, uint32_t width, uint32_t pixel_size, const void *params) {
+    (void)params;
+    uint32_t x = 0;
+    if (pixel_size == 4) {
+        for (; x + 16 <= width; x += 16) {
+            uint8x16x4_t p = vld4q_u8(row + x * 4);
+            uint8x16_t blue = p.val[0];
+            p.val[0] = p.val[2];
+            p.val[2] = blue;
+            vst4q_u8(row + x * 4, p);
+        }
+    } else {
+        for (; x + 16 <= width; x += 16) {
+            uint8x16x3_t p = vld3q_u8(row + x * 3);
+            uint8x16_t blue = p.val[0];
+            p.val[0] = p.val[2];
+            p.val[2] = blue;
+            vst3q_u8(row + x * 3, p);
+        }
+    }
+    bitmap_swap_scalar(row, x, width, pixel_size);
+}
+#endif
+
+/*
+* Returns the pixel kernels for the current CPU. The best instruction set is detected on the first call.
+* @return table of row kernels, valid for the lifetime of the program
+*/
+const BITMAPKERNELS *GetBitMapKernels(void) {
+    static BITMAPKERNELS kernels;
+    static volatile int initialized = 0;
+    if (initialized) return &kernels;
+    BITMAPKERNELS selected = {
+        bitmap_invert_row_scalar, bitmap_adjust_row_scalar, bitmap_grayscale_row_scalar, bitmap_swap_row_scalar
+    };
+#if defined(BITMAP_HAVE_NEON)
+    selected.invert = bitmap_invert_row_neon;
+    selected.brightness_contrast = bitmap_adjust_row_neon;
+    selected.grayscale = bitmap_grayscale_row_neon;
+    selected.swap_red_blue = bitmap_swap_row_neon;
+#elif defined(BITMAP_HAVE_SSE2)
+    selected.invert = bitmap_invert_row_sse2;
+    selected.brightness_contrast = bitmap_adjust_row_sse2;
+    selected.grayscale = bitmap_grayscale_row_sse2;
+    selected.swap_red_blue = bitmap_swap_row_sse2;
+#if defined(BITMAP_HAVE_AVX2)
+    if (bitmap_cpu_has_avx2()) {
+        selected.invert = bitmap_invert_row_avx2;
+        selected.brightness_contrast = bitmap_adjust_row_avx2;
+        selected.grayscale = bitmap_grayscale_row_avx2;
+        selected.swap_red_blue = bitmap_swap_row_avx2;
+    }
+#endif
+#endif
+    // Every thread computes the same table, so a race here only repeats the detection
+    kernels = selected;
+    initialized = 1;
+    return &kernels;
+}
+
+/*
+* Runs a row kernel over every row of a bitmap. Padding bytes are never touched.
+* @param bmp bitmap with padded pixel data (ROW_SIZE bytes per row), 24 or 32 bits per pixel
+* @param kernel the row kernel, usually taken from GetBitMapKernels
+* @param params kernel specific parameters
+* @return 0 on success, -1 if the color depth isn't supported
+*/
+int ApplyBitMapKernel(PBITMAP bmp, BITMAPROWKERNEL kernel, const void *params) {
+    BITMAP_SCOPE(ApplyBitMapKernel);
+    uint32_t pixel_size = bmp->info_header.bits_per_pixel / 8;
+    if ((pixel_size != 3 && pixel_size != 4) || bmp->info_header.bitmap_width < 0) return -1;
+    uint32_t width = bmp->info_header.bitmap_width;
+    int32_t height = bmp->info_header.bitmap_height;
+    uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    uint32_t row_size = ROW_SIZE(bmp->info_header.bits_per_pixel, width);
+    uint8_t *row = bmp->pixels;
+    for (uint32_t y = 0; y < rows; ++y, row += row_size) kernel(row, width, pixel_size, params);
+    return 0;
+}
+
+/*
+* Inverts the color channels of a 24 or 32 bit bitmap. Alpha and padding are kept.
+* @param bmp the bitmap to invert
+* @return 0 on success, -1 if the color depth isn't supported
+*/
+int InvertBitMap(PBITMAP bmp) {
+    BITMAP_SCOPE(InvertBitMap);
+    return ApplyBitMapKernel(bmp, GetBitMapKernels()->invert, NULL);
+}
+
+/*
+* Changes brightness and contrast of a 24 or 32 bit bitmap: c = (c - 128) * contrast + 128 + brightness
+* @param bmp the bitmap to change
+* @param brightness value added to every channel, -255 to 255
+* @param contrast contrast factor, 1.0 keeps the contrast
+* @return 0 on success, -1 if the color depth isn't supported
+*/
+int AdjustBrightnessContrast(PBITMAP bmp, int32_t brightness, float contrast) {
+    BITMAP_SCOPE(AdjustBrightnessContrast);
+    float scaled = contrast * 512.0f + 0.5f;
+    BRIGHTNESSCONTRAST params;
+    params.brightness = brightness < -255 ? -255 : brightness > 255 ? 255 : brightness;
+    params.contrast = scaled < 0.0f ? 0 : scaled > 32767.0f ? 32767 : (int32_t)scaled;
+    return ApplyBitMapKernel(bmp, GetBitMapKernels()->brightness_contrast, &params);
+}
+
+/*
+* Converts a 24 or 32 bit bitmap to grayscale (BT.601 luma), alpha is kept.
+* @param bmp the bitmap to convert
+* @return 0 on success, -1 if the color depth isn't supported
+*/
+int GrayscaleBitMap(PBITMAP bmp) {
+    BITMAP_SCOPE(GrayscaleBitMap);
+    return ApplyBitMapKernel(bmp, GetBitMapKernels()->grayscale, NULL);
+}
+
+/*
+* Swaps the red and blue channels of a 24 or 32 bit bitmap (BGR <-> RGB).
+* @param bmp the bitmap to change
+* @return 0 on success, -1 if the color depth isn't supported
+*/
+int SwapRedBlue(PBITMAP bmp) {
+    BITMAP_SCOPE(SwapRedBlue);
+    return ApplyBitMapKernel(bmp, GetBitMapKernels()->swap_red_blue, NULL);
+}
+
+/*
+* Thread pool and row band scheduler
+* Work is split into tasks that idle threads claim one at a time, so faster threads pick up the
+* bands that slower ones haven't started. The calling thread helps until its own job is finished.
+* Static runs instead give every worker a fixed share of the indices, so the same band always runs on the
+* same (pinned) worker and stays next to the memory that worker touched first.
+*/
+typedef void (*BITMAPTASK)(void *context, uint32_t index);
+
+typedef struct BITMAPTASKGROUP {
+    BITMAPTASK                  task;
+    void                        *context;
+    uint32_t                    n_tasks;
+    uint32_t                    next;       // Next index to hand out
+    uint32_t                    remaining;  // Indices that haven't finished yet
+    void                        (*on_done)(void *context);
+    int                         detached;   // Heap allocated group nobody waits on
+    struct BITMAPTASKGROUP      *next_group;
+} BITMAPTASKGROUP;
+
+// Share of a static run for one worker
+typedef struct BITMAPTASKSLOT {
+    BITMAPTASKGROUP             *group;
+    uint32_t                    worker;
+    uint32_t                    (*worker_of)(void *context, uint32_t index);
+    struct BITMAPTASKSLOT       *next;
+} BITMAPTASKSLOT;
+
+#define BITMAP_POOL_PIN_THREADS 0x1 // Pin worker i to CPU i % GetBitMapCpuCount()
+
+typedef struct {
+    BITMAP_MUTEX        mutex;
+    BITMAP_COND         work;       // Signaled when a group is queued or the pool shuts down
+    BITMAP_COND         done;       // Signaled when a group finishes
+    BITMAPTASKGROUP     *head;
+    BITMAPTASKGROUP     *tail;
+    BITMAP_THREAD       *threads;
+    uint32_t            n_threads;
+    int                 stopping;
+    uint32_t            flags;      // BITMAP_POOL_* flags
+    uint32_t            started;    // Workers that took their id
+    BITMAP_THREAD_ID    *ids;       // ids[i] is the thread of worker i
+    BITMAPTASKSLOT      **slots;    // Static run shares queued for each worker
+} BITMAPTHREADPOOL;
+
+/*
+* Runs a task for every index in [0, n_tasks) and returns when all of them finished.
+* Lets code that already has a thread pool plug it into the band scheduler.
+*/
+typedef struct {
+    void    (*run)(void *executor, BITMAPTASK task, void *context, uint32_t n_tasks);
+    void    *executor;
+} BITMAPEXECUTOR;
+
+typedef void (*BITMAPBANDTASK)(void *context, uint32_t first_row, uint32_t n_rows);
+
+typedef struct {
+    BITMAPTHREADPOOL        *pool;          // NULL uses GetBitMapThreadPool()
+    const BITMAPEXECUTOR    *executor;      // External pool, used instead of pool when set
+    uint32_t                band_bytes;     // Target size of one band, 0 = 256 KiB
+    uint32_t                flags;          // BITMAP_TILE_* flags
+} BITMAPTILEOPTIONS;
+
+/*
+* Runs every band on a fixed worker of the pool: the band whose middle row is in byte range
+* [k * band_bytes, (k + 1) * band_bytes) of the pixels runs on worker k % n_threads. Pixel buffers from
+* GetBitMapHugePageAllocator with BITMAP_HUGEPAGE_FIRST_TOUCH put those bytes on that worker's NUMA node.
+* Ignored with an executor.
+*/
+#define BITMAP_TILE_STATIC 0x1
+
+/*
+* Returns the number of online CPUs.
+*/
+uint32_t GetBitMapCpuCount(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return info.dwNumberOfProcessors ? (uint32_t)info.dwNumberOfProcessors : 1;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (uint32_t)count : 1;
+#endif
+}
+
+// Claims one index of the first queued group. Called with the pool mutex held, returns 0 if the queue is empty
+static int bitmap_pool_claim(BITMAPTHREADPOOL *pool, BITMAPTASKGROUP **group, uint32_t *index) {
+    BITMAPTASKGROUP *g = pool->head;
+    if (g == NULL) return 0;
+    *group = g;
+    *index = g->next++;
+    if (g->next == g->n_tasks) {
+        pool->head = g->next_group;
+        if (pool->head == NULL) pool->tail = NULL;
+    }
+    return 1;
+}
+
+// Runs a claimed index and retires the group when it was the last one. Called with the pool mutex held
+static void bitmap_pool_execute(BITMAPTHREADPOOL *pool, BITMAPTASKGROUP *group, uint32_t index) {
+    bitmap_mutex_unlock(&pool->mutex);
+    group->task(group->context, index);
+    bitmap_mutex_lock(&pool->mutex);
+    if (--group->remaining == 0) {
+        if (group->detached) {
+            void (*on_done)(void *) = group->on_done;
+            void *context = group->context;
+            free(group);
+            if (on_done) {
+                bitmap_mutex_unlock(&pool->mutex);
+                on_done(context);
+                bitmap_mutex_lock(&pool->mutex);
+            }
+        } else {
+            bitmap_cond_broadcast(&pool->done);
+        }
+    }
+}
+
+// Runs the indices of the first queued share of a worker. Called with the pool mutex held
+static void bitmap_pool_execute_slot(BITMAPTHREADPOOL *pool, uint32_t worker) {
+    BITMAPTASKSLOT *slot = pool->slots[worker];
+    pool->slots[worker] = slot->next;
+    BITMAPTASKGROUP *group = slot->group;
+    uint32_t n_threads = pool->n_threads, done = 0;
+    bitmap_mutex_unlock(&pool->mutex);
+    for (uint32_t i = 0; i < group->n_tasks; ++i) {
+        uint32_t owner = slot->worker_of ? slot->worker_of(group->context, i) % n_threads : i % n_threads;
+        if (owner != worker) continue;
+        group->task(group->context, i);
+        ++done;
+    }
+    bitmap_mutex_lock(&pool->mutex);
+    group->remaining -= done;
+    if (group->remaining == 0) bitmap_cond_broadcast(&pool->done);
+}
+
+// Worker id of the calling thread, n_threads if it isn't a worker of pool. Called with the pool mutex held
+static uint32_t bitmap_pool_worker_id(BITMAPTHREADPOOL *pool) {
+    BITMAP_THREAD_ID self = bitmap_thread_self();
+    for (uint32_t w = 0; w < pool->started; ++w) {
+        if (bitmap_thread_equal(pool->ids[w], self)) return w;
+    }
+    return pool->n_threads;
+}
+
+// Pins the calling thread to one CPU. Does nothing where affinity can't be set
+static void bitmap_pin_thread(uint32_t cpu) {
+#ifdef _WIN32
+    if (cpu < sizeof(DWORD_PTR) * 8) SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu);
+#elif defined(__linux__) && defined(CPU_SET)
+    // CPU_SET needs _GNU_SOURCE
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpu;
+#endif
+}
+
+#ifdef _WIN32
+static DWORD WINAPI bitmap_pool_worker(LPVOID arg) {
+#else
+static void *bitmap_pool_worker(void *arg) {
+#endif
+    BITMAPTHREADPOOL *pool = (BITMAPTHREADPOOL *)arg;
+    bitmap_mutex_lock(&pool->mutex);
+    uint32_t id = pool->started++;
+    pool->ids[id] = bitmap_thread_self();
+    if (pool->flags & BITMAP_POOL_PIN_THREADS) {
+        bitmap_mutex_unlock(&pool->mutex);
+        bitmap_pin_thread(id % GetBitMapCpuCount());
+        bitmap_mutex_lock(&pool->mutex);
+    }
+    for (;;) {
+        BITMAPTASKGROUP *group;
+        uint32_t index;
+        if (pool->slots[id]) {
+            bitmap_pool_execute_slot(pool, id);
+        } else if (bitmap_pool_claim(pool, &group, &index)) {
+            bitmap_pool_execute(pool, group, index);
+        } else if (pool->stopping) {
+            break;
+        } else {
+            bitmap_cond_wait(&pool->work, &pool->mutex);
+        }
+    }
+    bitmap_mutex_unlock(&pool->mutex);
+    return 0;
+}
+
+/*
+* Creates a thread pool.
+* @param n_threads number of worker threads, 0 = one per CPU
+* @param flags BITMAP_POOL_* flags. Pinning needs _GNU_SOURCE on Linux and is skipped without it
+* @return the pool, or NULL on failure. Release it with DestroyBitMapThreadPool
+*/
+BITMAPTHREADPOOL *CreateBitMapThreadPoolEx(uint32_t n_threads, uint32_t flags) {
+    BITMAP_SCOPE(CreateBitMapThreadPoolEx);
+    if (n_threads == 0) n_threads = GetBitMapCpuCount();
+    BITMAPTHREADPOOL *pool = (BITMAPTHREADPOOL *)bitmap_calloc(1, sizeof(BITMAPTHREADPOOL));
+    if (pool == NULL) return NULL;
+    pool->threads = (BITMAP_THREAD *)bitmap_calloc(n_threads, sizeof(BITMAP_THREAD));
+    pool->ids = (BITMAP_THREAD_ID *)bitmap_calloc(n_threads, sizeof(BITMAP_THREAD_ID));
+    pool->slots = (BITMAPTASKSLOT **)bitmap_calloc(n_threads, sizeof(BITMAPTASKSLOT *));
+    if (pool->threads == NULL || pool->ids == NULL || pool->slots == NULL) {
+        free(pool->threads);
+        free(pool->ids);
+        free(pool->slots);
+        free(pool);
+        return NULL;
+    }
+    pool->flags = flags;
+    bitmap_mutex_init(&pool->mutex);
+    bitmap_cond_init(&pool->work);
+    bitmap_cond_init(&pool->done);
+    for (; pool->n_threads < n_threads; ++pool->n_threads) {
+#ifdef _WIN32
+        pool->threads[pool->n_threads] = CreateThread(NULL, 0, bitmap_pool_worker, pool, 0, NULL);
+        if (pool->threads[pool->n_threads] == NULL) break;
+#else
+        if (pthread_create(&pool->threads[pool->n_threads], NULL, bitmap_pool_worker, pool) != 0) break;
+#endif
+    }
+    return pool;
+}
+
+/*
+* Creates a thread pool with unpinned workers, see CreateBitMapThreadPoolEx.
+* @param n_threads number of worker threads, 0 = one per CPU
+* @return the pool, or NULL on failure. Release it with DestroyBitMapThreadPool
+*/
+BITMAPTHREADPOOL *CreateBitMapThreadPool(uint32_t n_threads) {
+    BITMAP_SCOPE(CreateBitMapThreadPool);
+    return CreateBitMapThreadPoolEx(n_threads, 0);
+}
+
+/*
+* Waits for the queued work to finish, stops the workers and frees the pool.
+* @param pool the pool to destroy
+*/
+void DestroyBitMapThreadPool(BITMAPTHREADPOOL *pool) {
+    BITMAP_SCOPE(DestroyBitMapThreadPool);
+    if (pool == NULL) return;
+    bitmap_mutex_lock(&pool->mutex);
+    pool->stopping = 1;
+    bitmap_cond_broadcast(&pool->work);
+    bitmap_mutex_unlock(&pool->mutex);
+    for (uint32_t i = 0; i < pool->n_threads; ++i) {
+#ifdef _WIN32
+        WaitForSingleObject(pool->threads[i], INFINITE);
+        CloseHandle(pool->threads[i]);
+#else
+        pthread_join(pool->threads[i], NULL);
+#endif
+    }
+    bitmap_cond_destroy(&pool->done);
+    bitmap_cond_destroy(&pool->work);
+    bitmap_mutex_destroy(&pool->mutex);
+    free(pool->threads);
+    free(pool->ids);
+    free(pool->slots);
+    free(pool);
+}
+
+static void bitmap_pool_enqueue(BITMAPTHREADPOOL *pool, BITMAPTASKGROUP *group) {
+    group->next_group = NULL;
+    if (pool->tail) pool->tail->next_group = group;
+    else pool->head = group;
+    pool->tail = group;
+    if (group->n_tasks == 1) bitmap_cond_signal(&pool->work);
+    else bitmap_cond_broadcast(&pool->work);
+}
+
+/*
+* Runs task(context, i) for every i in [0, n_tasks) on the pool and waits for all of them.
+* The calling thread runs tasks too, so this is safe to call from inside a pool task.
+* @param pool the pool to run on
+* @param task the task
+* @param context passed to every call of task
+* @param n_tasks the number of indices
+*/
+void RunBitMapTasks(BITMAPTHREADPOOL *pool, BITMAPTASK task, void *context, uint32_t n_tasks) {
+    BITMAP_SCOPE(RunBitMapTasks);
+    if (n_tasks == 0) return;
+    if (n_tasks == 1 || pool == NULL || pool->n_threads == 0) {
+        for (uint32_t i = 0; i < n_tasks; ++i) task(context, i);
+        return;
+    }
+    BITMAPTASKGROUP group = { task, context, n_tasks, 0, n_tasks, NULL, 0, NULL };
+    bitmap_mutex_lock(&pool->mutex);
+    bitmap_pool_enqueue(pool, &group);
+    while (group.remaining) {
+        BITMAPTASKGROUP *claimed;
+        uint32_t index;
+        // Work on our own group first, then help with whatever is queued
+        if (group.next < group.n_tasks || bitmap_pool_claim(pool, &claimed, &index)) {
+            if (group.next < group.n_tasks) {
+                claimed = &group;
+                index = group.next++;
+                if (group.next == group.n_tasks) {
+                    // Unlink our group, it might not be at the head anymore
+                    BITMAPTASKGROUP **link = &pool->head, *prev = NULL;
+                    while (*link && *link != &group) { prev = *link; link = &(*link)->next_group; }
+                    if (*link) {
+                        *link = group.next_group;
+                        if (pool->tail == &group) pool->tail = prev;
+                    }
+                }
+            }
+            bitmap_pool_execute(pool, claimed, index);
+        } else {
+            // A worker waiting here may hold up a static run that queued a share for it
+            uint32_t own = bitmap_pool_worker_id(pool);
+            if (own < pool->n_threads && pool->slots[own]) bitmap_pool_execute_slot(pool, own);
+            else bitmap_cond_wait(&pool->done, &pool->mutex);
+        }
+    }
+    bitmap_mutex_unlock(&pool->mutex);
+}
+
+/*
+* Queues task(context, 0) on the pool without waiting for it. on_done(context) runs on the worker after the task.
+* @param pool the pool to run on
+* @param task the task
+* @param context passed to task and on_done
+* @param on_done called when the task finished, may be NULL
+* @return 0 on success, -1 if the pool has no workers or memory is exhausted
+*/
+int SubmitBitMapTask(BITMAPTHREADPOOL *pool, BITMAPTASK task, void *context, void (*on_done)(void *context)) {
+    BITMAP_SCOPE(SubmitBitMapTask);
+    if (pool == NULL || pool->n_threads == 0) return -1;
+    BITMAPTASKGROUP *group = (BITMAPTASKGROUP *)bitmap_calloc(1, sizeof(BITMAPTASKGROUP));
+    if (group == NULL) return -1;
+    group->task = task;
+    group->context = context;
+    group->n_tasks = group->remaining = 1;
+    group->on_done = on_done;
+    group->detached = 1;
+    bitmap_mutex_lock(&pool->mutex);
+    bitmap_pool_enqueue(pool, group);
+    bitmap_mutex_unlock(&pool->mutex);
+    return 0;
+}
+
+/*
+* RunBitMapTasks with a fixed worker for every index: index i runs on worker worker_of(context, i) % n_threads.
+* The calling thread only runs the share of its own worker when it is one. Use it with a pinned pool to keep
+* an index on the same CPU across runs.
+* @param pool the pool to run on
+* @param task the task
+* @param context passed to every call of task and worker_of
+* @param n_tasks the number of indices
+* @param worker_of maps an index to its worker, NULL for i % n_threads
+*/
+void RunBitMapTasksStatic(BITMAPTHREADPOOL *pool, BITMAPTASK task, void *context, uint32_t n_tasks,
+                          uint32_t (*worker_of)(void *context, uint32_t index)) {
+    BITMAP_SCOPE(RunBitMapTasksStatic);
+    if (n_tasks == 0) return;
+    uint32_t n_slots = pool ? pool->n_threads : 0;
+    BITMAPTASKSLOT *slots = n_slots ? (BITMAPTASKSLOT *)bitmap_calloc(n_slots, sizeof(BITMAPTASKSLOT)) : NULL;
+    if (slots == NULL) {
+        for (uint32_t i = 0; i < n_tasks; ++i) task(context, i);
+        return;
+    }
+    BITMAPTASKGROUP group = { task, context, n_tasks, n_tasks, n_tasks, NULL, 0, NULL };
+    bitmap_mutex_lock(&pool->mutex);
+    uint32_t own = bitmap_pool_worker_id(pool);
+    for (uint32_t w = 0; w < n_slots; ++w) {
+        // Appended, so the shares of one worker run in the order they were queued
+        BITMAPTASKSLOT **link = &pool->slots[w];
+        while (*link) link = &(*link)->next;
+        slots[w].group = &group;
+        slots[w].worker = w;
+        slots[w].worker_of = worker_of;
+        *link = &slots[w];
+    }
+    bitmap_cond_broadcast(&pool->work);
+    bitmap_cond_broadcast(&pool->done); // Workers waiting inside a run of their own check their shares too
+    while (group.remaining) {
+        BITMAPTASKGROUP *claimed;
+        uint32_t index;
+        if (own < n_slots && pool->slots[own]) {
+            bitmap_pool_execute_slot(pool, own);
+        } else if (bitmap_pool_claim(pool, &claimed, &index)) {
+            bitmap_pool_execute(pool, claimed, index);
+        } else {
+            bitmap_cond_wait(&pool->done, &pool->mutex);
+        }
+    }
+    bitmap_mutex_unlock(&pool->mutex);
+    free(slots);
+}
+
+static BITMAPTHREADPOOL *bitmap_default_pool = NULL;
+#ifdef _WIN32
+static BOOL CALLBACK bitmap_create_default_pool(PINIT_ONCE once, PVOID param, PVOID *ctx) {
+    (void)once; (void)param; (void)ctx;
+    bitmap_default_pool = CreateBitMapThreadPool(0);
+    return TRUE;
+}
+#else
+static void bitmap_create_default_pool(void) {
+    bitmap_default_pool = CreateBitMapThreadPool(0);
+}
+#endif
+
+/*
+* Returns the shared pool used when no pool is passed in. It's created with one worker per CPU on first use.
+*/
+BITMAPTHREADPOOL *GetBitMapThreadPool(void) {
+#ifdef _WIN32
+    static INIT_ONCE once = INIT_ONCE_STATIC_INIT;
+    InitOnceExecuteOnce(&once, bitmap_create_default_pool, NULL, NULL);
+#else
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, bitmap_create_default_pool);
+#endif
+    return bitmap_default_pool;
+}
+
+typedef struct {
+    BITMAPBANDTASK  task;
+    void            *context;
+    uint32_t        rows;
+    uint32_t        band_rows;
+    uint32_t        row_size;
+    uint32_t        band_bytes;
+} BITMAPBANDS;
+
+static void bitmap_run_band(void *context, uint32_t index) {
+    BITMAPBANDS *bands = (BITMAPBANDS *)context;
+    uint32_t first_row = index * bands->band_rows;
+    uint32_t n_rows = bands->rows - first_row < bands->band_rows ? bands->rows - first_row : bands->band_rows;
+    bands->task(bands->context, first_row, n_rows);
+}
+
+// Worker of a band for BITMAP_TILE_STATIC, by the byte range its middle row is in
+static uint32_t bitmap_band_worker(void *context, uint32_t index) {
+    BITMAPBANDS *bands = (BITMAPBANDS *)context;
+    uint32_t first_row = index * bands->band_rows;
+    uint32_t n_rows = bands->rows - first_row < bands->band_rows ? bands->rows - first_row : bands->band_rows;
+    return (uint32_t)((uint64_t)(first_row + n_rows / 2) * bands->row_size / bands->band_bytes);
+}
+
+/*
+* Splits `rows` rows into bands of about options->band_bytes and runs task on every band in parallel.
+* Bands always start and end on row boundaries.
+* @param rows number of rows
+* @param row_size bytes per row, used to size the bands
+* @param task called with the first row and row count of each band
+* @param context passed to task
+* @param options scheduling options, NULL for defaults
+*/
+void RunBitMapBands(uint32_t rows, uint32_t row_size, BITMAPBANDTASK task, void *context, const BITMAPTILEOPTIONS *options) {
+    BITMAP_SCOPE(RunBitMapBands);
+    if (rows == 0) return;
+    uint32_t band_bytes = (options && options->band_bytes) ? options->band_bytes : 256 * 1024;
+    uint32_t band_rows = row_size ? band_bytes / row_size : rows;
+    if (band_rows == 0) band_rows = 1;
+    BITMAPBANDS bands = { task, context, rows, band_rows, row_size, band_bytes };
+    uint32_t n_bands = (uint32_t)(((uint64_t)rows + band_rows - 1) / band_rows);
+    BITMAPTHREADPOOL *pool = (options && options->pool) ? options->pool : GetBitMapThreadPool();
+    if (options && options->executor) {
+        options->executor->run(options->executor->executor, bitmap_run_band, &bands, n_bands);
+    } else if (options && (options->flags & BITMAP_TILE_STATIC)) {
+        RunBitMapTasksStatic(pool, bitmap_run_band, &bands, n_bands, bitmap_band_worker);
+    } else {
+        RunBitMapTasks(pool, bitmap_run_band, &bands, n_bands);
+    }
+}
+
+/*
+* Huge page and NUMA aware pixel buffers
+* Large buffers are mapped straight from the OS. On Linux they are 2 MiB aligned and marked for transparent
+* huge pages, or taken from the explicit huge page pool (MAP_HUGETLB) when asked and available. Windows uses
+* large pages when the process holds SeLockMemoryPrivilege. With BITMAP_HUGEPAGE_FIRST_TOUCH every band of
+* the buffer is touched first by the worker BITMAP_TILE_STATIC runs it on, so its pages land on that worker's
+* NUMA node. Pass the same band options (with a pinned pool) to the *Tiled functions afterwards.
+*/
+#define BITMAP_HUGEPAGE_EXPLICIT    0x1     // Try MAP_HUGETLB / MEM_LARGE_PAGES before transparent huge pages
+#define BITMAP_HUGEPAGE_FIRST_TOUCH 0x2     // Fault the pages in from the workers that own their bands
+#define BITMAP_HUGEPAGE_SIZE        ((size_t)2 * 1024 * 1024)
+
+typedef struct {
+    uint32_t            flags;      // BITMAP_HUGEPAGE_* flags
+    size_t              min_size;   // Smaller allocations come from the default allocator, 0 = BITMAP_HUGEPAGE_SIZE
+    BITMAPTILEOPTIONS   bands;      // Pool and band_bytes of the first touch. band_bytes should be a multiple of
+                                    // BITMAP_HUGEPAGE_SIZE, a huge page belongs to the band that touches it first
+} BITMAPHUGEPAGEOPTIONS;
+
+typedef struct {
+    uint8_t     *ptr;
+    size_t      size;
+    size_t      chunk;
+} BITMAPTOUCH;
+
+static void bitmap_touch_chunk(void *context, uint32_t index) {
+    BITMAPTOUCH *touch = (BITMAPTOUCH *)context;
+    size_t start = (size_t)index * touch->chunk;
+    size_t end = touch->size - start < touch->chunk ? touch->size : start + touch->chunk;
+    // One write per 4 KiB page faults it in, a transparent huge page is faulted in as a whole
+    for (size_t offset = start; offset < end; offset += 4096) touch->ptr[offset] = 0;
+}
+
+static size_t bitmap_hugepage_min_size(const BITMAPHUGEPAGEOPTIONS *options) {
+    return options->min_size ? options->min_size : BITMAP_HUGEPAGE_SIZE;
+}
+
+static void *bitmap_hugepage_alloc(size_t size, size_t alignment, void *user) {
+    const BITMAPHUGEPAGEOPTIONS *options = (const BITMAPHUGEPAGEOPTIONS *)user;
+    if (size < bitmap_hugepage_min_size(options) || alignment > 4096) return bitmap_default_alloc(size, alignment, NULL);
+    uint8_t *ptr = NULL;
+#ifdef _WIN32
+    if (options->flags & BITMAP_HUGEPAGE_EXPLICIT) {
+        SIZE_T large = GetLargePageMinimum();
+        if (large) ptr = (uint8_t *)VirtualAlloc(NULL, (size + large - 1) / large * large, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+    }
+    if (ptr == NULL) ptr = (uint8_t *)VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+    if (ptr == NULL) return NULL;
+#elif defined(MAP_ANONYMOUS)
+    // Mappings cover whole huge pages, so free can recompute their length from size
+    size_t length = (size + BITMAP_HUGEPAGE_SIZE - 1) / BITMAP_HUGEPAGE_SIZE * BITMAP_HUGEPAGE_SIZE;
+#ifdef MAP_HUGETLB
+    if (options->flags & BITMAP_HUGEPAGE_EXPLICIT) {
+        void *mapped = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mapped != MAP_FAILED) ptr = (uint8_t *)mapped;
+    }
+#endif
+    if (ptr == NULL) {
+        // Map one huge page more and trim both ends, so the buffer starts on a huge page boundary
+        void *mapped = mmap(NULL, length + BITMAP_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapped == MAP_FAILED) return NULL;
+        uint8_t *base = (uint8_t *)mapped;
+        ptr = (uint8_t *)(((uintptr_t)base + BITMAP_HUGEPAGE_SIZE - 1) & ~(uintptr_t)(BITMAP_HUGEPAGE_SIZE - 1));
+        if (ptr > base) munmap(base, (size_t)(ptr - base));
+        if (base + length + BITMAP_HUGEPAGE_SIZE > ptr + length) munmap(ptr + length, (size_t)(base + length + BITMAP_HUGEPAGE_SIZE - (ptr + length)));
+#ifdef MADV_HUGEPAGE
+        madvise(ptr, length, MADV_HUGEPAGE);
+#endif
+    }
+#else
+    return bitmap_default_alloc(size, alignment, NULL);
+#endif
+    if (options->flags & BITMAP_HUGEPAGE_FIRST_TOUCH) {
+        BITMAPTOUCH touch = { ptr, size, options->bands.band_bytes ? options->bands.band_bytes : 256 * 1024 };
+        uint32_t n_chunks = (uint32_t)((size + touch.chunk - 1) / touch.chunk);
+        RunBitMapTasksStatic(options->bands.pool ? options->bands.pool : GetBitMapThreadPool(), bitmap_touch_chunk, &touch, n_chunks, NULL);
+    }
+    return ptr;
+}
+
+static void bitmap_hugepage_free(void *ptr, size_t size, void *user) {
+    const BITMAPHUGEPAGEOPTIONS *options = (const BITMAPHUGEPAGEOPTIONS *)user;
+    if (ptr == NULL) return;
+    if (size < bitmap_hugepage_min_size(options)) {
+        bitmap_default_free(ptr, size, NULL);
+        return;
+    }
+#ifdef _WIN32
+    VirtualFree(ptr, 0, MEM_RELEASE);
+#elif defined(MAP_ANONYMOUS)
+    munmap(ptr, (size + BITMAP_HUGEPAGE_SIZE - 1) / BITMAP_HUGEPAGE_SIZE * BITMAP_HUGEPAGE_SIZE);
+#else
+    bitmap_default_free(ptr, size, NULL);
+#endif
+}
+
+/*
+* Returns an allocator that backs large pixel buffers with huge pages. Pass it to GenerateBitMapDataEx or ReadBitMapEx.
+* @param options allocation options. The allocator keeps a pointer to them, they must outlive every buffer from it
+*/
+BITMAPALLOCATOR GetBitMapHugePageAllocator(const BITMAPHUGEPAGEOPTIONS *options) {
+    BITMAPALLOCATOR allocator = { bitmap_hugepage_alloc, bitmap_hugepage_free, (void *)options };
+    return allocator;
+}
+
+typedef struct {
+    BITMAPROWKERNEL kernel;
+    const void      *params;
+    uint8_t         *pixels;
+    uint32_t        row_size;
+    uint32_t        width;
+    uint32_t        pixel_size;
+} BITMAPKERNELBANDS;
+
+static void bitmap_kernel_band(void *context, uint32_t first_row, uint32_t n_rows) {
+    BITMAPKERNELBANDS *k = (BITMAPKERNELBANDS *)context;
+    uint8_t *row = k->pixels + (size_t)first_row * k->row_size;
+    for (uint32_t y = 0; y < n_rows; ++y, row += k->row_size) k->kernel(row, k->width, k->pixel_size, k->params);
+}
+
+/*
+* Multi-threaded ApplyBitMapKernel. The rows are split into cache sized bands that run on a thread pool.
+* @param bmp bitmap with padded pixel data (ROW_SIZE bytes per row), 24 or 32 bits per pixel
+* @param kernel the row kernel, usually taken from GetBitMapKernels
+* @param params kernel specific parameters
+* @param options scheduling options, NULL for defaults
+* @return 0 on success, -1 if the color depth isn't supported
+*/
+int ApplyBitMapKernelTiled(PBITMAP bmp, BITMAPROWKERNEL kernel, const void *params, const BITMAPTILEOPTIONS *options) {
+    BITMAP_SCOPE(ApplyBitMapKernelTiled);
+    uint32_t pixel_size = bmp->info_header.bits_per_pixel / 8;
+    if ((pixel_size != 3 && pixel_size != 4) || bmp->info_header.bitmap_width < 0) return -1;
+    int32_t height = bmp->info_header.bitmap_height;
+    BITMAPKERNELBANDS k;
+    k.kernel = kernel;
+    k.params = params;
+    k.pixels = bmp->pixels;
+    k.row_size = ROW_SIZE(bmp->info_header.bits_per_pixel, (uint32_t)bmp->info_header.bitmap_width);
+    k.width = (uint32_t)bmp->info_header.bitmap_width;
+    k.pixel_size = pixel_size;
+    RunBitMapBands(height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height, k.row_size, bitmap_kernel_band, &k, options);
+    return 0;
+}
+
+/*
+* Row access in display order. Row 0 is the top row of the image for both bottom-up (positive height)
+* and top-down (negative height) pixel data, stride is the signed distance to the next displayed row,
+* so loops walk rows with row += stride.
+*/
+typedef struct {
+    uint8_t     *top;           // Top row of the image
+    ptrdiff_t   stride;         // Bytes from one row to the one below it, negative for bottom-up pixel data
+    uint32_t    rows;
+    uint32_t    row_size;       // Padded size of a row
+    uint8_t     **row;          // row[y] is the address of row y, NULL unless requested
+} BITMAPROWTABLE;
+
+// Address of row y counted from the top of a bitmap with padded pixel data
+static inline uint8_t *bitmap_row(PBITMAP bmp, uint32_t y) {
+    int32_t height = bmp->info_header.bitmap_height;
+    size_t row_size = ROW_SIZE(bmp->info_header.bits_per_pixel, (uint32_t)bmp->info_header.bitmap_width);
+    size_t index = height < 0 ? y : (uint32_t)height - 1 - y;
+    return bmp->pixels + index * row_size;
+}
+
+/*
+* Returns the address of a row in display order.
+* @param bmp bitmap with padded uncompressed pixel data
+* @param y row counted from the top of the image, must be less than the number of rows
+*/
+uint8_t *GetBitMapRow(PBITMAP bmp, uint32_t y) {
+    BITMAP_SCOPE(GetBitMapRow);
+    return bitmap_row(bmp, y);
+}
+
+/*
+* Fills a row table of a bitmap. The table stays valid until the pixels of the bitmap are replaced.
+* @param bmp bitmap with padded uncompressed pixel data
+* @param table receives the table
+* @param with_pointers nonzero also builds table->row, one pointer per row. Free it with FreeBitMapRowTable
+* @return 0 on success, -1 if the bitmap has no pixels or the pointers couldn't be allocated
+*/
+int InitBitMapRowTable(PBITMAP bmp, BITMAPROWTABLE *table, int with_pointers) {
+    BITMAP_SCOPE(InitBitMapRowTable);
+    memset(table, 0, sizeof(*table));
+    if (bmp->pixels == NULL || bmp->info_header.bitmap_width < 0) return -1;
+    int32_t height = bmp->info_header.bitmap_height;
+    table->rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    table->row_size = ROW_SIZE(bmp->info_header.bits_per_pixel, (uint32_t)bmp->info_header.bitmap_width);
+    table->stride = height < 0 ? (ptrdiff_t)table->row_size : -(ptrdiff_t)table->row_size;
+    table->top = table->rows ? bitmap_row(bmp, 0) : bmp->pixels;
+    if (!with_pointers) return 0;
+    table->row = (uint8_t **)bitmap_malloc((table->rows ? table->rows : 1) * sizeof(uint8_t *));
+    if (table->row == NULL) return -1;
+    uint8_t *row = table->top;
+    for (uint32_t y = 0; y < table->rows; ++y, row += table->stride) table->row[y] = row;
+    return 0;
+}
+
+/*
+* Frees the row pointers of a table.
+* @param table table from InitBitMapRowTable
+*/
+void FreeBitMapRowTable(BITMAPROWTABLE *table) {
+    BITMAP_SCOPE(FreeBitMapRowTable);
+    free(table->row);
+    table->row = NULL;
+}
+
+/*
+* Reverses the storage order of the rows and negates the height, so the image looks the same and a
+* bottom-up bitmap becomes top-down or the other way round. Rows are swapped in blocks.
+* @param bmp bitmap with padded uncompressed pixel data
+* @return 0 on success, -1 if the bitmap has no uncompressed pixels
+*/
+int FlipBitMapRows(PBITMAP bmp) {
+    BITMAP_SCOPE(FlipBitMapRows);
+    if (bmp->pixels == NULL || bmp->info_header.bitmap_width < 0 || bmp->info_header.bitmap_height == INT32_MIN ||
+        !bitmap_is_uncompressed(&bmp->info_header)) return -1;
+    int32_t height = bmp->info_header.bitmap_height;
+    uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    size_t row_size = ROW_SIZE(bmp->info_header.bits_per_pixel, (uint32_t)bmp->info_header.bitmap_width);
+    uint8_t block[4096];
+    uint8_t *low = bmp->pixels, *high = bmp->pixels + (rows ? rows - 1 : 0) * row_size;
+    for (; low < high; low += row_size, high -= row_size) {
+        for (size_t done = 0; done < row_size; done += sizeof(block)) {
+            size_t n = row_size - done < sizeof(block) ? row_size - done : sizeof(block);
+            memcpy(block, low + done, n);
+            memcpy(low + done, high + done, n);
+            memcpy(high + done, block, n);
+        }
+    }
+    bmp->info_header.bitmap_height = -height;
+    return 0;
+}
+
+/*
+* Reads a bitmap file like ReadBitMapEx and flips bottom-up pixel data on load, so rows are stored top
+* first and row y is at pixels + y * row size.
+* @param file_name the path to a bitmap file
+* @param allocator allocator for the pixels, NULL for the default allocator
+* @return BITMAP with negative height, pixels is NULL on failure
+*/
+BITMAP ReadBitMapTopDown(const char *file_name, const BITMAPALLOCATOR *allocator) {
+    BITMAP_SCOPE(ReadBitMapTopDown);
+    BITMAP bitmap = ReadBitMapEx(file_name, allocator);
+    if (bitmap.pixels && bitmap.info_header.bitmap_height > 0 && bitmap_is_uncompressed(&bitmap.info_header)) {
+        FlipBitMapRows(&bitmap);
+    }
+    return bitmap;
+}
+
+/*
+* Rotation, mirroring and transposition
+* Transposing rotations write the output in 4x4 pixel blocks, 32 bit blocks are transposed in SSE2 registers.
+* Every source cache line a block reads serves 16 bytes of 4 output rows, and the blocks of a band walk the
+* source in 32 column tiles, so both sides stay in cache. Output bands run on the tile engine. A vertical flip
+* only negates bitmap_height unless the bitmap has a file or writable mapping, then its rows move.
+*/
+#define BITMAP_FLIP_HORIZONTAL  0x1
+#define BITMAP_FLIP_VERTICAL    0x2
+
+typedef struct {
+    uint8_t         *dst_top;       // Top row of the output
+    ptrdiff_t       dst_stride;     // Bytes from one output row to the one below it
+    const uint8_t   *src;           // Source pixel of output pixel (0, 0)
+    ptrdiff_t       src_x;          // Source bytes from output pixel (x, y) to (x + 1, y)
+    ptrdiff_t       src_y;          // Source bytes from output pixel (x, y) to (x, y + 1)
+    uint32_t        width;          // Output width
+    uint32_t        pixel_size;
+} BITMAPTRANSPOSE;
+
+static inline void bitmap_transpose_pixel(const BITMAPTRANSPOSE *t, uint32_t x, uint32_t y) {
+    uint8_t *dst = t->dst_top + (ptrdiff_t)y * t->dst_stride + (size_t)x * t->pixel_size;
+    const uint8_t *src = t->src + (ptrdiff_t)x * t->src_x + (ptrdiff_t)y * t->src_y;
+    dst[0] = src[0];
+    dst[1] = src[1];
+    dst[2] = src[2];
+    if (t->pixel_size == 4) dst[3] = src[3];
+}
+
+#ifdef BITMAP_HAVE_SSE2
+// Output pixels (x..x+3, y..y+3). src_y is +-4, so the 4 source pixels of an output column are adjacent
+static inline void bitmap_transpose_block_sse2(const BITMAPTRANSPOSE *t, uint32_t x, uint32_t y) {
+    const uint8_t *src = t->src + (ptrdiff_t)x * t->src_x + (ptrdiff_t)y * t->src_y;
+    __m128i v[4];
+    for (int k = 0; k < 4; ++k, src += t->src_x) {
+        // Column k of the block, row order reversed in memory when the source runs right to left
+        v[k] = t->src_y > 0 ? _mm_loadu_si128((const __m128i *)src) : _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)(src - 12)), 0x1B);
+    }
+    __m128i t0 = _mm_unpacklo_epi32(v[0], v[1]), t1 = _mm_unpacklo_epi32(v[2], v[3]);
+    __m128i t2 = _mm_unpackhi_epi32(v[0], v[1]), t3 = _mm_unpackhi_epi32(v[2], v[3]);
+    uint8_t *dst = t->dst_top + (ptrdiff_t)y * t->dst_stride + (size_t)x * 4;
+    _mm_storeu_si128((__m128i *)dst, _mm_unpacklo_epi64(t0, t1));
+    _mm_storeu_si128((__m128i *)(dst + t->dst_stride), _mm_unpackhi_epi64(t0, t1));
+    _mm_storeu_si128((__m128i *)(dst + 2 * t->dst_stride), _mm_unpacklo_epi64(t2, t3));
+    _mm_storeu_si128((__m128i *)(dst + 3 * t->dst_stride), _mm_unpackhi_epi64(t2, t3));
+}
+#endif
+
+static void bitmap_transpose_band(void *context, uint32_t first_row, uint32_t n_rows) {
+    const BITMAPTRANSPOSE *t = (const BITMAPTRANSPOSE *)context;
+    uint32_t last_row = first_row + n_rows;
+    for (uint32_t tile = 0; tile < t->width; tile += 32) {
+        uint32_t tile_end = t->width - tile < 32 ? t->width : tile + 32;
+        for (uint32_t y = first_row; y < last_row; y += 4) {
+            uint32_t x = tile;
+#ifdef BITMAP_HAVE_SSE2
+            if (t->pixel_size == 4 && last_row - y >= 4) {
+                for (; x + 4 <= tile_end; x += 4) bitmap_transpose_block_sse2(t, x, y);
+            }
+#endif
+            uint32_t block_end = last_row - y < 4 ? last_row : y + 4;
+            // Tile columns the blocks didn't cover, and the last rows of the band
+            for (uint32_t yy = y; yy < block_end; ++yy) {
+                for (uint32_t xx = x; xx < tile_end; ++xx) bitmap_transpose_pixel(t, xx, yy);
+            }
+        }
+    }
+}
+
+// Replaces the pixels of bmp with a width x height image whose pixel (x, y) is at src + x * src_x + y * src_y
+static int bitmap_transpose(PBITMAP bmp, const uint8_t *src, ptrdiff_t src_x, ptrdiff_t src_y, const BITMAPTILEOPTIONS *options) {
+    uint32_t pixel_size = bmp->info_header.bits_per_pixel / 8;
+    int32_t height = bmp->info_header.bitmap_height;
+    uint32_t width = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;   // Output width is the input height
+    uint32_t rows = (uint32_t)bmp->info_header.bitmap_width;
+    uint64_t row_size = ROW_SIZE((uint64_t)bmp->info_header.bits_per_pixel, width);
+    if (width > INT32_MAX || row_size * rows > UINT32_MAX) return -1;
+    BITMAP rotated = *bmp;
+    if (bitmap_alloc_pixels(&rotated, (size_t)(row_size * rows), bmp->allocator.alloc ? &bmp->allocator : NULL) == NULL) return -1;
+    // The output keeps the row order of the input
+    int32_t out_height = height < 0 ? -(int32_t)rows : (int32_t)rows;
+    BITMAPTRANSPOSE t;
+    t.dst_top = (uint8_t *)bitmap_top_row(rotated.pixels, out_height, (uint32_t)row_size, &t.dst_stride);
+    t.src = src;
+    t.src_x = src_x;
+    t.src_y = src_y;
+    t.width = width;
+    t.pixel_size = pixel_size;
+    uint32_t padding_size = (uint32_t)row_size - width * pixel_size;
+    if (padding_size) {
+        uint8_t *row = rotated.pixels;
+        for (uint32_t y = 0; y < rows; ++y, row += row_size) memset(row + width * pixel_size, 0, padding_size);
+    }
+    // Bands of 32 rows unless the caller picked a size, so a band reads 32 x 32 pixel source tiles
+    BITMAPTILEOPTIONS bands;
+    if (options) bands = *options;
+    else memset(&bands, 0, sizeof(bands));
+    if (bands.band_bytes == 0) bands.band_bytes = (uint32_t)(row_size * 32 < UINT32_MAX ? row_size * 32 : row_size);
+    RunBitMapBands(rows, (uint32_t)row_size, bitmap_transpose_band, &t, &bands);
+
+    bitmap_free_pixels(bmp);
+    bmp->pixels = rotated.pixels;
+    bmp->pixels_size = rotated.pixels_size;
+    bmp->allocator = rotated.allocator;
+    bmp->info_header.bitmap_width = (int32_t)width;
+    bmp->info_header.bitmap_height = out_height;
+    bmp->info_header.image_size = (uint32_t)(row_size * rows);
+    int32_t resolution = bmp->info_header.horizontal_resolution;
+    bmp->info_header.horizontal_resolution = bmp->info_header.vertical_resolution;
+    bmp->info_header.vertical_resolution = resolution;
+    return 0;
+}
+
+static int bitmap_can_rotate(const BITMAP *bmp) {
+    uint32_t bits_per_pixel = bmp->info_header.bits_per_pixel;
+    return bmp->pixels && (bits_per_pixel == 24 || bits_per_pixel == 32) && bmp->info_header.bitmap_width >= 0 &&
+           bmp->info_header.bitmap_height != INT32_MIN && bitmap_is_uncompressed(&bmp->info_header);
+}
+
+typedef struct {
+    uint8_t     *pixels;
+    uint32_t    row_size;
+    uint32_t    width;
+    uint32_t    pixel_size;
+} BITMAPMIRROR;
+
+static void bitmap_mirror_band(void *context, uint32_t first_row, uint32_t n_rows) {
+    const BITMAPMIRROR *m = (const BITMAPMIRROR *)context;
+    uint8_t *row = m->pixels + (size_t)first_row * m->row_size;
+    uint32_t size = m->pixel_size;
+    for (uint32_t y = 0; y < n_rows; ++y, row += m->row_size) {
+        uint8_t *left = row, *right = row + (size_t)(m->width ? m->width - 1 : 0) * size;
+#ifdef BITMAP_HAVE_SSE2
+        if (size == 4) {
+            // 4 pixels from each end, reversed and swapped
+            for (; right - left >= 28; left += 16, right -= 16) {
+                __m128i l = _mm_loadu_si128((const __m128i *)left);
+                __m128i r = _mm_loadu_si128((const __m128i *)(right - 12));
+                _mm_storeu_si128((__m128i *)left, _mm_shuffle_epi32(r, 0x1B));
+                _mm_storeu_si128((__m128i *)(right - 12), _mm_shuffle_epi32(l, 0x1B));
+            }
+        }
+#endif
+        for (; left < right; left += size, right -= size) {
+            uint8_t pixel[4];
+            memcpy(pixel, left, size);
+            memcpy(left, right, size);
+            memcpy(right, pixel, size);
+        }
+    }
+}
+
+/*
+* Mirrors a bitmap in place.
+* @param bmp bitmap with padded uncompressed pixel data, 24 or 32 bits per pixel
+* @param flags BITMAP_FLIP_HORIZONTAL reverses every row in parallel bands, BITMAP_FLIP_VERTICAL negates
+* bitmap_height and leaves the rows where they are. Bitmaps with an open file or a writable mapping keep the
+* header on disk valid instead: their rows are swapped, and every row is marked for SyncBitMap
+* @param options scheduling options, NULL for defaults
+* @return 0 on success, -1 if the format isn't supported
+*/
+int FlipBitMap(PBITMAP bmp, uint32_t flags, const BITMAPTILEOPTIONS *options) {
+    BITMAP_SCOPE(FlipBitMap);
+    if (!bitmap_can_rotate(bmp)) return -1;
+    int32_t height = bmp->info_header.bitmap_height;
+    uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    uint32_t row_size = ROW_SIZE(bmp->info_header.bits_per_pixel, (uint32_t)bmp->info_header.bitmap_width);
+    if (flags & BITMAP_FLIP_HORIZONTAL) {
+        BITMAPMIRROR m;
+        m.pixels = bmp->pixels;
+        m.width = (uint32_t)bmp->info_header.bitmap_width;
+        m.pixel_size = bmp->info_header.bits_per_pixel / 8;
+        m.row_size = row_size;
+        RunBitMapBands(rows, m.row_size, bitmap_mirror_band, &m, options);
+    }
+    if (flags & BITMAP_FLIP_VERTICAL) {
+        // FlipBitMapRows reverses the rows and negates the height, negating it back leaves the rows flipped
+        if (bitmap_has_backing(bmp)) FlipBitMapRows(bmp);
+        bmp->info_header.bitmap_height = -bmp->info_header.bitmap_height;
+    }
+    if (flags && rows > 0) bitmap_mark_dirty(bmp, 0, rows);
+    return 0;
+}
+
+/*
+* Transposes a bitmap along its main diagonal, pixel (x, y) counted from the top left moves to (y, x).
+* The pixels are replaced by a new buffer from the bitmap's allocator, the row order is kept.
+* @param bmp bitmap with padded uncompressed pixel data, 24 or 32 bits per pixel
+* @param options scheduling options, NULL for bands of 32 output rows
+* @return 0 on success, -1 if the format isn't supported or memory is exhausted
+*/
+int TransposeBitMap(PBITMAP bmp, const BITMAPTILEOPTIONS *options) {
+    BITMAP_SCOPE(TransposeBitMap);
+    if (!bitmap_can_rotate(bmp)) return -1;
+    ptrdiff_t stride;
+    uint32_t row_size = ROW_SIZE(bmp->info_header.bits_per_pixel, (uint32_t)bmp->info_header.bitmap_width);
+    const uint8_t *top = bitmap_top_row(bmp->pixels, bmp->info_header.bitmap_height, row_size, &stride);
+    return bitmap_transpose(bmp, top, stride, bmp->info_header.bits_per_pixel / 8, options);
+}
+
+/*
+* Rotates a bitmap clockwise. 90 and 270 degrees replace the pixels with a new buffer from the bitmap's
+* allocator, 180 degrees mirrors the rows in place and negates bitmap_height.
+* @param bmp bitmap with padded uncompressed pixel data, 24 or 32 bits per pixel
+* @param degrees 0, 90, 180 or 270
+* @param options scheduling options, NULL for defaults
+* @return 0 on success, -1 if the format or angle isn't supported or memory is exhausted
+*/
+int RotateBitMap(PBITMAP bmp, uint32_t degrees, const BITMAPTILEOPTIONS *options) {
+    BITMAP_SCOPE(RotateBitMap);
+    if (!bitmap_can_rotate(bmp)) return -1;
+    if (degrees == 0) return 0;
+    if (degrees == 180) return FlipBitMap(bmp, BITMAP_FLIP_HORIZONTAL | BITMAP_FLIP_VERTICAL, options);
+    if (degrees != 90 && degrees != 270) return -1;
+    int32_t height = bmp->info_header.bitmap_height;
+    uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    uint32_t width = (uint32_t)bmp->info_header.bitmap_width, pixel_size = bmp->info_header.bits_per_pixel / 8;
+    if (rows == 0 || width == 0) return bitmap_transpose(bmp, bmp->pixels, 0, 0, options);
+    ptrdiff_t stride;
+    const uint8_t *top = bitmap_top_row(bmp->pixels, height, ROW_SIZE(bmp->info_header.bits_per_pixel, width), &stride);
+    // 90: output (x, y) is input (y, rows - 1 - x). 270: output (x, y) is input (width - 1 - y, x)
+    if (degrees == 90) return bitmap_transpose(bmp, top + (ptrdiff_t)(rows - 1) * stride, -stride, pixel_size, options);
+    return bitmap_transpose(bmp, top + (size_t)(width - 1) * pixel_size, stride, -(ptrdiff_t)pixel_size, options);
+}
+
+/*
+* Resizing
+* ResizeBitMap runs a horizontal and a vertical pass of a separable filter. The output rows are split into
+* bands on the tile engine and every band filters only the source rows it needs, so a band's
+* intermediate rows stay in cache. Weights are 2.14 fixed point.
+*/
+typedef enum {
+    RESIZE_BOX,         // Average of the covered pixels
+    RESIZE_BILINEAR,    // Triangle filter, widened when downscaling
+    RESIZE_LANCZOS3     // Windowed sinc with 3 lobes
+} RESIZEFILTER;
+
+#define BITMAP_RESIZE_BITS 14
+
+// Taps of one output column or row
+typedef struct {
+    uint32_t    *first;     // First source pixel of each output pixel
+    uint32_t    *count;     // Number of taps of each output pixel
+    int16_t     *weights;   // taps weights per output pixel
+    uint32_t    taps;
+} BITMAPRESIZECOEFFS;
+
+static double bitmap_resize_filter(RESIZEFILTER filter, double x) {
+    if (x < 0) x = -x;
+    switch (filter) {
+    case RESIZE_BOX:
+        return x <= 0.5 ? 1.0 : 0.0;
+    case RESIZE_BILINEAR:
+        return x < 1.0 ? 1.0 - x : 0.0;
+    case RESIZE_LANCZOS3: {
+        if (x >= 3.0) return 0.0;
+        if (x < 1e-8) return 1.0;
+        const double pi = 3.14159265358979323846;
+        return 3.0 * sin(pi * x) * sin(pi * x / 3.0) / (pi * pi * x * x);
+    }
+    }
+    return 0.0;
+}
+
+static void bitmap_resize_free_coeffs(BITMAPRESIZECOEFFS *coeffs) {
+    free(coeffs->first);
+    free(coeffs->count);
+    free(coeffs->weights);
+}
+
+// Computes the taps that map in_size source pixels to out_size pixels
+static int bitmap_resize_coeffs(uint32_t in_size, uint32_t out_size, RESIZEFILTER filter, BITMAPRESIZECOEFFS *coeffs) {
+    double support = filter == RESIZE_BOX ? 0.5 : filter == RESIZE_BILINEAR ? 1.0 : 3.0;
+    double scale = (double)in_size / out_size;
+    double filter_scale = scale > 1.0 ? scale : 1.0;
+    support *= filter_scale;
+    coeffs->taps = (uint32_t)ceil(support) * 2 + 1;
+    if (coeffs->taps > in_size) coeffs->taps = in_size;
+    coeffs->first = (uint32_t *)bitmap_malloc(out_size * sizeof(uint32_t));
+    coeffs->count = (uint32_t *)bitmap_malloc(out_size * sizeof(uint32_t));
+    coeffs->weights = (int16_t *)bitmap_calloc((size_t)out_size * coeffs->taps, sizeof(int16_t));
+    double *w = (double *)bitmap_malloc(coeffs->taps * sizeof(double));
+    if (coeffs->first == NULL || coeffs->count == NULL || coeffs->weights == NULL || w == NULL) {
+        bitmap_resize_free_coeffs(coeffs);
+        free(w);
+        return -1;
+    }
+    for (uint32_t i = 0; i < out_size; ++i) {
+        double center = (i + 0.5) * scale;
+        int64_t lo = (int64_t)floor(center - support + 0.5), hi = (int64_t)floor(center + support + 0.5);
+        if (lo < 0) lo = 0;
+        if (hi > (int64_t)in_size) hi = in_size;
+        if (hi - lo > (int64_t)coeffs->taps) hi = lo + coeffs->taps;
+        if (hi <= lo) {
+            if (lo >= (int64_t)in_size) lo = in_size - 1;
+            hi = lo + 1;
+        }
+        uint32_t count = (uint32_t)(hi - lo);
+        double total = 0;
+        for (uint32_t k = 0; k < count; ++k) {
+            w[k] = bitmap_resize_filter(filter, ((double)lo + k + 0.5 - center) / filter_scale);
+            total += w[k];
+        }
+        if (total == 0) {
+            w[0] = total = 1;
+            count = 1;
+        }
+        // Round so the weights add up to exactly 1.0, the rounding error goes to the largest weight
+        int16_t *out = coeffs->weights + (size_t)i * coeffs->taps;
+        int32_t sum = 0;
+        uint32_t largest = 0;
+        for (uint32_t k = 0; k < count; ++k) {
+            out[k] = (int16_t)floor(w[k] / total * (1 << BITMAP_RESIZE_BITS) + 0.5);
+            sum += out[k];
+            if (out[k] > out[largest]) largest = k;
+        }
+        out[largest] = (int16_t)(out[largest] + (1 << BITMAP_RESIZE_BITS) - sum);
+        coeffs->first[i] = (uint32_t)lo;
+        coeffs->count[i] = count;
+    }
+    free(w);
+    return 0;
+}
+
+static inline uint8_t bitmap_resize_clamp(int32_t value) {
+    value = (value + (1 << (BITMAP_RESIZE_BITS - 1))) >> BITMAP_RESIZE_BITS;
+    return (uint8_t)(value < 0 ? 0 : value > 255 ? 255 : value);
+}
+
+// Filters one row horizontally
+static void bitmap_resize_row(const uint8_t *src, uint8_t *dst, uint32_t out_width, uint32_t pixel_size,
+                              const BITMAPRESIZECOEFFS *coeffs) {
+    for (uint32_t x = 0; x < out_width; ++x, dst += pixel_size) {
+        const int16_t *w = coeffs->weights + (size_t)x * coeffs->taps;
+        const uint8_t *p = src + (size_t)coeffs->first[x] * pixel_size;
+        uint32_t count = coeffs->count[x], k = 0;
+#ifdef BITMAP_HAVE_SSE2
+        if (pixel_size == 4) {
+            // Two taps per step: the channels of both pixels are interleaved and multiplied with (w0, w1) pairs
+            __m128i zero = _mm_setzero_si128(), sum = _mm_setzero_si128();
+            for (; k + 2 <= count; k += 2, p += 8) {
+                __m128i v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p), zero);
+                __m128i pairs = _mm_unpacklo_epi16(v, _mm_srli_si128(v, 8));
+                __m128i weights = _mm_set1_epi32((int32_t)((uint32_t)(uint16_t)w[k] | (uint32_t)(uint16_t)w[k + 1] << 16));
+                sum = _mm_add_epi32(sum, _mm_madd_epi16(pairs, weights));
+            }
+            int32_t acc[4];
+            _mm_storeu_si128((__m128i *)acc, sum);
+            for (; k < count; ++k, p += 4) {
+                for (int c = 0; c < 4; ++c) acc[c] += p[c] * w[k];
+            }
+            for (int c = 0; c < 4; ++c) dst[c] = bitmap_resize_clamp(acc[c]);
+            continue;
+        }
+#endif
+        int32_t acc[4] = { 0, 0, 0, 0 };
+        for (; k < count; ++k, p += pixel_size) {
+            for (uint32_t c = 0; c < pixel_size; ++c) acc[c] += p[c] * w[k];
+        }
+        for (uint32_t c = 0; c < pixel_size; ++c) dst[c] = bitmap_resize_clamp(acc[c]);
+    }
+}
+
+// Filters n rows vertically into one output row of bytes bytes
+static void bitmap_resize_column(const uint8_t *const *rows, const int16_t *w, uint32_t count, uint8_t *dst, uint32_t bytes) {
+    uint32_t i = 0;
+#ifdef BITMAP_HAVE_SSE2
+    __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi32(1 << (BITMAP_RESIZE_BITS - 1));
+    for (; i + 8 <= bytes; i += 8) {
+        __m128i lo = _mm_setzero_si128(), hi = _mm_setzero_si128();
+        uint32_t k = 0;
+        // Bytes of two rows are interleaved and multiplied with (w0, w1) pairs
+        for (; k + 2 <= count; k += 2) {
+            __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(rows[k] + i)), zero);
+            __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(rows[k + 1] + i)), zero);
+            __m128i weights = _mm_set1_epi32((int32_t)((uint32_t)(uint16_t)w[k] | (uint32_t)(uint16_t)w[k + 1] << 16));
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), weights));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), weights));
+        }
+        if (k < count) {
+            __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(rows[k] + i)), zero);
+            __m128i weights = _mm_set1_epi32((int32_t)(uint32_t)(uint16_t)w[k]);
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, zero), weights));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, zero), weights));
+        }
+        lo = _mm_srai_epi32(_mm_add_epi32(lo, round), BITMAP_RESIZE_BITS);
+        hi = _mm_srai_epi32(_mm_add_epi32(hi, round), BITMAP_RESIZE_BITS);
+        __m128i packed = _mm_packs_epi32(lo, hi);
+        _mm_storel_epi64((__m128i *)(dst + i), _mm_packus_epi16(packed, packed));
+    }
+#endif
+    for (; i < bytes; ++i) {
+        int32_t acc = 0;
+        for (uint32_t k = 0; k < count; ++k) acc += rows[k][i] * w[k];
+        dst[i] = bitmap_resize_clamp(acc);
+    }
+}
+
+typedef struct {
+    const uint8_t       *src;
+    uint8_t             *dst;
+    uint32_t            src_row_size;
+    uint32_t            dst_row_size;
+    uint32_t            dst_width;
+    uint32_t            pixel_size;
+    BITMAPRESIZECOEFFS  horizontal;
+    BITMAPRESIZECOEFFS  vertical;
+    int                 failed;
+} BITMAPRESIZE;
+
+static void bitmap_resize_band(void *context, uint32_t first_row, uint32_t n_rows) {
+    BITMAPRESIZE *r = (BITMAPRESIZE *)context;
+    const BITMAPRESIZECOEFFS *v = &r->vertical;
+    uint32_t lo = v->first[first_row], hi = lo;
+    for (uint32_t y = first_row; y < first_row + n_rows; ++y) {
+        if (v->first[y] + v->count[y] > hi) hi = v->first[y] + v->count[y];
+    }
+    // Horizontally filtered source rows lo to hi of this band
+    uint32_t bytes = r->dst_width * r->pixel_size;
+    uint8_t *temp = (uint8_t *)bitmap_malloc((size_t)(hi - lo) * bytes + 1);
+    const uint8_t **rows = (const uint8_t **)bitmap_malloc((v->taps ? v->taps : 1) * sizeof(uint8_t *));
+    if (temp == NULL || rows == NULL) {
+        free(temp);
+        free(rows);
+        r->failed = 1;
+        return;
+    }
+    for (uint32_t y = lo; y < hi; ++y) {
+        bitmap_resize_row(r->src + (size_t)y * r->src_row_size, temp + (size_t)(y - lo) * bytes, r->dst_width, r->pixel_size, &r->horizontal);
+    }
+    uint8_t *dst = r->dst + (size_t)first_row * r->dst_row_size;
+    for (uint32_t y = first_row; y < first_row + n_rows; ++y, dst += r->dst_row_size) {
+        for (uint32_t k = 0; k < v->count[y]; ++k) rows[k] = temp + (size_t)(v->first[y] + k - lo) * bytes;
+        bitmap_resize_column(rows, v->weights + (size_t)y * v->taps, v->count[y], dst, bytes);
+        memset(dst + bytes, 0, r->dst_row_size - bytes);
+    }
+    free(temp);
+    free(rows);
+}
+
+/*
+* Resizes a bitmap with a separable filter. The pixel buffer is replaced through the bitmap's allocator,
+* the row order (bottom-up or top-down) is kept. Channels are filtered independently, premultiply
+* 32 bit images with transparency first to avoid dark fringes.
+* @param bmp 24 or 32 bit bitmap with padded pixel data
+* @param width the new width
+* @param height the new number of rows
+* @param filter RESIZE_BOX, RESIZE_BILINEAR or RESIZE_LANCZOS3
+* @param options scheduling options, NULL for defaults
+* @return 0 on success, -1 if the bitmap isn't supported or memory is exhausted
+*/
+int ResizeBitMap(PBITMAP bmp, uint32_t width, uint32_t height, RESIZEFILTER filter, const BITMAPTILEOPTIONS *options) {
+    BITMAP_SCOPE(ResizeBitMap);
+    uint32_t pixel_size = bmp->info_header.bits_per_pixel / 8;
+    if ((pixel_size != 3 && pixel_size != 4) || bmp->pixels == NULL || bmp->info_header.bitmap_width <= 0 ||
+        bmp->info_header.bitmap_height == 0 || !bitmap_is_uncompressed(&bmp->info_header) ||
+        width == 0 || height == 0 || width > INT32_MAX || height > INT32_MAX) return -1;
+    int32_t src_height = bmp->info_header.bitmap_height;
+    uint32_t src_rows = src_height < 0 ? (uint32_t)-(int64_t)src_height : (uint32_t)src_height;
+    uint32_t src_width = (uint32_t)bmp->info_header.bitmap_width;
+
+    BITMAPRESIZE r;
+    memset(&r, 0, sizeof(r));
+    r.src = bmp->pixels;
+    r.src_row_size = ROW_SIZE(bmp->info_header.bits_per_pixel, src_width);
+    r.dst_row_size = ROW_SIZE(bmp->info_header.bits_per_pixel, width);
+    r.dst_width = width;
+    r.pixel_size = pixel_size;
+    BITMAP resized = *bmp;
+    if (bitmap_resize_coeffs(src_width, width, filter, &r.horizontal) != 0) return -1;
+    if (bitmap_resize_coeffs(src_rows, height, filter, &r.vertical) != 0) {
+        bitmap_resize_free_coeffs(&r.horizontal);
+        return -1;
+    }
+    if (bitmap_alloc_pixels(&resized, (size_t)r.dst_row_size * height, bmp->allocator.alloc ? &bmp->allocator : NULL) == NULL) {
+        r.failed = 1;
+    } else {
+        r.dst = resized.pixels;
+        // Bands are sized by the intermediate rows they filter. Neighbouring bands share the rows under the
+        // vertical taps, so a band is at least 4 times taller than that overlap
+        uint64_t per_row = (src_rows + height - 1) / height;
+        uint64_t row_cost = (uint64_t)width * pixel_size * per_row;
+        uint64_t budget = (options && options->band_bytes) ? options->band_bytes : 256 * 1024;
+        uint64_t band_rows = budget / row_cost, min_rows = (4 * (uint64_t)r.vertical.taps + per_row - 1) / per_row;
+        if (band_rows < min_rows) band_rows = min_rows;
+        BITMAPTILEOPTIONS bands;
+        memset(&bands, 0, sizeof(bands));
+        if (options) bands = *options;
+        bands.band_bytes = band_rows * row_cost < UINT32_MAX ? (uint32_t)(band_rows * row_cost) : UINT32_MAX;
+        RunBitMapBands(height, row_cost < UINT32_MAX ? (uint32_t)row_cost : UINT32_MAX, bitmap_resize_band, &r, &bands);
+    }
+    bitmap_resize_free_coeffs(&r.horizontal);
+    bitmap_resize_free_coeffs(&r.vertical);
+    if (r.failed) {
+        if (resized.pixels) bitmap_free_pixels(&resized);
+        return -1;
+    }
+    bitmap_free_pixels(bmp);
+    bmp->pixels = resized.pixels;
+    bmp->pixels_size = resized.pixels_size;
+    bmp->allocator = resized.allocator;
+    // Only the dimensions change, resolution, color space and masks stay as they were
+    bmp->info_header.bitmap_width = (int32_t)width;
+    bmp->info_header.bitmap_height = src_height < 0 ? -(int32_t)height : (int32_t)height;
+    bmp->info_header.image_size = IMAGE_SIZE(r.dst_row_size, height);
+    bmp->file_header.size = bmp->file_header.offset + bmp->info_header.image_size;
+    return 0;
+}
+
+/*
+* Power of two box downscaling of rows as they arrive, for example from ReadBitMapRows.
+* Only the sums of one output row are kept, never the full-resolution image.
+*/
+typedef struct {
+    uint32_t    width;          // Source width in pixels
+    uint32_t    out_width;
+    uint32_t    pixel_size;
+    uint32_t    shift;          // log2 of the factor
+    uint32_t    pending;        // Source rows summed into sums so far
+    uint32_t    *sums;          // out_width * pixel_size channel sums
+} BITMAPDOWNSCALER;
+
+/*
+* Prepares a downscaler.
+* @param downscaler receives the state
+* @param width source width in pixels
+* @param pixel_size bytes per pixel, every byte is averaged as one channel
+* @param factor 2, 4, 8, ... 256
+* @return 0 on success, -1 for an unsupported factor or exhausted memory. Free it with FreeBitMapDownscaler
+*/
+int InitBitMapDownscaler(BITMAPDOWNSCALER *downscaler, uint32_t width, uint32_t pixel_size, uint32_t factor) {
+    BITMAP_SCOPE(InitBitMapDownscaler);
+    memset(downscaler, 0, sizeof(*downscaler));
+    if (factor < 2 || factor > 256 || (factor & (factor - 1)) != 0 || pixel_size == 0 || pixel_size > 4) return -1;
+    while ((1u << downscaler->shift) < factor) ++downscaler->shift;
+    downscaler->width = width;
+    downscaler->out_width = (width + factor - 1) >> downscaler->shift;
+    downscaler->pixel_size = pixel_size;
+    downscaler->sums = (uint32_t *)bitmap_calloc((size_t)downscaler->out_width * pixel_size + 1, sizeof(uint32_t));
+    return downscaler->sums ? 0 : -1;
+}
+
+// Writes the averages of the pending rows and starts the next output row
+static void bitmap_downscale_emit(BITMAPDOWNSCALER *d, uint8_t *out) {
+    uint32_t factor = 1u << d->shift;
+    for (uint32_t x = 0; x < d->out_width; ++x) {
+        uint32_t columns = d->width - x * factor < factor ? d->width - x * factor : factor;
+        uint32_t n = columns * d->pending;
+        for (uint32_t c = 0; c < d->pixel_size; ++c) {
+            uint32_t *sum = &d->sums[x * d->pixel_size + c];
+            out[x * d->pixel_size + c] = (uint8_t)((*sum + n / 2) / n);
+            *sum = 0;
+        }
+    }
+    d->pending = 0;
+}
+
+/*
+* Adds a source row.
+* @param downscaler the downscaler
+* @param row width * pixel_size bytes
+* @param out receives an output row of out_width * pixel_size bytes when the function returns 1
+* @return 1 if out was written, 0 if more rows are needed
+*/
+int PushBitMapDownscalerRow(BITMAPDOWNSCALER *downscaler, const uint8_t *row, uint8_t *out) {
+    BITMAP_SCOPE(PushBitMapDownscalerRow);
+    uint32_t factor = 1u << downscaler->shift, pixel_size = downscaler->pixel_size;
+    uint32_t *sum = downscaler->sums;
+    uint32_t x = 0;
+    for (; x + factor <= downscaler->width; x += factor, sum += pixel_size) {
+        for (uint32_t k = 0; k < factor; ++k, row += pixel_size) {
+            for (uint32_t c = 0; c < pixel_size; ++c) sum[c] += row[c];
+        }
+    }
+    for (; x < downscaler->width; ++x, row += pixel_size) {
+        for (uint32_t c = 0; c < pixel_size; ++c) sum[c] += row[c];
+    }
+    if (++downscaler->pending < factor) return 0;
+    bitmap_downscale_emit(downscaler, out);
+    return 1;
+}
+
+/*
+* Writes the last output row when the number of source rows isn't a multiple of the factor.
+* @return 1 if out was written, 0 if no rows were pending
+*/
+int FlushBitMapDownscaler(BITMAPDOWNSCALER *downscaler, uint8_t *out) {
+    BITMAP_SCOPE(FlushBitMapDownscaler);
+    if (downscaler->pending == 0) return 0;
+    bitmap_downscale_emit(downscaler, out);
+    return 1;
+}
+
+void FreeBitMapDownscaler(BITMAPDOWNSCALER *downscaler) {
+    BITMAP_SCOPE(FreeBitMapDownscaler);
+    free(downscaler->sums);
+    downscaler->sums = NULL;
+}
+
+/*
+* Reads a bitmap file downscaled by a power of two. Rows are streamed and reduced as they are read,
+* so memory use is about one output image plus a few source rows.
+* @param file_name the path to an uncompressed 24 or 32 bit bitmap file
+* @param factor 2, 4, 8, ... 256
+* @param allocator allocator for the pixels, NULL for the default allocator
+* @return BITMAP of ceil(width / factor) by ceil(height / factor) pixels, pixels is NULL on failure
+*/
+BITMAP ReadBitMapDownscaled(const char *file_name, uint32_t factor, const BITMAPALLOCATOR *allocator) {
+    BITMAP_SCOPE(ReadBitMapDownscaled);
+    BITMAP bitmap;
+    memset(&bitmap, 0, sizeof(bitmap));
+    BITMAPSTREAM stream;
+    if (OpenBitMapStream(file_name, &stream) != 0) return bitmap;
+    uint32_t bits_per_pixel = stream.info_header.bits_per_pixel, pixel_size = bits_per_pixel / 8;
+    BITMAPDOWNSCALER downscaler;
+    if ((bits_per_pixel != 24 && bits_per_pixel != 32) || stream.info_header.bitmap_width <= 0 ||
+        InitBitMapDownscaler(&downscaler, (uint32_t)stream.info_header.bitmap_width, pixel_size, factor) != 0) {
+        CloseBitMapStream(&stream);
+        return bitmap;
+    }
+    uint32_t out_rows = (stream.rows + factor - 1) >> downscaler.shift;
+    int32_t height = stream.info_header.bitmap_height < 0 ? -(int32_t)out_rows : (int32_t)out_rows;
+    InitBitMapHeaders((int32_t)downscaler.out_width, height, (uint16_t)bits_per_pixel, stream.info_header.compression_method,
+                      &bitmap.file_header, &bitmap.info_header);
+    bitmap.info_header.red_mask = stream.info_header.red_mask;
+    bitmap.info_header.green_mask = stream.info_header.green_mask;
+    bitmap.info_header.blue_mask = stream.info_header.blue_mask;
+    bitmap.info_header.alpha_mask = stream.info_header.alpha_mask;
+    uint32_t out_row_size = ROW_SIZE(bits_per_pixel, downscaler.out_width);
+    // A chunk of source rows per read keeps the number of stdio calls low
+    uint32_t chunk = factor;
+    uint8_t *rows = (uint8_t *)bitmap_malloc((size_t)chunk * stream.row_bytes);
+    if (rows == NULL || bitmap_alloc_pixels(&bitmap, (size_t)out_row_size * out_rows + 1, allocator) == NULL) {
+        free(rows);
+        FreeBitMapDownscaler(&downscaler);
+        CloseBitMapStream(&stream);
+        memset(&bitmap, 0, sizeof(bitmap));
+        return bitmap;
+    }
+    memset(bitmap.pixels, 0, (size_t)out_row_size * out_rows);
+    uint8_t *out = bitmap.pixels;
+    uint32_t got;
+    while ((got = ReadBitMapRows(&stream, rows, chunk)) > 0) {
+        for (uint32_t i = 0; i < got; ++i) {
+            if (PushBitMapDownscalerRow(&downscaler, rows + (size_t)i * stream.row_bytes, out)) out += out_row_size;
+        }
+        if (got < chunk) break;
+    }
+    if (FlushBitMapDownscaler(&downscaler, out)) out += out_row_size;
+    int complete = stream.current_row == stream.rows;
+    free(rows);
+    FreeBitMapDownscaler(&downscaler);
+    CloseBitMapStream(&stream);
+    if (!complete) {
+        bitmap_free_pixels(&bitmap);
+        memset(&bitmap, 0, sizeof(bitmap));
+    }
+    return bitmap;
+}
+
+/*
+* Blitting
+* Copies or blends a rectangle of one bitmap onto another. Coordinates count rows from the top of
+* both images, so bottom-up and top-down bitmaps can be mixed.
+*/
+typedef enum {
+    BLIT_COPY,      // Replace the destination pixels. 24 bit sources get alpha 255, 24 bit destinations drop alpha
+    BLIT_SRC_OVER,  // Straight alpha blend, out = src * a + dst * (1 - a). The destination alpha becomes a + da * (1 - a)
+    BLIT_ADD        // Saturating add of src * a to the destination
+} BLITMODE;
+
+// x / 255 rounded, exact for x <= 65535 - 128
+#define BITMAP_DIV255(x) ((((x) + 128) + (((x) + 128) >> 8)) >> 8)
+
+// Blends one source pixel onto a destination pixel, sizes are 3 or 4 bytes
+static inline void bitmap_blend_pixel(uint8_t *d, uint32_t dst_size, const uint8_t *s, uint32_t src_size, BLITMODE mode) {
+    uint32_t a = src_size == 4 ? s[3] : 255;
+    if (mode == BLIT_ADD) {
+        for (int c = 0; c < 3; ++c) {
+            uint32_t v = d[c] + BITMAP_DIV255(s[c] * a);
+            d[c] = (uint8_t)(v > 255 ? 255 : v);
+        }
+        if (dst_size == 4) d[3] = (uint8_t)(d[3] + a > 255 ? 255 : d[3] + a);
+        return;
+    }
+    if (a == 0) return;
+    if (a == 255) {
+        d[0] = s[0];
+        d[1] = s[1];
+        d[2] = s[2];
+        if (dst_size == 4) d[3] = 255;
+        return;
+    }
+    for (int c = 0; c < 3; ++c) d[c] = (uint8_t)BITMAP_DIV255(s[c] * a + d[c] * (255 - a));
+    if (dst_size == 4) d[3] = (uint8_t)(a + BITMAP_DIV255(d[3] * (255 - a)));
+}
+
+static void bitmap_blend_row_scalar(uint8_t *dst, uint32_t dst_size, const uint8_t *src, uint32_t src_size, uint32_t width, BLITMODE mode) {
+    for (uint32_t x = 0; x < width; ++x, dst += dst_size, src += src_size) bitmap_blend_pixel(dst, dst_size, src, src_size, mode);
+}
+
+#ifdef BITMAP_HAVE_SSE2
+// src over for 4 BGRA pixels. Alpha is broadcast to the 16 bit lanes of its pixel
+static inline __m128i bitmap_over_sse2(__m128i s, __m128i d) {
+    const __m128i zero = _mm_setzero_si128(), full = _mm_set1_epi16(255), round = _mm_set1_epi16(128);
+    const __m128i alpha_lane = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0);
+    __m128i result[2];
+    for (int half = 0; half < 2; ++half) {
+        __m128i s16 = half ? _mm_unpackhi_epi8(s, zero) : _mm_unpacklo_epi8(s, zero);
+        __m128i d16 = half ? _mm_unpackhi_epi8(d, zero) : _mm_unpacklo_epi8(d, zero);
+        __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s16, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+        // The alpha lane computes a * 255 + da * (255 - a), which is a + da * (1 - a) after the division
+        __m128i sa = _mm_or_si128(_mm_andnot_si128(alpha_lane, s16), _mm_and_si128(alpha_lane, full));
+        __m128i t = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(sa, a), _mm_mullo_epi16(d16, _mm_sub_epi16(full, a))), round);
+        result[half] = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    }
+    return _mm_packus_epi16(result[0], result[1]);
+}
+
+// Saturating dst + src * a for 4 BGRA pixels, the alpha lane adds a
+static inline __m128i bitmap_add_sse2(__m128i s, __m128i d) {
+    const __m128i zero = _mm_setzero_si128(), round = _mm_set1_epi16(128);
+    const __m128i alpha_lane = _mm_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0), full = _mm_set1_epi16(255);
+    __m128i result[2];
+    for (int half = 0; half < 2; ++half) {
+        __m128i s16 = half ? _mm_unpackhi_epi8(s, zero) : _mm_unpacklo_epi8(s, zero);
+        __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s16, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+        __m128i sa = _mm_or_si128(_mm_andnot_si128(alpha_lane, s16), _mm_and_si128(alpha_lane, full));
+        __m128i t = _mm_add_epi16(_mm_mullo_epi16(sa, a), round);
+        result[half] = _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+    }
+    return _mm_adds_epu8(d, _mm_packus_epi16(result[0], result[1]));
+}
+
+// 32 bit onto 32 bit, 8 pixels per step. Groups that are fully opaque are copied, fully transparent ones skipped
+static uint32_t bitmap_blend_row_sse2(uint8_t *dst, const uint8_t *src, uint32_t width, BLITMODE mode) {
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000u), zero = _mm_setzero_si128();
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i s0 = _mm_loadu_si128((const __m128i *)(src + x * 4)), s1 = _mm_loadu_si128((const __m128i *)(src + x * 4 + 16));
+        if (mode == BLIT_SRC_OVER) {
+            __m128i a = _mm_and_si128(_mm_and_si128(s0, s1), alpha);
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(a, alpha)) == 0xFFFF) {
+                _mm_storeu_si128((__m128i *)(dst + x * 4), s0);
+                _mm_storeu_si128((__m128i *)(dst + x * 4 + 16), s1);
+                continue;
+            }
+            if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(_mm_or_si128(s0, s1), alpha), zero)) == 0xFFFF) continue;
+        }
+        __m128i d0 = _mm_loadu_si128((const __m128i *)(dst + x * 4)), d1 = _mm_loadu_si128((const __m128i *)(dst + x * 4 + 16));
+        if (mode == BLIT_SRC_OVER) {
+            d0 = bitmap_over_sse2(s0, d0);
+            d1 = bitmap_over_sse2(s1, d1);
+        } else {
+            d0 = bitmap_add_sse2(s0, d0);
+            d1 = bitmap_add_sse2(s1, d1);
+        }
+        _mm_storeu_si128((__m128i *)(dst + x * 4), d0);
+        _mm_storeu_si128((__m128i *)(dst + x * 4 + 16), d1);
+    }
+    return x;
+}
+#endif
+
+#ifdef BITMAP_HAVE_AVX2
+// AVX2 version of bitmap_blend_row_sse2, 16 pixels per step
+BITMAP_TARGET_AVX2 static uint32_t bitmap_blend_row_avx2(uint8_t *dst, const uint8_t *src, uint32_t width, BLITMODE mode) {
+    const __m256i alpha = _mm256_set1_epi32((int)0xFF000000u), zero = _mm256_setzero_si256();
+    const __m256i full = _mm256_set1_epi16(255), round = _mm256_set1_epi16(128);
+    const __m256i alpha_lane = _mm256_set_epi16(-1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0);
+    const __m256i spread = _mm256_setr_epi8(6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15,
+                                            6, 7, 6, 7, 6, 7, 6, 7, 14, 15, 14, 15, 14, 15, 14, 15);
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        for (int part = 0; part < 2; ++part) {
+            uint8_t *d = dst + (x + part * 8) * 4;
+            __m256i s = _mm256_loadu_si256((const __m256i *)(src + (x + part * 8) * 4));
+            __m256i sa8 = _mm256_and_si256(s, alpha);
+            if (mode == BLIT_SRC_OVER) {
+                if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(sa8, alpha)) == -1) {
+                    _mm256_storeu_si256((__m256i *)d, s);
+                    continue;
+                }
+                if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(sa8, zero)) == -1) continue;
+            }
+            __m256i dv = _mm256_loadu_si256((const __m256i *)d);
+            __m256i out[2];
+            for (int half = 0; half < 2; ++half) {
+                __m256i s16 = half ? _mm256_unpackhi_epi8(s, zero) : _mm256_unpacklo_epi8(s, zero);
+                __m256i a = _mm256_shuffle_epi8(s16, spread);
+                __m256i sa = _mm256_or_si256(_mm256_andnot_si256(alpha_lane, s16), _mm256_and_si256(alpha_lane, full));
+                __m256i t = _mm256_add_epi16(_mm256_mullo_epi16(sa, a), round);
+                if (mode == BLIT_SRC_OVER) {
+                    __m256i d16 = half ? _mm256_unpackhi_epi8(dv, zero) : _mm256_unpacklo_epi8(dv, zero);
+                    t = _mm256_add_epi16(t, _mm256_mullo_epi16(d16, _mm256_sub_epi16(full, a)));
+                }
+                out[half] = _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+            }
+            __m256i r = _mm256_packus_epi16(out[0], out[1]);
+            _mm256_storeu_si256((__m256i *)d, mode == BLIT_SRC_OVER ? r : _mm256_adds_epu8(dv, r));
+        }
+    }
+    return x;
+}
+#endif
+
+#if defined(BITMAP_HAVE_NEON)
+// NEON version of bitmap_blend_row_sse2, 8 deinterleaved pixels per step
+static uint32_t bitmap_blend_row_neon(uint8_t *dst, const uint8_t *src, uint32_t width, BLITMODE mode) {
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        uint8x8x4_t s = vld4_u8(src + x * 4);
+        if (mode == BLIT_SRC_OVER) {
+            uint64_t a = vget_lane_u64(vreinterpret_u64_u8(s.val[3]), 0);
+            if (a == UINT64_MAX) {
+                vst4_u8(dst + x * 4, s);
+                continue;
+            }
+            if (a == 0) continue;
+        }
+        uint8x8x4_t d = vld4_u8(dst + x * 4);
+        uint8x8_t a = s.val[3], inverse = vmvn_u8(a);
+        for (int c = 0; c < 4; ++c) {
+            uint8x8_t sc = c == 3 ? vdup_n_u8(255) : s.val[c];
+            uint16x8_t t = vmull_u8(sc, a);
+            if (mode == BLIT_SRC_OVER) t = vmlal_u8(t, d.val[c], inverse);
+            uint8x8_t v = vrshrn_n_u16(vrsraq_n_u16(t, t, 8), 8);
+            d.val[c] = mode == BLIT_SRC_OVER ? v : vqadd_u8(d.val[c], v);
+        }
+        vst4_u8(dst + x * 4, d);
+    }
+    return x;
+}
+#endif
+
+/*
+* Copies or blends a rectangle of src onto dst. The rectangle is clipped to both bitmaps.
+* @param dst 24 or 32 bit bitmap with padded pixel data
+* @param dx column of the destination rectangle, may be negative
+* @param dy row of the destination rectangle counted from the top, may be negative
+* @param src 24 or 32 bit BGR(A) bitmap with padded pixel data and straight alpha. May be dst for BLIT_COPY
+* @param sx column of the source rectangle
+* @param sy row of the source rectangle counted from the top
+* @param width width of the rectangle
+* @param height height of the rectangle
+* @param mode BLIT_COPY, BLIT_SRC_OVER or BLIT_ADD
+* @return 0 on success, -1 if a color depth isn't supported or src is dst for a blending mode
+*/
+int BlitBitMap(PBITMAP dst, int32_t dx, int32_t dy, PBITMAP src, int32_t sx, int32_t sy, uint32_t width, uint32_t height, BLITMODE mode) {
+    BITMAP_SCOPE(BlitBitMap);
+    uint32_t dst_size = dst->info_header.bits_per_pixel / 8, src_size = src->info_header.bits_per_pixel / 8;
+    if ((dst_size != 3 && dst_size != 4) || (src_size != 3 && src_size != 4) || dst->pixels == NULL || src->pixels == NULL ||
+        dst->info_header.bitmap_width < 0 || src->info_header.bitmap_width < 0 || (src->pixels == dst->pixels && mode != BLIT_COPY)) return -1;
+    int64_t dst_w = dst->info_header.bitmap_width, src_w = src->info_header.bitmap_width;
+    int64_t dst_h = dst->info_header.bitmap_height < 0 ? -(int64_t)dst->info_header.bitmap_height : dst->info_header.bitmap_height;
+    int64_t src_h = src->info_header.bitmap_height < 0 ? -(int64_t)src->info_header.bitmap_height : src->info_header.bitmap_height;
+
+    // Clip against the left and top edges of both images, then against the right and bottom edges
+    int64_t x0 = dx, y0 = dy, u0 = sx, v0 = sy, w = width, h = height;
+    if (x0 < 0) { u0 -= x0; w += x0; x0 = 0; }
+    if (y0 < 0) { v0 -= y0; h += y0; y0 = 0; }
+    if (u0 < 0) { x0 -= u0; w += u0; u0 = 0; }
+    if (v0 < 0) { y0 -= v0; h += v0; v0 = 0; }
+    if (w > dst_w - x0) w = dst_w - x0;
+    if (w > src_w - u0) w = src_w - u0;
+    if (h > dst_h - y0) h = dst_h - y0;
+    if (h > src_h - v0) h = src_h - v0;
+    if (w <= 0 || h <= 0) return 0;
+
+    ptrdiff_t dst_stride = ROW_SIZE(dst->info_header.bits_per_pixel, (uint32_t)dst_w);
+    ptrdiff_t src_stride = ROW_SIZE(src->info_header.bits_per_pixel, (uint32_t)src_w);
+    if (dst->info_header.bitmap_height > 0) dst_stride = -dst_stride;
+    if (src->info_header.bitmap_height > 0) src_stride = -src_stride;
+    uint8_t *d = bitmap_row(dst, (uint32_t)y0) + x0 * dst_size;
+    const uint8_t *s = bitmap_row(src, (uint32_t)v0) + u0 * src_size;
+    if (src->pixels == dst->pixels && (dst_stride > 0 ? d > s : d < s)) {
+        // Overlapping copy within one image where the destination is ahead in walking order,
+        // walk from the last row so no source row is overwritten before it is read
+        d += (h - 1) * dst_stride;
+        s += (h - 1) * src_stride;
+        dst_stride = -dst_stride;
+        src_stride = -src_stride;
+    }
+
+    int use_avx2 = 0;
+#ifdef BITMAP_HAVE_AVX2
+    use_avx2 = bitmap_cpu_has_avx2();
+#endif
+    (void)use_avx2;
+    uint32_t n = (uint32_t)w;
+    for (int64_t y = 0; y < h; ++y, d += dst_stride, s += src_stride) {
+        if (mode == BLIT_COPY) {
+            if (dst_size == src_size) {
+                memmove(d, s, (size_t)n * dst_size);
+            } else {
+                uint8_t *dp = d;
+                const uint8_t *sp = s;
+                for (uint32_t x = 0; x < n; ++x, dp += dst_size, sp += src_size) {
+                    dp[0] = sp[0];
+                    dp[1] = sp[1];
+                    dp[2] = sp[2];
+                    if (dst_size == 4) dp[3] = 255;
+                }
+            }
+            continue;
+        }
+        uint32_t x = 0;
+        if (dst_size == 4 && src_size == 4) {
+#ifdef BITMAP_HAVE_AVX2
+            if (use_avx2) x = bitmap_blend_row_avx2(d, s, n, mode);
+#endif
+#if defined(BITMAP_HAVE_SSE2)
+            x += bitmap_blend_row_sse2(d + x * 4, s + x * 4, n - x, mode);
+#elif defined(BITMAP_HAVE_NEON)
+            x = bitmap_blend_row_neon(d, s, n, mode);
+#endif
+        }
+        bitmap_blend_row_scalar(d + x * dst_size, dst_size, s + x * src_size, src_size, n - x, mode);
+    }
+    return 0;
+}
+
+/*
+* Header probing
+* Reads only the file header and the info header of a bitmap, with a single read.
+*/
+typedef struct {
+    int32_t     width;
+    int32_t     height;             // Negative for top-down images
+    uint16_t    bits_per_pixel;
+    uint32_t    compression;
+    uint32_t    header_size;        // 12, 40, 52, 56, 64, 108 or 124
+    uint32_t    offset;             // Start of the pixel array
+    uint32_t    file_size;          // Size stored in the file header
+    uint32_t    image_size;
+    uint32_t    n_colors_in_palette;
+} BITMAPPROBE;
+
+// Checks probed header bytes with the parser every reader uses and copies the fields of interest
+static int bitmap_parse_probe(const uint8_t *data, size_t size, BITMAPPROBE *probe) {
+    memset(probe, 0, sizeof(*probe));
+    BITMAPFILEHEADER file_header;
+    BITMAPV4HEADER info_header;
+    if (bitmap_parse_headers(data, size, &file_header, &info_header) != BITMAP_OK) return -1;
+    probe->width = info_header.bitmap_width;
+    probe->height = info_header.bitmap_height;
+    probe->bits_per_pixel = info_header.bits_per_pixel;
+    probe->compression = info_header.compression_method;
+    probe->header_size = info_header.header_size;
+    probe->offset = file_header.offset;
+    probe->file_size = file_header.size;
+    probe->image_size = info_header.image_size;
+    probe->n_colors_in_palette = info_header.n_colors_in_palette;
+    return 0;
+}
+
+/*
+* Reads the headers of a bitmap file and checks them. Much cheaper than ReadBitMap or MapBitMap
+* when only the dimensions and format are needed. The headers pass the same checks as in ReadBitMapChecked,
+* only the pixel array isn't checked against the file size.
+* @param file_name the path to a bitmap file
+* @param probe receives the header values
+* @return 0 on success, -1 if the file can't be read or has no valid headers
+*/
+int ProbeBitMap(const char *file_name, BITMAPPROBE *probe) {
+    BITMAP_SCOPE(ProbeBitMap);
+    uint8_t data[BITMAP_HEADERS_SIZE];
+    size_t size;
+#ifdef _WIN32
+    FILE *bitmap_file = bitmap_fopen(file_name, "rb");
+    if (bitmap_file == NULL) {
+        memset(probe, 0, sizeof(*probe));
+        return -1;
+    }
+    size = bitmap_fread(data, 1, sizeof(data), bitmap_file);
+    fclose(bitmap_file);
+#else
+    int fd = bitmap_open(file_name, O_RDONLY);
+    if (fd < 0) {
+        memset(probe, 0, sizeof(*probe));
+        return -1;
+    }
+    ssize_t got = bitmap_pread(fd, data, sizeof(data), 0);
+    close(fd);
+    size = got < 0 ? 0 : (size_t)got;
+#endif
+    return bitmap_parse_probe(data, size, probe);
+}
+
+/*
+* Metadata of many files, one array per field. Entry i belongs to the i-th path given to ProbeBitMaps
+*/
+typedef struct {
+    size_t      count;
+    int32_t     *width;
+    int32_t     *height;
+    uint16_t    *bits_per_pixel;
+    uint32_t    *compression;
+    uint32_t    *offset;
+    int8_t      *status;            // 0 = probed, -1 = unreadable or invalid
+} BITMAPPROBETABLE;
+
+/*
+* Frees the arrays of a metadata table.
+*/
+void FreeBitMapProbeTable(BITMAPPROBETABLE *table) {
+    BITMAP_SCOPE(FreeBitMapProbeTable);
+    free(table->width);
+    free(table->height);
+    free(table->bits_per_pixel);
+    free(table->compression);
+    free(table->offset);
+    free(table->status);
+    memset(table, 0, sizeof(*table));
+}
+
+/*
+* Allocates a metadata table for count files.
+* @return 0 on success, -1 if memory is exhausted. Release it with FreeBitMapProbeTable
+*/
+int AllocBitMapProbeTable(BITMAPPROBETABLE *table, size_t count) {
+    BITMAP_SCOPE(AllocBitMapProbeTable);
+    memset(table, 0, sizeof(*table));
+    size_t n = count ? count : 1;
+    table->count = count;
+    table->width = (int32_t *)bitmap_malloc(n * sizeof(int32_t));
+    table->height = (int32_t *)bitmap_malloc(n * sizeof(int32_t));
+    table->bits_per_pixel = (uint16_t *)bitmap_malloc(n * sizeof(uint16_t));
+    table->compression = (uint32_t *)bitmap_malloc(n * sizeof(uint32_t));
+    table->offset = (uint32_t *)bitmap_malloc(n * sizeof(uint32_t));
+    table->status = (int8_t *)bitmap_malloc(n * sizeof(int8_t));
+    if (!table->width || !table->height || !table->bits_per_pixel || !table->compression || !table->offset || !table->status) {
+        FreeBitMapProbeTable(table);
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    const char *const   *paths;
+    BITMAPPROBETABLE    *table;
+} BITMAPPROBEBATCH;
+
+#define BITMAP_PROBE_CHUNK 32
+
+static void bitmap_probe_chunk(void *context, uint32_t index) {
+    BITMAPPROBEBATCH *batch = (BITMAPPROBEBATCH *)context;
+    size_t end = ((size_t)index + 1) * BITMAP_PROBE_CHUNK;
+    if (end > batch->table->count) end = batch->table->count;
+    for (size_t i = (size_t)index * BITMAP_PROBE_CHUNK; i < end; ++i) {
+        BITMAPPROBE probe;
+        BITMAPPROBETABLE *t = batch->table;
+        t->status[i] = (int8_t)ProbeBitMap(batch->paths[i], &probe);
+        t->width[i] = probe.width;
+        t->height[i] = probe.height;
+        t->bits_per_pixel[i] = probe.bits_per_pixel;
+        t->compression[i] = probe.compression;
+        t->offset[i] = probe.offset;
+    }
+}
+
+/*
+* Probes many files concurrently on a thread pool, so the opens and reads of different files overlap.
+* @param paths table->count file paths
+* @param table table from AllocBitMapProbeTable
+* @param options pool or executor to run on, NULL for the shared pool. band_bytes is ignored
+* @return the number of files that were probed successfully
+*/
+size_t ProbeBitMaps(const char *const *paths, BITMAPPROBETABLE *table, const BITMAPTILEOPTIONS *options) {
+    BITMAP_SCOPE(ProbeBitMaps);
+    BITMAPPROBEBATCH batch = { paths, table };
+    uint32_t n_chunks = (uint32_t)((table->count + BITMAP_PROBE_CHUNK - 1) / BITMAP_PROBE_CHUNK);
+    if (options && options->executor) options->executor->run(options->executor->executor, bitmap_probe_chunk, &batch, n_chunks);
+    else RunBitMapTasks((options && options->pool) ? options->pool : GetBitMapThreadPool(), bitmap_probe_chunk, &batch, n_chunks);
+    size_t ok = 0;
+    for (size_t i = 0; i < table->count; ++i) ok += table->status[i] == 0;
+    return ok;
+}
+
+/*
+* Region reads
+* Coordinates are top-down (y = 0 is the top row) for both file orientations. The region keeps the
+* orientation of its source, and its stored rows are one contiguous run of the source's stored rows.
+*/
+
+// Clips a region and returns the first stored source row of it, -1 if nothing is left or the format isn't supported
+static int64_t bitmap_region_rows(const BITMAPV4HEADER *info_header, uint32_t x, uint32_t y, uint32_t *width, uint32_t *height) {
+    uint32_t bits_per_pixel = info_header->bits_per_pixel;
+    if ((bits_per_pixel != 8 && bits_per_pixel != 16 && bits_per_pixel != 24 && bits_per_pixel != 32) ||
+        (info_header->compression_method != BI_RGB && info_header->compression_method != BI_BITFIELDS &&
+         info_header->compression_method != BI_ALPHABITFIELDS) || info_header->bitmap_width <= 0) return -1;
+    uint32_t image_width = (uint32_t)info_header->bitmap_width;
+    int32_t image_height = info_header->bitmap_height;
+    uint32_t rows = image_height < 0 ? (uint32_t)-(int64_t)image_height : (uint32_t)image_height;
+    if (x >= image_width || y >= rows) return -1;
+    if (*width > image_width - x) *width = image_width - x;
+    if (*height > rows - y) *height = rows - y;
+    if (*width == 0 || *height == 0) return -1;
+    // Bottom-up files store the lowest region row first
+    return image_height < 0 ? (int64_t)y : (int64_t)rows - y - *height;
+}
+
+#ifndef _WIN32
+static int bitmap_pread_all(int fd, uint8_t *buffer, size_t size, uint64_t offset) {
+    while (size > 0) {
+        ssize_t got = bitmap_pread(fd, buffer, size, (off_t)offset);
+        if (got <= 0) return -1;
+        buffer += got;
+        size -= (size_t)got;
+        offset += (uint64_t)got;
+    }
+    return 0;
+}
+#endif
+
+/*
+* Reads a rectangle of an uncompressed bitmap file. Only the rows of the rectangle are read and of
+* every row only the requested columns, so the cost depends on the region and not on the image.
+* @param file_name the path to a bitmap file with 8, 16, 24 or 32 bits per pixel
+* @param x left column
+* @param y top row, counted from the top for bottom-up and top-down files
+* @param width width of the region, clipped to the image
+* @param height height of the region, clipped to the image
+* @return BITMAP with the region as padded pixel data, matching headers and the palette of 8 bit files, pixels is NULL on failure
+*/
+BITMAP ReadBitMapRegion(const char *file_name, uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+    BITMAP_SCOPE(ReadBitMapRegion);
+    BITMAP region;
+    memset(&region, 0, sizeof(region));
+    BITMAPFILEHEADER file_header;
+    BITMAPV4HEADER info_header;
+    uint8_t data[BITMAP_HEADERS_SIZE];
+#ifdef _WIN32
+    FILE *bitmap_file = bitmap_fopen(file_name, "rb");
+    if (bitmap_file == NULL) return region;
+    size_t got = bitmap_fread(data, 1, sizeof(data), bitmap_file);
+#else
+    int fd = bitmap_open(file_name, O_RDONLY);
+    if (fd < 0) return region;
+    ssize_t got = bitmap_pread(fd, data, sizeof(data), 0);
+#endif
+    int64_t first = -1;
+    uint64_t file_size = 0;
+#ifdef _WIN32
+    int sized = got > 0 && bitmap_file_size(bitmap_file, &file_size) == BITMAP_OK;
+#else
+    struct stat st;
+    int sized = got > 0 && fstat(fd, &st) == 0;
+    if (sized) file_size = (uint64_t)st.st_size;
+#endif
+    // The pixel array must fit the file and its sizes 32 bits before any of them is used
+    if (sized && bitmap_parse_headers(data, (size_t)got, &file_header, &info_header) == BITMAP_OK && info_header.header_size != 12 &&
+        bitmap_check_pixel_array(&file_header, &info_header, file_size) == BITMAP_OK) {
+        first = bitmap_region_rows(&info_header, x, y, &width, &height);
+    }
+    if (first >= 0) {
+        uint32_t pixel_size = info_header.bits_per_pixel / 8;
+        uint64_t src_stride = ROW_SIZE((uint64_t)info_header.bits_per_pixel, (uint32_t)info_header.bitmap_width);
+        InitBitMapHeaders((int32_t)width, info_header.bitmap_height < 0 ? -(int32_t)height : (int32_t)height,
+                          info_header.bits_per_pixel, info_header.compression_method, &region.file_header, &region.info_header);
+        if (info_header.compression_method == BI_BITFIELDS || info_header.compression_method == BI_ALPHABITFIELDS) {
+            region.info_header.red_mask = info_header.red_mask;
+            region.info_header.green_mask = info_header.green_mask;
+            region.info_header.blue_mask = info_header.blue_mask;
+            region.info_header.alpha_mask = info_header.alpha_mask;
+        }
+        uint64_t dst_stride = ROW_SIZE((uint64_t)info_header.bits_per_pixel, width);
+        size_t span = (size_t)width * pixel_size;
+        uint64_t start = file_header.offset + (uint64_t)first * src_stride + (uint64_t)x * pixel_size;
+        int result = 0;
+        if (bitmap_alloc_pixels(&region, (size_t)(dst_stride * height), NULL) == NULL) {
+            result = -1;
+        } else if (x == 0 && width == (uint32_t)info_header.bitmap_width) {
+            // Full rows: one read. The padding of the last row in the file may be missing
+            size_t size = (size_t)(dst_stride * height);
+            int32_t image_height = info_header.bitmap_height;
+            uint64_t image_rows = image_height < 0 ? (uint64_t)-(int64_t)image_height : (uint64_t)image_height;
+            size_t tail = (uint64_t)first + height == image_rows ? (size_t)dst_stride - span : 0;
+            memset(region.pixels + size - tail, 0, tail);
+#ifdef _WIN32
+            result = (_fseeki64(bitmap_file, (int64_t)start, SEEK_SET) != 0 ||
+                      bitmap_fread(region.pixels, 1, size - tail, bitmap_file) != size - tail) ? -1 : 0;
+#else
+            result = bitmap_pread_all(fd, region.pixels, size - tail, start);
+#endif
+        } else {
+            for (uint32_t i = 0; result == 0 && i < height; ++i) {
+                uint8_t *dst = region.pixels + (size_t)(i * dst_stride);
+                memset(dst + span, 0, (size_t)dst_stride - span);
+#ifdef _WIN32
+                result = (_fseeki64(bitmap_file, (int64_t)(start + (uint64_t)i * src_stride), SEEK_SET) != 0 ||
+                          bitmap_fread(dst, 1, span, bitmap_file) != span) ? -1 : 0;
+#else
+                result = bitmap_pread_all(fd, dst, span, start + (uint64_t)i * src_stride);
+#endif
+            }
+        }
+        // The color table of 8 bit files, like bitmap_read_palette a missing or short table is left out
+        uint32_t entry_size, n_colors = bitmap_palette_colors(&file_header, &info_header, &entry_size);
+        if (result == 0 && n_colors > 0) {
+            uint64_t palette_start = (uint64_t)sizeof(BITMAPFILEHEADER) + info_header.header_size;
+            BITMAP_STAT_ALLOC();
+            region.palette = (uint8_t *)region.allocator.alloc((size_t)n_colors * 4, sizeof(uint32_t), region.allocator.user);
+            if (region.palette) {
+                region.palette_colors = n_colors;
+#ifdef _WIN32
+                int missing = _fseeki64(bitmap_file, (int64_t)palette_start, SEEK_SET) != 0 ||
+                              bitmap_fread(region.palette, entry_size, n_colors, bitmap_file) != n_colors;
+#else
+                int missing = bitmap_pread_all(fd, region.palette, (size_t)n_colors * entry_size, palette_start) != 0;
+#endif
+                if (missing) {
+                    bitmap_free_palette(&region);
+                } else {
+                    bitmap_widen_palette(region.palette, n_colors, entry_size);
+                }
+            }
+        }
+        bitmap_normalize_headers(&region);
+        if (result != 0 && region.pixels) bitmap_free_pixels(&region);
+    }
+#ifdef _WIN32
+    fclose(bitmap_file);
+#else
+    close(fd);
+#endif
+    return region;
+}
+
+/*
+* Copies a rectangle out of a mapped bitmap. See ReadBitMapRegion for the coordinates and row order.
+* @param view view from MapBitMap, 8, 16, 24 or 32 bits per pixel
+* @param x left column
+* @param y top row
+* @param width width of the region, clipped to the image
+* @param height height of the region, clipped to the image
+* @param dst receives the region rows
+* @param dst_stride bytes per row in dst, at least width * bytes per pixel
+* @return 0 on success, -1 if the region is empty or the format isn't supported
+*/
+int CopyBitMapViewRegion(const BITMAPVIEW *view, uint32_t x, uint32_t y, uint32_t width, uint32_t height, uint8_t *dst, size_t dst_stride) {
+    BITMAP_SCOPE(CopyBitMapViewRegion);
+    int64_t first = bitmap_region_rows(&view->info_header, x, y, &width, &height);
+    if (first < 0) return -1;
+    uint32_t pixel_size = view->info_header.bits_per_pixel / 8;
+    size_t span = (size_t)width * pixel_size;
+    if (dst_stride < span) return -1;
+    const uint8_t *src = view->pixels + (size_t)first * view->stride + (size_t)x * pixel_size;
+    for (uint32_t i = 0; i < height; ++i, src += view->stride, dst += dst_stride) memcpy(dst, src, span);
+    return 0;
+}
+
+/*
+* Image comparison and pixel hashes
+* Both work on the pixel rows only, so padding bytes, headers and the stored row order don't matter.
+*/
+typedef struct {
+    int         identical;      // 1 if every pixel matches
+    uint32_t    channels;       // Bytes per pixel. Channel i is byte i of a pixel, B, G, R, A for 32 bit images
+    uint64_t    changed_pixels; // Pixels with at least one different channel
+    uint8_t     max_diff[4];    // Largest absolute difference per channel
+    double      mean_diff[4];   // Mean absolute difference per channel over all pixels
+    double      psnr;           // Peak signal to noise ratio over all channels in dB, INFINITY if identical
+    uint32_t    x;              // Bounding box of the changed pixels, y counted from the top. All 0 if identical
+    uint32_t    y;
+    uint32_t    width;
+    uint32_t    height;
+} BITMAPDIFFSTATS;
+
+// Differences of a band of rows, merged into the totals when the band is done
+typedef struct {
+    uint64_t    sum[4];
+    uint64_t    sum_squares;
+    uint8_t     max[4];
+    uint64_t    changed;
+    uint32_t    min_x, max_x, min_y, max_y;
+} BITMAPDIFFPARTIAL;
+
+typedef struct {
+    const uint8_t       *a_top;     // Top rows of both images
+    const uint8_t       *b_top;
+    ptrdiff_t           a_stride;   // Bytes from one row to the one below it
+    ptrdiff_t           b_stride;
+    uint32_t            row_bytes;  // Unpadded bytes per row
+    uint32_t            pixel_size;
+    BITMAP_MUTEX        mutex;
+    BITMAPDIFFPARTIAL   total;
+} BITMAPCOMPARE;
+
+static inline uint32_t bitmap_ctz32(uint32_t v) {
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, v);
+    return (uint32_t)index;
+#else
+    return (uint32_t)__builtin_ctz(v);
+#endif
+}
+
+static inline void bitmap_diff_pixel(BITMAPDIFFPARTIAL *p, uint32_t x, uint32_t y, uint32_t *last_x) {
+    if (x == *last_x) return;
+    *last_x = x;
+    p->changed++;
+    if (x < p->min_x) p->min_x = x;
+    if (x > p->max_x) p->max_x = x;
+    if (y < p->min_y) p->min_y = y;
+    if (y > p->max_y) p->max_y = y;
+}
+
+static void bitmap_compare_row_scalar(const uint8_t *a, const uint8_t *b, uint32_t offset, uint32_t row_bytes,
+                                      uint32_t pixel_size, uint32_t y, uint32_t *last_x, BITMAPDIFFPARTIAL *p) {
+    for (uint32_t i = offset; i < row_bytes; ++i) {
+        if (a[i] == b[i]) continue;
+        uint32_t d = a[i] > b[i] ? (uint32_t)(a[i] - b[i]) : (uint32_t)(b[i] - a[i]);
+        uint32_t c = i % pixel_size;
+        p->sum[c] += d;
+        p->sum_squares += d * d;
+        if (d > p->max[c]) p->max[c] = (uint8_t)d;
+        bitmap_diff_pixel(p, i / pixel_size, y, last_x);
+    }
+}
+
+#ifdef BITMAP_HAVE_SSE2
+static inline uint64_t bitmap_sum_epi32(__m128i v) {
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, v);
+    return (uint64_t)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+}
+
+// Adds the 32 bit lane sums to the channel totals and clears them
+static inline void bitmap_fold_diff_lanes(__m128i (*sum)[4], uint32_t phases, uint32_t pixel_size, BITMAPDIFFPARTIAL *p) {
+    for (uint32_t k = 0; k < phases; ++k) {
+        uint32_t lane_sum[16];
+        for (uint32_t j = 0; j < 4; ++j) {
+            _mm_storeu_si128((__m128i *)(lane_sum + j * 4), sum[k][j]);
+            sum[k][j] = _mm_setzero_si128();
+        }
+        for (uint32_t lane = 0; lane < 16; ++lane) p->sum[(k * 16 + lane) % pixel_size] += lane_sum[lane];
+    }
+}
+
+/*
+* Equal 16 byte blocks are skipped after one compare. Differing blocks add their absolute differences to
+* per byte lane sums, a 24 bit row repeats its channel pattern every 3 blocks so it keeps 3 sets of lanes.
+* Lane sums are folded into 64 bit totals every 4096 differing blocks, so any row length is safe.
+* Returns the number of bytes handled.
+*/
+static uint32_t bitmap_compare_row_sse2(const uint8_t *a, const uint8_t *b, uint32_t row_bytes, uint32_t pixel_size,
+                                        uint32_t y, uint32_t *last_x, BITMAPDIFFPARTIAL *p) {
+    uint32_t phases = pixel_size == 3 ? 3 : 1;
+    __m128i sum[3][4], max[3];
+    __m128i squares = _mm_setzero_si128();
+    const __m128i zero = _mm_setzero_si128();
+    for (uint32_t k = 0; k < phases; ++k) {
+        max[k] = zero;
+        for (uint32_t j = 0; j < 4; ++j) sum[k][j] = zero;
+    }
+    uint32_t n = row_bytes & ~(uint32_t)15, pending = 0, phase = 0;
+    for (uint32_t i = 0; i < n; i += 16, phase = phase + 1 == phases ? 0 : phase + 1) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) ^ 0xffff;
+        if (mask == 0) continue;
+        __m128i d = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+        __m128i lo = _mm_unpacklo_epi8(d, zero), hi = _mm_unpackhi_epi8(d, zero);
+        max[phase] = _mm_max_epu8(max[phase], d);
+        sum[phase][0] = _mm_add_epi32(sum[phase][0], _mm_unpacklo_epi16(lo, zero));
+        sum[phase][1] = _mm_add_epi32(sum[phase][1], _mm_unpackhi_epi16(lo, zero));
+        sum[phase][2] = _mm_add_epi32(sum[phase][2], _mm_unpacklo_epi16(hi, zero));
+        sum[phase][3] = _mm_add_epi32(sum[phase][3], _mm_unpackhi_epi16(hi, zero));
+        squares = _mm_add_epi32(squares, _mm_add_epi32(_mm_madd_epi16(lo, lo), _mm_madd_epi16(hi, hi)));
+        for (; mask; mask &= mask - 1) bitmap_diff_pixel(p, (i + bitmap_ctz32(mask)) / pixel_size, y, last_x);
+        // A 32 bit square lane grows by at most 4 * 255^2 per block and a sum lane by 255, fold them before they can overflow
+        if (++pending == 4096) {
+            p->sum_squares += bitmap_sum_epi32(squares);
+            squares = zero;
+            bitmap_fold_diff_lanes(sum, phases, pixel_size, p);
+            pending = 0;
+        }
+    }
+    p->sum_squares += bitmap_sum_epi32(squares);
+    bitmap_fold_diff_lanes(sum, phases, pixel_size, p);
+    for (uint32_t k = 0; k < phases; ++k) {
+        uint8_t lane_max[16];
+        _mm_storeu_si128((__m128i *)lane_max, max[k]);
+        for (uint32_t lane = 0; lane < 16; ++lane) {
+            uint32_t c = (k * 16 + lane) % pixel_size;
+            if (lane_max[lane] > p->max[c]) p->max[c] = lane_max[lane];
+        }
+    }
+    return n;
+}
+#endif
+
+static void bitmap_compare_band(void *context, uint32_t first_row, uint32_t n_rows) {
+    BITMAPCOMPARE *cmp = (BITMAPCOMPARE *)context;
+    BITMAPDIFFPARTIAL p;
+    memset(&p, 0, sizeof(p));
+    p.min_x = p.min_y = UINT32_MAX;
+    const uint8_t *a = cmp->a_top + (ptrdiff_t)first_row * cmp->a_stride;
+    const uint8_t *b = cmp->b_top + (ptrdiff_t)first_row * cmp->b_stride;
+    for (uint32_t y = first_row; y < first_row + n_rows; ++y) {
+        // Rows are usually equal, memcmp is the fastest way to find out
+        if (memcmp(a, b, cmp->row_bytes) != 0) {
+            uint32_t last_x = UINT32_MAX, x = 0;
+#ifdef BITMAP_HAVE_SSE2
+            x = bitmap_compare_row_sse2(a, b, cmp->row_bytes, cmp->pixel_size, y, &last_x, &p);
+#endif
+            bitmap_compare_row_scalar(a, b, x, cmp->row_bytes, cmp->pixel_size, y, &last_x, &p);
+        }
+        if (y + 1 < first_row + n_rows) {
+            a += cmp->a_stride;
+            b += cmp->b_stride;
+        }
+    }
+    if (p.changed == 0) return;
+    bitmap_mutex_lock(&cmp->mutex);
+    BITMAPDIFFPARTIAL *t = &cmp->total;
+    for (uint32_t c = 0; c < 4; ++c) {
+        t->sum[c] += p.sum[c];
+        if (p.max[c] > t->max[c]) t->max[c] = p.max[c];
+    }
+    t->sum_squares += p.sum_squares;
+    t->changed += p.changed;
+    if (p.min_x < t->min_x) t->min_x = p.min_x;
+    if (p.max_x > t->max_x) t->max_x = p.max_x;
+    if (p.min_y < t->min_y) t->min_y = p.min_y;
+    if (p.max_y > t->max_y) t->max_y = p.max_y;
+    bitmap_mutex_unlock(&cmp->mutex);
+}
+
+/*
+* Compares the pixels of two mapped bitmaps. Rows are compared in parallel straight from the mappings,
+* padding bytes are ignored and the images may be stored in different row orders.
+* @param a view from MapBitMap, uncompressed with 8, 16, 24 or 32 bits per pixel
+* @param b view with the same width, number of rows and color depth as a
+* @param stats receives the result
+* @param options scheduling options, NULL for defaults
+* @return 0 if the images were compared (see stats->identical), -1 if they can't be compared
+*/
+int CompareBitMaps(const BITMAPVIEW *a, const BITMAPVIEW *b, BITMAPDIFFSTATS *stats, const BITMAPTILEOPTIONS *options) {
+    BITMAP_SCOPE(CompareBitMaps);
+    memset(stats, 0, sizeof(*stats));
+    uint32_t bits_per_pixel = a->info_header.bits_per_pixel;
+    if (bits_per_pixel % 8 != 0 || bits_per_pixel == 0 || bits_per_pixel > 32 || bits_per_pixel != b->info_header.bits_per_pixel ||
+        a->info_header.bitmap_width < 0 || a->info_header.bitmap_width != b->info_header.bitmap_width ||
+        !bitmap_is_uncompressed(&a->info_header) || !bitmap_is_uncompressed(&b->info_header)) return -1;
+    int32_t height_a = a->info_header.bitmap_height, height_b = b->info_header.bitmap_height;
+    uint32_t rows = height_a < 0 ? (uint32_t)-(int64_t)height_a : (uint32_t)height_a;
+    if (rows != (height_b < 0 ? (uint32_t)-(int64_t)height_b : (uint32_t)height_b)) return -1;
+
+    uint32_t width = (uint32_t)a->info_header.bitmap_width;
+    BITMAPCOMPARE cmp;
+    memset(&cmp, 0, sizeof(cmp));
+    cmp.a_top = bitmap_top_row(a->pixels, height_a, a->stride, &cmp.a_stride);
+    cmp.b_top = bitmap_top_row(b->pixels, height_b, b->stride, &cmp.b_stride);
+    cmp.pixel_size = bits_per_pixel / 8;
+    cmp.row_bytes = width * cmp.pixel_size;
+    cmp.total.min_x = cmp.total.min_y = UINT32_MAX;
+    bitmap_mutex_init(&cmp.mutex);
+    RunBitMapBands(rows, cmp.row_bytes, bitmap_compare_band, &cmp, options);
+    bitmap_mutex_destroy(&cmp.mutex);
+
+    stats->channels = cmp.pixel_size;
+    stats->changed_pixels = cmp.total.changed;
+    stats->identical = cmp.total.changed == 0;
+    uint64_t pixels = (uint64_t)width * rows;
+    for (uint32_t c = 0; c < cmp.pixel_size; ++c) {
+        stats->max_diff[c] = cmp.total.max[c];
+        stats->mean_diff[c] = pixels ? (double)cmp.total.sum[c] / (double)pixels : 0.0;
+    }
+    if (stats->identical) {
+        stats->psnr = INFINITY;
+        return 0;
+    }
+    double mse = (double)cmp.total.sum_squares / ((double)pixels * cmp.pixel_size);
+    stats->psnr = 10.0 * log10(255.0 * 255.0 / mse);
+    stats->x = cmp.total.min_x;
+    stats->y = cmp.total.min_y;
+    stats->width = cmp.total.max_x - cmp.total.min_x + 1;
+    stats->height = cmp.total.max_y - cmp.total.min_y + 1;
+    return 0;
+}
+
+/*
+* Maps two bitmap files and compares their pixels with CompareBitMaps
+* @return 0 if the images were compared (see stats->identical), -1 if a file can't be mapped or the images can't be compared
+*/
+int CompareBitMapFiles(const char *file_a, const char *file_b, BITMAPDIFFSTATS *stats, const BITMAPTILEOPTIONS *options) {
+    BITMAP_SCOPE(CompareBitMapFiles);
+    BITMAPVIEW a, b;
+    memset(stats, 0, sizeof(*stats));
+    if (MapBitMap(file_a, &a) != 0) return -1;
+    if (MapBitMap(file_b, &b) != 0) {
+        UnmapBitMap(&a);
+        return -1;
+    }
+    int result = CompareBitMaps(&a, &b, stats, options);
+    UnmapBitMap(&a);
+    UnmapBitMap(&b);
+    return result;
+}
+
+/*
+* XXH64 (xxHash, 64 bit variant), fed incrementally so rows can be hashed without their padding
+*/
+#define BITMAP_XXH_PRIME1 11400714785074694791ULL
+#define BITMAP_XXH_PRIME2 14029467366897019727ULL
+#define BITMAP_XXH_PRIME3 1609587929392839161ULL
+#define BITMAP_XXH_PRIME4 9650029242287828579ULL
+#define BITMAP_XXH_PRIME5 2870177450012600261ULL
+
+typedef struct {
+    uint64_t    v[4];
+    uint64_t    seed;
+    uint64_t    length;
+    uint8_t     buffer[32];
+    uint32_t    buffered;
+} BITMAPXXH64;
+
+static inline uint64_t bitmap_rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static inline uint64_t bitmap_read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t bitmap_xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * BITMAP_XXH_PRIME2;
+    return bitmap_rotl64(acc, 31) * BITMAP_XXH_PRIME1;
+}
+
+static inline uint64_t bitmap_xxh64_merge(uint64_t acc, uint64_t v) {
+    acc ^= bitmap_xxh64_round(0, v);
+    return acc * BITMAP_XXH_PRIME1 + BITMAP_XXH_PRIME4;
+}
+
+static void bitmap_xxh64_init(BITMAPXXH64 *h, uint64_t seed) {
+    memset(h, 0, sizeof(*h));
+    h->seed = seed;
+    h->v[0] = seed + BITMAP_XXH_PRIME1 + BITMAP_XXH_PRIME2;
+    h->v[1] = seed + BITMAP_XXH_PRIME2;
+    h->v[2] = seed;
+    h->v[3] = seed - BITMAP_XXH_PRIME1;
+}
+
+static const uint8_t *bitmap_xxh64_stripes(BITMAPXXH64 *h, const uint8_t *p, const uint8_t *end) {
+    uint64_t v0 = h->v[0], v1 = h->v[1], v2 = h->v[2], v3 = h->v[3];
+    for (; end - p >= 32; p += 32) {
+        v0 = bitmap_xxh64_round(v0, bitmap_read64(p));
+        v1 = bitmap_xxh64_round(v1, bitmap_read64(p + 8));
+        v2 = bitmap_xxh64_round(v2, bitmap_read64(p + 16));
+        v3 = bitmap_xxh64_round(v3, bitmap_read64(p + 24));
+    }
+    h->v[0] = v0;
+    h->v[1] = v1;
+    h->v[2] = v2;
+    h->v[3] = v3;
+    return p;
+}
+
+static void bitmap_xxh64_update(BITMAPXXH64 *h, const uint8_t *p, size_t n) {
+    const uint8_t *end = p + n;
+    h->length += n;
+    if (h->buffered) {
+        size_t fill = 32 - h->buffered < n ? 32 - h->buffered : n;
+        memcpy(h->buffer + h->buffered, p, fill);
+        h->buffered += (uint32_t)fill;
+        p += fill;
+        if (h->buffered < 32) return;
+        bitmap_xxh64_stripes(h, h->buffer, h->buffer + 32);
+        h->buffered = 0;
+    }
+    p = bitmap_xxh64_stripes(h, p, end);
+    memcpy(h->buffer, p, (size_t)(end - p));
+    h->buffered = (uint32_t)(end - p);
+}
+
+static uint64_t bitmap_xxh64_digest(const BITMAPXXH64 *h) {
+    uint64_t hash;
+    if (h->length >= 32) {
+        hash = bitmap_rotl64(h->v[0], 1) + bitmap_rotl64(h->v[1], 7) + bitmap_rotl64(h->v[2], 12) + bitmap_rotl64(h->v[3], 18);
+        for (int i = 0; i < 4; ++i) hash = bitmap_xxh64_merge(hash, h->v[i]);
+    } else {
+        hash = h->seed + BITMAP_XXH_PRIME5;
+    }
+    hash += h->length;
+    const uint8_t *p = h->buffer, *end = h->buffer + h->buffered;
+    for (; end - p >= 8; p += 8) hash = bitmap_rotl64(hash ^ bitmap_xxh64_round(0, bitmap_read64(p)), 27) * BITMAP_XXH_PRIME1 + BITMAP_XXH_PRIME4;
+    if (end - p >= 4) {
+        uint32_t k;
+        memcpy(&k, p, sizeof(k));
+        hash = bitmap_rotl64(hash ^ (uint64_t)k * BITMAP_XXH_PRIME1, 23) * BITMAP_XXH_PRIME2 + BITMAP_XXH_PRIME3;
+        p += 4;
+    }
+    for (; p < end; ++p) hash = bitmap_rotl64(hash ^ *p * BITMAP_XXH_PRIME5, 11) * BITMAP_XXH_PRIME1;
+    hash ^= hash >> 33;
+    hash *= BITMAP_XXH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= BITMAP_XXH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// Hash of the rows top to bottom without padding, followed by width, rows and bits per pixel
+static uint64_t bitmap_hash_rows(const uint8_t *pixels, const BITMAPV4HEADER *info_header, uint32_t row_size, uint64_t seed) {
+    uint32_t width = info_header->bitmap_width < 0 ? 0 : (uint32_t)info_header->bitmap_width;
+    int32_t height = info_header->bitmap_height;
+    uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    uint32_t row_bytes = (uint32_t)(((uint64_t)info_header->bits_per_pixel * width + 7) / 8);
+    ptrdiff_t stride;
+    const uint8_t *row = bitmap_top_row(pixels, height, row_size, &stride);
+    BITMAPXXH64 h;
+    bitmap_xxh64_init(&h, seed);
+    if (row_bytes == row_size && height < 0) {
+        bitmap_xxh64_update(&h, row, (size_t)row_size * rows);
+    } else {
+        for (uint32_t y = 0; y < rows; ++y, row += y < rows ? stride : 0) bitmap_xxh64_update(&h, row, row_bytes);
+    }
+    uint32_t shape[3] = { width, rows, info_header->bits_per_pixel };
+    bitmap_xxh64_update(&h, (const uint8_t *)shape, sizeof(shape));
+    return bitmap_xxh64_digest(&h);
+}
+
+/*
+* Hashes the pixels of a mapped bitmap with XXH64. Headers, palette and padding bytes aren't hashed and both
+* row orders of the same image give the same hash, so equal hashes mean equal pixels.
+* @param view view from MapBitMap with uncompressed pixels
+* @param seed hash seed, 0 unless the hashes have to differ from the default ones
+* @return the hash, 0 for compressed images
+*/
+uint64_t HashBitMapView(const BITMAPVIEW *view, uint64_t seed) {
+    BITMAP_SCOPE(HashBitMapView);
+    if (!bitmap_is_uncompressed(&view->info_header)) return 0;
+    return bitmap_hash_rows(view->pixels, &view->info_header, view->stride, seed);
+}
+
+/*
+* Hashes the pixels of a bitmap in memory, see HashBitMapView. Gives the same hash as the file it was written to.
+* @param bmp bitmap with padded uncompressed pixel data
+* @param seed hash seed
+* @return the hash, 0 for compressed images
+*/
+uint64_t HashBitMap(const BITMAP *bmp, uint64_t seed) {
+    BITMAP_SCOPE(HashBitMap);
+    if (!bitmap_is_uncompressed(&bmp->info_header) || bmp->info_header.bitmap_width < 0) return 0;
+    return bitmap_hash_rows(bmp->pixels, &bmp->info_header,
+                            ROW_SIZE(bmp->info_header.bits_per_pixel, (uint32_t)bmp->info_header.bitmap_width), seed);
+}
+
+/*
+* Maps a bitmap file and hashes its pixels, see HashBitMapView. Only the pixel rows are touched, nothing is decoded or copied.
+* @param file_name the path to a bitmap file
+* @param seed hash seed
+* @param hash receives the hash
+* @return 0 on success, -1 if the file can't be mapped or is compressed
+*/
+int HashBitMapFile(const char *file_name, uint64_t seed, uint64_t *hash) {
+    BITMAP_SCOPE(HashBitMapFile);
+    BITMAPVIEW view;
+    if (MapBitMap(file_name, &view) != 0) return -1;
+    int result = bitmap_is_uncompressed(&view.info_header) ? 0 : -1;
+    *hash = result == 0 ? HashBitMapView(&view, seed) : 0;
+    UnmapBitMap(&view);
+    return result;
+}
+
+/*
+* Histograms and channel statistics
+* Both accumulate one row at a time, so they can run right after a row was read or converted while it is
+* still in cache (see ReadBitMapWithHistogram). Channel i is byte i of a pixel, B, G, R, A for 32 bit images.
+* The Compute functions split the image into bands, every band fills a partial of its own and the partials
+* are merged at the end.
+*/
+#define BITMAP_HISTOGRAM_LANES 4
+
+typedef struct {
+    uint32_t    channels;       // Bytes per pixel, 1 to 4
+    uint64_t    pixels;
+    uint64_t    count[4][256];  // count[c][v] is the number of pixels whose channel c is v, valid after FinishBitMapHistogram
+    // Pixel x is counted in lane x % BITMAP_HISTOGRAM_LANES, so runs of equal values don't increment the same
+    // counter back to back and wait on their own store
+    uint32_t    lanes[BITMAP_HISTOGRAM_LANES][4][256];
+    uint32_t    pending;        // Pixels in lanes
+} BITMAPHISTOGRAM;
+
+typedef struct {
+    uint32_t    channels;       // Bytes per pixel, 1 to 4
+    uint64_t    pixels;
+    uint8_t     min[4];
+    uint8_t     max[4];
+    uint64_t    sum[4];
+    double      mean[4];        // Valid after FinishBitMapChannelStats
+} BITMAPCHANNELSTATS;
+
+/*
+* Clears a histogram
+* @param channels bytes per pixel of the rows that will be added, 1 to 4
+*/
+void InitBitMapHistogram(BITMAPHISTOGRAM *histogram, uint32_t channels) {
+    BITMAP_SCOPE(InitBitMapHistogram);
+    memset(histogram, 0, sizeof(*histogram));
+    histogram->channels = channels;
+}
+
+static void bitmap_fold_histogram(BITMAPHISTOGRAM *histogram) {
+    if (histogram->pending == 0) return;
+    for (uint32_t c = 0; c < histogram->channels; ++c) {
+        for (uint32_t v = 0; v < 256; ++v) {
+            uint64_t n = 0;
+            for (uint32_t lane = 0; lane < BITMAP_HISTOGRAM_LANES; ++lane) n += histogram->lanes[lane][c][v];
+            histogram->count[c][v] += n;
+        }
+    }
+    memset(histogram->lanes, 0, sizeof(histogram->lanes));
+    histogram->pending = 0;
+}
+
+// Inlined per channel count, so the inner loop has no loop over channels
+static inline void bitmap_histogram_row(uint32_t (*lanes)[4][256], const uint8_t *p, uint32_t width, uint32_t channels) {
+    uint32_t x = 0;
+    for (; x + 4 <= width; x += 4, p += 4 * channels) {
+        for (uint32_t c = 0; c < channels; ++c) {
+            lanes[0][c][p[c]]++;
+            lanes[1][c][p[channels + c]]++;
+            lanes[2][c][p[2 * channels + c]]++;
+            lanes[3][c][p[3 * channels + c]]++;
+        }
+    }
+    for (; x < width; ++x, p += channels) {
+        for (uint32_t c = 0; c < channels; ++c) lanes[0][c][p[c]]++;
+    }
+}
+
+/*
+* Adds one row of pixels to a histogram
+* @param row UNPADED pixels, histogram->channels bytes each
+* @param width number of pixels in row
+*/
+void AccumulateBitMapHistogram(BITMAPHISTOGRAM *histogram, const uint8_t *row, uint32_t width) {
+    BITMAP_SCOPE(AccumulateBitMapHistogram);
+    if (histogram->pending > UINT32_MAX - width) bitmap_fold_histogram(histogram);
+    switch (histogram->channels) {
+    case 1: bitmap_histogram_row(histogram->lanes, row, width, 1); break;
+    case 2: bitmap_histogram_row(histogram->lanes, row, width, 2); break;
+    case 3: bitmap_histogram_row(histogram->lanes, row, width, 3); break;
+    case 4: bitmap_histogram_row(histogram->lanes, row, width, 4); break;
+    default: return;
+    }
+    histogram->pending += width;
+    histogram->pixels += width;
+}
+
+/*
+* Folds the lanes into histogram->count. More rows can be added afterwards
+*/
+void FinishBitMapHistogram(BITMAPHISTOGRAM *histogram) {
+    BITMAP_SCOPE(FinishBitMapHistogram);
+    bitmap_fold_histogram(histogram);
+}
+
+/*
+* Adds the pixels of src to dst, both with the same number of channels. src is finished first
+*/
+void MergeBitMapHistogram(BITMAPHISTOGRAM *dst, BITMAPHISTOGRAM *src) {
+    BITMAP_SCOPE(MergeBitMapHistogram);
+    bitmap_fold_histogram(src);
+    bitmap_fold_histogram(dst);
+    for (uint32_t c = 0; c < dst->channels; ++c) {
+        for (uint32_t v = 0; v < 256; ++v) dst->count[c][v] += src->count[c][v];
+    }
+    dst->pixels += src->pixels;
+}
+
+/*
+* Clears channel statistics
+* @param channels bytes per pixel of the rows that will be added, 1 to 4
+*/
+void InitBitMapChannelStats(BITMAPCHANNELSTATS *stats, uint32_t channels) {
+    BITMAP_SCOPE(InitBitMapChannelStats);
+    memset(stats, 0, sizeof(*stats));
+    stats->channels = channels;
+    memset(stats->min, 0xff, sizeof(stats->min));
+}
+
+static void bitmap_channel_stats_scalar(BITMAPCHANNELSTATS *stats, const uint8_t *row, uint32_t offset, uint32_t n_bytes) {
+    uint32_t channels = stats->channels;
+    for (uint32_t i = offset; i < n_bytes; ++i) {
+        uint32_t c = i % channels;
+        if (row[i] < stats->min[c]) stats->min[c] = row[i];
+        if (row[i] > stats->max[c]) stats->max[c] = row[i];
+        stats->sum[c] += row[i];
+    }
+}
+
+#ifdef BITMAP_HAVE_SSE2
+/*
+* Min, max and 16 bit sum per byte lane, 24 bit rows keep 3 sets of lanes as their channel pattern repeats
+* every 48 bytes. The 16 bit sums are folded every 128 blocks, before they can overflow.
+* Returns the number of bytes handled.
+*/
+static uint32_t bitmap_channel_stats_sse2(BITMAPCHANNELSTATS *stats, const uint8_t *row, uint32_t n_bytes) {
+    uint32_t channels = stats->channels, phases = channels == 3 ? 3 : 1;
+    uint32_t n = n_bytes / (16 * phases) * (16 * phases);
+    if (n == 0) return 0;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i min[3], max[3], lo[3], hi[3];
+    uint64_t sums[48] = {0};
+    for (uint32_t k = 0; k < phases; ++k) {
+        min[k] = _mm_set1_epi8((char)0xff);
+        max[k] = lo[k] = hi[k] = zero;
+    }
+    uint32_t pending = 0;
+    for (uint32_t i = 0; i < n; i += 16 * phases) {
+        for (uint32_t k = 0; k < phases; ++k) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(row + i + 16 * k));
+            min[k] = _mm_min_epu8(min[k], v);
+            max[k] = _mm_max_epu8(max[k], v);
+            lo[k] = _mm_add_epi16(lo[k], _mm_unpacklo_epi8(v, zero));
+            hi[k] = _mm_add_epi16(hi[k], _mm_unpackhi_epi8(v, zero));
+        }
+        if (++pending == 128 || i + 16 * phases == n) {
+            for (uint32_t k = 0; k < phases; ++k) {
+                uint16_t lanes[16];
+                _mm_storeu_si128((__m128i *)lanes, lo[k]);
+                _mm_storeu_si128((__m128i *)(lanes + 8), hi[k]);
+                for (uint32_t lane = 0; lane < 16; ++lane) sums[k * 16 + lane] += lanes[lane];
+                lo[k] = hi[k] = zero;
+            }
+            pending = 0;
+        }
+    }
+    for (uint32_t k = 0; k < phases; ++k) {
+        uint8_t lane_min[16], lane_max[16];
+        _mm_storeu_si128((__m128i *)lane_min, min[k]);
+        _mm_storeu_si128((__m128i *)lane_max, max[k]);
+        for (uint32_t lane = 0; lane < 16; ++lane) {
+            uint32_t c = (k * 16 + lane) % channels;
+            if (lane_min[lane] < stats->min[c]) stats->min[c] = lane_min[lane];
+            if (lane_max[lane] > stats->max[c]) stats->max[c] = lane_max[lane];
+            stats->sum[c] += sums[k * 16 + lane];
+        }
+    }
+    return n;
+}
+#endif
+
+/*
+* Adds one row of pixels to channel statistics
+* @param row UNPADED pixels, stats->channels bytes each
+* @param width number of pixels in row
+*/
+void AccumulateBitMapChannelStats(BITMAPCHANNELSTATS *stats, const uint8_t *row, uint32_t width) {
+    BITMAP_SCOPE(AccumulateBitMapChannelStats);
+    if (stats->channels == 0 || stats->channels > 4) return;
+    uint32_t n_bytes = width * stats->channels, x = 0;
+#ifdef BITMAP_HAVE_SSE2
+    x = bitmap_channel_stats_sse2(stats, row, n_bytes);
+#endif
+    bitmap_channel_stats_scalar(stats, row, x, n_bytes);
+    stats->pixels += width;
+}
+
+/*
+* Adds the pixels of src to dst, both with the same number of channels
+*/
+void MergeBitMapChannelStats(BITMAPCHANNELSTATS *dst, const BITMAPCHANNELSTATS *src) {
+    BITMAP_SCOPE(MergeBitMapChannelStats);
+    for (uint32_t c = 0; c < dst->channels; ++c) {
+        if (src->min[c] < dst->min[c]) dst->min[c] = src->min[c];
+        if (src->max[c] > dst->max[c]) dst->max[c] = src->max[c];
+        dst->sum[c] += src->sum[c];
+    }
+    dst->pixels += src->pixels;
+}
+
+/*
+* Computes stats->mean. Channels of empty statistics have min 255, max 0 and mean 0
+*/
+void FinishBitMapChannelStats(BITMAPCHANNELSTATS *stats) {
+    BITMAP_SCOPE(FinishBitMapChannelStats);
+    for (uint32_t c = 0; c < stats->channels; ++c) stats->mean[c] = stats->pixels ? (double)stats->sum[c] / (double)stats->pixels : 0.0;
+}
+
+typedef struct {
+    const uint8_t       *pixels;
+    uint32_t            row_size;
+    uint32_t            width;
+    uint32_t            channels;
+    BITMAP_MUTEX        mutex;
+    BITMAPHISTOGRAM     *histogram;
+    BITMAPCHANNELSTATS  *stats;
+    int                 failed;     // A band couldn't allocate its partial
+} BITMAPHISTOGRAMBANDS;
+
+static void bitmap_histogram_band(void *context, uint32_t first_row, uint32_t n_rows) {
+    BITMAPHISTOGRAMBANDS *bands = (BITMAPHISTOGRAMBANDS *)context;
+    const uint8_t *row = bands->pixels + (size_t)first_row * bands->row_size;
+    if (bands->histogram) {
+        // Too large for the stack of a pool thread
+        BITMAPHISTOGRAM *partial = (BITMAPHISTOGRAM *)bitmap_malloc(sizeof(BITMAPHISTOGRAM));
+        if (partial == NULL) {
+            bitmap_mutex_lock(&bands->mutex);
+            bands->failed = 1;
+            bitmap_mutex_unlock(&bands->mutex);
+            return;
+        }
+        InitBitMapHistogram(partial, bands->channels);
+        for (uint32_t y = 0; y < n_rows; ++y, row += bands->row_size) AccumulateBitMapHistogram(partial, row, bands->width);
+        bitmap_mutex_lock(&bands->mutex);
+        MergeBitMapHistogram(bands->histogram, partial);
+        bitmap_mutex_unlock(&bands->mutex);
+        free(partial);
     } else {
-        fprintf(stderr, "bmp->pixels is NULL. Not freeing!\n");
+        BITMAPCHANNELSTATS partial;
+        InitBitMapChannelStats(&partial, bands->channels);
+        for (uint32_t y = 0; y < n_rows; ++y, row += bands->row_size) AccumulateBitMapChannelStats(&partial, row, bands->width);
+        bitmap_mutex_lock(&bands->mutex);
+        MergeBitMapChannelStats(bands->stats, &partial);
+        bitmap_mutex_unlock(&bands->mutex);
+    }
+}
+
+static int bitmap_histogram_bands(PBITMAP bmp, BITMAPHISTOGRAM *histogram, BITMAPCHANNELSTATS *stats, const BITMAPTILEOPTIONS *options) {
+    uint32_t bits_per_pixel = bmp->info_header.bits_per_pixel;
+    uint32_t channels = bits_per_pixel / 8;
+    if (histogram) InitBitMapHistogram(histogram, channels);
+    if (stats) InitBitMapChannelStats(stats, channels);
+    if (bits_per_pixel % 8 != 0 || channels == 0 || channels > 4 || bmp->info_header.bitmap_width < 0 ||
+        !bitmap_is_uncompressed(&bmp->info_header)) return -1;
+    BITMAPHISTOGRAMBANDS bands;
+    bands.pixels = bmp->pixels;
+    bands.width = (uint32_t)bmp->info_header.bitmap_width;
+    bands.row_size = ROW_SIZE(bits_per_pixel, bands.width);
+    bands.channels = channels;
+    bands.histogram = histogram;
+    bands.stats = stats;
+    bands.failed = 0;
+    int32_t height = bmp->info_header.bitmap_height;
+    bitmap_mutex_init(&bands.mutex);
+    RunBitMapBands(height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height, bands.row_size, bitmap_histogram_band, &bands, options);
+    bitmap_mutex_destroy(&bands.mutex);
+    return bands.failed ? -1 : 0;
+}
+
+/*
+* Computes the histogram of every channel in parallel
+* @param bmp bitmap with padded uncompressed pixel data, 8, 16, 24 or 32 bits per pixel
+* @param histogram receives the finished histogram
+* @param options scheduling options, NULL for defaults
+* @return 0 on success, -1 if the format isn't supported or memory is exhausted
+*/
+int ComputeBitMapHistogram(PBITMAP bmp, BITMAPHISTOGRAM *histogram, const BITMAPTILEOPTIONS *options) {
+    BITMAP_SCOPE(ComputeBitMapHistogram);
+    if (bitmap_histogram_bands(bmp, histogram, NULL, options) != 0) return -1;
+    FinishBitMapHistogram(histogram);
+    return 0;
+}
+
+/*
+* Computes min, max, sum and mean of every channel in parallel. Cheaper than a histogram when only these are needed
+* @param bmp bitmap with padded uncompressed pixel data, 8, 16, 24 or 32 bits per pixel
+* @param stats receives the finished statistics
+* @param options scheduling options, NULL for defaults
+* @return 0 on success, -1 if the format isn't supported
+*/
+int ComputeBitMapChannelStats(PBITMAP bmp, BITMAPCHANNELSTATS *stats, const BITMAPTILEOPTIONS *options) {
+    BITMAP_SCOPE(ComputeBitMapChannelStats);
+    if (bitmap_histogram_bands(bmp, NULL, stats, options) != 0) return -1;
+    FinishBitMapChannelStats(stats);
+    return 0;
+}
+
+/*
+* ReadBitMapEx that builds a histogram and channel statistics while the pixels are read. The file is read in
+* blocks of rows and every block is added while it is still in cache, so the statistics cost no second pass.
+* @param file_name the path to a bitmap file
+* @param allocator allocator for the pixels, NULL for the default allocator
+* @param histogram receives the finished histogram, may be NULL
+* @param stats receives the finished statistics, may be NULL
+* @return the bitmap like ReadBitMapEx. Statistics are only filled for 8, 16, 24 and 32 bit results, their channels are 0 otherwise.
+* When the read fails the statistics are zeroed with 0 channels, partial counts are not returned
+*/
+BITMAP ReadBitMapWithHistogram(const char *file_name, const BITMAPALLOCATOR *allocator, BITMAPHISTOGRAM *histogram, BITMAPCHANNELSTATS *stats) {
+    BITMAP_SCOPE(ReadBitMapWithHistogram);
+    BITMAP bitmap;
+    memset(&bitmap, 0, sizeof(bitmap));
+    if (histogram) InitBitMapHistogram(histogram, 0);
+    if (stats) InitBitMapChannelStats(stats, 0);
+    FILE *bitmap_file = bitmap_fopen(file_name, "rb");
+    if (bitmap_file == NULL) return bitmap;
+    if (bitmap_read_headers(bitmap_file, &bitmap.file_header, &bitmap.info_header) != 0) {
+        fclose(bitmap_file);
+        return bitmap;
+    }
+    uint32_t bits_per_pixel = bitmap.info_header.bits_per_pixel, channels = bits_per_pixel / 8;
+    if (bitmap.info_header.compression_method != BI_RGB || bits_per_pixel % 8 != 0 || channels == 0 || channels > 4) {
+        // Decoded formats go through ReadBitMapEx and a separate pass
+        fclose(bitmap_file);
+        bitmap = ReadBitMapEx(file_name, allocator);
+        if (bitmap.pixels && histogram && ComputeBitMapHistogram(&bitmap, histogram, NULL) != 0) InitBitMapHistogram(histogram, 0);
+        if (bitmap.pixels && stats && ComputeBitMapChannelStats(&bitmap, stats, NULL) != 0) InitBitMapChannelStats(stats, 0);
+        return bitmap;
+    }
+    if (histogram) InitBitMapHistogram(histogram, channels);
+    if (stats) InitBitMapChannelStats(stats, channels);
+    uint32_t width = (uint32_t)bitmap.info_header.bitmap_width;
+    int32_t height = bitmap.info_header.bitmap_height;
+    uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    uint32_t row_size = ROW_SIZE(bits_per_pixel, width);
+    if (bitmap_alloc_pixels(&bitmap, (size_t)row_size * rows, allocator) == NULL || bitmap_fseek(bitmap_file, bitmap.file_header.offset, SEEK_SET) != 0) {
+        if (bitmap.pixels) bitmap_free_pixels(&bitmap);
+        fclose(bitmap_file);
+        if (histogram) InitBitMapHistogram(histogram, 0);
+        if (stats) InitBitMapChannelStats(stats, 0);
+        return bitmap;
+    }
+    // Blocks of about 64 KiB stay in L2 between the read and the accumulation
+    uint32_t block_rows = row_size ? 65536 / row_size : rows;
+    if (block_rows == 0) block_rows = 1;
+    uint8_t *row = bitmap.pixels;
+    for (uint32_t y = 0; y < rows; y += block_rows) {
+        uint32_t n = rows - y < block_rows ? rows - y : block_rows;
+        size_t size = (size_t)n * row_size;
+        size_t got = bitmap_fread(row, 1, size, bitmap_file);
+        // The padding of the last row may be missing
+        if (got < size - (y + n == rows ? row_size - (bits_per_pixel * width + 7) / 8 : 0)) {
+            bitmap_free_pixels(&bitmap);
+            break;
+        }
+        memset(row + got, 0, size - got);
+        for (uint32_t i = 0; i < n; ++i, row += row_size) {
+            if (histogram) AccumulateBitMapHistogram(histogram, row, width);
+            if (stats) AccumulateBitMapChannelStats(stats, row, width);
+        }
+    }
+    if (bitmap.pixels && bits_per_pixel <= 8) bitmap_read_palette(bitmap_file, &bitmap, allocator);
+    fclose(bitmap_file);
+    if (bitmap.pixels == NULL) {
+        // Nothing was read completely, drop the rows counted so far
+        if (histogram) InitBitMapHistogram(histogram, 0);
+        if (stats) InitBitMapChannelStats(stats, 0);
+        return bitmap;
     }
-    
-    if (bmp->file) {
-        fclose(bmp->file);
-        bmp->file = NULL;
+    bitmap_normalize_headers(&bitmap);
+    if (histogram) FinishBitMapHistogram(histogram);
+    if (stats) FinishBitMapChannelStats(stats);
+    return bitmap;
+}
+
+/*
+* Asynchronous reads and writes
+* Requests run on a thread pool and signal completion through a callback and a future, so one event loop
+* thread can keep many images in flight. A pool of its own for I/O keeps slow disks from holding up the
+* band scheduler.
+*/
+typedef struct BITMAPFUTURE BITMAPFUTURE;
+typedef void (*BITMAPCALLBACK)(BITMAPFUTURE *future, void *user);
+
+struct BITMAPFUTURE {
+    BITMAP_MUTEX        mutex;
+    BITMAP_COND         cond;
+    int                 done;
+    int                 in_callback; // The callback still runs, FreeBitMapFuture waits for it
+    int                 result;     // 0 on success, -1 on failure
+    BITMAP              bitmap;     // Result of a read
+    PBITMAP             source;     // Bitmap to write
+    char                *file_name;
+    int                 writing;
+    BITMAPCALLBACK      callback;
+    void                *user;
+};
+
+static void bitmap_future_run(void *context, uint32_t index) {
+    (void)index;
+    BITMAPFUTURE *future = (BITMAPFUTURE *)context;
+    int result = -1;
+    if (future->writing) {
+        FILE *bitmap_file = bitmap_fopen(future->file_name, "wb");
+        if (bitmap_file) {
+            WriteToBitMapFile(bitmap_file, future->source);
+            result = ferror(bitmap_file) ? -1 : 0;
+            if (fclose(bitmap_file) != 0) result = -1;
+        }
     } else {
-        fprintf(stderr, "bmp->file is NULL. Not closing!\n");
+        future->bitmap = ReadBitMapEx(future->file_name, NULL);
+        result = future->bitmap.pixels ? 0 : -1;
+    }
+    bitmap_mutex_lock(&future->mutex);
+    future->result = result;
+    bitmap_mutex_unlock(&future->mutex);
+}
+
+static void bitmap_future_done(void *context) {
+    BITMAPFUTURE *future = (BITMAPFUTURE *)context;
+    // The result is published first, so the callback can poll, wait on or take it. FreeBitMapFuture
+    // waits until in_callback drops, the future stays valid while the callback runs
+    bitmap_mutex_lock(&future->mutex);
+    future->done = 1;
+    future->in_callback = future->callback != NULL;
+    bitmap_cond_broadcast(&future->cond);
+    bitmap_mutex_unlock(&future->mutex);
+    if (future->callback == NULL) return;
+    future->callback(future, future->user);
+    bitmap_mutex_lock(&future->mutex);
+    future->in_callback = 0;
+    bitmap_cond_broadcast(&future->cond);
+    bitmap_mutex_unlock(&future->mutex);
+}
+
+static BITMAPFUTURE *bitmap_future_submit(BITMAPTHREADPOOL *pool, const char *file_name, PBITMAP source,
+                                          BITMAPCALLBACK callback, void *user) {
+    if (pool == NULL) pool = GetBitMapThreadPool();
+    BITMAPFUTURE *future = (BITMAPFUTURE *)bitmap_calloc(1, sizeof(BITMAPFUTURE));
+    if (future == NULL) return NULL;
+    size_t length = strlen(file_name) + 1;
+    future->file_name = (char *)bitmap_malloc(length);
+    if (future->file_name == NULL) {
+        free(future);
+        return NULL;
+    }
+    memcpy(future->file_name, file_name, length);
+    future->source = source;
+    future->writing = source != NULL;
+    future->callback = callback;
+    future->user = user;
+    bitmap_mutex_init(&future->mutex);
+    bitmap_cond_init(&future->cond);
+    if (SubmitBitMapTask(pool, bitmap_future_run, future, bitmap_future_done) != 0) {
+        bitmap_cond_destroy(&future->cond);
+        bitmap_mutex_destroy(&future->mutex);
+        free(future->file_name);
+        free(future);
+        return NULL;
+    }
+    return future;
+}
+
+/*
+* Starts reading a bitmap file and returns right away.
+* @param pool pool that runs the read, NULL for the shared pool
+* @param file_name the path to a bitmap file, copied
+* @param callback called on a pool thread after the read finished, may be NULL. The future is done when it runs,
+* so the callback may poll, wait on or take the result. The caller still owns the future, FreeBitMapFuture waits
+* for the callback to return
+* @param user passed to callback
+* @return future of the read, NULL if it couldn't be started. Release it with FreeBitMapFuture
+*/
+BITMAPFUTURE *ReadBitMapAsync(BITMAPTHREADPOOL *pool, const char *file_name, BITMAPCALLBACK callback, void *user) {
+    BITMAP_SCOPE(ReadBitMapAsync);
+    return bitmap_future_submit(pool, file_name, NULL, callback, user);
+}
+
+/*
+* Starts writing a bitmap (headers and padded pixels, like WriteToBitMapFile) and returns right away.
+* @param pool pool that runs the write, NULL for the shared pool
+* @param file_name the path to the output file, copied
+* @param bitmap_data the bitmap to write. It must stay valid until the future is done
+* @param callback called on a pool thread after the write finished, may be NULL. See ReadBitMapAsync
+* @param user passed to callback
+* @return future of the write, NULL if it couldn't be started. Release it with FreeBitMapFuture
+*/
+BITMAPFUTURE *WriteBitMapAsync(BITMAPTHREADPOOL *pool, const char *file_name, PBITMAP bitmap_data, BITMAPCALLBACK callback, void *user) {
+    BITMAP_SCOPE(WriteBitMapAsync);
+    if (bitmap_data == NULL) return NULL;
+    return bitmap_future_submit(pool, file_name, bitmap_data, callback, user);
+}
+
+/*
+* Checks whether a request finished without blocking.
+* @return 1 if done, 0 if still running
+*/
+int PollBitMapFuture(BITMAPFUTURE *future) {
+    BITMAP_SCOPE(PollBitMapFuture);
+    bitmap_mutex_lock(&future->mutex);
+    int done = future->done;
+    bitmap_mutex_unlock(&future->mutex);
+    return done;
+}
+
+/*
+* Blocks until a request finished.
+* @return 0 if the request succeeded, -1 if it failed
+*/
+int WaitBitMapFuture(BITMAPFUTURE *future) {
+    BITMAP_SCOPE(WaitBitMapFuture);
+    bitmap_mutex_lock(&future->mutex);
+    while (!future->done) bitmap_cond_wait(&future->cond, &future->mutex);
+    int result = future->result;
+    bitmap_mutex_unlock(&future->mutex);
+    return result;
+}
+
+/*
+* Moves the bitmap of a finished read out of the future. The caller owns it afterwards and releases it with cleanup.
+* Can be called from the callback.
+* @param future a finished read
+* @param bitmap receives the bitmap
+* @return 0 on success, -1 if the read failed or the bitmap was already taken
+*/
+int TakeBitMapFutureResult(BITMAPFUTURE *future, PBITMAP bitmap) {
+    BITMAP_SCOPE(TakeBitMapFutureResult);
+    if (future->writing || future->bitmap.pixels == NULL) return -1;
+    *bitmap = future->bitmap;
+    memset(&future->bitmap, 0, sizeof(future->bitmap));
+    return 0;
+}
+
+/*
+* Waits for a request and its callback, then frees the future. A read bitmap that wasn't taken is freed with it.
+* Must not be called from the future's own callback.
+*/
+void FreeBitMapFuture(BITMAPFUTURE *future) {
+    BITMAP_SCOPE(FreeBitMapFuture);
+    if (future == NULL) return;
+    bitmap_mutex_lock(&future->mutex);
+    while (!future->done || future->in_callback) bitmap_cond_wait(&future->cond, &future->mutex);
+    bitmap_mutex_unlock(&future->mutex);
+    ReleaseBitMap(&future->bitmap);
+    bitmap_cond_destroy(&future->cond);
+    bitmap_mutex_destroy(&future->mutex);
+    free(future->file_name);
+    free(future);
+}
+
+/*
+* Writes many bitmap files at once. Jobs go into a bounded queue and are padded and written on pool
+* workers, so the rows of one file are prepared while others are being written.
+*/
+typedef struct {
+    int     result;     // 0 on success, -1 on failure
+    int     error;      // errno of the failure, 0 if unknown
+} BITMAPWRITERESULT;
+
+typedef struct {
+    BITMAPTHREADPOOL    *pool;
+    BITMAP_MUTEX        mutex;
+    BITMAP_COND         cond;
+    uint32_t            max_queued;
+    uint32_t            in_flight;
+    uint32_t            n_jobs;         // Jobs queued since the last flush
+    uint32_t            capacity;
+    BITMAPWRITERESULT   *results;
+} BITMAPBATCHWRITER;
+
+typedef struct {
+    BITMAPBATCHWRITER   *writer;
+    uint32_t            index;
+    int32_t             width;
+    int32_t             height;
+    uint16_t            bits_per_pixel;
+    const uint8_t       *pixels;
+    char                file_name[1];   // Allocated with the job
+} BITMAPBATCHJOB;
+
+static void bitmap_batch_run(void *context, uint32_t index) {
+    (void)index;
+    BITMAPBATCHJOB *job = (BITMAPBATCHJOB *)context;
+    errno = 0;
+    int result = WriteBitMapFile(job->file_name, job->width, job->height, job->bits_per_pixel, job->pixels, BI_RGB);
+    int error = result == 0 ? 0 : errno;
+    BITMAPBATCHWRITER *writer = job->writer;
+    bitmap_mutex_lock(&writer->mutex);
+    writer->results[job->index].result = result;
+    writer->results[job->index].error = error;
+    bitmap_mutex_unlock(&writer->mutex);
+}
+
+static void bitmap_batch_done(void *context) {
+    BITMAPBATCHJOB *job = (BITMAPBATCHJOB *)context;
+    BITMAPBATCHWRITER *writer = job->writer;
+    free(job);
+    bitmap_mutex_lock(&writer->mutex);
+    --writer->in_flight;
+    bitmap_cond_broadcast(&writer->cond);
+    bitmap_mutex_unlock(&writer->mutex);
+}
+
+/*
+* Creates a batch writer.
+* @param pool pool that pads and writes the files, NULL for the shared pool
+* @param max_queued number of jobs that may be in flight before QueueBitMapWrite blocks, 0 for twice the workers
+* @return the writer or NULL. Release it with DestroyBitMapBatchWriter
+*/
+BITMAPBATCHWRITER *CreateBitMapBatchWriter(BITMAPTHREADPOOL *pool, uint32_t max_queued) {
+    BITMAP_SCOPE(CreateBitMapBatchWriter);
+    if (pool == NULL) pool = GetBitMapThreadPool();
+    if (pool == NULL) return NULL;
+    BITMAPBATCHWRITER *writer = (BITMAPBATCHWRITER *)bitmap_calloc(1, sizeof(BITMAPBATCHWRITER));
+    if (writer == NULL) return NULL;
+    writer->pool = pool;
+    writer->max_queued = max_queued ? max_queued : 2 * pool->n_threads;
+    bitmap_mutex_init(&writer->mutex);
+    bitmap_cond_init(&writer->cond);
+    return writer;
+}
+
+/*
+* Queues an uncompressed bitmap file to be written. Blocks while the queue is full.
+* @param writer the batch writer
+* @param file_name the path to the output file, copied
+* @param width the width of the bitmap file
+* @param height the height of the bitmap file
+* @param bits_per_pixel color depth of the bitmap file
+* @param pixels UNPADED pixel data. It must stay valid until the next FlushBitMapBatchWriter returns
+* @return index of the job in the results of the next flush, -1 if it couldn't be queued
+*/
+int64_t QueueBitMapWrite(BITMAPBATCHWRITER *writer, const char *file_name, int32_t width, int32_t height,
+                         uint16_t bits_per_pixel, const uint8_t *pixels) {
+    BITMAP_SCOPE(QueueBitMapWrite);
+    size_t length = strlen(file_name);
+    BITMAPBATCHJOB *job = (BITMAPBATCHJOB *)bitmap_malloc(sizeof(BITMAPBATCHJOB) + length);
+    if (job == NULL) return -1;
+    memcpy(job->file_name, file_name, length + 1);
+    job->writer = writer;
+    job->width = width;
+    job->height = height;
+    job->bits_per_pixel = bits_per_pixel;
+    job->pixels = pixels;
+
+    bitmap_mutex_lock(&writer->mutex);
+    while (writer->in_flight >= writer->max_queued) bitmap_cond_wait(&writer->cond, &writer->mutex);
+    if (writer->n_jobs == writer->capacity) {
+        uint32_t capacity = writer->capacity ? writer->capacity * 2 : 64;
+        BITMAPWRITERESULT *results = (BITMAPWRITERESULT *)realloc(writer->results, capacity * sizeof(BITMAPWRITERESULT));
+        if (results == NULL) {
+            bitmap_mutex_unlock(&writer->mutex);
+            free(job);
+            return -1;
+        }
+        writer->results = results;
+        writer->capacity = capacity;
+    }
+    uint32_t index = job->index = writer->n_jobs++;
+    writer->results[index].result = -1;
+    writer->results[index].error = 0;
+    ++writer->in_flight;
+    bitmap_mutex_unlock(&writer->mutex);
+
+    if (SubmitBitMapTask(writer->pool, bitmap_batch_run, job, bitmap_batch_done) != 0) {
+        // Run it here, the result is recorded the same way
+        bitmap_batch_run(job, 0);
+        bitmap_batch_done(job);
+    }
+    return index;
+}
+
+/*
+* Waits until every queued job finished and starts a new batch.
+* @param writer the batch writer
+* @param results receives the result of job i at index i, may be NULL
+* @param capacity number of entries in results
+* @return number of failed jobs
+*/
+uint32_t FlushBitMapBatchWriter(BITMAPBATCHWRITER *writer, BITMAPWRITERESULT *results, uint32_t capacity) {
+    BITMAP_SCOPE(FlushBitMapBatchWriter);
+    bitmap_mutex_lock(&writer->mutex);
+    while (writer->in_flight > 0) bitmap_cond_wait(&writer->cond, &writer->mutex);
+    uint32_t failed = 0;
+    for (uint32_t i = 0; i < writer->n_jobs; ++i) {
+        if (writer->results[i].result != 0) ++failed;
+        if (results && i < capacity) results[i] = writer->results[i];
+    }
+    writer->n_jobs = 0;
+    bitmap_mutex_unlock(&writer->mutex);
+    return failed;
+}
+
+/*
+* Flushes the writer and frees it.
+* @param writer the batch writer, may be NULL
+*/
+void DestroyBitMapBatchWriter(BITMAPBATCHWRITER *writer) {
+    BITMAP_SCOPE(DestroyBitMapBatchWriter);
+    if (writer == NULL) return;
+    FlushBitMapBatchWriter(writer, NULL, 0);
+    bitmap_cond_destroy(&writer->cond);
+    bitmap_mutex_destroy(&writer->mutex);
+    free(writer->results);
+    free(writer);
+}
+
+/*
+* Incremental writes
+* SetPixel, SetPixels, SetPixels24, SetPixelSpan and FillRect mark the rows they change in a bitset when the bitmap has an open
+* file or is a writable mapping. SyncBitMap writes only those rows back, with one pwrite per run of dirty rows, or
+* msyncs them when the pixels are a mapping of the file from MapBitMapWritable. Other changes are recorded with
+* MarkBitMapDirty.
+*/
+
+/*
+* Records rows as changed for SyncBitMap, for changes made through the pixel pointer or by whole image functions.
+* @param bmp bitmap with padded uncompressed pixel data
+* @param y first row, counted from the top of the image
+* @param count number of rows. The span is clipped to the bitmap
+*/
+void MarkBitMapDirty(PBITMAP bmp, uint32_t y, uint32_t count) {
+    BITMAP_SCOPE(MarkBitMapDirty);
+    int32_t height = bmp->info_header.bitmap_height;
+    uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    if (y >= rows) return;
+    if (count > rows - y) count = rows - y;
+    if (count == 0) return;
+    uint32_t first = height < 0 ? y : rows - y - count;
+    bitmap_add_dirty(bmp, first, first + count);
+}
+
+/*
+* Forgets the recorded changes without writing them.
+* @param bmp the bitmap
+*/
+void ClearBitMapDirty(PBITMAP bmp) {
+    BITMAP_SCOPE(ClearBitMapDirty);
+    if (bmp->dirty == NULL) return;
+    memset(bmp->dirty->words, 0, ((size_t)bmp->dirty->rows + 31) / 32 * sizeof(uint32_t));
+    bmp->dirty->count = 0;
+}
+
+/*
+* Maps an uncompressed BI_RGB bitmap file for reading and writing. The pixels are the file itself, SyncBitMap flushes
+* the changed rows to disk and cleanup unmaps it. Functions that replace the pixel buffer, like RotateBitMap, detach
+* the bitmap from the file.
+* @param file_name the path to a bitmap file
+* @param bitmap receives the headers, pixels points into the mapping. bitmap->file is NULL
+* @return BITMAP_OK, or a negative BITMAPERROR
+*/
+int MapBitMapWritable(const char *file_name, PBITMAP bitmap) {
+    BITMAP_SCOPE(MapBitMapWritable);
+    memset(bitmap, 0, sizeof(*bitmap));
+    uint8_t *data;
+    uint64_t size;
+#ifdef _WIN32
+    HANDLE file = CreateFileA(file_name, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return BITMAP_ERROR_IO;
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        return BITMAP_ERROR_IO;
+    }
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, 0, 0, NULL);
+    CloseHandle(file);
+    if (mapping == NULL) return BITMAP_ERROR_IO;
+    data = (uint8_t *)MapViewOfFile(mapping, FILE_MAP_WRITE, 0, 0, 0);
+    CloseHandle(mapping); // The view keeps the mapping alive
+    if (data == NULL) return BITMAP_ERROR_IO;
+    size = (uint64_t)file_size.QuadPart;
+#else
+    int fd = bitmap_open(file_name, O_RDWR);
+    if (fd < 0) return BITMAP_ERROR_IO;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return BITMAP_ERROR_IO;
+    }
+    void *mapped = bitmap_mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return BITMAP_ERROR_IO;
+    data = (uint8_t *)mapped;
+    size = (uint64_t)st.st_size;
+#endif
+    int result = bitmap_parse_headers(data, (size_t)size, &bitmap->file_header, &bitmap->info_header);
+    if (result == BITMAP_OK) result = bitmap_check_pixel_array(&bitmap->file_header, &bitmap->info_header, size);
+    if (result == BITMAP_OK && bitmap->info_header.compression_method != BI_RGB) result = BITMAP_ERROR_FORMAT;
+    int32_t height = bitmap->info_header.bitmap_height;
+    uint64_t rows = height < 0 ? (uint64_t)-(int64_t)height : (uint64_t)height;
+    uint64_t image_size = ROW_SIZE((uint64_t)bitmap->info_header.bits_per_pixel, (uint32_t)bitmap->info_header.bitmap_width) * rows;
+    // Every row is written with its padding, the last one included
+    if (result == BITMAP_OK && image_size > size - bitmap->file_header.offset) result = BITMAP_ERROR_TRUNCATED;
+    uintptr_t offset = bitmap->file_header.offset;
+    if (result != BITMAP_OK) {
+        bitmap_mapped_free(data, (size_t)size, NULL);
+        memset(bitmap, 0, sizeof(*bitmap));
+        return result;
     }
-    bmp = NULL;
+    bitmap->pixels = data + offset;
+    bitmap->pixels_size = (size_t)(size - offset);
+    bitmap->allocator.free = bitmap_mapped_free;
+    bitmap->allocator.user = (void *)offset;
+    return BITMAP_OK;
 }
 
+/*
+* Writes the rows changed since the last call back to the file of the bitmap: one pwrite per dirty range at
+* file_header.offset + row * ROW_SIZE into bitmap->file, or an msync of the pages holding them for bitmaps from
+* MapBitMapWritable. Write traffic follows the size of the change, not of the image.
+* The headers on disk must describe the same image, as after CreateBitMap or WriteToBitMapFile.
+* @param bmp bitmap with padded uncompressed pixel data and an open file or a writable mapping
+* @return BITMAP_OK, or a negative BITMAPERROR. The dirty ranges are kept if a write fails
+*/
+int SyncBitMap(PBITMAP bmp) {
+    BITMAP_SCOPE(SyncBitMap);
+    int mapped = bmp->allocator.free == bitmap_mapped_free;
+    if (bmp->pixels == NULL || (!mapped && bmp->file == NULL) || !bitmap_is_uncompressed(&bmp->info_header) ||
+        bmp->info_header.bitmap_width < 0) return BITMAP_ERROR;
+    uint32_t row_size = ROW_SIZE(bmp->info_header.bits_per_pixel, (uint32_t)bmp->info_header.bitmap_width);
+    int32_t height = bmp->info_header.bitmap_height;
+    uint32_t rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    if (bmp->pixels_size < (uint64_t)row_size * rows) return BITMAP_ERROR_SIZE;
+#ifndef _WIN32
+    long page_size = sysconf(_SC_PAGESIZE);
+    int fd = -1;
+    if (!mapped) {
+        // Buffered writes through the stream must reach the file before the rows are written around it
+        if (fflush(bmp->file) != 0 || (fd = fileno(bmp->file)) < 0) return BITMAP_ERROR_IO;
+    }
+#endif
+    BITMAPDIRTYROWS *dirty = bmp->dirty;
+    uint32_t end_row = dirty ? (dirty->rows < rows ? dirty->rows : rows) : 0;
+    for (uint32_t y = 0; y < end_row && dirty->count > 0;) {
+        // Whole clean words are skipped, a run of dirty rows becomes one write
+        uint32_t word = dirty->words[y >> 5] >> (y & 31);
+        if (word == 0) {
+            y = (y | 31) + 1;
+            continue;
+        }
+        y += bitmap_ctz32(word);
+        if (y >= end_row) break;
+        uint32_t first = y;
+        while (y < end_row && (dirty->words[y >> 5] >> (y & 31) & 1)) ++y;
+        const uint8_t *src = bmp->pixels + (size_t)first * row_size;
+        size_t length = (size_t)(y - first) * row_size;
+        if (mapped) {
+#ifdef _WIN32
+            if (!FlushViewOfFile(src, length)) return BITMAP_ERROR_IO;
+#else
+            // msync needs a page aligned start, the file offset of the pixels usually isn't
+            uintptr_t start = (uintptr_t)src / (uintptr_t)page_size * (uintptr_t)page_size;
+            if (msync((void *)start, length + ((uintptr_t)src - start), MS_SYNC) != 0) return BITMAP_ERROR_IO;
+#endif
+        } else {
+            uint64_t offset = bmp->file_header.offset + (uint64_t)first * row_size;
+#ifdef _WIN32
+            if (_fseeki64(bmp->file, (__int64)offset, SEEK_SET) != 0 || bitmap_fwrite(src, 1, length, bmp->file) != length) return BITMAP_ERROR_IO;
+#else
+            while (length > 0) {
+                ssize_t written = bitmap_pwrite(fd, src, length, (off_t)offset);
+                if (written < 0 && errno == EINTR) continue;
+                if (written <= 0) return BITMAP_ERROR_IO;
+                src += written;
+                offset += (uint64_t)written;
+                length -= (size_t)written;
+            }
+#endif
+        }
+        // Written rows are clean, a failed write leaves the rest marked
+        for (uint32_t k = first; k < y; ++k) dirty->words[k >> 5] &= ~(1u << (k & 31));
+        dirty->count -= y - first;
+    }
+#ifdef _WIN32
+    if (!mapped && fflush(bmp->file) != 0) return BITMAP_ERROR_IO;
+#endif
+    return BITMAP_OK;
+}
 
 /*
 * A function that inverts the pixels
@@ -288,21 +6747,175 @@ void cleanup(PBITMAP bmp) {
 * @param image_size bitmap image size. Can be obtained by using the IMAGE_SIZE and ROW_SIZE macros
 * @return the inverted pixel values are returned via pixels argument. If you want to keep 
 * the original pixel data make sure to save it!
+* The pixels are treated as 32 bit. Use InvertBitMap for 24 bit bitmaps.
 */
 void InvertPixel(uint8_t *pixels, uint32_t image_size) {
-    for (int i = 0; i < image_size; i += 4) {
-        pixels[i] = 255 - pixels[i];         // Blue component
-        pixels[i + 1] = 255 - pixels[i + 1]; // Green component
-        pixels[i + 2] = 255 - pixels[i + 2]; // Red component
-    }
+    BITMAP_SCOPE(InvertPixel);
+    GetBitMapKernels()->invert(pixels, image_size / 4, 4, NULL);
 }
 
+/*
+* Sets a single pixel. Prefer SetPixelSpan, FillRect or SetPixels when drawing many pixels
+* @param x column of the pixel
+* @param y row of the pixel, counted from the top of the image
+* @param file 24 or 32 bit bitmap with padded pixel data. 24 bit bitmaps ignore alpha
+*/
 void SetPixel(uint32_t x, uint32_t y, uint8_t red, uint8_t green, uint8_t blue, uint8_t alpha, PBITMAP file) {
-    uint32_t index = (y * file->info_header.bitmap_width + x) * 4;
-    file->pixels[index]     = blue;                     // Blue
-    file->pixels[index + 1] = green;                    // Green
-    file->pixels[index + 2] = red;                      // Red
-    file->pixels[index + 3] = alpha;                    // Alpha
+    BITMAP_SCOPE(SetPixel);
+    uint32_t pixel_size = file->info_header.bits_per_pixel / 8;
+    uint8_t *pixel = bitmap_row(file, y) + x * pixel_size;
+    pixel[0] = blue;                                    // Blue
+    pixel[1] = green;                                   // Green
+    pixel[2] = red;                                     // Red
+    if (pixel_size == 4) pixel[3] = alpha;              // Alpha
+    bitmap_mark_dirty(file, y, 1);
+}
+
+typedef struct {
+    uint32_t    x;
+    uint32_t    y;
+    COLOR32BIT  color;
+} BITMAPPOINT;
+
+// Fills count pixels with one color: memset when all bytes match, otherwise the filled part is copied onto the rest
+static void bitmap_fill_pixels(uint8_t *dst, uint32_t count, uint32_t pixel_size, COLOR32BIT color) {
+    if (count == 0) return;
+    if (color.red == color.blue && color.green == color.blue && (pixel_size == 3 || color.alpha == color.blue)) {
+        memset(dst, color.blue, (size_t)count * pixel_size);
+        return;
+    }
+    dst[0] = color.blue;
+    dst[1] = color.green;
+    dst[2] = color.red;
+    if (pixel_size == 4) dst[3] = color.alpha;
+    size_t total = (size_t)count * pixel_size, done = pixel_size;
+    while (done < total) {
+        size_t n = done < total - done ? done : total - done;
+        memcpy(dst + done, dst, n);
+        done += n;
+    }
+}
+
+/*
+* Fills a rectangle. The rectangle is clipped to the bitmap
+* @param bmp 24 or 32 bit bitmap with padded pixel data. 24 bit bitmaps ignore alpha
+* @param x first column
+* @param y first row, counted from the top of the image
+* @param width width of the rectangle
+* @param height height of the rectangle
+* @param color fill color
+* @return 0 on success, -1 if the color depth isn't supported
+*/
+int FillRect(PBITMAP bmp, uint32_t x, uint32_t y, uint32_t width, uint32_t height, COLOR32BIT color) {
+    BITMAP_SCOPE(FillRect);
+    uint32_t pixel_size = bmp->info_header.bits_per_pixel / 8;
+    if ((pixel_size != 3 && pixel_size != 4) || bmp->info_header.bitmap_width < 0) return -1;
+    uint32_t image_width = (uint32_t)bmp->info_header.bitmap_width;
+    int32_t image_height = bmp->info_header.bitmap_height;
+    uint32_t rows = image_height < 0 ? (uint32_t)-(int64_t)image_height : (uint32_t)image_height;
+    if (x >= image_width || y >= rows) return 0;
+    if (width > image_width - x) width = image_width - x;
+    if (height > rows - y) height = rows - y;
+    if (width == 0 || height == 0) return 0;
+
+    ptrdiff_t stride = ROW_SIZE(bmp->info_header.bits_per_pixel, image_width);
+    if (image_height > 0) stride = -stride;
+    uint8_t *first = bitmap_row(bmp, y) + x * pixel_size;
+    bitmap_fill_pixels(first, width, pixel_size, color);
+    size_t span = (size_t)width * pixel_size;
+    uint8_t *row = first;
+    for (uint32_t i = 1; i < height; ++i) {
+        row += stride;
+        memcpy(row, first, span);
+    }
+    bitmap_mark_dirty(bmp, y, height);
+    return 0;
+}
+
+/*
+* Fills a horizontal run of pixels. The run is clipped to the bitmap width
+* @param bmp 24 or 32 bit bitmap with padded pixel data. 24 bit bitmaps ignore alpha
+* @param x first column of the run
+* @param y row of the run, counted from the top of the image
+* @param length number of pixels
+* @param color fill color
+* @return 0 on success, -1 if the color depth isn't supported
+*/
+int SetPixelSpan(PBITMAP bmp, uint32_t x, uint32_t y, uint32_t length, COLOR32BIT color) {
+    BITMAP_SCOPE(SetPixelSpan);
+    return FillRect(bmp, x, y, length, 1, color);
+}
+
+typedef struct {
+    uint32_t    x;
+    uint32_t    y;
+    COLOR24BIT  color;
+} BITMAPPOINT24;
+
+// Checks the depth of a SetPixels target and finds its top row and the step between rows
+static int bitmap_points_target(PBITMAP bmp, uint8_t **top, ptrdiff_t *stride, uint32_t *width, uint32_t *rows) {
+    uint32_t pixel_size = bmp->info_header.bits_per_pixel / 8;
+    if ((pixel_size != 3 && pixel_size != 4) || bmp->info_header.bitmap_width < 0) return -1;
+    int32_t height = bmp->info_header.bitmap_height;
+    *width = (uint32_t)bmp->info_header.bitmap_width;
+    *rows = height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    *stride = ROW_SIZE(bmp->info_header.bits_per_pixel, *width);
+    if (height > 0) *stride = -*stride;
+    *top = *rows ? bitmap_row(bmp, 0) : bmp->pixels;
+    return (int)pixel_size;
+}
+
+/*
+* Sets many single pixels. Points outside the bitmap are skipped, y is counted from the top of the image
+* @param bmp 24 or 32 bit bitmap with padded pixel data. 24 bit bitmaps ignore alpha
+* @param points array of pixel positions and colors
+* @param count number of points
+* @return 0 on success, -1 if the color depth isn't supported
+*/
+int SetPixels(PBITMAP bmp, const BITMAPPOINT *points, size_t count) {
+    BITMAP_SCOPE(SetPixels);
+    uint8_t *top;
+    ptrdiff_t stride;
+    uint32_t width, rows;
+    int pixel_size = bitmap_points_target(bmp, &top, &stride, &width, &rows);
+    if (pixel_size < 0) return -1;
+    for (size_t i = 0; i < count; ++i) {
+        const BITMAPPOINT *p = &points[i];
+        if (p->x >= width || p->y >= rows) continue;
+        uint8_t *pixel = top + (ptrdiff_t)p->y * stride + (size_t)p->x * (uint32_t)pixel_size;
+        pixel[0] = p->color.blue;
+        pixel[1] = p->color.green;
+        pixel[2] = p->color.red;
+        if (pixel_size == 4) pixel[3] = p->color.alpha;
+        bitmap_mark_dirty(bmp, p->y, 1);
+    }
+    return 0;
+}
+
+/*
+* Sets many single pixels from 24 bit colors. Works like SetPixels, the alpha of 32 bit bitmaps is left as it was
+* @param bmp 24 or 32 bit bitmap with padded pixel data
+* @param points array of pixel positions and colors
+* @param count number of points
+* @return 0 on success, -1 if the color depth isn't supported
+*/
+int SetPixels24(PBITMAP bmp, const BITMAPPOINT24 *points, size_t count) {
+    BITMAP_SCOPE(SetPixels24);
+    uint8_t *top;
+    ptrdiff_t stride;
+    uint32_t width, rows;
+    int pixel_size = bitmap_points_target(bmp, &top, &stride, &width, &rows);
+    if (pixel_size < 0) return -1;
+    for (size_t i = 0; i < count; ++i) {
+        const BITMAPPOINT24 *p = &points[i];
+        if (p->x >= width || p->y >= rows) continue;
+        uint8_t *pixel = top + (ptrdiff_t)p->y * stride + (size_t)p->x * (uint32_t)pixel_size;
+        pixel[0] = p->color.blue;
+        pixel[1] = p->color.green;
+        pixel[2] = p->color.red;
+        bitmap_mark_dirty(bmp, p->y, 1);
+    }
+    return 0;
 }
 
 #endif
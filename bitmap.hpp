@@ -0,0 +1,335 @@
+#ifndef BITMAP_HPP
+#define BITMAP_HPP
+/*
+* C++ layer over bitmap.h (C++11, header only)
+* BitmapView<Format, Orientation> knows the bytes per pixel, the channel order and the row order at
+* compile time, so pixel accessors compile to plain loads and stores and per pixel kernels inline and
+* vectorize for each format. Bitmap owns a BITMAP and releases it when it goes out of scope.
+*/
+#include "bitmap.h"
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+namespace bitmap {
+
+/*
+* Pixel formats. bytes is the size of a pixel, red, green, blue and alpha the byte offsets of the
+* channels, alpha is -1 for formats without one. Bitmap files are stored as BGR24 or BGRA32.
+*/
+struct BGR24 {
+    static constexpr uint32_t bytes = 3;
+    static constexpr int red = 2, green = 1, blue = 0, alpha = -1;
+    static constexpr PIXELFORMAT format = PIXELFORMAT_BGR24;
+};
+struct BGRA32 {
+    static constexpr uint32_t bytes = 4;
+    static constexpr int red = 2, green = 1, blue = 0, alpha = 3;
+    static constexpr PIXELFORMAT format = PIXELFORMAT_BGRA32;
+};
+struct RGB24 {
+    static constexpr uint32_t bytes = 3;
+    static constexpr int red = 0, green = 1, blue = 2, alpha = -1;
+    static constexpr PIXELFORMAT format = PIXELFORMAT_RGB24;
+};
+struct RGBA32 {
+    static constexpr uint32_t bytes = 4;
+    static constexpr int red = 0, green = 1, blue = 2, alpha = 3;
+    static constexpr PIXELFORMAT format = PIXELFORMAT_RGBA32;
+};
+
+// Row order of the pixel data. BottomUp is a positive bitmap_height, TopDown a negative one
+enum class Orientation { BottomUp, TopDown };
+
+// ROW_SIZE and IMAGE_SIZE as constant expressions
+constexpr uint32_t row_size(uint32_t bits_per_pixel, uint32_t width) {
+    return ((bits_per_pixel * width + 31) / 32) * 4;
+}
+constexpr size_t image_size(uint32_t row_size, uint32_t rows) {
+    return (size_t)row_size * rows;
+}
+
+struct Color {
+    uint8_t red, green, blue, alpha;
+};
+
+/*
+* Reference to one pixel of a view
+*/
+template <class Format>
+class PixelRef {
+public:
+    explicit PixelRef(uint8_t *p) : p_(p) {}
+    uint8_t &red() const { return p_[Format::red]; }
+    uint8_t &green() const { return p_[Format::green]; }
+    uint8_t &blue() const { return p_[Format::blue]; }
+    // 255 for formats without alpha
+    uint8_t alpha() const { return Format::alpha < 0 ? 255 : p_[Format::alpha < 0 ? 0 : Format::alpha]; }
+    Color get() const { return Color{red(), green(), blue(), alpha()}; }
+    // Formats without alpha ignore color.alpha
+    void set(Color color) const {
+        p_[Format::red] = color.red;
+        p_[Format::green] = color.green;
+        p_[Format::blue] = color.blue;
+        if (Format::alpha >= 0) p_[Format::alpha < 0 ? 0 : Format::alpha] = color.alpha;
+    }
+    const PixelRef &operator=(Color color) const {
+        set(color);
+        return *this;
+    }
+    uint8_t *data() const { return p_; }
+
+private:
+    uint8_t *p_;
+};
+
+/*
+* Forward iterator over the pixels of one row, steps by Format::bytes
+*/
+template <class Format>
+class PixelIterator {
+public:
+    explicit PixelIterator(uint8_t *p) : p_(p) {}
+    PixelRef<Format> operator*() const { return PixelRef<Format>(p_); }
+    PixelIterator &operator++() {
+        p_ += Format::bytes;
+        return *this;
+    }
+    PixelIterator operator++(int) {
+        PixelIterator it = *this;
+        p_ += Format::bytes;
+        return it;
+    }
+    bool operator==(const PixelIterator &other) const { return p_ == other.p_; }
+    bool operator!=(const PixelIterator &other) const { return p_ != other.p_; }
+
+private:
+    uint8_t *p_;
+};
+
+// One row of a view, usable in range-for
+template <class Format>
+class Row {
+public:
+    Row(uint8_t *p, uint32_t width) : p_(p), width_(width) {}
+    PixelIterator<Format> begin() const { return PixelIterator<Format>(p_); }
+    PixelIterator<Format> end() const { return PixelIterator<Format>(p_ + (size_t)width_ * Format::bytes); }
+    PixelRef<Format> operator[](uint32_t x) const { return PixelRef<Format>(p_ + (size_t)x * Format::bytes); }
+    uint8_t *data() const { return p_; }
+    uint32_t width() const { return width_; }
+
+private:
+    uint8_t *p_;
+    uint32_t width_;
+};
+
+/*
+* Non owning view of padded pixel data. x and y count from the top left corner for both orientations,
+* the stored row order only changes the sign of the stride.
+*/
+template <class Format, Orientation O = Orientation::BottomUp>
+class BitmapView {
+public:
+    static constexpr uint32_t bytes_per_pixel = Format::bytes;
+    static constexpr Orientation orientation = O;
+
+    BitmapView() : pixels_(nullptr), width_(0), height_(0), row_size_(0) {}
+    /*
+    * @param pixels first stored row of padded pixel data
+    * @param width the image width
+    * @param height number of rows, without the sign of bitmap_height
+    */
+    BitmapView(uint8_t *pixels, uint32_t width, uint32_t height)
+        : pixels_(pixels), width_(width), height_(height), row_size_(bitmap::row_size(Format::bytes * 8, width)) {}
+
+    uint32_t width() const { return width_; }
+    uint32_t height() const { return height_; }
+    uint32_t row_size() const { return row_size_; }
+    bool empty() const { return pixels_ == nullptr; }
+    // Bytes from one row to the one below it
+    ptrdiff_t stride() const { return O == Orientation::TopDown ? (ptrdiff_t)row_size_ : -(ptrdiff_t)row_size_; }
+
+    // Address of row y counted from the top
+    uint8_t *row_data(uint32_t y) const {
+        size_t index = O == Orientation::TopDown ? y : height_ - 1 - y;
+        return pixels_ + index * row_size_;
+    }
+    Row<Format> row(uint32_t y) const { return Row<Format>(row_data(y), width_); }
+    PixelRef<Format> operator()(uint32_t x, uint32_t y) const {
+        return PixelRef<Format>(row_data(y) + (size_t)x * Format::bytes);
+    }
+
+    /*
+    * Calls f(row) for every row from the top, row is a Row<Format>
+    */
+    template <class F>
+    void for_each_row(F f) const {
+        if (height_ == 0) return;
+        uint8_t *p = row_data(0);
+        // Stops before stepping past the last row, a bottom-up step there would leave the buffer
+        for (uint32_t y = 1;; ++y, p += stride()) {
+            f(Row<Format>(p, width_));
+            if (y == height_) break;
+        }
+    }
+
+    /*
+    * Calls f(pixel) for every pixel, pixel is a PixelRef<Format>.
+    * The inner loop has a constant pixel size, so simple kernels vectorize.
+    */
+    template <class F>
+    void for_each_pixel(F f) const {
+        for_each_row([&f](Row<Format> r) {
+            uint8_t *p = r.data();
+            uint8_t *end = p + (size_t)r.width() * Format::bytes;
+            for (; p != end; p += Format::bytes) f(PixelRef<Format>(p));
+        });
+    }
+
+    // Inverts the color channels, alpha is kept
+    void invert() const {
+        for_each_pixel([](PixelRef<Format> px) {
+            px.red() = (uint8_t)~px.red();
+            px.green() = (uint8_t)~px.green();
+            px.blue() = (uint8_t)~px.blue();
+        });
+    }
+
+    void fill(Color color) const {
+        for_each_pixel([color](PixelRef<Format> px) { px.set(color); });
+    }
+
+private:
+    uint8_t *pixels_;
+    uint32_t width_;
+    uint32_t height_;
+    uint32_t row_size_;
+};
+
+/*
+* Move only owner of a BITMAP. The destructor releases everything it owns with ReleaseBitMap, which is cleanup
+* without its messages for members that were never set.
+*/
+class Bitmap {
+public:
+    Bitmap() { memset(&bmp_, 0, sizeof(bmp_)); }
+    // Takes ownership of bmp
+    explicit Bitmap(const BITMAP &bmp) : bmp_(bmp) {}
+    Bitmap(Bitmap &&other) noexcept : bmp_(other.bmp_) { memset(&other.bmp_, 0, sizeof(other.bmp_)); }
+    Bitmap &operator=(Bitmap &&other) noexcept {
+        if (this != &other) {
+            reset();
+            bmp_ = other.bmp_;
+            memset(&other.bmp_, 0, sizeof(other.bmp_));
+        }
+        return *this;
+    }
+    Bitmap(const Bitmap &) = delete;
+    Bitmap &operator=(const Bitmap &) = delete;
+    ~Bitmap() { reset(); }
+
+    /*
+    * Reads a bitmap file, see ReadBitMapEx. The result is empty if the file can't be read
+    */
+    static Bitmap read(const char *file_name, const BITMAPALLOCATOR *allocator = nullptr) {
+        return Bitmap(ReadBitMapEx(file_name, allocator));
+    }
+
+    /*
+    * Pads UNPADED pixel data into a new bitmap, see GenerateBitMapDataEx. The result is empty on failure
+    */
+    static Bitmap generate(int32_t width, int32_t height, uint16_t bits_per_pixel, const uint8_t *pixels,
+                           uint32_t compression = BI_RGB, const BITMAPALLOCATOR *allocator = nullptr) {
+        PBITMAP generated = GenerateBitMapDataEx(width, height, bits_per_pixel, pixels, compression, allocator);
+        Bitmap result;
+        if (generated == NULL) return result;
+        result.bmp_ = *generated;
+        // Only the structure goes, the pixels now belong to result
+        BITMAPALLOCATOR owner = generated->allocator;
+        if (owner.free) owner.free(generated, sizeof(BITMAP), owner.user);
+        else free(generated);
+        return result;
+    }
+
+    /*
+    * Writes the headers and the padded pixels, like WriteToBitMapFile
+    * @return 0 on success, -1 on failure
+    */
+    int write(const char *file_name) const {
+        if (empty()) return -1;
+        FILE *bitmap_file = fopen(file_name, "wb");
+        if (bitmap_file == NULL) return -1;
+        WriteToBitMapFile(bitmap_file, const_cast<PBITMAP>(&bmp_));
+        int result = ferror(bitmap_file) ? -1 : 0;
+        if (fclose(bitmap_file) != 0) result = -1;
+        return result;
+    }
+
+    bool empty() const { return bmp_.pixels == nullptr; }
+    explicit operator bool() const { return !empty(); }
+    uint32_t width() const { return bmp_.info_header.bitmap_width < 0 ? 0 : (uint32_t)bmp_.info_header.bitmap_width; }
+    uint32_t height() const {
+        int32_t height = bmp_.info_header.bitmap_height;
+        return height < 0 ? (uint32_t)-(int64_t)height : (uint32_t)height;
+    }
+    uint16_t bits_per_pixel() const { return bmp_.info_header.bits_per_pixel; }
+    Orientation orientation() const {
+        return bmp_.info_header.bitmap_height < 0 ? Orientation::TopDown : Orientation::BottomUp;
+    }
+
+    /*
+    * Typed view of the pixels. Empty if the bitmap is empty, compressed, or its depth or row order
+    * don't match Format and O. Format is a stored format, BGR24 or BGRA32. For RGB24 or RGBA32 pixels
+    * convert while reading, with ReadBitMapRowsAs
+    */
+    template <class Format, Orientation O = Orientation::BottomUp>
+    BitmapView<Format, O> view() const {
+        static_assert(std::is_same<Format, BGR24>::value || std::is_same<Format, BGRA32>::value,
+                      "bitmap files store BGR24 or BGRA32, use ReadBitMapRowsAs to read other formats");
+        if (empty() || bmp_.info_header.bits_per_pixel != Format::bytes * 8 || orientation() != O ||
+            !bitmap_is_uncompressed(&bmp_.info_header)) {
+            return BitmapView<Format, O>();
+        }
+        return BitmapView<Format, O>(bmp_.pixels, width(), height());
+    }
+
+    /*
+    * Calls f(view) with the view whose orientation matches the bitmap. f takes both view types (a generic
+    * lambda or a functor template) and is compiled once per row order
+    * @return false if the bitmap has no view of Format
+    */
+    template <class Format, class F>
+    bool visit(F f) const {
+        if (orientation() == Orientation::TopDown) {
+            BitmapView<Format, Orientation::TopDown> v = view<Format, Orientation::TopDown>();
+            if (v.empty()) return false;
+            f(v);
+        } else {
+            BitmapView<Format, Orientation::BottomUp> v = view<Format, Orientation::BottomUp>();
+            if (v.empty()) return false;
+            f(v);
+        }
+        return true;
+    }
+
+    // The underlying bitmap for the C functions. It stays owned by this object
+    PBITMAP get() { return &bmp_; }
+    const BITMAP *get() const { return &bmp_; }
+
+    // Gives up ownership, the caller releases the result with cleanup
+    BITMAP release() {
+        BITMAP bmp = bmp_;
+        memset(&bmp_, 0, sizeof(bmp_));
+        return bmp;
+    }
+
+    void reset() { ReleaseBitMap(&bmp_); }
+
+private:
+    BITMAP bmp_;
+};
+
+} // namespace bitmap
+
+#endif // BITMAP_HPP
@@ -0,0 +1,1196 @@
+/*
+* Regression tests. Each test writes its input files next to the executable and returns 0 on success.
+* Build with the CMake option BITMAP_BUILD_TESTS, the tests run under AddressSanitizer where the compiler has it.
+*/
+#include "bitmap.h"
+
+static int failures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        ++failures; \
+        return; \
+    } \
+} while (0)
+
+// Writes a width x height image whose channel c of pixel (x, y) is pattern_byte(x, y, c)
+static uint8_t pattern_byte(uint32_t x, uint32_t y, uint32_t c) {
+    return (uint8_t)(x * 7 + y * 31 + c * 89 + 1);
+}
+
+static int write_pattern(const char *file_name, uint32_t width, uint32_t height, uint32_t bits_per_pixel) {
+    uint32_t pixel_size = bits_per_pixel / 8;
+    uint8_t *pixels = (uint8_t *)malloc((size_t)width * height * pixel_size);
+    if (pixels == NULL) return -1;
+    // CreateBitMap takes unpadded rows, bottom row first
+    for (uint32_t y = 0; y < height; ++y) {
+        for (uint32_t x = 0; x < width; ++x) {
+            for (uint32_t c = 0; c < pixel_size; ++c) {
+                pixels[((size_t)(height - 1 - y) * width + x) * pixel_size + c] = pattern_byte(x, y, c);
+            }
+        }
+    }
+    BITMAP bitmap = CreateBitMap(file_name, (int32_t)width, (int32_t)height, pixels, bits_per_pixel, BI_RGB);
+    free(pixels);
+    if (bitmap.pixels == NULL || bitmap.file == NULL) return -1;
+    cleanup(&bitmap);
+    return 0;
+}
+
+// Writes size bytes to a new file
+static int write_file(const char *file_name, const void *data, size_t size) {
+    FILE *f = fopen(file_name, "wb");
+    if (f == NULL) return -1;
+    size_t written = fwrite(data, 1, size, f);
+    return fclose(f) == 0 && written == size ? 0 : -1;
+}
+
+// Fills in a file header and the BITMAPINFOHEADER fields of a header_size byte info header, everything else stays as it is
+static void put_headers(uint8_t *file, uint32_t file_size, uint32_t header_size, int32_t width, int32_t height,
+                        uint16_t bits_per_pixel, uint32_t compression, uint32_t offset) {
+    const uint16_t planes = 1;
+    file[0] = 'B';
+    file[1] = 'M';
+    memcpy(file + 2, &file_size, 4);
+    memcpy(file + 10, &offset, 4);
+    memcpy(file + 14, &header_size, 4);
+    memcpy(file + 18, &width, 4);
+    memcpy(file + 22, &height, 4);
+    memcpy(file + 26, &planes, 2);
+    memcpy(file + 28, &bits_per_pixel, 2);
+    memcpy(file + 30, &compression, 4);
+}
+
+// A 32 bit file read as BGR24 must not write more than width * 3 bytes per row
+static void test_read_rows_as_narrower_format(void) {
+    const uint32_t width = 5, height = 4;
+    CHECK(write_pattern("rows_as_32.bmp", width, height, 32) == 0);
+    BITMAPSTREAM stream;
+    CHECK(OpenBitMapStream("rows_as_32.bmp", &stream) == 0);
+    // Exactly sized, AddressSanitizer reports a write past the end
+    uint8_t *buffer = (uint8_t *)malloc((size_t)width * height * 3);
+    CHECK(buffer != NULL);
+    uint32_t done = ReadBitMapRowsAs(&stream, buffer, height, PIXELFORMAT_BGR24);
+    CloseBitMapStream(&stream);
+    int ok = done == height;
+    // Stream rows are in file order, bottom row first
+    for (uint32_t row = 0; ok && row < height; ++row) {
+        for (uint32_t x = 0; x < width; ++x) {
+            for (uint32_t c = 0; c < 3; ++c) {
+                if (buffer[((size_t)row * width + x) * 3 + c] != pattern_byte(x, height - 1 - row, c)) ok = 0;
+            }
+        }
+    }
+    free(buffer);
+    CHECK(ok);
+}
+
+// Width 4 and 3 at 24 bpp both pad to 12 bytes, the region rows still start at x and end at the region width
+static void test_region_with_same_stride(void) {
+    const uint32_t width = 4, height = 3;
+    CHECK(write_pattern("region_24.bmp", width, height, 24) == 0);
+    BITMAP region = ReadBitMapRegion("region_24.bmp", 1, 0, 3, height);
+    CHECK(region.pixels != NULL);
+    uint32_t stride = ROW_SIZE(24, 3);
+    int ok = region.info_header.bitmap_width == 3 && region.info_header.bitmap_height == (int32_t)height;
+    for (uint32_t y = 0; ok && y < height; ++y) {
+        const uint8_t *row = region.pixels + (size_t)(height - 1 - y) * stride;
+        for (uint32_t x = 0; x < 3; ++x) {
+            for (uint32_t c = 0; c < 3; ++c) {
+                if (row[x * 3 + c] != pattern_byte(x + 1, y, c)) ok = 0;
+            }
+        }
+        // Padding is zero, not the first pixel of the next row
+        for (uint32_t k = 9; k < stride; ++k) {
+            if (row[k] != 0) ok = 0;
+        }
+    }
+    ReleaseBitMap(&region);
+    CHECK(ok);
+}
+
+// A BITMAPINFOHEADER file is followed by its palette, not by masks. The region keeps the palette and has no masks
+static void test_region_keeps_palette(void) {
+    uint8_t file[14 + 40 + 2 * 4 + 4] = { 0 };
+    put_headers(file, sizeof(file), 40, 3, 1, 8, BI_RGB, 14 + 40 + 2 * 4);
+    const uint32_t colors = 2;
+    memcpy(file + 14 + 32, &colors, 4);
+    const uint8_t palette[8] = { 10, 20, 30, 0, 40, 50, 60, 0 };
+    memcpy(file + 14 + 40, palette, sizeof(palette));
+    file[14 + 40 + 8 + 2] = 1;
+    CHECK(write_file("region_8.bmp", file, sizeof(file)) == 0);
+    BITMAP region = ReadBitMapRegion("region_8.bmp", 1, 0, 2, 1);
+    int ok = region.pixels != NULL && region.pixels[0] == 0 && region.pixels[1] == 1;
+    ok = ok && region.palette != NULL && region.palette_colors == 2 && memcmp(region.palette, palette, sizeof(palette)) == 0;
+    ok = ok && region.info_header.red_mask == 0 && region.info_header.green_mask == 0 && region.info_header.blue_mask == 0;
+    ReleaseBitMap(&region);
+    CHECK(ok);
+}
+
+// A width whose row size doesn't fit 32 bits is rejected before the strides are computed
+static void test_region_of_oversized_width(void) {
+    uint8_t file[118] = { 0 };
+    put_headers(file, sizeof(file), 40, 0x40000001, 1, 32, BI_RGB, 14 + 40);
+    CHECK(write_file("region_wide.bmp", file, sizeof(file)) == 0);
+    BITMAP region = ReadBitMapRegion("region_wide.bmp", 1, 0, 0x40000000, 1);
+    CHECK(region.pixels == NULL);
+    ReleaseBitMap(&region);
+}
+
+typedef struct {
+    int polled;
+    int waited;
+} FUTURECHAIN;
+
+static void chain_callback(BITMAPFUTURE *future, void *user) {
+    FUTURECHAIN *chain = (FUTURECHAIN *)user;
+    chain->polled = PollBitMapFuture(future);
+    chain->waited = WaitBitMapFuture(future);
+}
+
+// The callback sees a finished future, waiting on it from there returns instead of blocking the worker
+static void test_future_callback_sees_result(void) {
+    CHECK(write_pattern("future_24.bmp", 3, 2, 24) == 0);
+    FUTURECHAIN chain = { -1, -1 };
+    BITMAPFUTURE *future = ReadBitMapAsync(NULL, "future_24.bmp", chain_callback, &chain);
+    CHECK(future != NULL);
+    int result = WaitBitMapFuture(future);
+    FreeBitMapFuture(future);
+    CHECK(result == 0);
+    CHECK(chain.polled == 1 && chain.waited == 0);
+}
+
+// Rows changed through SetPixel allocate the dirty table, ReleaseBitMap frees it with the rest (LeakSanitizer checks)
+static void test_release_frees_dirty_rows(void) {
+    uint8_t pixels[4 * 3 * 3] = { 0 };
+    BITMAP bitmap = CreateBitMap("release_24.bmp", 4, 3, pixels, 24, BI_RGB);
+    CHECK(bitmap.pixels != NULL && bitmap.file != NULL);
+    SetPixel(1, 1, 255, 0, 0, 0, &bitmap);
+    CHECK(bitmap.dirty != NULL);
+    ReleaseBitMap(&bitmap);
+    CHECK(bitmap.pixels == NULL && bitmap.dirty == NULL && bitmap.file == NULL);
+}
+
+// A delta past the right edge followed by a run must not write past the row, the runs are clipped
+static void test_rle_run_after_delta_past_row(void) {
+    const uint8_t src[] = {
+        2, 0xAA,        // Two pixels in row 0
+        0, 0,           // End of line
+        0, 2, 6, 0,     // Delta 6 to the right, past the 4 pixel row
+        3, 0xBB,        // Run that starts outside the row
+        0, 1            // End of bitmap
+    };
+    uint8_t *dst = (uint8_t *)malloc(4 * 2);
+    CHECK(dst != NULL);
+    int result = DecodeRLE(src, sizeof(src), BI_RLE8, 4, 2, dst, 4);
+    int ok = result == 0 && dst[0] == 0xAA && dst[1] == 0xAA && dst[2] == 0 && dst[4] == 0 && dst[7] == 0;
+    free(dst);
+    CHECK(ok);
+}
+
+// SetPixels stores blue, green, red, alpha in that byte order, SetPixels24 keeps the alpha of 32 bit pixels
+static void test_set_pixels_byte_order(void) {
+    uint8_t pixels[2 * 2 * 4];
+    memset(pixels, 0x55, sizeof(pixels));
+    BITMAP bitmap = CreateBitMap("set_pixels_32.bmp", 2, 2, pixels, 32, BI_RGB);
+    CHECK(bitmap.pixels != NULL && bitmap.file != NULL);
+    const BITMAPPOINT points[] = { { 0, 0, { 1, 2, 3, 4 } }, { 5, 0, { 9, 9, 9, 9 } } };
+    const BITMAPPOINT24 points24[] = { { 1, 1, { 5, 6, 7 } } };
+    int ok = SetPixels(&bitmap, points, 2) == 0 && SetPixels24(&bitmap, points24, 1) == 0;
+    // Bottom-up file, the top row is stored last
+    const uint8_t *top = bitmap.pixels + 8, *bottom = bitmap.pixels;
+    ok = ok && top[0] == 3 && top[1] == 2 && top[2] == 1 && top[3] == 4;
+    ok = ok && bottom[4] == 7 && bottom[5] == 6 && bottom[6] == 5 && bottom[7] == 0x55;
+    cleanup(&bitmap);
+    CHECK(ok);
+}
+
+static void *failing_alloc(size_t size, size_t alignment, void *user) {
+    (void)size; (void)alignment; (void)user;
+    return NULL;
+}
+
+static void failing_free(void *ptr, size_t size, void *user) {
+    (void)ptr; (void)size; (void)user;
+}
+
+// A read that fails after the headers leaves zeroed statistics, not ones initialized for the file's channels
+static void test_histogram_of_failed_read(void) {
+    CHECK(write_pattern("histogram_24.bmp", 4, 4, 24) == 0);
+    const BITMAPALLOCATOR allocator = { failing_alloc, failing_free, NULL };
+    static BITMAPHISTOGRAM histogram;
+    static BITMAPCHANNELSTATS stats;
+    BITMAP bitmap = ReadBitMapWithHistogram("histogram_24.bmp", &allocator, &histogram, &stats);
+    CHECK(bitmap.pixels == NULL);
+    CHECK(histogram.channels == 0 && histogram.pixels == 0);
+    CHECK(stats.channels == 0 && stats.pixels == 0);
+}
+
+// ReadBitMap keeps its unpadded rows, ReadBitMapEx pads them to ROW_SIZE
+static void test_read_bitmap_row_layout(void) {
+    const uint32_t width = 5, height = 3;
+    CHECK(write_pattern("layout_24.bmp", width, height, 24) == 0);
+    BITMAP dense = ReadBitMap("layout_24.bmp");
+    BITMAP padded = ReadBitMapEx("layout_24.bmp", NULL);
+    int ok = dense.pixels != NULL && padded.pixels != NULL;
+    uint32_t row_size = ROW_SIZE(24, width);
+    // Bottom-up file, the first stored row is the bottom one
+    for (uint32_t row = 0; ok && row < height; ++row) {
+        for (uint32_t x = 0; x < width; ++x) {
+            for (uint32_t c = 0; c < 3; ++c) {
+                uint8_t expected = pattern_byte(x, height - 1 - row, c);
+                if (dense.pixels[((size_t)row * width + x) * 3 + c] != expected) ok = 0;
+                if (padded.pixels[(size_t)row * row_size + x * 3 + c] != expected) ok = 0;
+            }
+        }
+    }
+    ReleaseBitMap(&dense);
+    ReleaseBitMap(&padded);
+    CHECK(ok);
+}
+
+// Writes a bitmap with WriteToBitMapFile and reads the file back
+static BITMAP write_and_read(const char *file_name, PBITMAP bitmap) {
+    FILE *f = fopen(file_name, "wb");
+    if (f != NULL) {
+        WriteToBitMapFile(f, bitmap);
+        fclose(f);
+    }
+    return ReadBitMapEx(file_name, NULL);
+}
+
+// A 3x2 24 bit file with a header_size byte info header, image_size 0 as BI_RGB allows. Pixel byte i is i + 1
+static void round_trip_header(uint32_t header_size, const char *file_name, const char *copy_name) {
+    uint8_t file[14 + 124 + 2 * 12] = { 0 };
+    uint32_t offset = 14 + header_size;
+    put_headers(file, offset + 24, header_size, 3, 2, 24, BI_RGB, offset);
+    for (uint32_t i = 0; i < 24; ++i) file[offset + i] = (uint8_t)(i % 12 < 9 ? i + 1 : 0);
+    CHECK(write_file(file_name, file, offset + 24) == 0);
+    BITMAP bitmap = ReadBitMapEx(file_name, NULL);
+    CHECK(bitmap.pixels != NULL);
+    CHECK(bitmap.info_header.header_size == sizeof(BITMAPV4HEADER) && bitmap.info_header.image_size == 24);
+    BITMAP copy = write_and_read(copy_name, &bitmap);
+    int ok = copy.pixels != NULL && memcmp(copy.pixels, file + offset, 24) == 0 && copy.file_header.size == 14 + 108 + 24;
+    ReleaseBitMap(&bitmap);
+    ReleaseBitMap(&copy);
+    CHECK(ok);
+}
+
+// Headers of a read bitmap describe the file WriteToBitMapFile makes of it, not the source file
+static void test_round_trip_info_header(void) {
+    round_trip_header(40, "round_trip_40.bmp", "round_trip_40_copy.bmp");
+}
+
+static void test_round_trip_v5_header(void) {
+    round_trip_header(124, "round_trip_124.bmp", "round_trip_124_copy.bmp");
+}
+
+// The color table of an 8 bit image is written back and found again
+static void test_round_trip_palette(void) {
+    const uint8_t indices[4] = { 0, 1, 1, 0 };
+    const uint8_t palette[8] = { 10, 20, 30, 0, 40, 50, 60, 0 };
+    CHECK(WriteBitMapIndexed("round_trip_8.bmp", 2, 2, 8, indices, palette, 2) == 0);
+    BITMAP bitmap = ReadBitMapEx("round_trip_8.bmp", NULL);
+    CHECK(bitmap.pixels != NULL && bitmap.palette_colors == 2);
+    BITMAP copy = write_and_read("round_trip_8_copy.bmp", &bitmap);
+    int ok = copy.pixels != NULL && copy.palette_colors == 2 && memcmp(copy.palette, palette, sizeof(palette)) == 0 &&
+             memcmp(copy.pixels, bitmap.pixels, bitmap.info_header.image_size) == 0;
+    ReleaseBitMap(&bitmap);
+    ReleaseBitMap(&copy);
+    CHECK(ok);
+}
+
+// A 3x2 24 bit file without the padding of its last row. Pixel byte i of stored row r is r * 16 + i + 1
+static int write_unpadded_end(const char *file_name) {
+    uint8_t file[14 + 40 + 12 + 9] = { 0 };
+    put_headers(file, sizeof(file), 40, 3, 2, 24, BI_RGB, 14 + 40);
+    for (uint32_t r = 0; r < 2; ++r) {
+        for (uint32_t i = 0; i < 9; ++i) file[14 + 40 + r * 12 + i] = (uint8_t)(r * 16 + i + 1);
+    }
+    return write_file(file_name, file, sizeof(file));
+}
+
+// Every reader accepts the missing padding that bitmap_check_pixel_array allows
+static void test_missing_last_padding(void) {
+    CHECK(write_unpadded_end("unpadded_end.bmp") == 0);
+    BITMAPSTREAM stream;
+    CHECK(OpenBitMapStream("unpadded_end.bmp", &stream) == 0);
+    uint8_t rows[2 * 9];
+    uint32_t done = ReadBitMapRows(&stream, rows, 2);
+    CloseBitMapStream(&stream);
+    CHECK(done == 2 && rows[9] == 17 && rows[17] == 25);
+    BITMAP region = ReadBitMapRegion("unpadded_end.bmp", 0, 0, 3, 2);
+    int ok = region.pixels != NULL && region.pixels[12] == 17 && region.pixels[20] == 25 && region.pixels[21] == 0;
+    ReleaseBitMap(&region);
+    CHECK(ok);
+    BITMAP small = ReadBitMapDownscaled("unpadded_end.bmp", 2, NULL);
+    ok = small.pixels != NULL && small.info_header.bitmap_width == 2 && small.info_header.bitmap_height == 1;
+    ReleaseBitMap(&small);
+    CHECK(ok);
+}
+
+// ProbeBitMap accepts and rejects the same headers as the readers
+static void test_probe_matches_parser(void) {
+    uint8_t file[14 + 40 + 12 + 4] = { 0 };
+    BITMAPPROBE probe;
+    put_headers(file, sizeof(file), 40, 1, 1, 7, BI_RGB, 14 + 40);
+    CHECK(write_file("probe.bmp", file, sizeof(file)) == 0);
+    CHECK(ProbeBitMap("probe.bmp", &probe) == -1);
+    // The masks of a BI_BITFIELDS BITMAPINFOHEADER follow the header, the pixels can't start before them
+    put_headers(file, sizeof(file), 40, 1, 1, 32, BI_BITFIELDS, 14 + 40);
+    CHECK(write_file("probe.bmp", file, sizeof(file)) == 0);
+    CHECK(ProbeBitMap("probe.bmp", &probe) == -1);
+    put_headers(file, sizeof(file), 40, 1, 0, 24, BI_RGB, 14 + 40);
+    CHECK(write_file("probe.bmp", file, sizeof(file)) == 0);
+    CHECK(ProbeBitMap("probe.bmp", &probe) == 0 && probe.height == 0 && probe.header_size == 40 && probe.bits_per_pixel == 24);
+}
+
+// An expanded RLE8 image is a plain 32 bit image: written and read back it has the same pixels
+static void test_expand_rle_round_trip(void) {
+    const uint8_t indices[4 * 2] = { 0, 0, 1, 2, 2, 2, 1, 0 };
+    const uint8_t palette[3 * 4] = { 10, 20, 30, 0, 40, 50, 60, 0, 70, 80, 90, 0 };
+    CHECK(WriteBitMapRLE("expand_rle8.bmp", 4, 2, indices, palette, 3, BI_RLE8) == 0);
+    BITMAP bitmap = ReadBitMapEx("expand_rle8.bmp", NULL);
+    CHECK(bitmap.pixels != NULL && bitmap.palette != NULL);
+    CHECK(ExpandIndexedBitMap(&bitmap) == 0);
+    CHECK(bitmap.palette == NULL && bitmap.info_header.n_colors_in_palette == 0 && bitmap.file_header.offset == 14 + 108);
+    BITMAP copy = write_and_read("expand_rle8_copy.bmp", &bitmap);
+    int ok = copy.pixels != NULL && copy.info_header.bits_per_pixel == 32 &&
+             memcmp(copy.pixels, bitmap.pixels, 4 * 2 * 4) == 0 && bitmap.pixels[0] == 10 && bitmap.pixels[4 * 4 + 2] == 90;
+    ReleaseBitMap(&bitmap);
+    ReleaseBitMap(&copy);
+    CHECK(ok);
+}
+
+// ReadBitMapInto can't convert bit fields in a caller's buffer and rejects them. Its result records the buffer size
+static void test_read_into_caller_buffer(void) {
+    uint8_t buffer[4 * 4 * 4];
+    BITMAP bitmap;
+    CHECK(write_pattern("into_32.bmp", 4, 4, 32) == 0);
+    CHECK(ReadBitMapInto("into_32.bmp", buffer, 0, &bitmap) == 0);
+    CHECK(bitmap.pixels == buffer && bitmap.pixels_size == sizeof(buffer) && buffer[0] == pattern_byte(0, 3, 0));
+    uint8_t file[14 + 40 + 12 + 4] = { 0 };
+    put_headers(file, sizeof(file), 40, 1, 1, 32, BI_BITFIELDS, 14 + 40 + 12);
+    const uint32_t masks[3] = { 0x00ff0000, 0x0000ff00, 0x000000ff };
+    memcpy(file + 14 + 40, masks, sizeof(masks));
+    CHECK(write_file("into_bitfields.bmp", file, sizeof(file)) == 0);
+    CHECK(GetBitMapBufferSize("into_bitfields.bmp", 0) == 0);
+    CHECK(ReadBitMapInto("into_bitfields.bmp", buffer, 0, &bitmap) == -1);
+}
+
+// Resizing changes the dimensions only. A box halving of 2x2 blocks of one color gives those colors
+static void test_resize_keeps_headers(void) {
+    uint8_t pixels[4 * 2 * 3];
+    for (uint32_t y = 0; y < 2; ++y) {
+        for (uint32_t x = 0; x < 4; ++x) {
+            for (uint32_t c = 0; c < 3; ++c) pixels[(y * 4 + x) * 3 + c] = (uint8_t)(x < 2 ? 40 + c : 200 + c);
+        }
+    }
+    PBITMAP bitmap = GenerateBitMapData(4, 2, 24, pixels, BI_RGB);
+    CHECK(bitmap != NULL);
+    bitmap->info_header.horizontal_resolution = 1234;
+    bitmap->info_header.color_space = S_RGB;
+    int ok = ResizeBitMap(bitmap, 2, 1, RESIZE_BOX, NULL) == 0;
+    ok = ok && bitmap->info_header.bitmap_width == 2 && bitmap->info_header.bitmap_height == 1 &&
+         bitmap->info_header.image_size == 8 && bitmap->file_header.size == bitmap->file_header.offset + 8;
+    ok = ok && bitmap->info_header.horizontal_resolution == 1234 && bitmap->info_header.color_space == S_RGB;
+    ok = ok && bitmap->pixels[0] == 40 && bitmap->pixels[2] == 42 && bitmap->pixels[3] == 200 && bitmap->pixels[5] == 202;
+    FreeBitMap(bitmap);
+    CHECK(ok);
+}
+
+// A flip of a bitmap with a file survives SyncBitMap, the rows move instead of the height changing sign
+static void test_flip_survives_sync(void) {
+    const uint32_t width = 2, height = 3;
+    CHECK(write_pattern("flip_sync.bmp", width, height, 24) == 0);
+    BITMAP bitmap;
+    CHECK(MapBitMapWritable("flip_sync.bmp", &bitmap) == 0);
+    int ok = FlipBitMap(&bitmap, BITMAP_FLIP_HORIZONTAL | BITMAP_FLIP_VERTICAL, NULL) == 0 &&
+             bitmap.info_header.bitmap_height == (int32_t)height && SyncBitMap(&bitmap) == 0;
+    ReleaseBitMap(&bitmap);
+    CHECK(ok);
+    BITMAP flipped = ReadBitMapEx("flip_sync.bmp", NULL);
+    CHECK(flipped.pixels != NULL && flipped.info_header.bitmap_height == (int32_t)height);
+    uint32_t row_size = ROW_SIZE(24, width);
+    // Stored row r of a bottom-up file is image row height - 1 - r, after the flip it holds image row r mirrored
+    for (uint32_t r = 0; ok && r < height; ++r) {
+        for (uint32_t x = 0; x < width; ++x) {
+            for (uint32_t c = 0; c < 3; ++c) {
+                if (flipped.pixels[r * row_size + x * 3 + c] != pattern_byte(width - 1 - x, r, c)) ok = 0;
+            }
+        }
+    }
+    ReleaseBitMap(&flipped);
+    CHECK(ok);
+}
+
+// Sets up a view of uncompressed pixels in memory, rows stored bottom-up for a positive height
+static void memory_view(PBITMAPVIEW view, const uint8_t *pixels, int32_t width, int32_t height, uint16_t bits_per_pixel) {
+    memset(view, 0, sizeof(*view));
+    view->info_header.bitmap_width = width;
+    view->info_header.bitmap_height = height;
+    view->info_header.bits_per_pixel = bits_per_pixel;
+    view->info_header.compression_method = BI_RGB;
+    view->pixels = pixels;
+    view->stride = ROW_SIZE(bits_per_pixel, (uint32_t)width);
+}
+
+// Rows longer than 4096 blocks of 16 bytes fold their lane sums, the stats don't depend on the stored row order
+static void test_compare_stats_and_hash(void) {
+    const uint32_t width = 30000, row_bytes = width * 3;
+    uint8_t *a = (uint8_t *)malloc((size_t)row_bytes * 2);
+    uint8_t *b = (uint8_t *)malloc((size_t)row_bytes * 2);
+    uint8_t *same = (uint8_t *)malloc((size_t)row_bytes * 2);
+    int ok = a != NULL && b != NULL && same != NULL;
+    // a is bottom-up, b and same are top-down, b adds 2 to channel 0 and 1 to channels 1 and 2
+    for (uint32_t y = 0; ok && y < 2; ++y) {
+        for (uint32_t i = 0; i < row_bytes; ++i) {
+            uint8_t value = (uint8_t)((i * 7 + y * 13) % 200);
+            a[(size_t)(1 - y) * row_bytes + i] = value;
+            same[(size_t)y * row_bytes + i] = value;
+            b[(size_t)y * row_bytes + i] = (uint8_t)(value + (i % 3 == 0 ? 2 : 1));
+        }
+    }
+    BITMAPVIEW view_a, view_b, view_same;
+    BITMAPDIFFSTATS stats;
+    if (ok) {
+        memory_view(&view_a, a, (int32_t)width, 2, 24);
+        memory_view(&view_b, b, (int32_t)width, -2, 24);
+        memory_view(&view_same, same, (int32_t)width, -2, 24);
+        ok = CompareBitMaps(&view_a, &view_b, &stats, NULL) == 0 && !stats.identical && stats.channels == 3 &&
+             stats.changed_pixels == (uint64_t)width * 2 && stats.max_diff[0] == 2 && stats.max_diff[1] == 1 &&
+             stats.max_diff[2] == 1 && stats.mean_diff[0] == 2.0 && stats.mean_diff[1] == 1.0 && stats.mean_diff[2] == 1.0 &&
+             fabs(stats.psnr - 10.0 * log10(255.0 * 255.0 / 2.0)) < 1e-9 &&
+             stats.x == 0 && stats.y == 0 && stats.width == width && stats.height == 2;
+        ok = ok && CompareBitMaps(&view_a, &view_same, &stats, NULL) == 0 && stats.identical && isinf(stats.psnr);
+        ok = ok && HashBitMapView(&view_a, 0) == HashBitMapView(&view_same, 0) &&
+             HashBitMapView(&view_a, 0) != HashBitMapView(&view_b, 0);
+    }
+    free(a);
+    free(b);
+    free(same);
+    CHECK(ok);
+}
+
+// A mapped file points at its pixel array in place, a file without its last full row isn't mapped
+static void test_map_points_into_file(void) {
+    const uint32_t width = 5, height = 3;
+    CHECK(write_pattern("map_24.bmp", width, height, 24) == 0);
+    BITMAPVIEW view;
+    CHECK(MapBitMap("map_24.bmp", &view) == 0);
+    int ok = view.stride == ROW_SIZE(24, width) && view.pixels == view.data + view.file_header.offset &&
+             view.info_header.bitmap_width == (int32_t)width && view.info_header.bitmap_height == (int32_t)height;
+    // Stored row r of a bottom-up file is image row height - 1 - r
+    for (uint32_t r = 0; ok && r < height; ++r) {
+        for (uint32_t x = 0; x < width; ++x) {
+            for (uint32_t c = 0; c < 3; ++c) {
+                if (view.pixels[r * view.stride + x * 3 + c] != pattern_byte(x, height - 1 - r, c)) ok = 0;
+            }
+        }
+    }
+    ok = ok && write_file("map_short.bmp", view.data, view.size - view.stride) == 0;
+    UnmapBitMap(&view);
+    CHECK(ok);
+    CHECK(view.data == NULL && view.pixels == NULL);
+    CHECK(MapBitMap("map_short.bmp", &view) == -1);
+    CHECK(MapBitMap("map_missing.bmp", &view) == -1);
+}
+
+// WriteBitMapFile writes the same bytes as CreateBitMap, padding included
+static void test_write_file_matches_create(void) {
+    const uint32_t width = 5, height = 3;
+    uint8_t pixels[5 * 3 * 3];
+    for (uint32_t i = 0; i < sizeof(pixels); ++i) pixels[i] = (uint8_t)(i * 11 + 3);
+    const int32_t heights[2] = { (int32_t)height, -(int32_t)height };
+    for (uint32_t k = 0; k < 2; ++k) {
+        BITMAP created = CreateBitMap("create_24.bmp", (int32_t)width, heights[k], pixels, 24, BI_RGB);
+        int ok = created.pixels != NULL && created.file != NULL;
+        cleanup(&created);
+        CHECK(ok);
+        CHECK(WriteBitMapFile("write_24.bmp", (int32_t)width, heights[k], 24, pixels, BI_RGB) == 0);
+        BITMAPVIEW a, b;
+        CHECK(MapBitMap("create_24.bmp", &a) == 0);
+        if (MapBitMap("write_24.bmp", &b) != 0) {
+            UnmapBitMap(&a);
+            CHECK(0);
+        }
+        ok = a.size == b.size && memcmp(a.data, b.data, a.size) == 0 && b.info_header.bitmap_height == heights[k] &&
+             memcmp(b.pixels + b.stride, pixels + width * 3, width * 3) == 0 && b.pixels[width * 3] == 0;
+        UnmapBitMap(&a);
+        UnmapBitMap(&b);
+        CHECK(ok);
+    }
+}
+
+// The dispatched row kernels match the scalar ones for every width, so the SIMD tails are covered
+static void test_kernels_match_scalar(void) {
+    const BITMAPKERNELS *kernels = GetBitMapKernels();
+    const BITMAPROWKERNEL simd[4] = { kernels->invert, kernels->brightness_contrast, kernels->grayscale, kernels->swap_red_blue };
+    const BITMAPROWKERNEL scalar[4] = {
+        bitmap_invert_row_scalar, bitmap_adjust_row_scalar, bitmap_grayscale_row_scalar, bitmap_swap_row_scalar
+    };
+    BRIGHTNESSCONTRAST bc;
+    bc.brightness = 20;
+    bc.contrast = 700;
+    uint8_t a[70 * 4 + 8], b[70 * 4 + 8];
+    for (uint32_t k = 0; k < 4; ++k) {
+        for (uint32_t pixel_size = 3; pixel_size <= 4; ++pixel_size) {
+            for (uint32_t width = 1; width <= 70; ++width) {
+                for (uint32_t i = 0; i < sizeof(a); ++i) a[i] = b[i] = (uint8_t)(i * 37 + width + k);
+                simd[k](a, width, pixel_size, &bc);
+                scalar[k](b, width, pixel_size, &bc);
+                // Bytes past the row stay as they were
+                CHECK(memcmp(a, b, sizeof(a)) == 0 && a[width * pixel_size] == (uint8_t)(width * pixel_size * 37 + width + k));
+            }
+        }
+    }
+    uint8_t pixel[4] = { 10, 20, 30, 40 };
+    InvertPixel(pixel, 4);
+    CHECK(pixel[0] == 245 && pixel[1] == 235 && pixel[2] == 225 && pixel[3] == 40);
+}
+
+static void count_band_rows(void *context, uint32_t first_row, uint32_t n_rows) {
+    uint8_t *seen = (uint8_t *)context;
+    for (uint32_t y = first_row; y < first_row + n_rows; ++y) ++seen[y];
+}
+
+// Tiled kernels give the same pixels as the single threaded loop, bands cover every row once
+static void test_tiled_kernel_matches_untiled(void) {
+    const uint32_t width = 13, height = 37;
+    uint8_t pixels[13 * 37 * 3];
+    for (uint32_t i = 0; i < sizeof(pixels); ++i) pixels[i] = (uint8_t)(i * 29 + 5);
+    BITMAPTHREADPOOL *pool = CreateBitMapThreadPool(3);
+    CHECK(pool != NULL);
+    BITMAPTILEOPTIONS options;
+    memset(&options, 0, sizeof(options));
+    options.pool = pool;
+    options.band_bytes = ROW_SIZE(24, width) * 2;
+    int ok = 1;
+    for (uint32_t k = 0; ok && k < 2; ++k) {
+        options.flags = k ? BITMAP_TILE_STATIC : 0;
+        uint8_t seen[37] = { 0 };
+        RunBitMapBands(height, ROW_SIZE(24, width), count_band_rows, seen, &options);
+        for (uint32_t y = 0; y < height; ++y) ok = ok && seen[y] == 1;
+        PBITMAP tiled = GenerateBitMapData((int32_t)width, (int32_t)height, 24, pixels, BI_RGB);
+        PBITMAP plain = GenerateBitMapData((int32_t)width, (int32_t)height, 24, pixels, BI_RGB);
+        ok = ok && tiled != NULL && plain != NULL &&
+             ApplyBitMapKernelTiled(tiled, GetBitMapKernels()->grayscale, NULL, &options) == 0 &&
+             ApplyBitMapKernel(plain, GetBitMapKernels()->grayscale, NULL) == 0 &&
+             memcmp(tiled->pixels, plain->pixels, tiled->info_header.image_size) == 0;
+        FreeBitMap(tiled);
+        FreeBitMap(plain);
+    }
+    DestroyBitMapThreadPool(pool);
+    CHECK(ok);
+}
+
+// A pooled buffer comes back to the next bitmap of the same size, a pool with no room caches nothing
+static void test_pool_reuses_buffers(void) {
+    uint8_t pixels[64 * 64 * 3] = { 0 };
+    BITMAPPOOL *pool = CreateBitMapPool(1 << 20);
+    CHECK(pool != NULL);
+    BITMAPALLOCATOR allocator = GetBitMapPoolAllocator(pool);
+    PBITMAP first = GenerateBitMapDataEx(64, 64, 24, pixels, BI_RGB, &allocator);
+    uint8_t *buffer = first ? first->pixels : NULL;
+    int ok = first != NULL && ((uintptr_t)buffer % BITMAP_ALIGNMENT) == 0;
+    FreeBitMap(first);
+    ok = ok && pool->cached_bytes > 0;
+    PBITMAP second = GenerateBitMapDataEx(64, 64, 24, pixels, BI_RGB, &allocator);
+    ok = ok && second != NULL && second->pixels == buffer && pool->cached_bytes == 0;
+    FreeBitMap(second);
+    DestroyBitMapPool(pool);
+    CHECK(ok);
+
+    pool = CreateBitMapPool(0);
+    CHECK(pool != NULL);
+    allocator = GetBitMapPoolAllocator(pool);
+    first = GenerateBitMapDataEx(64, 64, 24, pixels, BI_RGB, &allocator);
+    ok = first != NULL;
+    FreeBitMap(first);
+    ok = ok && pool->cached_bytes == 0;
+    DestroyBitMapPool(pool);
+    CHECK(ok);
+}
+
+// EncodeRLE and DecodeRLE round trip long runs, long absolute runs and short tails in both modes
+static void test_rle_round_trip(void) {
+    const uint32_t width = 301, rows = 4;
+    uint8_t indices[301 * 4], decoded[301 * 4];
+    for (uint32_t y = 0; y < rows; ++y) {
+        for (uint32_t x = 0; x < width; ++x) {
+            // Row 0 is one run, row 1 never repeats, rows 2 and 3 mix runs of 1 to 6 pixels
+            uint8_t value = y == 0 ? 7 : y == 1 ? (uint8_t)(x * 13 + 1) : (uint8_t)((x / (1 + (x + y) % 6)) * 5);
+            indices[y * width + x] = value;
+        }
+    }
+    const uint32_t modes[2] = { BI_RLE8, BI_RLE4 };
+    size_t capacity = GetRLEBoundSize(width, rows);
+    uint8_t *encoded = (uint8_t *)malloc(capacity);
+    CHECK(encoded != NULL);
+    int ok = 1;
+    for (uint32_t k = 0; ok && k < 2; ++k) {
+        size_t size = EncodeRLE(indices, width, rows, width, modes[k], encoded, capacity);
+        memset(decoded, 0xFF, sizeof(decoded));
+        ok = size > 0 && size <= capacity && encoded[size - 2] == 0 && encoded[size - 1] == 1 &&
+             DecodeRLE(encoded, size, modes[k], width, rows, decoded, width) == 0;
+        for (uint32_t i = 0; ok && i < width * rows; ++i) {
+            ok = decoded[i] == (modes[k] == BI_RLE4 ? (indices[i] & 0x0F) : indices[i]);
+        }
+        ok = ok && EncodeRLE(indices, width, rows, width, modes[k], encoded, size - 1) == 0;
+    }
+    ok = ok && EncodeRLE(indices, width, rows, width, BI_RGB, encoded, capacity) == 0;
+    free(encoded);
+    CHECK(ok);
+}
+
+// Channel value of a mask scaled to 8 bits by repeating its bits, 255 for a missing alpha mask
+static uint8_t mask_channel(uint32_t value, uint32_t mask, int alpha) {
+    if (mask == 0) return alpha ? 255 : 0;
+    uint32_t shift = 0, bits = 0;
+    while (!((mask >> shift) & 1)) ++shift;
+    while (shift + bits < 32 && ((mask >> (shift + bits)) & 1)) ++bits;
+    uint32_t v = (value & mask) >> shift;
+    if (bits >= 8) return (uint8_t)(v >> (bits - 8));
+    uint32_t r = 0;
+    for (int s = 8 - (int)bits; s > -(int)bits; s -= (int)bits) r |= s >= 0 ? v << s : v >> -s;
+    return (uint8_t)r;
+}
+
+// Every fast path of DecodeBitFieldsRow matches the masks bit by bit, and a 565 file is read as BGRA
+static void test_bitfields_decoding(void) {
+    const uint32_t masks[5][5] = {
+        { 16, 0xF800, 0x07E0, 0x001F, 0 },
+        { 16, 0x7C00, 0x03E0, 0x001F, 0x8000 },
+        { 32, 0x000000FF, 0x0000FF00, 0x00FF0000, 0 },
+        { 32, 0x0000FF00, 0x00FF0000, 0xFF000000, 0x000000FF },
+        { 32, 0x3FF00000, 0x000FFC00, 0x000003FF, 0xC0000000 }
+    };
+    uint8_t src[20 * 4], dst[20 * 4];
+    for (uint32_t i = 0; i < sizeof(src); ++i) src[i] = (uint8_t)(i * 53 + 17);
+    for (uint32_t k = 0; k < 5; ++k) {
+        BITFIELDSDECODER decoder;
+        CHECK(InitBitFieldsDecoder(&decoder, masks[k][0], masks[k][1], masks[k][2], masks[k][3], masks[k][4]) == 0);
+        uint32_t pixel_size = masks[k][0] / 8;
+        for (uint32_t width = 1; width <= 20; ++width) {
+            DecodeBitFieldsRow(&decoder, src, dst, width);
+            for (uint32_t x = 0; x < width; ++x) {
+                uint32_t value = 0;
+                memcpy(&value, src + x * pixel_size, pixel_size);
+                CHECK(dst[x * 4] == mask_channel(value, masks[k][3], 0) && dst[x * 4 + 1] == mask_channel(value, masks[k][2], 0) &&
+                      dst[x * 4 + 2] == mask_channel(value, masks[k][1], 0) && dst[x * 4 + 3] == mask_channel(value, masks[k][4], 1));
+            }
+        }
+    }
+    BITFIELDSDECODER decoder;
+    CHECK(InitBitFieldsDecoder(&decoder, 16, 0xF00F, 0x07E0, 0x001F, 0) == -1);
+
+    uint8_t file[14 + 40 + 12 + 8] = { 0 };
+    put_headers(file, sizeof(file), 40, 3, 1, 16, BI_BITFIELDS, 14 + 40 + 12);
+    const uint32_t file_masks[3] = { 0xF800, 0x07E0, 0x001F };
+    const uint16_t pixels[3] = { 0xF800, 0x07E0, 0x001F };
+    memcpy(file + 14 + 40, file_masks, sizeof(file_masks));
+    memcpy(file + 14 + 40 + 12, pixels, sizeof(pixels));
+    CHECK(write_file("bitfields_565.bmp", file, sizeof(file)) == 0);
+    BITMAP bitmap = ReadBitMapEx("bitfields_565.bmp", NULL);
+    const uint8_t expected[12] = { 0, 0, 255, 255, 0, 255, 0, 255, 255, 0, 0, 255 };
+    int ok = bitmap.pixels != NULL && bitmap.info_header.bits_per_pixel == 32 && bitmap.info_header.compression_method == BI_RGB &&
+             memcmp(bitmap.pixels, expected, sizeof(expected)) == 0;
+    ReleaseBitMap(&bitmap);
+    CHECK(ok);
+}
+
+// ProbeBitMaps fills entry i from path i across several chunks and marks unreadable or invalid files
+static void test_probe_table(void) {
+    CHECK(write_pattern("probe_24.bmp", 3, 2, 24) == 0);
+    CHECK(write_pattern("probe_32.bmp", 5, 4, 32) == 0);
+    const uint8_t junk[64] = { 'B', 'M' };
+    CHECK(write_file("probe_junk.bmp", junk, sizeof(junk)) == 0);
+    const char *names[4] = { "probe_24.bmp", "probe_32.bmp", "probe_junk.bmp", "probe_missing.bmp" };
+    const char *paths[70];
+    for (uint32_t i = 0; i < 70; ++i) paths[i] = names[i % 4];
+    BITMAPTHREADPOOL *pool = CreateBitMapThreadPool(2);
+    CHECK(pool != NULL);
+    BITMAPTILEOPTIONS options;
+    memset(&options, 0, sizeof(options));
+    options.pool = pool;
+    BITMAPPROBETABLE table;
+    int ok = AllocBitMapProbeTable(&table, 70) == 0;
+    ok = ok && ProbeBitMaps(paths, &table, &options) == 36;
+    for (uint32_t i = 0; ok && i < 70; ++i) {
+        switch (i % 4) {
+        case 0:
+            ok = table.status[i] == 0 && table.width[i] == 3 && table.height[i] == 2 && table.bits_per_pixel[i] == 24 &&
+                 table.compression[i] == BI_RGB && table.offset[i] == 14 + 108;
+            break;
+        case 1:
+            ok = table.status[i] == 0 && table.width[i] == 5 && table.height[i] == 4 && table.bits_per_pixel[i] == 32;
+            break;
+        default:
+            ok = table.status[i] == -1;
+            break;
+        }
+    }
+    FreeBitMapProbeTable(&table);
+    DestroyBitMapThreadPool(pool);
+    CHECK(ok);
+}
+
+// RetargetBitMap writes the next frame from the same pixel buffer and leaves the previous file as it was
+static void test_retarget_reuses_buffer(void) {
+    const uint32_t width = 3, height = 2;
+    uint8_t frames[2][3 * 2 * 3];
+    for (uint32_t i = 0; i < sizeof(frames[0]); ++i) {
+        frames[0][i] = (uint8_t)(i + 1);
+        frames[1][i] = (uint8_t)(200 - i);
+    }
+    CHECK(WriteBitMapFile("retarget_expected_0.bmp", (int32_t)width, (int32_t)height, 24, frames[0], BI_RGB) == 0);
+    CHECK(WriteBitMapFile("retarget_expected_1.bmp", (int32_t)width, (int32_t)height, 24, frames[1], BI_RGB) == 0);
+    BITMAP bitmap = CreateBitMap("retarget_0.bmp", (int32_t)width, (int32_t)height, frames[0], 24, BI_RGB);
+    CHECK(bitmap.pixels != NULL && bitmap.file != NULL);
+    uint8_t *buffer = bitmap.pixels;
+    int ok = RetargetBitMap(&bitmap, "retarget_1.bmp", frames[1]) == 0 && bitmap.pixels == buffer && bitmap.file != NULL;
+    // Without a file name only the pixels change
+    ok = ok && RetargetBitMap(&bitmap, NULL, frames[0]) == 0 && bitmap.pixels[0] == frames[0][0];
+    cleanup(&bitmap);
+    CHECK(ok);
+    uint64_t hashes[4];
+    CHECK(HashBitMapFile("retarget_0.bmp", 0, &hashes[0]) == 0 && HashBitMapFile("retarget_expected_0.bmp", 0, &hashes[1]) == 0);
+    CHECK(HashBitMapFile("retarget_1.bmp", 0, &hashes[2]) == 0 && HashBitMapFile("retarget_expected_1.bmp", 0, &hashes[3]) == 0);
+    CHECK(hashes[0] == hashes[1] && hashes[2] == hashes[3] && hashes[0] != hashes[2]);
+    CHECK(RetargetBitMap(NULL, "retarget_2.bmp", NULL) == -1);
+}
+
+// A batch reports each job at its queue index, failures with their errno, and writes the same files as WriteBitMapFile
+static void test_batch_writer_results(void) {
+    uint8_t frames[8][5 * 3 * 3];
+    for (uint32_t k = 0; k < 8; ++k) {
+        for (uint32_t i = 0; i < sizeof(frames[k]); ++i) frames[k][i] = (uint8_t)(k * 31 + i);
+    }
+    BITMAPTHREADPOOL *pool = CreateBitMapThreadPool(2);
+    CHECK(pool != NULL);
+    BITMAPBATCHWRITER *writer = CreateBitMapBatchWriter(pool, 2);
+    int ok = writer != NULL;
+    char name[32];
+    for (uint32_t k = 0; ok && k < 8; ++k) {
+        snprintf(name, sizeof(name), k == 5 ? "batch_missing/%u.bmp" : "batch_%u.bmp", k);
+        ok = QueueBitMapWrite(writer, name, 5, 3, 24, frames[k]) == (int64_t)k;
+    }
+    BITMAPWRITERESULT results[8];
+    ok = ok && FlushBitMapBatchWriter(writer, results, 8) == 1 && results[5].result == -1 && results[5].error == ENOENT;
+    for (uint32_t k = 0; ok && k < 8; ++k) {
+        if (k == 5) continue;
+        uint64_t written, expected;
+        snprintf(name, sizeof(name), "batch_%u.bmp", k);
+        ok = results[k].result == 0 && HashBitMapFile(name, 0, &written) == 0 &&
+             WriteBitMapFile("batch_expected.bmp", 5, 3, 24, frames[k], BI_RGB) == 0 &&
+             HashBitMapFile("batch_expected.bmp", 0, &expected) == 0 && written == expected;
+    }
+    // The next batch starts at index 0 again
+    ok = ok && FlushBitMapBatchWriter(writer, NULL, 0) == 0 && QueueBitMapWrite(writer, "batch_0.bmp", 5, 3, 24, frames[0]) == 0;
+    DestroyBitMapBatchWriter(writer);
+    DestroyBitMapThreadPool(pool);
+    CHECK(ok);
+}
+
+// Row y of the pattern, counted from the top
+static int is_pattern_row(const uint8_t *row, uint32_t width, uint32_t y, uint32_t pixel_size) {
+    for (uint32_t x = 0; x < width; ++x) {
+        for (uint32_t c = 0; c < pixel_size; ++c) {
+            if (row[x * pixel_size + c] != pattern_byte(x, y, c)) return 0;
+        }
+    }
+    return 1;
+}
+
+// Row access counts from the top for both row orders, before and after FlipBitMapRows
+static void test_row_access_in_display_order(void) {
+    const uint32_t width = 4, height = 3;
+    CHECK(write_pattern("rows_24.bmp", width, height, 24) == 0);
+    BITMAP bitmap = ReadBitMapEx("rows_24.bmp", NULL);
+    CHECK(bitmap.pixels != NULL);
+    BITMAPROWTABLE table;
+    int ok = InitBitMapRowTable(&bitmap, &table, 1) == 0 && table.rows == height && table.stride == -(ptrdiff_t)ROW_SIZE(24, width);
+    for (uint32_t y = 0; ok && y < height; ++y) {
+        ok = table.row[y] == GetBitMapRow(&bitmap, y) && table.top + (ptrdiff_t)y * table.stride == table.row[y] &&
+             is_pattern_row(table.row[y], width, y, 3);
+    }
+    FreeBitMapRowTable(&table);
+    ok = ok && FlipBitMapRows(&bitmap) == 0 && bitmap.info_header.bitmap_height == -(int32_t)height;
+    for (uint32_t y = 0; ok && y < height; ++y) {
+        ok = GetBitMapRow(&bitmap, y) == bitmap.pixels + y * ROW_SIZE(24, width) && is_pattern_row(GetBitMapRow(&bitmap, y), width, y, 3);
+    }
+    ReleaseBitMap(&bitmap);
+    CHECK(ok);
+    BITMAP top_down = ReadBitMapTopDown("rows_24.bmp", NULL);
+    ok = top_down.pixels != NULL && top_down.info_header.bitmap_height == -(int32_t)height;
+    for (uint32_t y = 0; ok && y < height; ++y) ok = is_pattern_row(top_down.pixels + y * ROW_SIZE(24, width), width, y, 3);
+    ReleaseBitMap(&top_down);
+    CHECK(ok);
+}
+
+// Every filter keeps a flat image flat and the same size unchanged, box halving matches the streaming downscale
+static void test_resize_known_outputs(void) {
+    const uint32_t width = 8, height = 6;
+    CHECK(write_pattern("resize_24.bmp", width, height, 24) == 0);
+    const RESIZEFILTER filters[3] = { RESIZE_BOX, RESIZE_BILINEAR, RESIZE_LANCZOS3 };
+    uint8_t flat[8 * 6 * 4];
+    for (uint32_t i = 0; i < sizeof(flat); ++i) flat[i] = (uint8_t)(i % 4 == 3 ? 255 : 90 + i % 4 * 40);
+    for (uint32_t k = 0; k < 3; ++k) {
+        const uint32_t sizes[3][2] = { { 3, 2 }, { 13, 11 }, { 8, 6 } };
+        for (uint32_t s = 0; s < 3; ++s) {
+            PBITMAP bitmap = GenerateBitMapData((int32_t)width, -(int32_t)height, 32, flat, BI_RGB);
+            CHECK(bitmap != NULL);
+            int ok = ResizeBitMap(bitmap, sizes[s][0], sizes[s][1], filters[k], NULL) == 0 &&
+                     bitmap->info_header.bitmap_height == -(int32_t)sizes[s][1];
+            for (uint32_t i = 0; ok && i < sizes[s][0] * sizes[s][1] * 4; ++i) ok = bitmap->pixels[i] == flat[i % 4];
+            FreeBitMap(bitmap);
+            CHECK(ok);
+        }
+        BITMAP same = ReadBitMapEx("resize_24.bmp", NULL);
+        BITMAP original = ReadBitMapEx("resize_24.bmp", NULL);
+        int ok = same.pixels != NULL && original.pixels != NULL && ResizeBitMap(&same, width, height, filters[k], NULL) == 0 &&
+                 memcmp(same.pixels, original.pixels, original.info_header.image_size) == 0;
+        ReleaseBitMap(&same);
+        ReleaseBitMap(&original);
+        CHECK(ok);
+    }
+    BITMAP halved = ReadBitMapEx("resize_24.bmp", NULL);
+    BITMAP streamed = ReadBitMapDownscaled("resize_24.bmp", 2, NULL);
+    int ok = halved.pixels != NULL && streamed.pixels != NULL && ResizeBitMap(&halved, width / 2, height / 2, RESIZE_BOX, NULL) == 0 &&
+             streamed.info_header.bitmap_width == (int32_t)width / 2 && streamed.info_header.bitmap_height == (int32_t)height / 2;
+    for (uint32_t i = 0; ok && i < halved.info_header.image_size; ++i) ok = abs(halved.pixels[i] - streamed.pixels[i]) <= 1;
+    ReleaseBitMap(&halved);
+    ReleaseBitMap(&streamed);
+    CHECK(ok);
+}
+
+// Blending matches bitmap_blend_pixel at widths that leave every vector tail, copies clip and convert
+static void test_blit_modes(void) {
+    const uint32_t width = 40, height = 3;
+    uint8_t zero[40 * 3 * 4] = { 0 };
+    PBITMAP dst = GenerateBitMapData((int32_t)width, -(int32_t)height, 32, zero, BI_RGB);
+    PBITMAP src = GenerateBitMapData((int32_t)width, -(int32_t)height, 32, zero, BI_RGB);
+    uint8_t *expected = (uint8_t *)malloc(width * height * 4);
+    int ok = dst != NULL && src != NULL && expected != NULL;
+    const uint32_t widths[5] = { 7, 9, 17, 33, 40 };
+    const BLITMODE modes[2] = { BLIT_SRC_OVER, BLIT_ADD };
+    for (uint32_t m = 0; ok && m < 2; ++m) {
+        for (uint32_t k = 0; ok && k < 5; ++k) {
+            for (uint32_t i = 0; i < width * height * 4; ++i) {
+                uint32_t x = i / 4 % width;
+                dst->pixels[i] = (uint8_t)(i * 13 + 7);
+                // Pixels 0 to 7 are opaque, 8 to 15 transparent, the rest varies
+                src->pixels[i] = (uint8_t)(i % 4 != 3 ? i * 29 + 3 : x < 8 ? 255 : x < 16 ? 0 : i * 41);
+            }
+            memcpy(expected, dst->pixels, width * height * 4);
+            for (uint32_t y = 0; y < 2; ++y) {
+                for (uint32_t x = 0; x < widths[k]; ++x) {
+                    bitmap_blend_pixel(expected + ((y + 1) * width + x) * 4, 4, src->pixels + (y * width + x) * 4, 4, modes[m]);
+                }
+            }
+            ok = BlitBitMap(dst, 0, 1, src, 0, 0, widths[k], 5, modes[m]) == 0 && memcmp(dst->pixels, expected, width * height * 4) == 0;
+        }
+    }
+    free(expected);
+    CHECK(ok);
+    CHECK(BlitBitMap(dst, 0, 0, dst, 1, 0, 4, 1, BLIT_SRC_OVER) == -1);
+
+    // A 24 bit source copied 2 columns left of the destination loses its first 2 columns and gets alpha 255
+    uint8_t rgb[4 * 1 * 3];
+    for (uint32_t i = 0; i < sizeof(rgb); ++i) rgb[i] = (uint8_t)(i + 1);
+    PBITMAP small = GenerateBitMapData(4, 1, 24, rgb, BI_RGB);
+    ok = small != NULL && BlitBitMap(dst, -2, 0, small, 0, 0, 4, 1, BLIT_COPY) == 0;
+    ok = ok && dst->pixels[0] == 7 && dst->pixels[1] == 8 && dst->pixels[2] == 9 && dst->pixels[3] == 255 &&
+         dst->pixels[4] == 10 && dst->pixels[7] == 255 && dst->pixels[8] == (uint8_t)(8 * 13 + 7);
+    // Overlapping copy inside one image reads every source pixel before it is overwritten
+    uint8_t row[8 * 4];
+    memcpy(row, dst->pixels, sizeof(row));
+    ok = ok && BlitBitMap(dst, 2, 0, dst, 0, 0, 8, 1, BLIT_COPY) == 0 && memcmp(dst->pixels + 8, row, sizeof(row)) == 0;
+    FreeBitMap(small);
+    FreeBitMap(dst);
+    FreeBitMap(src);
+    CHECK(ok);
+}
+
+// Writes pixel (x, y) counted from the top as x, y, first byte of the payload, fails for user != NULL
+static int fake_decode(void *user, const BITMAPPAYLOAD *payload, uint8_t *top, ptrdiff_t stride, uint32_t width, uint32_t height) {
+    if (user != NULL) return -1;
+    for (uint32_t y = 0; y < height; ++y, top += stride) {
+        for (uint32_t x = 0; x < width; ++x) {
+            top[x * 3] = (uint8_t)x;
+            top[x * 3 + 1] = (uint8_t)y;
+            top[x * 3 + 2] = payload->data[0];
+        }
+    }
+    return 0;
+}
+
+// A PNG stream is stored and read back untouched and is only turned into pixels by a codec
+static void test_payload_passthrough(void) {
+    const uint8_t stream[13] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n', 1, 2, 3, 4, 5 };
+    CHECK(WriteBitMapPayload("payload_png.bmp", 3, 2, BI_PNG, stream, sizeof(stream)) == 0);
+    BITMAPVIEW view;
+    BITMAPPAYLOAD payload;
+    CHECK(MapBitMap("payload_png.bmp", &view) == 0);
+    int ok = GetBitMapViewPayload(&view, &payload) == 0 && payload.compression == BI_PNG && payload.size == sizeof(stream) &&
+             memcmp(payload.data, stream, sizeof(stream)) == 0;
+    UnmapBitMap(&view);
+    CHECK(ok);
+    BITMAP bitmap = ReadBitMapEx("payload_png.bmp", NULL);
+    ok = bitmap.pixels != NULL && GetBitMapPayload(&bitmap, &payload) == 0 && payload.size == sizeof(stream) &&
+         memcmp(payload.data, stream, sizeof(stream)) == 0;
+    BITMAPCODEC codec = { fake_decode, 24, &codec };
+    ok = ok && DecodeBitMapPayload(&bitmap, &codec) == -1 && bitmap.info_header.compression_method == BI_PNG;
+    codec.user = NULL;
+    ok = ok && DecodeBitMapPayload(&bitmap, &codec) == 0 && bitmap.info_header.compression_method == BI_RGB &&
+         bitmap.info_header.bits_per_pixel == 24 && bitmap.info_header.image_size == 2 * ROW_SIZE(24, 3);
+    // Bottom-up, so the top row is stored second
+    const uint8_t *top = bitmap.pixels ? bitmap.pixels + ROW_SIZE(24, 3) : NULL;
+    ok = ok && top[3] == 1 && top[4] == 0 && top[5] == 0x89 && bitmap.pixels[4] == 1 && top[9] == 0 && top[11] == 0;
+    ok = ok && GetBitMapPayload(&bitmap, &payload) == -1;
+    ReleaseBitMap(&bitmap);
+    CHECK(ok);
+    CHECK(WriteBitMapPayload("payload_rgb.bmp", 3, 2, BI_RGB, stream, sizeof(stream)) == -1);
+}
+
+// Buffers above min_size come from page aligned mappings that keep their content through reads, resizes and frees
+static void test_hugepage_allocator(void) {
+    const uint32_t width = 600, height = 400;
+    CHECK(write_pattern("hugepage_24.bmp", width, height, 24) == 0);
+    BITMAPTHREADPOOL *pool = CreateBitMapThreadPool(2);
+    CHECK(pool != NULL);
+    const uint32_t flags[2] = { BITMAP_HUGEPAGE_FIRST_TOUCH, BITMAP_HUGEPAGE_EXPLICIT | BITMAP_HUGEPAGE_FIRST_TOUCH };
+    int ok = 1;
+    for (uint32_t k = 0; ok && k < 2; ++k) {
+        BITMAPHUGEPAGEOPTIONS options;
+        memset(&options, 0, sizeof(options));
+        options.flags = flags[k];
+        options.min_size = 64 * 1024;
+        options.bands.pool = pool;
+        options.bands.band_bytes = 64 * 1024;
+        BITMAPALLOCATOR allocator = GetBitMapHugePageAllocator(&options);
+        BITMAP bitmap = ReadBitMapEx("hugepage_24.bmp", &allocator);
+        ok = bitmap.pixels != NULL && ((uintptr_t)bitmap.pixels % 4096) == 0;
+        for (uint32_t y = 0; ok && y < height; y += 57) ok = is_pattern_row(GetBitMapRow(&bitmap, y), width, y, 3);
+        ok = ok && ResizeBitMap(&bitmap, width / 2, height / 2, RESIZE_BOX, NULL) == 0 && ((uintptr_t)bitmap.pixels % 4096) == 0;
+        ReleaseBitMap(&bitmap);
+        // The structure itself is below min_size and comes from the default allocator
+        uint8_t pixels[16 * 16 * 3] = { 0 };
+        PBITMAP small = GenerateBitMapDataEx(16, 16, 24, pixels, BI_RGB, &allocator);
+        ok = ok && small != NULL;
+        FreeBitMap(small);
+    }
+    DestroyBitMapThreadPool(pool);
+    CHECK(ok);
+}
+
+// Rotations and the transpose move pattern pixel (x, y) where expected for both row orders and pixel sizes
+static void test_rotate_and_transpose(void) {
+    const uint32_t width = 37, height = 5;
+    const uint32_t turns[4] = { 90, 180, 270, 1 }; // 1 stands for TransposeBitMap
+    BITMAPTHREADPOOL *pool = CreateBitMapThreadPool(2);
+    CHECK(pool != NULL);
+    BITMAPTILEOPTIONS options;
+    memset(&options, 0, sizeof(options));
+    options.pool = pool;
+    options.band_bytes = 256;
+    int ok = 1;
+    for (uint32_t bpp = 24; ok && bpp <= 32; bpp += 8) {
+        uint32_t pixel_size = bpp / 8;
+        CHECK(write_pattern("rotate.bmp", width, height, bpp) == 0);
+        for (uint32_t k = 0; ok && k < 8; ++k) {
+            BITMAP bitmap = ReadBitMapEx("rotate.bmp", NULL);
+            ok = bitmap.pixels != NULL && (k < 4 || FlipBitMapRows(&bitmap) == 0);
+            uint32_t turn = turns[k % 4];
+            ok = ok && (turn == 1 ? TransposeBitMap(&bitmap, &options) : RotateBitMap(&bitmap, turn, &options)) == 0;
+            uint32_t out_width = turn == 180 ? width : height, out_rows = turn == 180 ? height : width;
+            int32_t out_height = bitmap.info_header.bitmap_height;
+            ok = ok && bitmap.info_header.bitmap_width == (int32_t)out_width &&
+                 (out_height < 0 ? (uint32_t)-out_height : (uint32_t)out_height) == out_rows;
+            for (uint32_t y = 0; ok && y < out_rows; ++y) {
+                const uint8_t *row = GetBitMapRow(&bitmap, y);
+                for (uint32_t x = 0; ok && x < out_width; ++x) {
+                    uint32_t sx = turn == 90 ? y : turn == 180 ? width - 1 - x : turn == 270 ? width - 1 - y : y;
+                    uint32_t sy = turn == 90 ? height - 1 - x : turn == 180 ? height - 1 - y : x;
+                    for (uint32_t c = 0; c < pixel_size; ++c) ok = ok && row[x * pixel_size + c] == pattern_byte(sx, sy, c);
+                }
+                // Padding is zero
+                for (uint32_t i = out_width * pixel_size; ok && i < ROW_SIZE(bpp, out_width); ++i) ok = row[i] == 0;
+            }
+            ReleaseBitMap(&bitmap);
+        }
+    }
+    DestroyBitMapThreadPool(pool);
+    CHECK(ok);
+}
+
+// Every rejection path of the validating parser reports its own code before anything is allocated
+static void test_parser_error_codes(void) {
+    typedef struct {
+        uint32_t header_size;
+        int32_t width, height;
+        uint16_t bits_per_pixel;
+        uint32_t compression, offset, size;
+        int expected;
+    } PARSECASE;
+    const PARSECASE cases[] = {
+        { 40, 2, 2, 24, BI_RGB, 54, 70, BITMAP_OK },
+        { 40, 2, 2, 24, BI_RGB, 54, 70, BITMAP_ERROR_SIGNATURE },       // Signature broken below
+        { 41, 2, 2, 24, BI_RGB, 54, 70, BITMAP_ERROR_HEADER },
+        { 40, -2, 2, 24, BI_RGB, 54, 70, BITMAP_ERROR_HEADER },
+        { 40, 2, 2, 24, BI_RGB, 20, 70, BITMAP_ERROR_HEADER },
+        { 40, 2, 2, 7, BI_RGB, 54, 70, BITMAP_ERROR_FORMAT },
+        { 40, 2, 2, 24, 9, 54, 70, BITMAP_ERROR_FORMAT },
+        { 40, 2, -2, 8, BI_RLE8, 54, 70, BITMAP_ERROR_FORMAT },
+        { 40, 2, 2, 24, BI_BITFIELDS, 66, 70, BITMAP_ERROR_FORMAT },
+        { 40, 0x7FFFFFFF, 16, 32, BI_RGB, 54, 70, BITMAP_ERROR_SIZE },
+        { 40, 2, 2, 24, BI_RGB, 54, 60, BITMAP_ERROR_TRUNCATED },      // Pixel array cut short
+        { 40, 2, 2, 24, BI_RGB, 54, 40, BITMAP_ERROR_TRUNCATED },      // Info header cut short
+        { 40, 2, 2, 24, BI_RGB, 80, 70, BITMAP_ERROR_TRUNCATED }       // Pixels start past the end
+    };
+    uint8_t file[70];
+    for (uint32_t k = 0; k < sizeof(cases) / sizeof(cases[0]); ++k) {
+        const PARSECASE *c = &cases[k];
+        memset(file, 0, sizeof(file));
+        put_headers(file, c->size, c->header_size, c->width, c->height, c->bits_per_pixel, c->compression, c->offset);
+        if (c->expected == BITMAP_ERROR_SIGNATURE) file[1] = 'X';
+        CHECK(write_file("parse_case.bmp", file, c->size) == 0);
+        BITMAP bitmap;
+        int result = ReadBitMapChecked("parse_case.bmp", NULL, &bitmap);
+        int ok = result == c->expected && (result == BITMAP_OK) == (bitmap.pixels != NULL);
+        ReleaseBitMap(&bitmap);
+        if (!ok) fprintf(stderr, "parser case %u gave %d (%s)\n", k, result, GetBitMapErrorString(result));
+        CHECK(ok);
+        CHECK(strcmp(GetBitMapErrorString(result), "error") != 0);
+    }
+
+    // A BITMAPCOREHEADER has 16 bit fields and is widened
+    uint8_t core[14 + 12 + 8] = { 'B', 'M' };
+    const uint32_t core_size = sizeof(core), core_offset = 14 + 12, core_header = 12;
+    const uint16_t core_fields[4] = { 2, 1, 1, 24 };
+    memcpy(core + 2, &core_size, 4);
+    memcpy(core + 10, &core_offset, 4);
+    memcpy(core + 14, &core_header, 4);
+    memcpy(core + 18, core_fields, sizeof(core_fields));
+    CHECK(write_file("parse_core.bmp", core, sizeof(core)) == 0);
+    BITMAP bitmap;
+    int ok = ReadBitMapChecked("parse_core.bmp", NULL, &bitmap) == BITMAP_OK && bitmap.info_header.bitmap_width == 2 &&
+             bitmap.info_header.bitmap_height == 1 && bitmap.info_header.bits_per_pixel == 24;
+    ReleaseBitMap(&bitmap);
+    CHECK(ok);
+    CHECK(ReadBitMapChecked("parse_missing.bmp", NULL, &bitmap) == BITMAP_ERROR_IO && bitmap.pixels == NULL);
+    CHECK(strcmp(GetBitMapErrorString(-100), "error") == 0);
+}
+
+// Parallel histograms and channel statistics count every pixel once, the same as while reading
+static void test_histogram_and_stats(void) {
+    const uint32_t width = 23, height = 17;
+    CHECK(write_pattern("histogram_pattern.bmp", width, height, 24) == 0);
+    static BITMAPHISTOGRAM expected, parallel, read;
+    memset(&expected, 0, sizeof(expected));
+    uint8_t min[3] = { 255, 255, 255 }, max[3] = { 0, 0, 0 };
+    uint64_t sum[3] = { 0, 0, 0 };
+    for (uint32_t y = 0; y < height; ++y) {
+        for (uint32_t x = 0; x < width; ++x) {
+            for (uint32_t c = 0; c < 3; ++c) {
+                uint8_t v = pattern_byte(x, y, c);
+                ++expected.count[c][v];
+                if (v < min[c]) min[c] = v;
+                if (v > max[c]) max[c] = v;
+                sum[c] += v;
+            }
+        }
+    }
+    BITMAPTHREADPOOL *pool = CreateBitMapThreadPool(3);
+    CHECK(pool != NULL);
+    BITMAPTILEOPTIONS options;
+    memset(&options, 0, sizeof(options));
+    options.pool = pool;
+    options.band_bytes = ROW_SIZE(24, width) * 3;
+    BITMAP bitmap = ReadBitMapEx("histogram_pattern.bmp", NULL);
+    BITMAPCHANNELSTATS stats, read_stats;
+    int ok = bitmap.pixels != NULL && ComputeBitMapHistogram(&bitmap, &parallel, &options) == 0 &&
+             ComputeBitMapChannelStats(&bitmap, &stats, &options) == 0;
+    ReleaseBitMap(&bitmap);
+    DestroyBitMapThreadPool(pool);
+    bitmap = ReadBitMapWithHistogram("histogram_pattern.bmp", NULL, &read, &read_stats);
+    ok = ok && bitmap.pixels != NULL && parallel.channels == 3 && parallel.pixels == width * height && read.pixels == width * height;
+    for (uint32_t c = 0; ok && c < 3; ++c) {
+        ok = memcmp(parallel.count[c], expected.count[c], sizeof(expected.count[c])) == 0 &&
+             memcmp(read.count[c], expected.count[c], sizeof(expected.count[c])) == 0 &&
+             stats.min[c] == min[c] && stats.max[c] == max[c] && stats.sum[c] == sum[c] &&
+             stats.mean[c] == (double)sum[c] / (width * height) &&
+             read_stats.min[c] == min[c] && read_stats.max[c] == max[c] && read_stats.sum[c] == sum[c];
+    }
+    ReleaseBitMap(&bitmap);
+    CHECK(ok);
+}
+
+// FillRect and SetPixelSpan clip and give the same pixels as one SetPixel call per pixel
+static void test_fill_matches_set_pixel(void) {
+    const uint32_t width = 7, height = 5;
+    uint8_t pixels[7 * 5 * 4];
+    for (uint32_t i = 0; i < sizeof(pixels); ++i) pixels[i] = (uint8_t)(i * 3);
+    const COLOR32BIT color = { 10, 20, 30, 40 };
+    for (uint32_t bpp = 24; bpp <= 32; bpp += 8) {
+        PBITMAP filled = GenerateBitMapData((int32_t)width, (int32_t)height, (uint16_t)bpp, pixels, BI_RGB);
+        PBITMAP expected = GenerateBitMapData((int32_t)width, (int32_t)height, (uint16_t)bpp, pixels, BI_RGB);
+        int ok = filled != NULL && expected != NULL &&
+                 FillRect(filled, 3, 1, 10, 3, color) == 0 && SetPixelSpan(filled, 5, 4, 9, color) == 0 &&
+                 FillRect(filled, width, 0, 2, 2, color) == 0;
+        for (uint32_t y = 0; ok && y < height; ++y) {
+            for (uint32_t x = 0; x < width; ++x) {
+                if ((x >= 3 && y >= 1 && y <= 3) || (x >= 5 && y == 4)) SetPixel(x, y, 10, 20, 30, 40, expected);
+            }
+        }
+        ok = ok && memcmp(filled->pixels, expected->pixels, filled->info_header.image_size) == 0;
+        FreeBitMap(filled);
+        FreeBitMap(expected);
+        CHECK(ok);
+    }
+}
+
+int main(void) {
+    test_read_rows_as_narrower_format();
+    test_region_with_same_stride();
+    test_region_keeps_palette();
+    test_region_of_oversized_width();
+    test_future_callback_sees_result();
+    test_release_frees_dirty_rows();
+    test_rle_run_after_delta_past_row();
+    test_set_pixels_byte_order();
+    test_histogram_of_failed_read();
+    test_read_bitmap_row_layout();
+    test_round_trip_info_header();
+    test_round_trip_v5_header();
+    test_round_trip_palette();
+    test_missing_last_padding();
+    test_probe_matches_parser();
+    test_expand_rle_round_trip();
+    test_read_into_caller_buffer();
+    test_resize_keeps_headers();
+    test_flip_survives_sync();
+    test_compare_stats_and_hash();
+    test_map_points_into_file();
+    test_write_file_matches_create();
+    test_kernels_match_scalar();
+    test_tiled_kernel_matches_untiled();
+    test_pool_reuses_buffers();
+    test_rle_round_trip();
+    test_bitfields_decoding();
+    test_probe_table();
+    test_retarget_reuses_buffer();
+    test_batch_writer_results();
+    test_row_access_in_display_order();
+    test_resize_known_outputs();
+    test_blit_modes();
+    test_payload_passthrough();
+    test_hugepage_allocator();
+    test_rotate_and_transpose();
+    test_parser_error_codes();
+    test_histogram_and_stats();
+    test_fill_matches_set_pixel();
+    if (failures) fprintf(stderr, "%d test(s) failed\n", failures);
+    return failures ? 1 : 0;
+}